@@ -5,6 +5,7 @@
  *      Author: raluca
  */
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 
@@ -187,11 +188,11 @@ bytewise_xor(const string & a, const string & b) {
 
     unsigned int len = a.length();
 
-    char * res = new char[len];
+    string res(len, '\0');
     for (unsigned int i = 0; i < len; i++) {
 	res[i] = a[i] xor b[i];
     }
-    return string(res, len);
+    return res;
 }
 
 string
@@ -363,3 +364,100 @@ SWP::searchExists(const Token & token, const list<string> & ciphs)
     return false;
 }
 
+/*
+ * SWPsearch(token, c) with S the first SWPr bytes of c ^ E[W] is
+ * AES_k(pad(S) ^ k)[SWPr..] == (c ^ E[W])[SWPr..], since PRP(k, S) is a
+ * single CBC block with k as its IV.  The masks fold E[W] and k in
+ * ahead of time.
+ */
+static_assert(SWPCiphSize == AES_BLOCK_SIZE,
+              "SWPSearcher handles one AES block per word");
+
+static EVP_CIPHER_CTX *
+newSearchContext(const Token &token)
+{
+    throw_c(token.ciph.length() == SWPCiphSize,
+            "token ciphertext has incorrect length");
+    throw_c(token.wordKey.length() == AES_BLOCK_SIZE,
+            "key has incorrect length");
+
+    EVP_CIPHER_CTX *const ctx = EVP_CIPHER_CTX_new();
+    throw_c(NULL != ctx, "could not allocate a cipher context");
+    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), NULL,
+                    reinterpret_cast<const unsigned char *>(
+                        token.wordKey.data()),
+                    NULL)) {
+        EVP_CIPHER_CTX_free(ctx);
+        throw_c(false, "could not expand the word key");
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+    return ctx;
+}
+
+const size_t SWPSearcher::batch;
+
+SWPSearcher::SWPSearcher(const Token &token)
+    : ctx(newSearchContext(token))
+{
+    const string &salt_block =
+        pad(string(SWPr, '\0'), AES_BLOCK_SIZE);
+
+    for (unsigned int i = 0; i < SWPr; i++) {
+        salt_mask[i] = token.ciph[i] ^ token.wordKey[i];
+    }
+    for (unsigned int i = SWPr; i < SWPCiphSize; i++) {
+        pad_block[i - SWPr] = salt_block[i] ^ token.wordKey[i];
+        func_mask[i - SWPr] = token.ciph[i];
+    }
+}
+
+SWPSearcher::~SWPSearcher()
+{
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+bool
+SWPSearcher::searchExists(const unsigned char *ciph, size_t len)
+{
+    // > throw_c(...) would build its message on every call
+    if (len % SWPCiphSize != 0) {
+        throw_c(false, "searchExists receives invalid input");
+    }
+
+    for (size_t done = 0; done < len; ) {
+        const size_t n = std::min(batch, (len - done) / SWPCiphSize);
+        const unsigned char *const words = ciph + done;
+
+        for (size_t i = 0; i < n; i++) {
+            const unsigned char *const word = words + i * SWPCiphSize;
+            unsigned char *const block = in + i * AES_BLOCK_SIZE;
+            for (unsigned int j = 0; j < SWPr; j++) {
+                block[j] = word[j] ^ salt_mask[j];
+            }
+            memcpy(block + SWPr, pad_block, sizeof pad_block);
+        }
+
+        int outlen = 0;
+        if (1 != EVP_EncryptUpdate(ctx, out, &outlen, in, n * AES_BLOCK_SIZE)
+            || static_cast<size_t>(outlen) != n * AES_BLOCK_SIZE) {
+            throw_c(false, "could not encrypt the salts");
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            const unsigned char *const word = words + i * SWPCiphSize;
+            const unsigned char *const func = out + i * AES_BLOCK_SIZE;
+            unsigned char diff = 0;
+            for (unsigned int j = 0; j < SWPm; j++) {
+                diff |= (word[SWPr + j] ^ func_mask[j]) ^ func[SWPr + j];
+            }
+            if (0 == diff) {
+                return true;
+            }
+        }
+
+        done += n * SWPCiphSize;
+    }
+
+    return false;
+}
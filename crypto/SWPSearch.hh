@@ -19,8 +19,10 @@
  */
 
 #include <openssl/aes.h>
+#include <openssl/evp.h>
 #include <openssl/rand.h>
 #include <list>
+#include <string>
 
 
 // for all following constants unit is bytes
@@ -119,3 +121,38 @@ class SWP {
                                std::string & wordKey);
 
 };
+
+/*
+ * A token prepared for scanning many ciphertexts, as the search UDF does
+ * for every row of a LIKE '%word%'.  The word key's AES schedule is
+ * expanded once, and each ciphertext is searched in place: a batch of
+ * its words is masked into a fixed buffer and encrypted with a single
+ * ECB call, which lets OpenSSL use AES-NI and pipeline the blocks.
+ * Searching allocates nothing.
+ */
+class SWPSearcher {
+    SWPSearcher(const SWPSearcher &other) = delete;
+    SWPSearcher &operator=(const SWPSearcher &rhs) = delete;
+
+ public:
+    explicit SWPSearcher(const Token &token);
+    ~SWPSearcher();
+
+    // > the same answer as SWP::searchExists over the SWPCiphSize byte
+    //   words of 'ciph'; throws if 'len' is not a multiple of that
+    bool searchExists(const unsigned char *ciph, size_t len);
+
+ private:
+    static const size_t batch = 64;
+
+    EVP_CIPHER_CTX *const ctx;
+    // > E[W] ^ k, so a word's salt block is one XOR away
+    unsigned char salt_mask[SWPr];
+    // > the padding of the salt block, already XORed with k
+    unsigned char pad_block[SWPCiphSize - SWPr];
+    // > the bytes of E[W] that cover F_k(S)
+    unsigned char func_mask[SWPm];
+
+    unsigned char in[batch * AES_BLOCK_SIZE];
+    unsigned char out[batch * AES_BLOCK_SIZE];
+};
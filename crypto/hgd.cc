@@ -1,9 +1,70 @@
 #include <crypto/hgd.hh>
+#include <util/scoped_lock.hh>
 #include <NTL/RR.h>
 
 using namespace std;
 using namespace NTL;
 
+/*
+ * NTL keeps the RR precision in a global.  When NTL is built with
+ * NTL_THREADS the global is thread local, so a sampler only has to put
+ * back the precision it found.  Otherwise samplers take turns.
+ */
+#ifndef NTL_THREADS
+static pthread_mutex_t rr_precision_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+class ScopedRRPrecision {
+ public:
+    explicit ScopedRRPrecision(long precision)
+        :
+#ifndef NTL_THREADS
+          l(&rr_precision_lock),
+#endif
+          saved(RR::precision())
+    {
+        RR::SetPrecision(precision);
+    }
+
+    ~ScopedRRPrecision()
+    {
+        RR::SetPrecision(saved);
+    }
+
+ private:
+#ifndef NTL_THREADS
+    scoped_lock l;
+#endif
+    const long saved;
+};
+
+/*
+ * The draws where only one result is possible; they do not need RR.
+ * The RR code below computes the same bounds exactly.
+ */
+static bool
+degenerateHGD(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, ZZ *const out)
+{
+    const ZZ &N1 = NN1 >= NN2 ? NN2 : NN1;
+    const ZZ &N2 = NN1 >= NN2 ? NN1 : NN2;
+    const ZZ TN = N1 + N2;
+    const ZZ K = KK + KK >= TN ? TN - KK : KK;
+
+    const ZZ MINJX = K - N2 < 0 ? to_ZZ(0) : K - N2;
+    const ZZ MAXJX = N1 < K ? N1 : K;
+    if (MINJX != MAXJX) {
+        return false;
+    }
+
+    const ZZ &IX = MAXJX;
+    if (KK + KK >= TN) {
+        *out = NN1 > NN2 ? KK - NN2 + IX : NN1 - IX;
+    } else {
+        *out = NN1 > NN2 ? KK - IX : IX;
+    }
+    return true;
+}
+
 static RR
 AFC(const RR &I)
 {
@@ -36,15 +97,17 @@ ZZ
 HGD(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, PRNG *prng)
 {
     /*
-     * XXX
-     * NTL is single-threaded by design: there is a global precision
-     * setting, which gets switched back and forth all over the place
-     * (see NTL's RR.c).  We should hold a lock around any RR usage,
-     * or re-implement the relevant parts of NTL::RR with a scoped
-     * precision parameter..
+     * CHECK PARAMETER VALIDITY
      */
+    if ((NN1 < 0) || (NN2 < 0) || (KK < 0) || (KK > NN1 + NN2))
+        throw_c(false);
+
+    ZZ degenerate;
+    if (degenerateHGD(KK, NN1, NN2, &degenerate))
+        return degenerate;
+
     long precision = NumBits(NN1 + NN2 + KK) + 10;
-    RR::SetPrecision(precision);
+    ScopedRRPrecision scoped_precision(precision);
 
     RR JX;      // the result
     RR TN, N1, N2, K;
@@ -59,12 +122,6 @@ HGD(const ZZ &KK, const ZZ &NN1, const ZZ &NN2, PRNG *prng)
     double DELTAU = 0.0034;
     double SCALE = 1.0e25;
 
-    /*
-     * CHECK PARAMETER VALIDITY
-     */
-    if ((NN1 < 0) || (NN2 < 0) || (KK < 0) || (KK > NN1 + NN2))
-        throw_c(false);
-
     /*
      * INITIALIZE
      */
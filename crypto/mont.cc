@@ -1,5 +1,6 @@
 #include <algorithm>
 #include <crypto/mont.hh>
+#include <util/errstream.hh>
 
 #include <gmp.h>
 
@@ -45,3 +46,74 @@ montgomery::mmul(const ZZ &a, const ZZ &b)
         ab = ab - _m;
     return ab;
 }
+
+mpn_montgomery::mpn_montgomery(const ZZ &m)
+    : _mzz(m), _m((NumBytes(m) + sizeof(mp_limb_t) - 1) / sizeof(mp_limb_t)),
+      _t(2 * _m.size())
+{
+    throw_c(IsOdd(m));
+
+    std::vector<uint8_t> bytes(_m.size() * sizeof(mp_limb_t));
+    BytesFromZZ(&bytes[0], m, bytes.size());
+    from_bytes(&_m[0], &bytes[0], bytes.size());
+
+    // > Newton's iteration; each step doubles the correct low bits
+    mp_limb_t inv = 1;
+    for (uint i = 0; i < 7; i++)
+        inv *= 2 - _m[0] * inv;
+    _minv = -inv;
+}
+
+void
+mpn_montgomery::mul(mp_limb_t *out, const mp_limb_t *a, const mp_limb_t *b)
+{
+    const mp_size_t n = _m.size();
+    mp_limb_t *const t = &_t[0];
+
+    mpn_mul_n(t, a, b, n);
+
+    // > 'hi' carries into t[i + n], which later rounds have not touched
+    mp_limb_t hi = 0;
+    for (mp_size_t i = 0; i < n; i++) {
+        const mp_limb_t c = mpn_addmul_1(t + i, &_m[0], n, t[i] * _minv);
+        const mp_limb_t s = t[i + n] + c;
+        t[i + n] = s + hi;
+        hi = (s < c) + (t[i + n] < hi);
+    }
+
+    // > t / R < 2m
+    if (hi || mpn_cmp(t + n, &_m[0], n) >= 0)
+        mpn_sub_n(out, t + n, &_m[0], n);
+    else
+        std::copy(t + n, t + 2*n, out);
+}
+
+ZZ
+mpn_montgomery::rpow(uint64_t k) const
+{
+    ZZ r = to_ZZ(1) << (_m.size() * sizeof(mp_limb_t) * 8);
+    return PowerMod(r % _mzz, to_ZZ(k), _mzz);
+}
+
+bool
+mpn_montgomery::from_bytes(mp_limb_t *out, const uint8_t *p, size_t len) const
+{
+    if (len > _m.size() * sizeof(mp_limb_t))
+        return false;
+
+    std::fill(out, out + _m.size(), 0);
+    for (size_t i = 0; i < len; i++)
+        out[i / sizeof(mp_limb_t)] |=
+            ((mp_limb_t) p[i]) << (8 * (i % sizeof(mp_limb_t)));
+    return true;
+}
+
+ZZ
+mpn_montgomery::to_zz(const mp_limb_t *a) const
+{
+    std::vector<uint8_t> bytes(_m.size() * sizeof(mp_limb_t));
+    for (size_t i = 0; i < bytes.size(); i++)
+        bytes[i] = (uint8_t) (a[i / sizeof(mp_limb_t)]
+                              >> (8 * (i % sizeof(mp_limb_t))));
+    return ZZFromBytes(&bytes[0], bytes.size());
+}
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <vector>
 #include <NTL/ZZ.h>
+#include <gmp.h>
 
 class montgomery {
  private:
@@ -20,3 +22,37 @@ class montgomery {
     NTL::ZZ from_mont(const NTL::ZZ &a);
     NTL::ZZ mmul(const NTL::ZZ &a, const NTL::ZZ &b);
 };
+
+/*
+ * Montgomery multiplication on fixed-size limb arrays, for long runs of
+ * products mod one odd modulus.  mul() does not allocate; R is 2^(bits
+ * of a limb * limbs()).
+ *
+ * A running product needs no conversion into Montgomery form: after k
+ * mul()s by plain values it is off by R^-k, which rpow(k) undoes once
+ * at the end.
+ */
+class mpn_montgomery {
+ public:
+    explicit mpn_montgomery(const NTL::ZZ &m);
+
+    size_t limbs() const { return _m.size(); }
+    const NTL::ZZ &modulus() const { return _mzz; }
+
+    /* out = a * b / R mod m for a < m and b < R; out may alias a or b */
+    void mul(mp_limb_t *out, const mp_limb_t *a, const mp_limb_t *b);
+
+    /* R^k mod m */
+    NTL::ZZ rpow(uint64_t k) const;
+
+    /* Little-endian bytes, as with ZZFromBytes; false if they do not
+     * fit in limbs() limbs */
+    bool from_bytes(mp_limb_t *out, const uint8_t *p, size_t len) const;
+    NTL::ZZ to_zz(const mp_limb_t *a) const;
+
+ private:
+    const NTL::ZZ _mzz;
+    std::vector<mp_limb_t> _m;
+    mp_limb_t _minv;                /* -m^-1 mod 2^(bits of a limb) */
+    std::vector<mp_limb_t> _t;      /* 2 * limbs() */
+};
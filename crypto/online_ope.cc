@@ -6,6 +6,7 @@
 
 #include <sstream>
 
+using namespace std;
 
 template<class EncT>
 struct tree_node {
@@ -140,6 +141,63 @@ ope_server<EncT>::relabel(tree_node<EncT> * parent, bool isLeft, uint64_t size)
     delete w;
 }
 
+// in order, so relabeling keeps the position of every node in the list
+template<class EncT>
+static void
+in_order_codes(const tree_node<EncT> * n, uint64_t v, uint64_t nbits,
+               vector<pair<const tree_node<EncT> *, uint64_t> > * out)
+{
+    if (!n) {
+        return;
+    }
+    in_order_codes(n->left, v<<1, nbits+1, out);
+    out->push_back(make_pair(n, ope_code(v, nbits)));
+    in_order_codes(n->right, (v<<1) | 1, nbits+1, out);
+}
+
+template<class EncT>
+void
+ope_server<EncT>::record_relabel(
+    const vector<pair<const tree_node<EncT> *, uint64_t> > &before,
+    const vector<pair<const tree_node<EncT> *, uint64_t> > &after)
+{
+    throw_c(before.size() == after.size());
+
+    for (uint64_t i = 0; i < before.size(); i++) {
+        throw_c(before[i].first == after[i].first);
+
+        auto it = moved.find(before[i].first);
+        if (it != moved.end()) {
+            it->second.second = after[i].second;
+            continue;
+        }
+        // a node that already moved had this ciphertext, so this node
+        // was inserted after it moved and nothing was encrypted to
+        // it's old ciphertext
+        if (moved_from.count(before[i].second)) {
+            continue;
+        }
+        moved[before[i].first] = make_pair(before[i].second, after[i].second);
+        moved_from.insert(before[i].second);
+    }
+}
+
+template<class EncT>
+vector<pair<uint64_t, uint64_t> >
+ope_server<EncT>::take_relabels()
+{
+    vector<pair<uint64_t, uint64_t> > out;
+    for (auto &it : moved) {
+        if (it.second.first != it.second.second) {
+            out.push_back(it.second);
+        }
+    }
+    moved.clear();
+    moved_from.clear();
+
+    return out;
+}
+
 ////////////////////////////////////////////////////
 
 
@@ -154,11 +212,26 @@ ope_server<EncT>::tree_insert(tree_node<EncT> **np, uint64_t v,
         tree_node<EncT> *n = new tree_node<EncT>(encval);
         *np = n;
 	update_tree_stats(pathlen);
-	if (trigger(pathlen)) {
+	if (trigger(pathlen, num_nodes)) {
 	    bool isLeft;
 	    uint64_t subtree_size;
 	    tree_node<EncT> * parent = node_to_balance(v, pathlen, isLeft, subtree_size);
+
+	    //the scapegoat is on v's path; find how far down
+	    tree_node<EncT> * scapegoat =
+		parent ? (isLeft ? parent->left : parent->right) : root;
+	    uint64_t depth = 0;
+	    for (tree_node<EncT> * m = root; m != scapegoat; depth++) {
+		m = (v&(1ULL<<(pathlen-depth-1))) ? m->right : m->left;
+	    }
+	    uint64_t prefix = v >> (pathlen-depth);
+
+	    vector<pair<const tree_node<EncT> *, uint64_t> > before, after;
+	    in_order_codes<EncT>(scapegoat, prefix, depth, &before);
      	    relabel(parent, isLeft, subtree_size);
+	    scapegoat = parent ? (isLeft ? parent->left : parent->right) : root;
+	    in_order_codes<EncT>(scapegoat, prefix, depth, &after);
+	    record_relabel(before, after);
 	} else {
 
 	}
@@ -262,10 +335,10 @@ ope_server<EncT>::update_tree_stats(uint64_t path_len)
 
 template<class EncT>
 bool
-ope_server<EncT>::trigger(uint64_t path_len) const
+ope_server<EncT>::trigger(uint64_t path_len, unsigned int nodes)
 {
     //basic scapegoat trigger
-    if ((path_len > 1) && (path_len > log(num_nodes)/log(1/scapegoat_alpha) + 1)) {
+    if ((path_len > 1) && (path_len > log(nodes)/log(1/scapegoat_alpha) + 1)) {
 	return true;
     } else {
 	return false;
@@ -273,6 +346,13 @@ ope_server<EncT>::trigger(uint64_t path_len) const
 
 }
 
+template<class EncT>
+bool
+ope_server<EncT>::insert_relabels(uint64_t nbits) const
+{
+    return trigger(nbits, num_nodes + 1);
+}
+
 template<class EncT>
 EncT
 ope_server<EncT>::lookup(uint64_t v, uint64_t nbits) const
@@ -291,6 +371,9 @@ void
 ope_server<EncT>::insert(uint64_t v, uint64_t nbits, const EncT &encval)
 {
     tree_insert(&root, v, encval, nbits, nbits);
+    if (inserted) {
+        inserted(v, nbits, encval);
+    }
 
 }
 
@@ -2,12 +2,15 @@
 
 #include <string>
 #include <iostream>
+#include <functional>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
 
 #include <crypto/blowfish.hh>
 #include <util/errstream.hh>
 
-using namespace std;
-
 //parameters
 const double scapegoat_alpha = 0.5;
 
@@ -28,6 +31,13 @@ ffsl(uint64_t mask)
 	return (bit);
 }
 
+// the ciphertext of the node reached by the nbits-long path v
+static inline uint64_t
+ope_code(uint64_t v, uint64_t nbits)
+{
+    return (nbits == 0 ? 0 : v<<(64-nbits)) | (1ULL<<(63-nbits));
+}
+
 
 template<class EncT>
 class ope_server {
@@ -35,12 +45,30 @@ class ope_server {
     EncT lookup(uint64_t v, uint64_t nbits) const;
     void insert(uint64_t v, uint64_t nbits, const EncT &encval);
 
+    // ciphertexts changed by relabeling since the last call, as
+    // (old, new) pairs; values encrypted in between never had the
+    // old ciphertext and are left out
+    std::vector<std::pair<uint64_t, uint64_t> > take_relabels();
+    bool has_relabels() const {return !moved.empty();}
+    // true if inserting a node at an nbits-long path would rebalance
+    // the tree
+    bool insert_relabels(uint64_t nbits) const;
+
+    // called after every insert; lets the caller log the inserts and
+    // replay them into a new server to rebuild the same tree
+    std::function<void (uint64_t v, uint64_t nbits, const EncT &encval)>
+        inserted;
+
     ope_server();
     ~ope_server();
 
  private:
     tree_node<EncT> *root;
 
+    // node -> (ciphertext before the first relabel, current ciphertext)
+    std::map<const tree_node<EncT> *, std::pair<uint64_t, uint64_t> > moved;
+    std::set<uint64_t> moved_from;
+
     tree_node<EncT> * tree_lookup(tree_node<EncT> *root, uint64_t v, uint64_t nbits) const;
     void tree_insert(tree_node<EncT> **np, uint64_t v, const EncT &encval,
 		     uint64_t nbits, uint64_t pathlen);
@@ -48,9 +76,14 @@ class ope_server {
     //relabels the tree rooted at the node whose parent is "parent"
     // size indicates the size of the subtree of the node rooted at parent
     void relabel(tree_node<EncT> * parent, bool isLeft, uint64_t size);
+    //remembers the ciphertexts of the subtree before and after relabel
+    void record_relabel(
+        const std::vector<std::pair<const tree_node<EncT> *, uint64_t> > &before,
+        const std::vector<std::pair<const tree_node<EncT> *, uint64_t> > &after);
     //decides whether we trigger a relabel or not
-    //receives the path length of a recently added node
-    bool trigger(uint64_t path_len) const;
+    //receives the path length of a recently added node and the
+    //number of nodes counting it
+    static bool trigger(uint64_t path_len, unsigned int nodes);
     //upon relabel, finds the node that is the root of the subtree to be relabelled
     // given v: last ciphertext value inserted
     // returns the parent of this node, and whether it is left or right;
@@ -78,33 +111,42 @@ class ope_client {
     }
 
     uint64_t encrypt(V pt) const {
-        uint64_t v = 0;
-        uint64_t nbits = 0;
+        uint64_t v;
+        uint64_t nbits;
+        if (!find(pt, &v, &nbits)) {
+            s->insert(v, nbits, block_encrypt(pt));
+	    //relabeling may have been triggered so we need to lookup value again
+	    throw_c(find(pt, &v, &nbits));
+        }
+
+        throw_c(nbits <= 63);
+        return ope_code(v, nbits);
+    }
+
+    // the path of pt's node; false if pt is not in the tree, and the
+    // path is where it would be inserted
+    bool find(V pt, uint64_t *v, uint64_t *nbits) const {
+        *v = 0;
+        *nbits = 0;
         try {
             for (;;) {
-		V xct = s->lookup(v, nbits);
+		V xct = s->lookup(*v, *nbits);
 		V xpt = block_decrypt(xct);
 
                 if (pt == xpt) {
-		    break;
+		    return true;
 		}
                 if (pt < xpt) {
-                    v = (v<<1) | 0;
+                    *v = (*v<<1) | 0;
 		}
                 else {
-                    v = (v<<1) | 1;
+                    *v = (*v<<1) | 1;
 		}
-                nbits++;
+                (*nbits)++;
             }
         } catch (ope_lookup_failure&) {
-            s->insert(v, nbits, block_encrypt(pt));
-	    //relabeling may have been triggered so we need to lookup value again
-	    //todo: optimize by avoiding extra tree lookup
-	    return encrypt(pt);
+            return false;
         }
-
-        throw_c(nbits <= 63);
-        return (v<<(64-nbits)) | (1ULL<<(63-nbits));
     }
 
  private:
@@ -1,3 +1,12 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
 #include <crypto/ope.hh>
 #include <crypto/prng.hh>
 #include <crypto/hgd.hh>
@@ -5,10 +14,377 @@
 #include <crypto/sha.hh>
 #include <crypto/hmac.hh>
 #include <util/zz.hh>
+#include <util/scoped_lock.hh>
 
 using namespace std;
 using namespace NTL;
 
+// > the std::map node of an entry and its index
+const size_t OPECache::ENTRY_BYTES =
+    64 + sizeof(OPECache::Key) + sizeof(size_t) + sizeof(OPECache::Slot);
+
+/*
+ * Conversions for the nodes of the ZZ trees; the cache and the native
+ * trees keep 128 bit integers.
+ */
+static ZZ
+ZZFromUint128(ope_uint128 v)
+{
+    uint8_t buf[sizeof(v)];
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        buf[i] = static_cast<uint8_t>(v);
+        v >>= 8;
+    }
+    return ZZFromBytes(buf, sizeof(buf));
+}
+
+static bool
+fitsUint128(const ZZ &v)
+{
+    return v >= 0 && NumBits(v) <= 128;
+}
+
+static ope_uint128
+uint128FromZZ(const ZZ &v)
+{
+    throw_c(fitsUint128(v));
+    uint8_t buf[sizeof(ope_uint128)];
+    BytesFromZZ(buf, v, sizeof(buf));
+    ope_uint128 out = 0;
+    for (size_t i = sizeof(buf); i > 0; i--)
+        out = (out << 8) | buf[i - 1];
+    return out;
+}
+
+// > the bytes StringFromZZ(...) gives for v; little endian without
+//   leading zeros
+static size_t
+le_bytes(ope_uint128 v, uint8_t *out)
+{
+    size_t n = 0;
+    for (; v != 0; v >>= 8)
+        out[n++] = static_cast<uint8_t>(v);
+    return n;
+}
+
+/*
+ * A number of the native trees.  Ciphertexts take up to 128 bits but
+ * the range of a tree is [0, 2^cbits], so one more bit is kept.
+ */
+class ope_word {
+ public:
+    ope_word(ope_uint128 v = 0) : lo(v), hi(0) {}
+
+    static ope_word pow2(size_t bits) {
+        assert(bits <= 128);
+        ope_word w;
+        if (128 == bits)
+            w.hi = 1;
+        else
+            w.lo = static_cast<ope_uint128>(1) << bits;
+        return w;
+    }
+
+    // > the value, which must fit in 128 bits
+    ope_uint128 low() const {
+        throw_c(0 == hi);
+        return lo;
+    }
+
+    size_t bits() const {
+        if (hi)
+            return 129;
+        size_t n = 0;
+        for (ope_uint128 v = lo; v != 0; v >>= 1)
+            n++;
+        return n;
+    }
+
+    // > out must have room for 17 bytes
+    size_t bytes(uint8_t *out) const {
+        if (!hi)
+            return le_bytes(lo, out);
+        for (size_t i = 0; i < sizeof(lo); i++)
+            out[i] = static_cast<uint8_t>(lo >> (8 * i));
+        out[sizeof(lo)] = 1;
+        return sizeof(lo) + 1;
+    }
+
+    ZZ zz() const {
+        uint8_t buf[sizeof(lo) + 1];
+        return ZZFromBytes(buf, bytes(buf));
+    }
+
+    friend ope_word operator+(const ope_word &a, const ope_word &b) {
+        ope_word w;
+        w.lo = a.lo + b.lo;
+        w.hi = a.hi + b.hi + (w.lo < a.lo);
+        assert(w.hi <= 1);
+        return w;
+    }
+
+    friend ope_word operator-(const ope_word &a, const ope_word &b) {
+        ope_word w;
+        w.lo = a.lo - b.lo;
+        w.hi = a.hi - b.hi - (a.lo < b.lo);
+        assert(w.hi <= 1);
+        return w;
+    }
+
+    friend ope_word operator>>(const ope_word &a, unsigned int n) {
+        assert(n > 0 && n < 128);
+        ope_word w;
+        w.lo = (a.lo >> n) | (static_cast<ope_uint128>(a.hi) << (128 - n));
+        return w;
+    }
+
+    friend bool operator<(const ope_word &a, const ope_word &b) {
+        return a.hi != b.hi ? a.hi < b.hi : a.lo < b.lo;
+    }
+    friend bool operator>=(const ope_word &a, const ope_word &b) {
+        return !(a < b);
+    }
+    friend bool operator==(const ope_word &a, const ope_word &b) {
+        return a.hi == b.hi && a.lo == b.lo;
+    }
+
+ private:
+    ope_uint128 lo;
+    unsigned int hi;
+};
+
+static void
+tree_top(size_t bits, ZZ *const top)
+{
+    *top = to_ZZ(1) << bits;
+}
+
+static void
+tree_top(size_t bits, ope_word *const top)
+{
+    *top = ope_word::pow2(bits);
+}
+
+OPECache::OPECache(size_t budget_bytes)
+    : budget_bytes(budget_bytes)
+{
+}
+
+OPECache::~OPECache()
+{
+}
+
+OPECache &
+OPECache::shared()
+{
+    static OPECache cache;
+    return cache;
+}
+
+OPECache::Shard &
+OPECache::shardFor(uint64_t tag, ope_uint128 node)
+{
+    // > nodes near the root have few low bits set, so mix in the high ones
+    const uint64_t h = tag ^ static_cast<uint64_t>(node)
+                     ^ (static_cast<uint64_t>(node >> 64)
+                        * 0x9E3779B97F4A7C15ULL);
+    return shards[(h ^ (h >> 32)) % SHARDS];
+}
+
+bool
+OPECache::lookup(uint64_t tag, ope_uint128 node, ope_uint128 *const dgap)
+{
+    Shard &shard = shardFor(tag, node);
+    scoped_lock l(&shard.lock);
+    auto it = shard.index.find(Key(tag, node));
+    if (shard.index.end() == it) {
+        return false;
+    }
+
+    Slot &slot = shard.slots[it->second];
+    slot.referenced = true;
+    *dgap = slot.dgap;
+    return true;
+}
+
+// > the CLOCK hand clears the referenced bits it passes and takes the
+//   first slot that was not referenced
+void
+OPECache::evictOne(Shard *const shard)
+{
+    assert(shard->slots.size() > 0);
+    while (true) {
+        if (shard->hand >= shard->slots.size()) {
+            shard->hand = 0;
+        }
+        Slot &slot = shard->slots[shard->hand];
+        if (slot.referenced) {
+            slot.referenced = false;
+            ++shard->hand;
+            continue;
+        }
+
+        shard->bytes -= ENTRY_BYTES;
+        shard->index.erase(slot.key);
+        // > fill the hole with the last slot; the hand now points at it
+        if (shard->hand != shard->slots.size() - 1) {
+            slot = std::move(shard->slots.back());
+            shard->index[slot.key] = shard->hand;
+        }
+        shard->slots.pop_back();
+        return;
+    }
+}
+
+void
+OPECache::insert(uint64_t tag, ope_uint128 node, ope_uint128 dgap)
+{
+    const size_t shard_budget = budget_bytes / SHARDS;
+    if (ENTRY_BYTES > shard_budget) {
+        return;
+    }
+
+    Shard &shard = shardFor(tag, node);
+    scoped_lock l(&shard.lock);
+    const Key key(tag, node);
+    if (shard.index.end() != shard.index.find(key)) {
+        return;
+    }
+
+    while (shard.bytes + ENTRY_BYTES > shard_budget) {
+        evictOne(&shard);
+    }
+
+    Slot slot;
+    slot.key = key;
+    slot.dgap = dgap;
+    slot.referenced = false;
+    shard.slots.push_back(std::move(slot));
+    shard.index[key] = shard.slots.size() - 1;
+    shard.bytes += ENTRY_BYTES;
+}
+
+size_t
+OPECache::entries() const
+{
+    size_t out = 0;
+    for (const auto &shard : shards) {
+        scoped_lock l(&shard.lock);
+        out += shard.slots.size();
+    }
+
+    return out;
+}
+
+size_t
+OPECache::bytes() const
+{
+    size_t out = 0;
+    for (const auto &shard : shards) {
+        scoped_lock l(&shard.lock);
+        out += shard.bytes;
+    }
+
+    return out;
+}
+
+void
+OPECache::clear()
+{
+    for (auto &shard : shards) {
+        scoped_lock l(&shard.lock);
+        shard.index.clear();
+        shard.slots.clear();
+        shard.hand = 0;
+        shard.bytes = 0;
+    }
+}
+
+// > one node per line: tag, node and gap in decimal
+bool
+OPECache::save(const std::string &path) const
+{
+    // > the gaps follow from the keys, so only we may read the file; a
+    //   leftover temp file may have been made by someone else
+    const std::string tmp = path + ".tmp";
+    unlink(tmp.c_str());
+    const int fd =
+        open(tmp.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_TRUNC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    bool ok = true;
+    for (const auto &shard : shards) {
+        std::stringstream out;
+        {
+            scoped_lock l(&shard.lock);
+            for (const auto &slot : shard.slots) {
+                out << slot.key.first << " "
+                    << ZZFromUint128(slot.key.second) << " "
+                    << ZZFromUint128(slot.dgap) << "\n";
+            }
+        }
+
+        const std::string &data = out.str();
+        for (size_t done = 0; ok && done < data.size(); ) {
+            const ssize_t n =
+                write(fd, data.data() + done, data.size() - done);
+            if (n < 0 && EINTR == errno) {
+                continue;
+            }
+            ok = n > 0;
+            done += ok ? n : 0;
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    ok = 0 == fsync(fd) && ok;
+    ok = 0 == close(fd) && ok;
+
+    // > a crash while saving leaves the old snapshot in place
+    if (!ok || 0 != rename(tmp.c_str(), path.c_str())) {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool
+OPECache::load(const std::string &path)
+{
+    std::ifstream in(path.c_str());
+    if (!in) {
+        return false;
+    }
+
+    uint64_t tag;
+    ZZ node, dgap;
+    while (in >> tag >> node >> dgap) {
+        if (fitsUint128(node) && fitsUint128(dgap)) {
+            this->insert(tag, uint128FromZZ(node), uint128FromZZ(dgap));
+        }
+    }
+
+    return in.eof();
+}
+
+uint64_t
+OPE::cacheTag(const std::string &key, size_t pbits, size_t cbits)
+{
+    std::stringstream ss;
+    ss << key << "/" << pbits << "/" << cbits;
+    const std::string &h = sha256::hash(ss.str());
+    uint64_t out = 0;
+    for (size_t i = 0; i < sizeof(out); ++i) {
+        out = (out << 8) | static_cast<unsigned char>(h[i]);
+    }
+
+    return out;
+}
+
 /*
  * A gap is represented by the next integer value _above_ the gap.
  */
@@ -18,66 +394,293 @@ domain_gap(const ZZ &ndomain, const ZZ &nrange, const ZZ &rgap, PRNG *prng)
     return HGD(rgap, ndomain, nrange-ndomain, prng);
 }
 
-template<class CB>
-ope_domain_range
-OPE::lazy_sample(const ZZ &d_lo, const ZZ &d_hi,
-                 const ZZ &r_lo, const ZZ &r_hi,
-                 CB go_low, blockrng<AES> *prng)
+/*
+ * Arithmetic on the walk registers.  The ZZ forms write into their
+ * first argument, which keeps it's storage.
+ */
+static inline void
+ope_add(ZZ &x, const ZZ &a, const ZZ &b)
+{
+    add(x, a, b);
+}
+
+static inline void
+ope_add(ZZ &x, const ZZ &a, long b)
+{
+    add(x, a, b);
+}
+
+static inline void
+ope_sub(ZZ &x, const ZZ &a, const ZZ &b)
+{
+    sub(x, a, b);
+}
+
+static inline void
+ope_sub(ZZ &x, const ZZ &a, long b)
+{
+    sub(x, a, b);
+}
+
+static inline void
+ope_half(ZZ &x, const ZZ &a)
+{
+    RightShift(x, a, 1);
+}
+
+static inline void
+ope_add(ope_word &x, const ope_word &a, const ope_word &b)
+{
+    x = a + b;
+}
+
+static inline void
+ope_sub(ope_word &x, const ope_word &a, const ope_word &b)
+{
+    x = a - b;
+}
+
+static inline void
+ope_half(ope_word &x, const ope_word &a)
+{
+    x = a >> 1;
+}
+
+// > room for the bytes of a bound, and the bytes; little endian without
+//   leading zeros like StringFromZZ(...)
+static inline size_t
+bound_room(const ZZ &x)
+{
+    return NumBytes(x);
+}
+
+static inline size_t
+bound_bytes(const ZZ &x, uint8_t *out)
+{
+    const size_t n = NumBytes(x);
+    BytesFromZZ(out, x, n);
+    return n;
+}
+
+static inline size_t
+bound_room(const ope_word &)
 {
-    ZZ ndomain = d_hi - d_lo + 1;
-    ZZ nrange  = r_hi - r_lo + 1;
-    throw_c(nrange >= ndomain);
+    return sizeof(ope_uint128) + 1;
+}
 
-    if (ndomain == 1)
-        return ope_domain_range(d_lo, r_lo, r_hi);
+static inline size_t
+bound_bytes(const ope_word &x, uint8_t *out)
+{
+    return x.bytes(out);
+}
 
+/*
+ * Deterministically reset the PRNG counter, regardless of whether we
+ * had to use it for HGD or not in previous round.  The HMAC input is
+ * what StringFromZZ(d_lo) + "/" + ... + "/" + StringFromZZ(r_hi) gives,
+ * built on the stack.
+ */
+template<class N>
+static void
+seed_node(const hmac<sha256> &mac_key, const ope_walk<N> &w,
+          blockrng<AES> *prng)
+{
+    uint8_t buf[bound_room(w.d_lo) + bound_room(w.d_hi) +
+                bound_room(w.r_lo) + bound_room(w.r_hi) + 3];
+    size_t len = bound_bytes(w.d_lo, buf);
+    buf[len++] = '/';
+    len += bound_bytes(w.d_hi, buf + len);
+    buf[len++] = '/';
+    len += bound_bytes(w.r_lo, buf + len);
+    buf[len++] = '/';
+    len += bound_bytes(w.r_hi, buf + len);
+
+    hmac<sha256> h(mac_key);
+    h.update(buf, len);
+    uint8_t v[sha256::hashsize];
+    h.final(v);
+    prng->set_ctr(v);
+}
+
+/*
+ * The domain gap of the node that covers [d_lo, d_hi] -> [r_lo, r_hi];
+ * the gap splits the range in half.
+ */
+void
+OPE::node_gap(ope_walk<ZZ> *const w, blockrng<AES> *prng) const
+{
     /*
-     * Deterministically reset the PRNG counter, regardless of
-     * whether we had to use it for HGD or not in previous round.
+     * Sampling is deterministic, so two threads racing to fill in the
+     * same gap will compute the same value.
      */
-    auto v = hmac<sha256>::mac(StringFromZZ(d_lo) + "/" +
-                               StringFromZZ(d_hi) + "/" +
-                               StringFromZZ(r_lo) + "/" +
-                               StringFromZZ(r_hi), key);
-    v.resize(AES::blocksize);
-    prng->set_ctr(v);
+    const bool cached = fitsUint128(w->r_mid) && fitsUint128(w->ndomain);
+    ope_uint128 cached_gap;
+    if (cached && cache->lookup(tag, uint128FromZZ(w->r_mid), &cached_gap)) {
+        uint8_t buf[sizeof(cached_gap)];
+        for (size_t i = 0; i < sizeof(buf); i++) {
+            buf[i] = static_cast<uint8_t>(cached_gap);
+            cached_gap >>= 8;
+        }
+        ZZFromBytes(w->dgap, buf, sizeof(buf));
+        return;
+    }
+
+    seed_node(mac_key, *w, prng);
+    w->dgap = domain_gap(w->ndomain, w->nrange, w->rgap, prng);
+    if (cached)
+        cache->insert(tag, uint128FromZZ(w->r_mid), uint128FromZZ(w->dgap));
+}
+
+/*
+ * The same gap as the ZZ version.  Below the nodes where the domain
+ * fills the range no HGD draw is needed: drawing rgap balls from an urn
+ * of white balls gives rgap of them.  The other draws still go through
+ * HGD(...) as its RR arithmetic decides the result.
+ */
+void
+OPE::node_gap(ope_walk<ope_word> *const w, blockrng<AES> *prng) const
+{
+    const ope_uint128 node = w->r_mid.low();
+
+    ope_uint128 dgap;
+    if (cache->lookup(tag, node, &dgap)) {
+        w->dgap = dgap;
+        return;
+    }
+
+    if (w->nrange == w->ndomain) {
+        cache->insert(tag, node, w->rgap.low());
+        w->dgap = w->rgap;
+        return;
+    }
+
+    seed_node(mac_key, *w, prng);
+    dgap = uint128FromZZ(domain_gap(w->ndomain.zz(), w->nrange.zz(),
+                                    w->rgap.zz(), prng));
+    cache->insert(tag, node, dgap);
+    w->dgap = dgap;
+}
 
-    ZZ rgap = nrange/2;
-    ZZ dgap;
+// > a loop down the tree; the bounds are narrowed in place
+template<class N, class CB>
+ope_range<N>
+OPE::lazy_sample(ope_walk<N> *const w, CB go_low, blockrng<AES> *prng) const
+{
+    for (;;) {
+        ope_sub(w->ndomain, w->d_hi, w->d_lo);
+        ope_add(w->ndomain, w->ndomain, 1);
+        ope_sub(w->nrange, w->r_hi, w->r_lo);
+        ope_add(w->nrange, w->nrange, 1);
+        throw_c(w->nrange >= w->ndomain);
+
+        if (w->ndomain == 1)
+            return ope_range<N>(w->d_lo, w->r_lo, w->r_hi);
 
-    auto ci = dgap_cache.find(r_lo + rgap);
-    if (ci == dgap_cache.end()) {
-        dgap = domain_gap(ndomain, nrange, nrange / 2, prng);
-        dgap_cache[r_lo + rgap] = dgap;
-    } else {
-        dgap = ci->second;
+        ope_half(w->rgap, w->nrange);
+        ope_add(w->r_mid, w->r_lo, w->rgap);
+        node_gap(w, prng);
+        ope_add(w->d_mid, w->d_lo, w->dgap);
+
+        if (go_low(w->d_mid, w->r_mid)) {
+            ope_sub(w->d_hi, w->d_mid, 1);
+            ope_sub(w->r_hi, w->r_mid, 1);
+        } else {
+            swap(w->d_lo, w->d_mid);
+            swap(w->r_lo, w->r_mid);
+        }
     }
+}
+
+/*
+ * Walks the tree for a run of inputs at once; [begin, end) are indices
+ * of the inputs sorted so that the ones that go low come first.  Each
+ * node is sampled once for all the inputs that pass through it.
+ */
+template<class N, class CB>
+void
+OPE::lazy_sample_batch(const N &d_lo, const N &d_hi,
+                       const N &r_lo, const N &r_hi,
+                       CB go_low, std::vector<size_t>::const_iterator begin,
+                       std::vector<size_t>::const_iterator end,
+                       blockrng<AES> *prng,
+                       std::vector<ope_range<N> > *out) const
+{
+    ope_walk<N> w;
+    w.d_lo = d_lo;
+    w.d_hi = d_hi;
+    w.r_lo = r_lo;
+    w.r_hi = r_hi;
+    w.ndomain = d_hi - d_lo + 1;
+    w.nrange  = r_hi - r_lo + 1;
+    throw_c(w.nrange >= w.ndomain);
 
-    if (go_low(d_lo + dgap, r_lo + rgap))
-        return lazy_sample(d_lo, d_lo + dgap - 1, r_lo, r_lo + rgap - 1, go_low, prng);
-    else
-        return lazy_sample(d_lo + dgap, d_hi, r_lo + rgap, r_hi, go_low, prng);
+    if (w.ndomain == 1) {
+        for (auto it = begin; it != end; ++it)
+            (*out)[*it] = ope_range<N>(d_lo, r_lo, r_hi);
+        return;
+    }
+
+    w.rgap = w.nrange >> 1;
+    w.r_mid = r_lo + w.rgap;
+    node_gap(&w, prng);
+    const N d_mid = d_lo + w.dgap;
+    const N &r_mid = w.r_mid;
+
+    auto split = std::partition_point(begin, end,
+        [&go_low, &d_mid, &r_mid](size_t i) { return go_low(i, d_mid, r_mid); });
+    if (begin != split)
+        lazy_sample_batch(d_lo, d_mid - 1, r_lo, r_mid - 1, go_low,
+                          begin, split, prng, out);
+    if (split != end)
+        lazy_sample_batch(d_mid, d_hi, r_mid, r_hi, go_low,
+                          split, end, prng, out);
 }
 
-template<class CB>
-ope_domain_range
-OPE::search(CB go_low)
+template<class N, class CB>
+ope_range<N>
+OPE::search(CB go_low) const
 {
     blockrng<AES> r(aesk);
+    ope_walk<N> w;
+    tree_top(pbits, &w.d_hi);
+    tree_top(cbits, &w.r_hi);
 
-    return lazy_sample(to_ZZ(0), to_ZZ(1) << pbits,
-                       to_ZZ(0), to_ZZ(1) << cbits,
-                       go_low, &r);
+    return lazy_sample(&w, go_low, &r);
 }
 
-ZZ
-OPE::encrypt(const ZZ &ptext)
+// > the leaf of each input; go_low(i, d, r) decides for input i
+template<class N, class CB>
+std::vector<ope_range<N> >
+OPE::search_batch(const std::vector<N> &inputs, CB go_low) const
 {
-    ope_domain_range dr =
-        search([&ptext](const ZZ &d, const ZZ &) { return ptext < d; });
+    std::vector<size_t> order(inputs.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&inputs](size_t a, size_t b) { return inputs[a] < inputs[b]; });
 
-    auto v = sha256::hash(StringFromZZ(ptext));
-    v.resize(16);
+    std::vector<ope_range<N> > out(inputs.size(), ope_range<N>(N(), N(), N()));
+    if (inputs.empty())
+        return out;
+
+    blockrng<AES> r(aesk);
+    N d_top, r_top;
+    tree_top(pbits, &d_top);
+    tree_top(cbits, &r_top);
+    lazy_sample_batch(N(), d_top, N(), r_top,
+                      go_low, order.begin(), order.end(), &r, &out);
+    return out;
+}
+
+// > the ciphertext is picked from the leaf's range by the plaintext
+ZZ
+OPE::pick_ciphertext(const ZZ &ptext, const ope_domain_range &dr) const
+{
+    uint8_t pbuf[bound_room(ptext) + 1];
+    sha256 h;
+    h.update(pbuf, bound_bytes(ptext, pbuf));
+    uint8_t v[sha256::hashsize];
+    h.final(v);
 
     blockrng<AES> aesrand(aesk);
     aesrand.set_ctr(v);
@@ -86,10 +689,131 @@ OPE::encrypt(const ZZ &ptext)
     return dr.r_lo + aesrand.rand_zz_mod(nrange);
 }
 
+// > draws the same bytes as PRNG::rand_zz_mod(...) does
+ope_uint128
+OPE::pick_ciphertext(uint64_t ptext, const ope_range<ope_word> &dr) const
+{
+    const ope_word nrange = dr.r_hi - dr.r_lo + 1;
+    const size_t nbytes = nrange.bits() / 8 + 1;
+    if (nbytes > sizeof(ope_uint128)) {
+        const ope_domain_range zdr(dr.d.zz(), dr.r_lo.zz(), dr.r_hi.zz());
+        return uint128FromZZ(pick_ciphertext(ZZFromUint128(ptext), zdr));
+    }
+
+    uint8_t pbuf[sizeof(ptext)];
+    sha256 h;
+    h.update(pbuf, le_bytes(ptext, pbuf));
+    uint8_t v[sha256::hashsize];
+    h.final(v);
+
+    blockrng<AES> aesrand(aesk);
+    aesrand.set_ctr(v);
+
+    uint8_t buf[sizeof(ope_uint128)];
+    aesrand.rand_bytes(nbytes, buf);
+    ope_uint128 rand = 0;
+    for (size_t i = nbytes; i > 0; i--)
+        rand = (rand << 8) | buf[i - 1];
+
+    return (dr.r_lo + ope_word(rand % nrange.low())).low();
+}
+
 ZZ
-OPE::decrypt(const ZZ &ctext)
+OPE::encrypt(const ZZ &ptext) const
 {
     ope_domain_range dr =
-        search([&ctext](const ZZ &, const ZZ &r) { return ctext < r; });
+        search<ZZ>([&ptext](const ZZ &d, const ZZ &) { return ptext < d; });
+
+    return pick_ciphertext(ptext, dr);
+}
+
+ZZ
+OPE::decrypt(const ZZ &ctext) const
+{
+    ope_domain_range dr =
+        search<ZZ>([&ctext](const ZZ &, const ZZ &r) { return ctext < r; });
     return dr.d;
 }
+
+std::vector<ZZ>
+OPE::encrypt_batch(const std::vector<ZZ> &ptexts) const
+{
+    const std::vector<ope_domain_range> &drs =
+        search_batch(ptexts, [&ptexts](size_t i, const ZZ &d, const ZZ &) {
+            return ptexts[i] < d;
+        });
+
+    std::vector<ZZ> out;
+    for (size_t i = 0; i < ptexts.size(); i++)
+        out.push_back(pick_ciphertext(ptexts[i], drs[i]));
+    return out;
+}
+
+std::vector<ZZ>
+OPE::decrypt_batch(const std::vector<ZZ> &ctexts) const
+{
+    const std::vector<ope_domain_range> &drs =
+        search_batch(ctexts, [&ctexts](size_t i, const ZZ &, const ZZ &r) {
+            return ctexts[i] < r;
+        });
+
+    std::vector<ZZ> out;
+    for (const auto &it : drs)
+        out.push_back(it.d);
+    return out;
+}
+
+ope_uint128
+OPE::encrypt_native(uint64_t ptext) const
+{
+    throw_c(native());
+    const ope_word p(ptext);
+    const ope_range<ope_word> &dr =
+        search<ope_word>([&p](const ope_word &d, const ope_word &) {
+            return p < d;
+        });
+
+    return pick_ciphertext(ptext, dr);
+}
+
+ope_uint128
+OPE::decrypt_native(ope_uint128 ctext) const
+{
+    throw_c(native());
+    const ope_word c(ctext);
+    return search<ope_word>([&c](const ope_word &, const ope_word &r) {
+        return c < r;
+    }).d.low();
+}
+
+std::vector<ope_uint128>
+OPE::encrypt_batch_native(const std::vector<uint64_t> &ptexts) const
+{
+    throw_c(native());
+    const std::vector<ope_word> ps(ptexts.begin(), ptexts.end());
+    const std::vector<ope_range<ope_word> > &drs =
+        search_batch(ps, [&ps](size_t i, const ope_word &d, const ope_word &) {
+            return ps[i] < d;
+        });
+
+    std::vector<ope_uint128> out;
+    for (size_t i = 0; i < ptexts.size(); i++)
+        out.push_back(pick_ciphertext(ptexts[i], drs[i]));
+    return out;
+}
+
+std::vector<ope_uint128>
+OPE::decrypt_batch_native(const std::vector<ope_uint128> &ctexts) const
+{
+    throw_c(native());
+    const std::vector<ope_word> cs(ctexts.begin(), ctexts.end());
+    const std::vector<ope_range<ope_word> > &drs =
+        search_batch(cs, [&cs](size_t i, const ope_word &, const ope_word &r) {
+            return cs[i] < r;
+        });
+
+    std::vector<ope_uint128> out;
+    for (const auto &it : drs)
+        out.push_back(it.d.low());
+    return out;
+}
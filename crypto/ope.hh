@@ -2,27 +2,136 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <atomic>
+#include <pthread.h>
+#include <stdint.h>
 #include <crypto/prng.hh>
 #include <crypto/aes.hh>
 #include <crypto/sha.hh>
+#include <crypto/hmac.hh>
 #include <NTL/ZZ.h>
 
-class ope_domain_range {
+typedef unsigned __int128 ope_uint128;
+
+template<class N>
+class ope_range {
  public:
-    ope_domain_range(const NTL::ZZ &d_arg,
-                     const NTL::ZZ &r_lo_arg,
-                     const NTL::ZZ &r_hi_arg)
+    ope_range(const N &d_arg, const N &r_lo_arg, const N &r_hi_arg)
         : d(d_arg), r_lo(r_lo_arg), r_hi(r_hi_arg) {}
-    NTL::ZZ d, r_lo, r_hi;
+    N d, r_lo, r_hi;
+};
+
+typedef ope_range<NTL::ZZ> ope_domain_range;
+
+// > the registers of one walk down a tree; they are reused from level to
+//   level so a ZZ walk stops allocating once they have grown
+template<class N>
+struct ope_walk {
+    N d_lo, d_hi, r_lo, r_hi;
+    N ndomain, nrange, rgap, dgap;
+    N d_mid, r_mid;
+};
+
+// > the numbers of the native trees; see ope.cc
+class ope_word;
+
+/*
+ * The domain gaps sampled at the nodes of the OPE search trees.
+ *
+ * Each gap costs an HGD draw, so all OPE instances share one cache and
+ * keep their gaps across schema reloads.  Memory is bounded by a budget;
+ * once it is reached the CLOCK algorithm evicts nodes that have not been
+ * used since the hand last passed them.  Gaps are a deterministic
+ * function of the key, so a snapshot saved by one proxy is valid for
+ * the next one.  Only nodes of trees with ciphertexts of up to 128 bits
+ * are kept.
+ */
+class OPECache {
+ public:
+    explicit OPECache(size_t budget_bytes = DEFAULT_BUDGET);
+    ~OPECache();
+
+    OPECache(const OPECache &) = delete;
+    OPECache &operator=(const OPECache &) = delete;
+
+    static OPECache &shared();
+
+    bool lookup(uint64_t tag, ope_uint128 node, ope_uint128 *const dgap);
+    void insert(uint64_t tag, ope_uint128 node, ope_uint128 dgap);
+
+    // > a smaller budget takes effect as nodes are inserted
+    void setBudget(size_t bytes) {budget_bytes = bytes;}
+    size_t budget() const {return budget_bytes;}
+    size_t entries() const;
+    size_t bytes() const;
+    void clear();
+
+    // > false if the file can not be written or read
+    bool save(const std::string &path) const;
+    bool load(const std::string &path);
+
+    static const size_t DEFAULT_BUDGET = 64 << 20;
+
+ private:
+    typedef std::pair<uint64_t, ope_uint128> Key;
+    struct Slot {
+        Key key;
+        ope_uint128 dgap;
+        bool referenced;
+    };
+    struct Shard {
+        Shard() : hand(0), bytes(0) {pthread_mutex_init(&lock, NULL);}
+        ~Shard() {pthread_mutex_destroy(&lock);}
+
+        mutable pthread_mutex_t lock;
+        std::map<Key, size_t> index;
+        std::vector<Slot> slots;
+        size_t hand;
+        size_t bytes;
+    };
+
+    // > what an entry costs with the bookkeeping of the index
+    static const size_t ENTRY_BYTES;
+    static const unsigned int SHARDS = 16;
+    Shard shards[SHARDS];
+    std::atomic<size_t> budget_bytes;
+
+    Shard &shardFor(uint64_t tag, ope_uint128 node);
+    void evictOne(Shard *const shard);
 };
 
 class OPE {
  public:
-    OPE(const std::string &keyarg, size_t plainbits, size_t cipherbits)
-    : key(keyarg), pbits(plainbits), cbits(cipherbits), aesk(aeskey(key)) {}
+    OPE(const std::string &keyarg, size_t plainbits, size_t cipherbits,
+        OPECache *const cache = &OPECache::shared())
+    : key(keyarg), pbits(plainbits), cbits(cipherbits), aesk(aeskey(key)),
+      mac_key(keyarg.data(), keyarg.size()), cache(cache),
+      tag(cacheTag(key, pbits, cbits)) {}
+
+    OPE(const OPE &) = delete;
+    OPE &operator=(const OPE &) = delete;
+
+    NTL::ZZ encrypt(const NTL::ZZ &ptext) const;
+    NTL::ZZ decrypt(const NTL::ZZ &ctext) const;
 
-    NTL::ZZ encrypt(const NTL::ZZ &ptext);
-    NTL::ZZ decrypt(const NTL::ZZ &ctext);
+    // > match encrypt(...) and decrypt(...) value for value; the tree
+    //   nodes the values share are only visited once
+    std::vector<NTL::ZZ> encrypt_batch(const std::vector<NTL::ZZ> &ptexts)
+        const;
+    std::vector<NTL::ZZ> decrypt_batch(const std::vector<NTL::ZZ> &ctexts)
+        const;
+
+    // > the same ciphertexts computed on native integers; only for
+    //   plaintexts of up to 64 bits and ciphertexts of up to 128 bits,
+    //   which covers every integer column
+    bool native() const {return pbits <= 64 && cbits <= 128;}
+    ope_uint128 encrypt_native(uint64_t ptext) const;
+    ope_uint128 decrypt_native(ope_uint128 ctext) const;
+    std::vector<ope_uint128>
+    encrypt_batch_native(const std::vector<uint64_t> &ptexts) const;
+    std::vector<ope_uint128>
+    decrypt_batch_native(const std::vector<ope_uint128> &ctexts) const;
 
  private:
     static std::string aeskey(const std::string &key) {
@@ -30,18 +139,43 @@ class OPE {
         v.resize(16);
         return v;
     }
+    // > names this key's tree in the shared cache
+    static uint64_t cacheTag(const std::string &key, size_t pbits,
+                             size_t cbits);
 
     std::string key;
     size_t pbits, cbits;
 
     AES aesk;
-    std::map<NTL::ZZ, NTL::ZZ> dgap_cache;
+    // > keyed once; each node copies it
+    const hmac<sha256> mac_key;
+    /* encrypt and decrypt may be called concurrently */
+    OPECache *const cache;
+    const uint64_t tag;
+
+    // > sets w->dgap from the bounds, ndomain, nrange, rgap and r_mid
+    void node_gap(ope_walk<NTL::ZZ> *const w, blockrng<AES> *prng) const;
+    void node_gap(ope_walk<ope_word> *const w, blockrng<AES> *prng) const;
+    NTL::ZZ pick_ciphertext(const NTL::ZZ &ptext,
+                            const ope_domain_range &dr) const;
+    ope_uint128 pick_ciphertext(uint64_t ptext,
+                                const ope_range<ope_word> &dr) const;
 
-    template<class CB>
-    ope_domain_range search(CB go_low);
+    template<class N, class CB>
+    ope_range<N> search(CB go_low) const;
+    template<class N, class CB>
+    std::vector<ope_range<N> >
+    search_batch(const std::vector<N> &inputs, CB go_low) const;
 
-    template<class CB>
-    ope_domain_range lazy_sample(const NTL::ZZ &d_lo, const NTL::ZZ &d_hi,
-                                 const NTL::ZZ &r_lo, const NTL::ZZ &r_hi,
-                                 CB go_low, blockrng<AES> *prng);
+    template<class N, class CB>
+    ope_range<N> lazy_sample(ope_walk<N> *const w, CB go_low,
+                             blockrng<AES> *prng) const;
+    template<class N, class CB>
+    void lazy_sample_batch(const N &d_lo, const N &d_hi,
+                           const N &r_lo, const N &r_hi,
+                           CB go_low,
+                           std::vector<size_t>::const_iterator begin,
+                           std::vector<size_t>::const_iterator end,
+                           blockrng<AES> *prng,
+                           std::vector<ope_range<N> > *out) const;
 };
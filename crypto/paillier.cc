@@ -4,6 +4,58 @@
 using namespace std;
 using namespace NTL;
 
+/*
+ * NTL's RandomLen_ZZ draws from one global generator with no locking,
+ * and HOM layers encrypt on client threads and on the proxy's randomness
+ * producer at once; every thread draws r from it's own generator.
+ */
+static ZZ
+random_r(const ZZ &n)
+{
+    static thread_local urandom u;
+    return u.rand_zz_mod(n);
+}
+
+/*
+ * Fixed-base exponentiation
+ */
+
+FixedBasePow::FixedBasePow(const ZZ &base, const ZZ &marg, uint ebits,
+                           uint warg)
+    : m(marg), w(warg), table((ebits + warg - 1) / warg)
+{
+    throw_c(w > 0 && w < 16);
+
+    ZZ b = base % m;
+    for (auto &row: table) {
+        row.resize((1 << w) - 1);
+        row[0] = b;
+        for (uint j = 1; j < row.size(); j++)
+            MulMod(row[j], row[j-1], b, m);
+
+        // > b^(2^w) for the next window
+        MulMod(b, row.back(), b, m);
+    }
+}
+
+ZZ
+FixedBasePow::pow(const ZZ &e) const
+{
+    long ebits = NumBits(e);
+    throw_c(sign(e) >= 0 && (size_t) ebits <= table.size() * w);
+
+    ZZ r = to_ZZ(1);
+    for (uint i = 0; (long) (i * w) < ebits; i++) {
+        uint d = 0;
+        for (uint b = 0; b < w; b++)
+            d |= bit(e, i * w + b) << b;
+        if (d)
+            MulMod(r, r, table[i][d-1], m);
+    }
+    return r;
+}
+
+
 /*
  * Public-key operations
  */
@@ -27,7 +79,7 @@ Paillier::rand_gen(size_t niter, size_t nmax)
         niter = min(niter, nmax - rqueue.size());
 
     for (uint i = 0; i < niter; i++) {
-        ZZ r = RandomLen_ZZ(nbits) % n;
+        ZZ r = random_r(n);
         ZZ rn = PowerMod(g, n*r, n2);
         rqueue.push_back(rn);
     }
@@ -43,7 +95,7 @@ Paillier::encrypt(const ZZ &plaintext)
 
         return (PowerMod(g, plaintext, n2) * rn) % n2;
     } else {
-        ZZ r = RandomLen_ZZ(nbits) % n;
+        ZZ r = random_r(n);
         return PowerMod(g, plaintext + n*r, n2);
     }
 }
@@ -94,7 +146,13 @@ Paillier_priv::Paillier_priv(const vector<ZZ> &sk)
       hp(InvMod(Lfast(PowerMod(g % p2, fast ? a : (p-1), p2),
                       pinv, two_p, p), p)),
       hq(InvMod(Lfast(PowerMod(g % q2, fast ? a : (q-1), q2),
-                      qinv, two_q, q), q))
+                      qinv, two_q, q), q)),
+      // > in fast mode g^a = 1 mod n, so g^(a*p) = 1 mod p^2
+      gordp(fast ? a * p : p * (p-1)),
+      gordq(fast ? a * q : q * (q-1)),
+      p2inv(InvMod(p2 % q2, q2)),
+      gp(g, p2, NumBits(gordp)),
+      gq(g, q2, NumBits(gordq))
 {
     throw_c(sk.size() == 4);
 }
@@ -158,3 +216,31 @@ Paillier_priv::decrypt(const ZZ &ciphertext) const
 
     return m;
 }
+
+ZZ
+Paillier_priv::encrypt(const ZZ &plaintext) const
+{
+    return encrypt(plaintext, random_r(n));
+}
+
+ZZ
+Paillier_priv::encrypt(const ZZ &plaintext, const ZZ &r) const
+{
+    return crt_pow(plaintext + n*r);
+}
+
+ZZ
+Paillier_priv::encrypt_rn(const ZZ &plaintext, const ZZ &rn) const
+{
+    return MulMod(crt_pow(plaintext), rn, n2);
+}
+
+ZZ
+Paillier_priv::crt_pow(const ZZ &e) const
+{
+    ZZ cp = gp.pow(e % gordp);
+    ZZ cq = gq.pow(e % gordq);
+
+    // > c = cp mod p^2 and c = cq mod q^2
+    return cp + p2 * MulMod((cq - cp) % q2, p2inv, q2);
+}
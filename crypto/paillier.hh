@@ -9,6 +9,25 @@
 const unsigned int Paillier_len_bytes = PAILLIER_LEN_BYTES;
 const unsigned int Paillier_len_bits = Paillier_len_bytes * 8;
 
+/*
+ * base^e mod m for a fixed base and exponents of at most ebits bits.
+ * base^(j * 2^(w*i)) is precomputed for every w-bit window i of the
+ * exponent, so a power is one multiplication per non-zero window and
+ * needs no squarings.
+ */
+class FixedBasePow {
+ public:
+    FixedBasePow() : w(0) {} //HACK: for Paillier_priv()
+    FixedBasePow(const NTL::ZZ &base, const NTL::ZZ &m, uint ebits,
+                 uint w = 4);
+
+    NTL::ZZ pow(const NTL::ZZ &e) const;
+
+ private:
+    const NTL::ZZ m;
+    const uint w;
+    std::vector<std::vector<NTL::ZZ> > table;
+};
 
 class Paillier {
  public:
@@ -113,6 +132,22 @@ class Paillier_priv : public Paillier {
 
     NTL::ZZ decrypt(const NTL::ZZ &ciphertext) const;
 
+    /*
+     * The ciphertexts of Paillier::encrypt, g^(plaintext + n*r) mod n^2,
+     * computed mod p^2 and mod q^2 with the exponent reduced by the
+     * order of g and joined with CRT.
+     */
+    NTL::ZZ encrypt(const NTL::ZZ &plaintext) const;
+    // > for a given r in [0, n)
+    NTL::ZZ encrypt(const NTL::ZZ &plaintext, const NTL::ZZ &r) const;
+
+    /*
+     * The randomness of a ciphertext, g^(n*r) mod n^2, can be computed
+     * ahead of time; encrypt_rn then costs a short power of g.
+     */
+    NTL::ZZ rand_rn() const { return encrypt(NTL::to_ZZ(0)); }
+    NTL::ZZ encrypt_rn(const NTL::ZZ &plaintext, const NTL::ZZ &rn) const;
+
     static std::vector<NTL::ZZ> keygen(PRNG*, uint nbits = 1024, uint abits = 256);
 
     template<class PackT>
@@ -136,6 +171,9 @@ class Paillier_priv : public Paillier {
     }
 
  private:
+    /* g^e mod n^2 */
+    NTL::ZZ crt_pow(const NTL::ZZ &e) const;
+
     /* Private key, including g from public part; n=pq */
     const NTL::ZZ p, q;
     const NTL::ZZ a;      /* non-zero for fast mode */
@@ -146,4 +184,8 @@ class Paillier_priv : public Paillier {
     const NTL::ZZ two_p, two_q;
     const NTL::ZZ pinv, qinv;
     const NTL::ZZ hp, hq;
+    /* Multiples of the order of g mod p^2 and q^2 */
+    const NTL::ZZ gordp, gordq;
+    const NTL::ZZ p2inv;  /* p^2 ^ -1 mod q^2 */
+    const FixedBasePow gp, gq;
 };
@@ -107,6 +107,10 @@ class blockrng : public PRNG {
         memcpy(ctr, v.data(), BlockCipher::blocksize);
     }
 
+    void set_ctr(const uint8_t *v) {
+        memcpy(ctr, v, BlockCipher::blocksize);
+    }
+
  private:
     BlockCipher bc;
     uint8_t ctr[BlockCipher::blocksize];
@@ -1,5 +1,10 @@
+#include <atomic>
 #include <vector>
 #include <iomanip>
+#include <math.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <crypto/BasicCrypto.hh>
 #include <crypto/cbc.hh>
 #include <crypto/cmc.hh>
 #include <crypto/prng.hh>
@@ -14,6 +19,7 @@
 #include <crypto/bn.hh>
 #include <crypto/ecjoin.hh>
 #include <crypto/search.hh>
+#include <crypto/SWPSearch.hh>
 #include <crypto/skip32.hh>
 #include <crypto/cbcmac.hh>
 #include <crypto/ffx.hh>
@@ -22,12 +28,40 @@
 #include <crypto/mont.hh>
 #include <crypto/gfe.hh>
 #include <util/timer.hh>
+#include <util/parallel.hh>
 #include <NTL/ZZ.h>
 #include <NTL/RR.h>
 
 using namespace std;
 using namespace NTL;
 
+/*
+ * Counts the heap allocations of the benchmarks; NTL allocates with
+ * malloc(...) directly so operator new would miss them.
+ */
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+
+static std::atomic<uint64_t> heap_allocs(0);
+
+extern "C" void *
+malloc(size_t size) __THROW
+{
+    ++heap_allocs;
+    return __libc_malloc(size);
+}
+
+extern "C" void *
+realloc(void *p, size_t size) __THROW
+{
+    ++heap_allocs;
+    return __libc_realloc(p, size);
+}
+#else
+static const uint64_t heap_allocs = 0;
+#endif
+
 template<class T>
 void
 test_block_cipher(T *c, PRNG *u, const std::string &cname)
@@ -120,6 +154,184 @@ test_ope(int pbits, int cbits)
                                                        : NumBits(to_ZZ(1/maxerr))) << endl;
 }
 
+static void
+test_ope_cache()
+{
+    urandom u;
+    const std::string key = "hello world";
+
+    // > a cache too small for the tree must not change the ciphertexts
+    OPECache small(16 * 4096);
+    OPE o(key, 64, 128);
+    OPE o_small(key, 64, 128, &small);
+    for (uint i = 0; i < 200; i++) {
+        ZZ pt = u.rand_zz_mod(to_ZZ(1) << 64);
+        ZZ ct = o.encrypt(pt);
+        throw_c(o_small.encrypt(pt) == ct);
+        throw_c(o_small.decrypt(ct) == pt);
+    }
+    throw_c(small.bytes() <= small.budget());
+
+    // > a reloaded snapshot gives the same gaps, and only we can read it
+    char path_buf[] = "/tmp/ope_cache_test.XXXXXX";
+    const int fd = mkstemp(path_buf);
+    throw_c(fd >= 0);
+    close(fd);
+    const std::string path = path_buf;
+    throw_c(small.save(path));
+    struct stat st;
+    throw_c(0 == stat(path.c_str(), &st));
+    throw_c(0600 == (st.st_mode & 0777));
+    OPECache loaded;
+    throw_c(loaded.load(path));
+    throw_c(loaded.entries() == small.entries());
+    OPE o_loaded(key, 64, 128, &loaded);
+    for (uint i = 0; i < 20; i++) {
+        ZZ pt = u.rand_zz_mod(to_ZZ(1) << 64);
+        throw_c(o_loaded.encrypt(pt) == o.encrypt(pt));
+    }
+    unlink(path.c_str());
+
+    cout << "--- ope cache: " << small.entries() << " nodes in "
+         << small.bytes() << " bytes" << endl;
+}
+
+static void
+test_ope_batch(int pbits, int cbits)
+{
+    urandom u;
+    std::vector<ZZ> pts;
+    for (uint i = 0; i < 1000; i++)
+        pts.push_back(u.rand_zz_mod(to_ZZ(1) << pbits));
+    pts.push_back(pts[0]);
+
+    // > a cold cache for each so the walks are compared fairly
+    OPECache single_cache, batch_cache;
+    OPE single("hello world", pbits, cbits, &single_cache);
+    OPE batch("hello world", pbits, cbits, &batch_cache);
+
+    timer t;
+    std::vector<ZZ> cts;
+    for (auto &pt : pts)
+        cts.push_back(single.encrypt(pt));
+    uint64_t single_usec = t.lap();
+
+    const std::vector<ZZ> &batch_cts = batch.encrypt_batch(pts);
+    uint64_t batch_usec = t.lap();
+    throw_c(batch_cts == cts);
+
+    batch_cache.clear();
+    throw_c(batch.decrypt_batch(cts) == pts);
+
+    cout << "--- ope batch: " << pbits << "-bit plaintext, "
+         << cbits << "-bit ciphertext, " << pts.size() << " values" << endl
+         << "  one at a time: " << single_usec << " usec; "
+         << "batch: " << batch_usec << " usec" << endl;
+}
+
+static ZZ
+zzFromUint128(ope_uint128 v)
+{
+    uint8_t buf[sizeof(v)];
+    for (uint i = 0; i < sizeof(buf); i++) {
+        buf[i] = static_cast<uint8_t>(v);
+        v >>= 8;
+    }
+    return ZZFromBytes(buf, sizeof(buf));
+}
+
+static void
+test_ope_native(int pbits, int cbits)
+{
+    urandom u;
+    std::vector<uint64_t> pts;
+    for (uint i = 0; i < 1000; i++) {
+        uint64_t pt = u.rand<uint64_t>();
+        pts.push_back(pbits < 64 ? pt & ((1ULL << pbits) - 1) : pt);
+    }
+    pts.push_back(0);
+    pts.push_back(pbits < 64 ? (1ULL << pbits) - 1 : ~0ULL);
+
+    // > a cold cache for each so both sample the whole tree
+    OPECache zz_cache, native_cache;
+    OPE zz("hello world", pbits, cbits, &zz_cache);
+    OPE native("hello world", pbits, cbits, &native_cache);
+    throw_c(native.native());
+
+    timer t;
+    std::vector<ZZ> cts;
+    for (auto pt : pts)
+        cts.push_back(zz.encrypt(zzFromUint128(pt)));
+    uint64_t zz_usec = t.lap();
+
+    std::vector<ope_uint128> native_cts;
+    for (auto pt : pts)
+        native_cts.push_back(native.encrypt_native(pt));
+    uint64_t native_usec = t.lap();
+
+    // > and again with the trees cached
+    for (auto pt : pts)
+        zz.encrypt(zzFromUint128(pt));
+    uint64_t zz_warm_usec = t.lap();
+    for (auto pt : pts)
+        native.encrypt_native(pt);
+    uint64_t native_warm_usec = t.lap();
+
+    for (uint i = 0; i < pts.size(); i++) {
+        throw_c(zzFromUint128(native_cts[i]) == cts[i]);
+        throw_c(native.decrypt_native(native_cts[i]) == pts[i]);
+    }
+
+    cout << "--- ope native: " << pbits << "-bit plaintext, "
+         << cbits << "-bit ciphertext" << endl
+         << "  zz: " << zz_usec / pts.size() << " usec; "
+         << "native: " << native_usec / pts.size() << " usec; "
+         << "cached zz: " << zz_warm_usec / pts.size() << " usec; "
+         << "cached native: " << native_warm_usec / pts.size() << " usec"
+         << endl;
+}
+
+// > one encryption down a tree with no cached nodes, so every level is
+//   sampled; the ZZ walk against the native one
+static void
+test_ope_perf(int pbits, int cbits)
+{
+    urandom u;
+    std::vector<uint64_t> pts;
+    for (uint i = 0; i < 200; i++) {
+        uint64_t pt = u.rand<uint64_t>();
+        pts.push_back(pbits < 64 ? pt & ((1ULL << pbits) - 1) : pt);
+    }
+    std::vector<ZZ> zpts;
+    for (auto pt : pts)
+        zpts.push_back(zzFromUint128(pt));
+
+    OPECache uncached(0);
+    OPE o("hello world", pbits, cbits, &uncached);
+
+    uint64_t allocs = heap_allocs;
+    timer t;
+    for (auto &pt : zpts)
+        o.encrypt(pt);
+    uint64_t zz_usec = t.lap();
+    uint64_t zz_allocs = heap_allocs - allocs;
+
+    allocs = heap_allocs;
+    t.lap();
+    for (auto pt : pts)
+        o.encrypt_native(pt);
+    uint64_t native_usec = t.lap();
+    uint64_t native_allocs = heap_allocs - allocs;
+    throw_c(0 == uncached.entries());
+
+    cout << "--- ope perf: " << pbits << "-bit plaintext, "
+         << cbits << "-bit ciphertext, uncached" << endl
+         << "  zz: " << zz_usec * 1000 / pts.size() << " ns, "
+         << zz_allocs / pts.size() << " allocs; "
+         << "native: " << native_usec * 1000 / pts.size() << " ns, "
+         << native_allocs / pts.size() << " allocs per encrypt" << endl;
+}
+
 static void
 test_hgd()
 {
@@ -136,6 +348,95 @@ test_hgd()
     throw_c(s == 100);
 }
 
+// > chi-squared of the counts of HGD(KK, NN1, NN2) against the exact
+//   distribution; bins expecting fewer than 5 draws are merged
+static double
+hgd_chi_squared(long KK, long NN1, long NN2, uint nsamples, PRNG *prng)
+{
+    std::vector<uint> counts(KK + 1, 0);
+    for (uint i = 0; i < nsamples; i++) {
+        ZZ x = HGD(to_ZZ(KK), to_ZZ(NN1), to_ZZ(NN2), prng);
+        throw_c(x >= 0 && x <= KK);
+        counts[to_long(x)]++;
+    }
+
+    const double lc = lgamma(NN1 + NN2 + 1) - lgamma(KK + 1)
+                      - lgamma(NN1 + NN2 - KK + 1);
+    double chi2 = 0, expected = 0, observed = 0;
+    int bins = 0;
+    for (long x = 0; x <= KK; x++) {
+        if (x > NN1 || KK - x > NN2)
+            continue;
+        const double lp = lgamma(NN1 + 1) - lgamma(x + 1) - lgamma(NN1 - x + 1)
+                        + lgamma(NN2 + 1) - lgamma(KK - x + 1)
+                        - lgamma(NN2 - KK + x + 1) - lc;
+        expected += nsamples * exp(lp);
+        observed += counts[x];
+        if (expected >= 5) {
+            chi2 += (observed - expected) * (observed - expected) / expected;
+            expected = observed = 0;
+            bins++;
+        }
+    }
+    chi2 += expected > 0 ? (observed - expected) * (observed - expected)
+                           / expected
+                         : 0;
+
+    // > far out in the tail for bins - 1 degrees of freedom
+    throw_c(chi2 < bins + 6 * sqrt(2.0 * bins),
+            "HGD does not follow the hypergeometric distribution");
+    return chi2;
+}
+
+static void
+test_hgd_distribution()
+{
+    streamrng<arc4> r("hello world");
+
+    // > the inverse transformation and the H2PE branches
+    double small = hgd_chi_squared(20, 30, 50, 20000, &r);
+    double large = hgd_chi_squared(1000, 2000, 3000, 20000, &r);
+
+    cout << "--- hgd distribution: chi-squared " << small << " (inverse), "
+         << large << " (h2pe)" << endl;
+}
+
+static void
+test_hgd_perf()
+{
+    // > the draw at the root of a 64-bit to 128-bit OPE tree
+    const ZZ KK = to_ZZ(1) << 127;
+    const ZZ NN1 = (to_ZZ(1) << 64) + 1;
+    const ZZ NN2 = (to_ZZ(1) << 128) + 1 - NN1;
+
+    enum { nsamples = 2000 };
+    auto sample = [&KK, &NN1, &NN2](size_t i) {
+        streamrng<arc4> r("hgd " + std::to_string(
+                              static_cast<unsigned long long>(i)));
+        return HGD(KK, NN1, NN2, &r);
+    };
+
+    timer t;
+    std::vector<ZZ> serial;
+    for (uint i = 0; i < nsamples; i++)
+        serial.push_back(sample(i));
+    uint64_t serial_usec = t.lap();
+
+    // > samplers on other threads must not disturb each other
+    std::vector<ZZ> parallel(nsamples);
+    const unsigned int threads = defaultThreadCount();
+    parallelFor(nsamples, [&sample, &parallel](size_t i) {
+        parallel[i] = sample(i);
+    }, threads);
+    uint64_t parallel_usec = t.lap();
+    throw_c(parallel == serial);
+
+    cout << "--- hgd: " << nsamples * 1000000 / serial_usec
+         << " samples/sec on one thread; "
+         << nsamples * 1000000 / parallel_usec
+         << " samples/sec on " << threads << " threads" << endl;
+}
+
 static void
 test_paillier()
 {
@@ -169,6 +470,28 @@ test_paillier()
     cout << "paillier add: "
          << ((double) sumperf.lap()) / 1000 << " usec" << endl;
 
+    ZZ n = pk[0], g = pk[1];
+    for (int i = 0; i < 10; i++) {
+        ZZ m = u.rand_zz_mod(to_ZZ(1) << 64);
+        ZZ r = u.rand_zz_mod(n);
+        throw_c(pp.encrypt(m, r) == PowerMod(g, m + n*r, n*n));
+        throw_c(pp.decrypt(pp.encrypt(m)) == m);
+        throw_c(pp.encrypt_rn(m, pp.encrypt(to_ZZ(0), r)) ==
+                pp.encrypt(m, r));
+    }
+    throw_c(pp.decrypt(p.add(pp.encrypt(pt0), pp.encrypt(pt1))) ==
+            pt0 + pt1);
+
+    timer encperf;
+    for (int i = 0; i < 20; i++)
+        p.encrypt(to_ZZ(i));
+    double pub_usec = ((double) encperf.lap()) / 20;
+    for (int i = 0; i < 20; i++)
+        pp.encrypt(to_ZZ(i));
+    double priv_usec = ((double) encperf.lap()) / 20;
+    cout << "paillier encrypt: " << pub_usec << " usec public key, "
+         << priv_usec << " usec private key" << endl;
+
     for (int i = 0; i < 10; i++) {
         blockrng<AES> br(u.rand_string(16));
         auto v = u.rand_string(AES::blocksize);
@@ -283,6 +606,129 @@ test_montgomery()
     cout << "montgomery multiply: " << tmont.lap() << " usec for 100k" << endl;
 }
 
+/*
+ * The per-row work of the cryptdb_agg UDF: parse a ciphertext and fold
+ * it into the product mod n^2.
+ */
+static void
+test_montgomery_agg()
+{
+    urandom u;
+    Paillier_priv pp(Paillier_priv::keygen(&u));
+    const ZZ n2 = pp.hompubkey();
+
+    // > distinct ciphertexts, used round robin
+    enum { nct = 1024 };
+    std::vector<uint32_t> pts;
+    std::vector<std::string> cts;
+    for (uint i = 0; i < nct; i++) {
+        pts.push_back(u.rand<uint32_t>());
+        std::string ct(Paillier_len_bytes, '\0');
+        BytesFromZZ(reinterpret_cast<uint8_t *>(&ct[0]),
+                    pp.encrypt(to_ZZ(pts.back())), ct.size());
+        cts.push_back(ct);
+    }
+    auto plainsum = [&pts](uint64_t nrows) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < nrows; i++)
+            sum += pts[i % nct];
+        return to_ZZ(sum);
+    };
+
+    enum { nrows = 10000000, nntl = 1000000 };
+
+    timer t;
+    ZZ sum = to_ZZ(1);
+    for (uint i = 0; i < nntl; i++) {
+        const std::string &ct = cts[i % nct];
+        ZZ e;
+        ZZFromBytes(e, reinterpret_cast<const uint8_t *>(ct.data()),
+                    ct.size());
+        MulMod(sum, sum, e, n2);
+    }
+    double ntl_nsec = ((double) t.lap()) * 1000 / nntl;
+    throw_c(pp.decrypt(sum) == plainsum(nntl));
+
+    mpn_montgomery mm(n2);
+    std::vector<mp_limb_t> msum(mm.limbs(), 0), row(mm.limbs());
+    msum[0] = 1;
+    for (uint i = 0; i < nrows; i++) {
+        const std::string &ct = cts[i % nct];
+        throw_c(mm.from_bytes(&row[0],
+                              reinterpret_cast<const uint8_t *>(ct.data()),
+                              ct.size()));
+        mm.mul(&msum[0], &msum[0], &row[0]);
+    }
+    sum = MulMod(mm.to_zz(&msum[0]), mm.rpow(nrows), n2);
+    double mont_nsec = ((double) t.lap()) * 1000 / nrows;
+    throw_c(pp.decrypt(sum) == plainsum(nrows));
+
+    cout << "paillier aggregate per row: " << ntl_nsec << " nsec MulMod, "
+         << mont_nsec << " nsec montgomery (" << nrows << " rows)" << endl;
+}
+
+/*
+ * The per-row work of the decryption UDFs during onion adjustment, with
+ * the key expanded for every row and with it expanded once in _init.
+ */
+static void
+test_udf_key_schedule()
+{
+    urandom u;
+    const std::string bfkey = u.rand_string(16);
+    const std::string aeskey = u.rand_string(AES_KEY_BYTES);
+
+    enum { nrows = 10000000, nrekey = 100000 };
+
+    const blowfish bf(bfkey);
+    std::vector<uint64_t> cts;
+    for (uint i = 0; i < 1024; i++)
+        cts.push_back(bf.encrypt(i));
+
+    auto plainsum = [&cts](uint64_t n) {
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < n; i++)
+            sum += i % cts.size();
+        return sum;
+    };
+
+    timer t;
+    uint64_t sum = 0;
+    for (uint i = 0; i < nrekey; i++)
+        sum += blowfish(bfkey).decrypt(cts[i % cts.size()]);
+    double bf_rekey = ((double) t.lap()) * 1000 / nrekey;
+    throw_c(sum == plainsum(nrekey));
+
+    t.lap();
+    sum = 0;
+    for (uint i = 0; i < nrows; i++)
+        sum += bf.decrypt(cts[i % cts.size()]);
+    double bf_cached = ((double) t.lap()) * 1000 / nrows;
+    throw_c(sum == plainsum(nrows));
+
+    const std::unique_ptr<AES_KEY> enc(get_AES_enc_key(aeskey));
+    const std::string pt = u.rand_string(16);
+    const std::string ct = encrypt_AES_CMC(pt, enc.get());
+
+    t.lap();
+    for (uint i = 0; i < nrekey; i++) {
+        const std::unique_ptr<AES_KEY> dec(get_AES_dec_key(aeskey));
+        throw_c(decrypt_AES_CMC(ct, dec.get()) == pt);
+    }
+    double aes_rekey = ((double) t.lap()) * 1000 / nrekey;
+    const std::unique_ptr<AES_KEY> dec(get_AES_dec_key(aeskey));
+    for (uint i = 0; i < nrekey; i++)
+        throw_c(decrypt_AES_CMC(ct, dec.get()) == pt);
+    double aes_cached = ((double) t.lap()) * 1000 / nrekey;
+
+    cout << "udf decrypt per row: blowfish " << bf_rekey << " nsec rekeyed, "
+         << bf_cached << " nsec cached; aes cmc " << aes_rekey
+         << " nsec rekeyed, " << aes_cached << " nsec cached" << endl;
+    cout << "udf onion adjustment of " << nrows << " int rows: "
+         << bf_rekey * nrows / 1e9 << " sec rekeyed, "
+         << bf_cached * nrows / 1e9 << " sec cached" << endl;
+}
+
 static void
 test_bn()
 {
@@ -334,6 +780,77 @@ test_search()
     throw_c(s.match(cl, s.wordkey("world")));
 }
 
+/*
+ * The search UDF's scan: SWPSearcher must agree with SWP::searchExists,
+ * which it replaces, and is timed against it.
+ */
+static void
+test_swp_search()
+{
+    urandom u;
+    const std::string key = u.rand_string(AES_BLOCK_SIZE);
+    const std::list<std::string> words =
+        {"hello", "world", "hello", "testing", "test", "a", ""};
+    std::unique_ptr<std::list<std::string>> ciphs(SWP::encrypt(key, words));
+    std::string row;
+    for (auto &c : *ciphs)
+        row += c;
+    const unsigned char *const rowp =
+        reinterpret_cast<const unsigned char *>(row.data());
+
+    for (auto &w : {"hello", "world", "test", "testing", "a", "", "Hello",
+                    "tes", "xyzzy"}) {
+        const Token t = SWP::token(key, w);
+        SWPSearcher searcher(t);
+        const bool want = SWP::searchExists(t, *ciphs);
+        throw_c(want == (std::find(words.begin(), words.end(), w)
+                         != words.end()));
+        throw_c(searcher.searchExists(rowp, row.size()) == want);
+        for (size_t n = 0; n <= row.size(); n += SWPCiphSize) {
+            std::list<std::string> prefix;
+            for (size_t i = 0; i < n; i += SWPCiphSize)
+                prefix.push_back(row.substr(i, SWPCiphSize));
+            throw_c(searcher.searchExists(rowp, n)
+                    == SWP::searchExists(t, prefix));
+        }
+    }
+
+    // > rows of 100 words that do not match, as in a LIKE that
+    //   scans the whole table
+    enum { nwords = 100, nrows = 100000 };
+    std::list<std::string> rowwords;
+    for (uint i = 0; i < nwords; i++)
+        rowwords.push_back(std::to_string(i));
+    ciphs.reset(SWP::encrypt(key, rowwords));
+    row.clear();
+    for (auto &c : *ciphs)
+        row += c;
+    const Token t = SWP::token(key, "absent");
+
+    timer tm;
+    for (uint i = 0; i < nrows / 100; i++) {
+        std::list<std::string> l;
+        for (size_t j = 0; j < row.size(); j += SWPCiphSize)
+            l.push_back(row.substr(j, SWPCiphSize));
+        throw_c(!SWP::searchExists(t, l));
+    }
+    double old_nsec = ((double) tm.lap()) * 1000 / (nrows / 100);
+
+    SWPSearcher searcher(t);
+    uint64_t allocs = heap_allocs;
+    for (uint i = 0; i < nrows; i++)
+        throw_c(!searcher.searchExists(
+                    reinterpret_cast<const unsigned char *>(row.data()),
+                    row.size()));
+    double new_nsec = ((double) tm.lap()) * 1000 / nrows;
+    allocs = heap_allocs - allocs;
+    throw_c(allocs == 0);
+
+    cout << "swp search per " << nwords << " word row: " << old_nsec
+         << " nsec SWP::searchExists, " << new_nsec << " nsec SWPSearcher ("
+         << row.size() * 1000 / new_nsec << " MB/s)" << endl;
+}
+
 static void
 test_skip32(void)
 {
@@ -509,6 +1026,73 @@ test_online_ope_rebalance()
     cerr << "test online ope rebalance OK \n";
 }
 
+// > a table holding the ciphertexts must stay decryptable and ordered when
+//   the relabels are applied to it, and replaying the inserts must give
+//   the same tree
+static void
+test_online_ope_relabel()
+{
+    urandom u;
+    blowfish bf(u.rand_string(16));
+
+    ope_server<uint64_t> ope_serv;
+    ope_client<uint64_t, blowfish> ope_clnt(&bf, &ope_serv);
+    vector<pair<uint64_t, uint64_t> > journal_v;
+    vector<uint64_t> journal_enc;
+    ope_serv.inserted = [&] (uint64_t v, uint64_t nbits, const uint64_t &enc) {
+        journal_v.push_back(make_pair(v, nbits));
+        journal_enc.push_back(enc);
+    };
+
+    // plaintext -> ciphertext as a backend table would hold it
+    map<uint64_t, uint64_t> table;
+    uint relabels = 0;
+    for (uint i = 0; i < 2000; i++) {
+        uint64_t pt = u.rand<uint32_t>() % 5000;
+        uint64_t v, nbits;
+        bool predicted = !ope_clnt.find(pt, &v, &nbits)
+                         && ope_serv.insert_relabels(nbits);
+        uint64_t ct = ope_clnt.encrypt(pt);
+
+        auto moved = ope_serv.take_relabels();
+        // the proxy takes it's lock for a rebalance before the insert
+        throw_c(predicted || moved.empty());
+        map<uint64_t, uint64_t> update(moved.begin(), moved.end());
+        throw_c(update.size() == moved.size());
+        for (auto &it : table) {
+            auto m = update.find(it.second);
+            if (m != update.end()) {
+                it.second = m->second;
+            }
+        }
+        relabels += moved.size() > 0;
+        table[pt] = ct;
+    }
+    throw_c(relabels > 0);
+
+    uint64_t last = 0;
+    for (auto &it : table) {
+        throw_c(ope_clnt.decrypt(it.second) == it.first);
+        throw_c(it.second > last);
+        last = it.second;
+    }
+
+    ope_server<uint64_t> replayed;
+    for (uint i = 0; i < journal_v.size(); i++) {
+        replayed.insert(journal_v[i].first, journal_v[i].second,
+                        journal_enc[i]);
+    }
+    replayed.take_relabels();
+    ope_client<uint64_t, blowfish> replayed_clnt(&bf, &replayed);
+    for (auto &it : table) {
+        throw_c(replayed_clnt.decrypt(it.second) == it.first);
+        throw_c(replayed_clnt.encrypt(it.first) == it.second);
+    }
+
+    cerr << "test online ope relabel: " << relabels
+         << " relabeling inserts OK\n";
+}
+
 static void
 test_padding()
 {
@@ -605,6 +1189,7 @@ main(int ac, char **av)
     cout << u.rand<int64_t>() << endl;
 
     test_online_ope_rebalance();
+    test_online_ope_relabel();
 
     test_gfe<uint8_t>(4);
     test_gfe<uint16_t>(3);
@@ -615,9 +1200,12 @@ main(int ac, char **av)
     test_bn();
     test_ecjoin();
     test_search();
+    test_swp_search();
     test_paillier();
     test_paillier_packing();
     test_montgomery();
+    test_montgomery_agg();
+    test_udf_key_schedule();
     test_skip32();
     test_online_ope();
     test_ffx();
@@ -651,6 +1239,15 @@ main(int ac, char **av)
     cout << dec << endl;
 
     test_hgd();
+    test_hgd_distribution();
+    test_hgd_perf();
+    test_ope_cache();
+    test_ope_batch(32, 64);
+    test_ope_batch(64, 128);
+    test_ope_native(32, 64);
+    test_ope_native(64, 128);
+    test_ope_perf(32, 64);
+    test_ope_perf(64, 128);
 
     for (int pbits = 32; pbits <= 128; pbits += 32)
         for (int cbits = pbits; cbits <= pbits + 128; cbits += 32)
@@ -4,6 +4,7 @@
 #include <main/metadata_tables.hh>
 #include <main/macro_util.hh>
 #include <main/stored_procedures.hh>
+#include <util/parallel.hh>
 #include <util/util.hh>
 
 // FIXME: Wrong interfaces.
@@ -366,6 +367,16 @@ synchronizeDatabases(const std::unique_ptr<Connect> &conn,
     return true;
 }
 
+// > CRYPTDB_AGG_CONNECTIONS; the most connections the partitioned
+//   aggregates of every client keep open at once
+static unsigned int
+aggConnectionLimit()
+{
+    const char *const limit = getenv("CRYPTDB_AGG_CONNECTIONS");
+    return limit ? std::max(1ul, strtoul(limit, NULL, 10))
+                 : defaultThreadCount();
+}
+
 SharedProxyState::SharedProxyState(ConnectionInfo ci,
                                    const std::string &embed_dir,
                                    const std::string &master_key,
@@ -376,9 +387,13 @@ SharedProxyState::SharedProxyState(ConnectionInfo ci,
                                                    // connections in init
                                                    // list.
       conn(new Connect(ci.server, ci.user, ci.passwd, ci.port)),
+      agg_conns(ci.server, ci.user, ci.passwd, ci.port,
+                aggConnectionLimit()),
       default_sec_rating(default_sec_rating),
       cache(std::move(SchemaCache()))
 {
+    setMutableOPEJournalDirectory(embed_dir + "/mope");
+
     // make sure the server was not started in SQL_SAFE_UPDATES mode
     // > it might not even be possible to start the server in this mode;
     //   better to be safe
@@ -409,6 +424,15 @@ SharedProxyState::SharedProxyState(ConnectionInfo ci,
     loadUDFs(conn);
 
     assert(loadStoredProcedures(conn));
+
+    // > loading the schema replays the mutable OPE journals; relabels a
+    //   crash left behind reach the columns before any query reads them
+    if (mutableOPEJournalsExist()) {
+        const std::shared_ptr<const SchemaInfo> &schema =
+            cache.getSchema(conn, init_e_conn);
+        TEST_TextMessageError(applyMutableOPERelabels(conn, *schema.get()),
+                              "Failed to apply mutable OPE relabels!");
+    }
 }
 
 SharedProxyState::~SharedProxyState()
@@ -473,6 +497,16 @@ ProxyState::safeCreateEmbeddedTHD()
     return;
 }
 
+void
+ProxyState::ensureEmbeddedTHD()
+{
+    if (false == thds.empty() && current_thd == thds.back().get()) {
+        return;
+    }
+
+    this->safeCreateEmbeddedTHD();
+}
+
 void ProxyState::dumpTHDs()
 {
     for (auto &it : thds) {
@@ -560,6 +594,7 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
             assert(REGULAR_TABLE == table_type);
             // should only be used one time
             this->id_cache.erase(&object);
+            this->object_ids[&object] = old_object_id.get();
         }
 
         std::function<bool(const DBMeta &)> localCreateHandler =
@@ -584,8 +619,40 @@ bool CreateDelta::apply(const std::unique_ptr<Connect> &e_conn,
     return b;
 }
 
-// FIXME: used incorrectly, as we should be doing copy construction
-// on the original object; not modifying it in place
+// > builds the new objects the same way loadSchemaInfo(...) would, from
+//   their serialized form and the ids they were given in the database
+bool CreateDelta::applyToSnapshot(SchemaInfoBuilder *const builder)
+{
+    DBMeta *const parent_copy = builder->getMutable(parent_meta);
+    RFIF(parent_copy);
+
+    std::function<bool(const DBMeta &, const DBMeta &,
+                       const AbstractMetaKey &, DBMeta *const)> helper =
+        [this, &helper]
+        (const DBMeta &object, const DBMeta &parent,
+         const AbstractMetaKey &k, DBMeta *const new_parent)
+    {
+        const auto &id = this->object_ids.find(&object);
+        RFIF(this->object_ids.end() != id);
+
+        DBMeta *const new_object =
+            new_parent->deserializeChild(k.getSerial(),
+                                         object.serialize(parent),
+                                         id->second);
+        RFIF(new_object);
+
+        std::function<bool(const DBMeta &)> localCreateHandler =
+            [&object, new_object, &helper] (const DBMeta &child)
+            {
+                return helper(child, object, object.getKey(child),
+                              new_object);
+            };
+        return object.applyToChildren(localCreateHandler);
+    };
+
+    return helper(*meta.get(), parent_meta, key, parent_copy);
+}
+
 bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
                          TableType table_type)
 {
@@ -593,7 +660,9 @@ bool ReplaceDelta::apply(const std::unique_ptr<Connect> &e_conn,
 
     const unsigned int child_id = meta.getDatabaseID();
 
-    const std::string child_serial = meta.serialize(parent_meta);
+    const std::unique_ptr<DBMeta> replacement = meta.shallowCopy();
+    this->change(replacement.get());
+    const std::string child_serial = replacement->serialize(parent_meta);
     const std::string esc_child_serial =
         escapeString(e_conn, child_serial);
     const std::string serial_key = key.getSerial();
@@ -640,6 +709,25 @@ bool DeleteDelta::apply(const std::unique_ptr<Connect> &e_conn,
     return helper(meta, parent_meta);
 }
 
+// > an earlier delta may have changed the copy already, so the new
+//   state is applied to it rather than replacing it
+bool ReplaceDelta::applyToSnapshot(SchemaInfoBuilder *const builder)
+{
+    DBMeta *const copy = builder->getMutable(meta);
+    RFIF(copy);
+
+    this->change(copy);
+    return true;
+}
+
+bool DeleteDelta::applyToSnapshot(SchemaInfoBuilder *const builder)
+{
+    DBMeta *const parent_copy = builder->getMutable(parent_meta);
+    RFIF(parent_copy);
+
+    return parent_copy->removeChild(builder->getCurrent(meta));
+}
+
 bool
 writeDeltas(const std::unique_ptr<Connect> &e_conn,
             const std::vector<std::unique_ptr<Delta> > &deltas,
@@ -936,7 +1024,7 @@ SECLEVEL Analysis::getOnionLevel(const FieldMeta &fm, onion o)
     return Analysis::getOnionLevel(this->getOnionMeta(fm, o));
 }
 
-const std::vector<std::unique_ptr<EncLayer> > &
+const std::vector<std::shared_ptr<EncLayer> > &
 Analysis::getEncLayers(const OnionMeta &om)
 {
     return om.getLayers();
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <util/onions.hh>
 #include <util/cryptdb_log.hh>
+#include <main/Connect.hh>
 #include <main/schema.hh>
 #include <main/rewrite_ds.hh>
 #include <parser/embedmysql.hh>
@@ -93,6 +94,8 @@ private:
     const std::string &embed_dir;
     const int mysql_dummy;
     const std::unique_ptr<Connect> conn;
+    // > partitioned aggregates run their parts here at once
+    mutable ConnectPool agg_conns;
     const SECURITY_RATING default_sec_rating;
     const SchemaCache cache;
 } SharedProxyState;
@@ -108,7 +111,10 @@ public:
     const std::unique_ptr<AES_KEY> &getMasterKey() const;
     const std::unique_ptr<Connect> &getConn() const;
     const std::unique_ptr<Connect> &getEConn() const;
+    ConnectPool &getAggConnPool() const {return shared.agg_conns;}
     void safeCreateEmbeddedTHD();
+    // > only makes a THD if the thread isn't using our latest one
+    void ensureEmbeddedTHD();
     void dumpTHDs();
     const SchemaCache &getSchemaCache() const {return shared.cache;}
     std::shared_ptr<const SchemaInfo> getSchemaInfo() const
@@ -136,6 +142,11 @@ public:
      */
     virtual bool apply(const std::unique_ptr<Connect> &e_conn,
                        TableType table_type) = 0;
+    /*
+     * Take the same action against a copy-on-write SchemaInfo after
+     * apply(...) has succeeded against the REGULAR_TABLE.
+     */
+    virtual bool applyToSnapshot(SchemaInfoBuilder *const builder) = 0;
 
 protected:
     const DBMeta &parent_meta;
@@ -166,10 +177,13 @@ public:
 
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
+    bool applyToSnapshot(SchemaInfoBuilder *const builder);
 
 private:
     const std::unique_ptr<DBMeta> meta;
     std::map<const DBMeta *, unsigned int> id_cache;
+    // > the ids the objects were written to the REGULAR_TABLE with
+    std::map<const DBMeta *, unsigned int> object_ids;
 };
 
 class DerivedKeyDelta : public Delta {
@@ -185,13 +199,21 @@ protected:
     const AbstractMetaKey &key;
 };
 
+// > 'meta' belongs to a published snapshot and is never modified;
+//   'change' gives a copy of it the new state. apply(...) writes a
+//   changed copy and applyToSnapshot(...) changes the new snapshot's copy
 class ReplaceDelta : public DerivedKeyDelta {
 public:
-    ReplaceDelta(const DBMeta &meta, const DBMeta &parent_meta)
-        : DerivedKeyDelta(meta, parent_meta) {}
+    ReplaceDelta(const DBMeta &meta, const DBMeta &parent_meta,
+                 std::function<void(DBMeta *const)> change)
+        : DerivedKeyDelta(meta, parent_meta), change(change) {}
 
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
+    bool applyToSnapshot(SchemaInfoBuilder *const builder);
+
+private:
+    const std::function<void(DBMeta *const)> change;
 };
 
 class DeleteDelta : public DerivedKeyDelta {
@@ -201,6 +223,7 @@ public:
 
     bool apply(const std::unique_ptr<Connect> &e_conn,
                TableType table_type);
+    bool applyToSnapshot(SchemaInfoBuilder *const builder);
 };
 
 class Rewriter;
@@ -256,6 +279,7 @@ private:
 };
 
 class RewritePlan;
+class PlanRecorder;
 class Analysis {
     Analysis() = delete;
     Analysis(Analysis &&a) = delete;
@@ -267,11 +291,11 @@ public:
              const std::unique_ptr<AES_KEY> &master_key,
              SECURITY_RATING default_sec_rating)
         : pos(0), inject_alias(false), summation_hack(false),
-          db_name(default_db), schema(schema), master_key(master_key),
-          default_sec_rating(default_sec_rating) {}
+          plan_recorder(NULL), db_name(default_db), schema(schema),
+          master_key(master_key), default_sec_rating(default_sec_rating) {}
     Analysis(const Analysis &analysis)
         : pos(0), inject_alias(false), summation_hack(false),
-          db_name(analysis.getDatabaseName()), schema(analysis.getSchema()),
+          plan_recorder(NULL), db_name(analysis.getDatabaseName()), schema(analysis.getSchema()),
           master_key(analysis.getMasterKey()),
           default_sec_rating(analysis.getDefaultSecurityRating()) {}
 
@@ -289,6 +313,9 @@ public:
     bool inject_alias;
     bool summation_hack;
     KillZone kill_zone;
+    // > set while we build a query plan; constants that came from the
+    //   client's literals are left for the plan to encrypt
+    PlanRecorder *plan_recorder;
 
     // These functions are prefered to their lower level counterparts.
     bool addAlias(const std::string &alias, const std::string &db,
@@ -327,7 +354,7 @@ public:
     static const EncLayer &getBackEncLayer(const OnionMeta &om);
     static SECLEVEL getOnionLevel(const OnionMeta &om);
     SECLEVEL getOnionLevel(const FieldMeta &fm, onion o);
-    static const std::vector<std::unique_ptr<EncLayer> > &
+    static const std::vector<std::shared_ptr<EncLayer> > &
         getEncLayers(const OnionMeta &om);
     const SchemaInfo &getSchema() const {return schema;}
 
@@ -13,6 +13,7 @@
 #include <memory>
 
 #include <util/cryptdb_log.hh>
+#include <util/scoped_lock.hh>
 #include <main/Connect.hh>
 #include <main/macro_util.hh>
 #include <main/Analysis.hh>
@@ -27,6 +28,35 @@ Connect::Connect(const std::string &server, const std::string &user,
     do_connect(server, user, passwd, port);
 }
 
+std::unique_ptr<Connect>
+ConnectPool::take()
+{
+    // > connecting is kept under the lock as well; it initializes the
+    //   client library
+    scoped_lock l(&lock);
+    while (idle.empty() && open >= limit) {
+        pthread_cond_wait(&returned, &lock);
+    }
+    if (idle.empty()) {
+        std::unique_ptr<Connect> conn(
+            new Connect(server, user, passwd, port));
+        ++open;
+        return conn;
+    }
+
+    std::unique_ptr<Connect> conn = std::move(idle.front());
+    idle.pop_front();
+    return conn;
+}
+
+void
+ConnectPool::give(std::unique_ptr<Connect> &&conn)
+{
+    scoped_lock l(&lock);
+    idle.push_back(std::move(conn));
+    pthread_cond_signal(&returned);
+}
+
 bool
 strictMode(Connect *const c)
 {
@@ -94,6 +124,17 @@ Connect *Connect::getEmbedded(const std::string &embed_db)
     return new Connect(m);
 }
 
+// > running a query against the embedded server leaves us with its THD
+static void
+recreateEmbeddedTHD()
+{
+    if (thread_ps) {
+        thread_ps->safeCreateEmbeddedTHD();
+    } else {
+        assert(create_embedded_thd(0));
+    }
+}
+
 // @multiple_resultsets causes us to ignore query results.
 // > This is a hack that allows us to deal with potentially multiple
 //   sets returned when CALLing a stored procedure.
@@ -146,16 +187,11 @@ Connect::execute(const std::string &query, std::unique_ptr<DBResult> *res,
         }
     }
 
-    if (thread_ps) {
-        thread_ps->safeCreateEmbeddedTHD();
-    } else {
-        assert(create_embedded_thd(0));
-    }
+    recreateEmbeddedTHD();
 
     return success;
 }
 
-
 // because the caller is ignoring the ResType we must account for
 // errors encoded in the ResType
 bool
@@ -228,6 +264,40 @@ getItem(char *const content, enum_field_types type, uint len)
     }
 }
 
+static void
+unpackFields(DBResult_native *const n, std::vector<std::string> *const names,
+             std::vector<enum_field_types> *const types)
+{
+    const unsigned int col_count = mysql_num_fields(n);
+    const MYSQL_FIELD *const fields = mysql_fetch_fields(n);
+    for (unsigned int j = 0; j < col_count; j++) {
+        names->push_back(fields[j].name);
+        types->push_back(fields[j].type);
+    }
+}
+
+// > false once the rows run out
+static bool
+unpackRow(DBResult_native *const n,
+          const std::vector<enum_field_types> &types,
+          std::vector<std::vector<Item *> > *const rows)
+{
+    const MYSQL_ROW row = mysql_fetch_row(n);
+    if (!row) {
+        return false;
+    }
+    unsigned long *const lengths = mysql_fetch_lengths(n);
+
+    std::vector<Item *> resrow;
+    for (size_t j = 0; j < types.size(); j++) {
+        Item *const item = getItem(row[j], types[j], lengths[j]);
+        resrow.push_back(item);
+    }
+
+    rows->push_back(resrow);
+    return true;
+}
+
 // > returns the data in the last server response
 // > TODO: to optimize return pointer to avoid overcopying large
 //   result sets?
@@ -245,40 +315,37 @@ DBResult::unpack()
     }
 
     const size_t row_count = static_cast<size_t>(mysql_num_rows(n));
-    const int col_count    = mysql_num_fields(n);
 
     std::vector<std::string> names;
     std::vector<enum_field_types> types;
-    for (int j = 0;; j++) {
-        MYSQL_FIELD *const field = mysql_fetch_field(n);
-        if (!field) {
-            assert(col_count == j);
-            break;
-        }
-
-        names.push_back(field->name);
-        types.push_back(field->type);
-    }
+    unpackFields(n, &names, &types);
 
     std::vector<std::vector<Item *> > rows;
-    for (size_t index = 0;; index++) {
-        const MYSQL_ROW row = mysql_fetch_row(n);
-        if (!row) {
-            assert(row_count == index);
-            break;
-        }
-        unsigned long *const lengths = mysql_fetch_lengths(n);
-
-        std::vector<Item *> resrow;
+    while (unpackRow(n, types, &rows))
+        ;
+    assert(row_count == rows.size());
 
-        for (int j = 0; j < col_count; j++) {
-            Item *const item = getItem(row[j], types[j], lengths[j]);
-            resrow.push_back(item);
-        }
+    return ResType(this->success, this->affected_rows, this->insert_id,
+                   std::move(names), std::move(types), std::move(rows));
+}
 
-        rows.push_back(resrow);
+// > the Items of each batch can be freed before the next batch is
+//   unpacked; see ScopedMemRoot
+ResType
+DBResult::unpack(size_t max_rows)
+{
+    if (nullptr == n) {
+        return ResType(this->success, this->affected_rows, this->insert_id);
     }
 
+    std::vector<std::string> names;
+    std::vector<enum_field_types> types;
+    unpackFields(n, &names, &types);
+
+    std::vector<std::vector<Item *> > rows;
+    while (rows.size() < max_rows && unpackRow(n, types, &rows))
+        ;
+
     return ResType(this->success, this->affected_rows, this->insert_id,
                    std::move(names), std::move(types), std::move(rows));
 }
@@ -5,9 +5,11 @@
  *
  */
 
+#include <list>
 #include <vector>
 #include <string>
 #include <memory>
+#include <pthread.h>
 
 #include <util/util.hh>
 #include <parser/sql_utils.hh>
@@ -17,6 +19,9 @@ typedef MYSQL_RES DBResult_native;
 
 extern "C" void *create_embedded_thd(int client_flag);
 
+// > rows per batch when a result is handled a batch at a time
+const size_t RESULT_BATCH_ROWS = 1024;
+
 class DBResult {
  public:
     DBResult(DBResult_native *const n, bool success,
@@ -29,6 +34,9 @@ class DBResult {
 
     //returns data from this db result
     ResType unpack();
+    // > at most 'max_rows' of the rows that have not been unpacked yet;
+    //   no rows once they run out
+    ResType unpack(size_t max_rows);
 
     static DBResult *store(MYSQL *const mysql);
 
@@ -75,5 +83,63 @@ class Connect {
     bool close_on_destroy;
 };
 
+// > connections to one server, each used by one thread at a time; at
+//   most 'limit' are open at once
+class ConnectPool {
+    ConnectPool(const ConnectPool &other) = delete;
+    ConnectPool &operator=(const ConnectPool &rhs) = delete;
+
+ public:
+    ConnectPool(const std::string &server, const std::string &user,
+                const std::string &passwd, uint port, unsigned int limit)
+        : server(server), user(user), passwd(passwd), port(port),
+          limit(limit), open(0)
+    {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&returned, NULL);
+    }
+    ~ConnectPool()
+    {
+        pthread_cond_destroy(&returned);
+        pthread_mutex_destroy(&lock);
+    }
+
+    // > a connection held for the life of the lease; it goes back to the
+    //   pool however the lease ends, so a query that fails and throws
+    //   does not lose it
+    class Lease {
+        Lease(const Lease &other) = delete;
+        Lease &operator=(const Lease &rhs) = delete;
+
+     public:
+        explicit Lease(ConnectPool *const pool)
+            : pool(pool), conn(pool->take()) {}
+        ~Lease() {pool->give(std::move(conn));}
+
+        Connect *operator->() const {return conn.get();}
+
+     private:
+        ConnectPool *const pool;
+        std::unique_ptr<Connect> conn;
+    };
+
+ private:
+    // > an idle connection, or a new one while fewer than 'limit' are
+    //   open; otherwise it waits for one to come back
+    std::unique_ptr<Connect> take();
+    void give(std::unique_ptr<Connect> &&conn);
+
+    const std::string server;
+    const std::string user;
+    const std::string passwd;
+    const uint port;
+    const unsigned int limit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t returned;
+    std::list<std::unique_ptr<Connect> > idle;
+    unsigned int open;
+};
+
 bool strictMode(Connect *const c);
 
@@ -7,12 +7,27 @@
 #include <crypto/BasicCrypto.hh>
 #include <crypto/SWPSearch.hh>
 #include <crypto/arc4.hh>
+#include <crypto/online_ope.hh>
+#include <crypto/sha.hh>
+#include <crypto/hmac.hh>
 #include <util/util.hh>
 #include <util/cryptdb_log.hh>
 #include <util/zz.hh>
+#include <util/parallel.hh>
+#include <util/scoped_lock.hh>
+#include <util/timer.hh>
 
 #include <cmath>
 #include <memory>
+#include <future>
+#include <list>
+#include <map>
+#include <set>
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
 
 #define LEXSTRING(cstr) { (char*) cstr, sizeof(cstr) }
 #define BITS_PER_BYTE 8
@@ -56,7 +71,8 @@ using namespace NTL;
          - OPE layers: OPE_int, OPE_str, OPE_dec
 
     -HOMFactory: outputs a HOM layer
-         - HOM layers: HOM (for integers), HOM_dec (for decimals)
+         - HOM layers: HOM (for integers), HOM_pack (for narrow integers
+           sharing a ciphertext), HOM_dec (for decimals)
 
  */
 
@@ -115,7 +131,8 @@ public:
 class HOMFactory : public LayerFactory {
 public:
     static std::unique_ptr<EncLayer>
-        create(const Create_field &cf, const std::string &key);
+        create(const Create_field &cf, const std::string &key,
+               const AGGSlot *const slot);
     static std::unique_ptr<EncLayer>
         deserialize(unsigned int id, const SerialLayer &serial);
 };
@@ -166,14 +183,15 @@ underSerial(const std::string &serial)
 
 std::unique_ptr<EncLayer>
 EncLayerFactory::encLayer(onion o, SECLEVEL sl, const Create_field &cf,
-                          const std::string &key)
+                          const std::string &key,
+                          const AGGSlot *const slot)
 {
     switch (sl) {
         case SECLEVEL::RND: {return RNDFactory::create(cf, key);}
         case SECLEVEL::DET: {return DETFactory::create(cf, key);}
         case SECLEVEL::DETJOIN: {return DETJOINFactory::create(cf, key);}
         case SECLEVEL::OPE:{return OPEFactory::create(cf, key);}
-        case SECLEVEL::HOM: {return HOMFactory::create(cf, key);}
+        case SECLEVEL::HOM: {return HOMFactory::create(cf, key, slot);}
         case SECLEVEL::SEARCH: {
             return std::unique_ptr<EncLayer>(new Search(cf, key));
         }
@@ -207,6 +225,10 @@ EncLayerFactory::deserializeLayer(unsigned int id,
             return OPEFactory::deserialize(id, li);
 
         case SECLEVEL::HOM:
+            // > a plain HOM layer is keyed by it's whole serial
+            if ("HOM_pack" == li.name) {
+                return HOMFactory::deserialize(id, li);
+            }
             return std::unique_ptr<EncLayer>(new HOM(id, serial));
 
         case SECLEVEL::SEARCH:
@@ -289,6 +311,77 @@ get_key_item(const std::string &key)
     return keyI;
 }
 
+LayerValue
+LayerValue::fromItem(const Item &i)
+{
+    LayerValue out;
+    if (Item::Type::INT_ITEM == i.type()) {
+        out.integer = static_cast<const Item_int &>(i).value;
+        out.is_unsigned = i.unsigned_flag;
+    } else {
+        out.is_string = true;
+        out.string = ItemToString(i);
+    }
+
+    return out;
+}
+
+LayerValue
+LayerValue::fromUint(uint64_t value)
+{
+    LayerValue out;
+    out.integer = value;
+    return out;
+}
+
+LayerValue
+LayerValue::fromString(const std::string &value)
+{
+    LayerValue out;
+    out.is_string = true;
+    out.string = value;
+    return out;
+}
+
+Item *
+LayerValue::toItem() const
+{
+    if (true == is_string) {
+        return new (current_thd->mem_root)
+                   Item_string(make_thd_string(string), string.length(),
+                               &my_charset_bin);
+    }
+
+    if (false == is_unsigned) {
+        return new (current_thd->mem_root)
+                   Item_int(static_cast<longlong>(integer));
+    }
+    return new (current_thd->mem_root)
+               Item_int(static_cast<ulonglong>(integer));
+}
+
+uint64_t
+LayerValue::uintValue() const
+{
+    if (true == is_string) {
+        return strtoull(string.c_str(), NULL, 10);
+    }
+
+    return integer;
+}
+
+std::string
+LayerValue::stringValue() const
+{
+    if (true == is_string) {
+        return string;
+    }
+
+    return true == is_unsigned
+           ? std::to_string(integer)
+           : std::to_string(static_cast<int64_t>(integer));
+}
+
 // Can only check unsigned values
 static bool
 rangeCheck(uint64_t value, std::pair<int64_t, uint64_t> inclusiveRange)
@@ -425,6 +518,8 @@ public:
 
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(const Item &ctext, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
     Item * decryptUDF(Item * const col, Item * const ivcol) const;
 
 private:
@@ -449,6 +544,8 @@ public:
 
     Item * encrypt(const Item &ptext, uint64_t IV) const;
     Item * decrypt(const Item &ctext, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
     Item * decryptUDF(Item * const col, Item * const ivcol) const;
 
 private:
@@ -546,6 +643,17 @@ RND_int::decrypt(const Item &ctext, uint64_t IV) const
                Item_int(static_cast<ulonglong>(p));
 }
 
+void
+RND_int::decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(values->size() == IVs.size());
+    for (size_t i = 0; i < values->size(); ++i) {
+        LayerValue &v = (*values)[i];
+        v = LayerValue::fromUint(bf.decrypt(v.uintValue()) ^ IVs[i]);
+    }
+}
+
 static udf_func u_decRNDInt = {
     LEXSTRING("cryptdb_decrypt_int_sem"),
     INT_RESULT,
@@ -636,6 +744,20 @@ RND_str::decrypt(const Item &ctext, uint64_t IV) const
                                                    &my_charset_bin);
 }
 
+void
+RND_str::decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const
+{
+    assert(values->size() == IVs.size());
+    for (size_t i = 0; i < values->size(); ++i) {
+        LayerValue &v = (*values)[i];
+        v = LayerValue::fromString(
+                decrypt_AES_CBC(v.stringValue(), deckey.get(),
+                                BytesFromInt(IVs[i], SALT_LEN_BYTES),
+                                do_pad));
+    }
+}
+
 
 //TODO; make edb.cc udf naming consistent with these handlers
 static udf_func u_decRNDString = {
@@ -690,6 +812,8 @@ public:
     // FIXME: final
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(const Item &ctext, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
     Item *decryptUDF(Item *const col, Item *const ivcol = NULL) const;
 
 protected:
@@ -789,6 +913,8 @@ public:
 
     Item *encrypt(const Item &ptext, uint64_t IV) const;
     Item *decrypt(const Item &ctext, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
     Item * decryptUDF(Item * const col, Item * const ivcol = NULL) const;
 
 protected:
@@ -878,6 +1004,16 @@ DET_abstract_integer::decrypt(const Item &ctext, uint64_t IV) const
     return new (current_thd->mem_root) Item_int(retdec);
 }
 
+void
+DET_abstract_integer::decryptBatch(std::vector<LayerValue> *const values,
+                                   const std::vector<uint64_t> &IVs) const
+{
+    const blowfish &bf = getBlowfish_();
+    for (auto &it : *values) {
+        it = LayerValue::fromUint(bf.decrypt(it.uintValue()));
+    }
+}
+
 Item *
 DET_abstract_integer::decryptUDF(Item *const col, Item *const ivcol)
     const
@@ -1020,6 +1156,16 @@ DET_str::decrypt(const Item &ctext, uint64_t IV) const
                                                    &my_charset_bin);
 }
 
+void
+DET_str::decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const
+{
+    for (auto &it : *values) {
+        it = LayerValue::fromString(
+                decrypt_AES_CMC(it.stringValue(), deckey.get(), do_pad));
+    }
+}
+
 static udf_func u_decDETStr = {
     LEXSTRING("cryptdb_decrypt_text_det"),
     STRING_RESULT,
@@ -1164,21 +1310,39 @@ public:
 
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item *decrypt(const Item &c, uint64_t IV) const;
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
 
 private:
     const CryptedInteger cinteger;
     static const size_t key_bytes = 16;
     const size_t plain_size;
     const size_t ciph_size;
-    mutable OPE ope;                      // HACK
+    const OPE ope;
 };
 
+/*
+ * Orders the whole string: it is cut into chunks of chunk_plain_size
+ * bytes, each chunk is encrypted with OPE and the ciphertexts are
+ * concatenated into a VARBINARY.  Comparing those bytes compares the
+ * chunks in turn, and a string that is a prefix of another sorts first,
+ * so the backend orders the column like the plaintext.  Each chunk
+ * position has a key of it's own; only chunks at the same position are
+ * ever compared, and equal chunks at different positions do not give
+ * equal ciphertexts.
+ *
+ * Layers serialized before this only hold the key; they keep ordering
+ * by the first legacy_plain_size bytes into a BIGINT.
+ */
 class OPE_str : public EncLayer {
 public:
     OPE_str(const Create_field &cf, const std::string &seed_key);
 
     // serialize and deserialize
-    std::string doSerialize() const {return key;}
+    std::string doSerialize() const;
     OPE_str(unsigned int id, const std::string &serial);
 
     SECLEVEL level() const {return SECLEVEL::OPE;}
@@ -1190,14 +1354,73 @@ public:
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item *decrypt(const Item &c, uint64_t IV) const
         __attribute__((noreturn));
+    std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const;
 
 private:
+    static uint32_t prefixValue(const Item &ptext);
+    std::vector<uint64_t> chunkValues(const Item &ptext) const;
+    Item *chunkCiphertext(std::vector<ope_uint128>::const_iterator begin,
+                          std::vector<ope_uint128>::const_iterator end)
+        const;
+    bool legacy() const {return 0 == chunks;}
+
     const std::string key;
-    // HACK.
-    mutable OPE ope;
+    // > the most chunks a value is ordered by; 0 for a legacy layer
+    const size_t chunks;
+    // > legacy layers only
+    const OPE ope;
+    // > one for each chunk position
+    const std::vector<std::unique_ptr<const OPE> > chunk_opes;
+    static const size_t key_bytes = 16;
+    static const size_t legacy_plain_size = 4;
+    static const size_t legacy_ciph_size = 8;
+    static const size_t chunk_plain_size = 8;
+    static const size_t chunk_ciph_size = 16;
+    // > 512 bytes of ciphertext still fit in an index key
+    static const size_t max_chunks = 32;
+};
+
+
+/*
+ * Mutable OPE: the proxy keeps a search tree of the values in the column
+ * and the ciphertext of a value is it's path through the tree, so the
+ * column is a BIGINT whatever the plaintext range.  Values that are not
+ * in the tree yet are inserted when they are encrypted.
+ *
+ * Rebalancing the tree changes the ciphertexts of values that are already
+ * stored; pendingMutableOPERelabels(...) hands them out so the rows can be
+ * updated.  A ciphertext is only good for the tree it came from, so the
+ * onion has no RND layer on top and it's order is always visible.
+ */
+class MutableOPETree;
+
+class MOPE_int : public EncLayer {
+public:
+    MOPE_int(const Create_field &cf, const std::string &seed_key);
+    MOPE_int(unsigned int id, const std::string &serial);
+
+    SECLEVEL level() const {return SECLEVEL::OPE;}
+    std::string name() const {return "MOPE_int";}
+
+    std::string doSerialize() const {return cinteger.serialize();}
+    Create_field * newCreateField(const Create_field &cf,
+                                  const std::string &anonname = "")
+        const;
+
+    Item *encrypt(const Item &p, uint64_t IV) const;
+    Item *decrypt(const Item &c, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
+
+    std::vector<MutableOPERelabels> pendingRelabels() const;
+
+private:
+    const CryptedInteger cinteger;
+    // > shared by every layer with the same key
+    const std::shared_ptr<MutableOPETree> tree;
     static const size_t key_bytes = 16;
-    static const size_t plain_size = 4;
-    static const size_t ciph_size = 8;
 };
 
 
@@ -1231,6 +1454,9 @@ OPEFactory::create(const Create_field &cf, const std::string &key)
             || cf.sql_type ==  MYSQL_TYPE_NEWDECIMAL) {
             FAIL_TextMessageError("decimal support is broken");
         }
+        if (useMutableOPE(cf)) {
+            return std::unique_ptr<EncLayer>(new MOPE_int(cf, key));
+        }
         return std::unique_ptr<EncLayer>(new OPE_int(cf, key));
     }
     return std::unique_ptr<EncLayer>(new OPE_str(cf, key));
@@ -1243,6 +1469,8 @@ OPEFactory::deserialize(unsigned int id, const SerialLayer &sl)
         return OPE_int::deserialize(id, sl.layer_info);
     } else if (sl.name == "OPE_str") {
         return std::unique_ptr<EncLayer>(new OPE_str(id, sl.layer_info));
+    } else if (sl.name == "MOPE_int") {
+        return std::unique_ptr<EncLayer>(new MOPE_int(id, sl.layer_info));
     } else {
         FAIL_TextMessageError("decimal support broken");
     }
@@ -1357,16 +1585,16 @@ opeCiphSize(const CryptedInteger &cinteger)
 OPE_int::OPE_int(const Create_field &f, const std::string &seed_key)
     : cinteger(opeHelper(f, prng_expand(seed_key, key_bytes))),
       plain_size(opePlainSize(cinteger)), ciph_size(opeCiphSize(cinteger)),
-      ope(OPE(cinteger.getKey(), plain_size * BITS_PER_BYTE,
-              ciph_size * BITS_PER_BYTE))
+      ope(cinteger.getKey(), plain_size * BITS_PER_BYTE,
+          ciph_size * BITS_PER_BYTE)
 {}
 
 OPE_int::OPE_int(unsigned int id, const CryptedInteger &cinteger,
                  size_t plain_size, size_t ciph_size)
     : EncLayer(id), cinteger(cinteger), plain_size(plain_size),
       ciph_size(ciph_size),
-      ope(OPE(cinteger.getKey(), plain_size * BITS_PER_BYTE,
-              ciph_size * BITS_PER_BYTE))
+      ope(cinteger.getKey(), plain_size * BITS_PER_BYTE,
+          ciph_size * BITS_PER_BYTE)
 {}
 
 std::unique_ptr<OPE_int>
@@ -1410,28 +1638,46 @@ reverse(const std::string &s)
     return std::string(s.rbegin(), s.rend());
 }
 
-Item *
-OPE_int::encrypt(const Item &ptext, uint64_t IV) const
+// > high to low order bytes without leading zeros; what
+//   reverse(StringFromZZ(...)) gives for the same number
+static std::string
+bigEndianString(ope_uint128 v)
 {
-    const uint64_t pval = RiboldMYSQL::val_uint(ptext);
-    cinteger.checkValue(pval);
+    std::string out;
+    for (; v != 0; v >>= 8) {
+        out.push_back(static_cast<char>(v & 0xFF));
+    }
+    return reverse(out);
+}
 
-    LOG(encl) << "OPE_int encrypt " << pval << " IV " << IV << std::endl;
+static ope_uint128
+uint128FromBigEndian(const std::string &s)
+{
+    TEST_Text(s.size() <= sizeof(ope_uint128),
+              "OPE ciphertext is too long");
+    ope_uint128 out = 0;
+    for (auto c : s) {
+        out = (out << 8) | static_cast<unsigned char>(c);
+    }
+    return out;
+}
 
-    if (MYSQL_TYPE_VARCHAR != this->cinteger.getFieldType()) {
-        const ulonglong enc = uint64FromZZ(ope.encrypt(ZZFromUint64(pval)));
-        return new Item_int(enc);
+static Item *
+opeIntItem(ope_uint128 enc, enum enum_field_types field_type,
+           size_t ciph_size)
+{
+    if (MYSQL_TYPE_VARCHAR != field_type) {
+        assert(0 == (enc >> 64));
+        return new Item_int(static_cast<ulonglong>(enc));
     }
 
     // > the result of the encryption could be larger than 64 bits so
     //   don't try to handle with an integer
-    // > the ``stringd'' ZZ must be reversed because we want the string to go
-    //   from high to low order bytes
+    // > the string must go from high to low order bytes
     // > leading zeros must be added because not all numbers will span the
     //   allotted bytes and we don't want mysql to do a misaligned comparison
     const std::string &enc_string =
-        leadingZeros(reverse(StringFromZZ(ope.encrypt(ZZFromUint64(pval)))),
-                     this->ciph_size);
+        leadingZeros(bigEndianString(enc), ciph_size);
 
 
     return new Item_string(make_thd_string(enc_string),
@@ -1439,38 +1685,140 @@ OPE_int::encrypt(const Item &ptext, uint64_t IV) const
                            &my_charset_bin);
 }
 
+Item *
+OPE_int::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const uint64_t pval = RiboldMYSQL::val_uint(ptext);
+    cinteger.checkValue(pval);
+
+    LOG(encl) << "OPE_int encrypt " << pval << " IV " << IV << std::endl;
+
+    return opeIntItem(ope.encrypt_native(pval),
+                      this->cinteger.getFieldType(), this->ciph_size);
+}
+
+std::vector<Item *>
+OPE_int::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    std::vector<uint64_t> pvals;
+    for (auto it : ptexts) {
+        const uint64_t pval = RiboldMYSQL::val_uint(*it);
+        cinteger.checkValue(pval);
+        pvals.push_back(pval);
+    }
+
+    std::vector<Item *> out;
+    for (const auto &it : ope.encrypt_batch_native(pvals)) {
+        out.push_back(opeIntItem(it, this->cinteger.getFieldType(),
+                                 this->ciph_size));
+    }
+    return out;
+}
+
 Item *
 OPE_int::decrypt(const Item &ctext, uint64_t IV) const
 {
     LOG(encl) << "OPE_int decrypt " << ItemToString(ctext) << " IV " << IV
               << std::endl;
 
-    if (MYSQL_TYPE_VARCHAR != this->cinteger.getFieldType()) {
-        const ulonglong cval = RiboldMYSQL::val_uint(ctext);
-        return new Item_int(static_cast<ulonglong>(uint64FromZZ(ope.decrypt(ZZFromUint64(cval)))));
+    const ope_uint128 cval =
+        MYSQL_TYPE_VARCHAR != this->cinteger.getFieldType()
+            ? RiboldMYSQL::val_uint(ctext)
+            : uint128FromBigEndian(ItemToString(ctext));
+    const ope_uint128 pval = ope.decrypt_native(cval);
+    TEST_Text(0 == (pval >> 64), "OPE plaintext does not fit 64 bits");
+    return new Item_int(static_cast<ulonglong>(pval));
+}
+
+void
+OPE_int::decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const
+{
+    const bool varchar = MYSQL_TYPE_VARCHAR == this->cinteger.getFieldType();
+    std::vector<ope_uint128> cvals;
+    for (const auto &it : *values) {
+        cvals.push_back(varchar ? uint128FromBigEndian(it.stringValue())
+                                : it.uintValue());
+    }
+
+    const std::vector<ope_uint128> &pvals = ope.decrypt_batch_native(cvals);
+    for (size_t i = 0; i < pvals.size(); ++i) {
+        TEST_Text(0 == (pvals[i] >> 64),
+                  "OPE plaintext does not fit 64 bits");
+        (*values)[i] = LayerValue::fromUint(static_cast<uint64_t>(pvals[i]));
     }
+}
+
 
-    // undo the reversal from encryption
-    return new Item_int(static_cast<ulonglong>(uint64FromZZ(ope.decrypt(ZZFromString(reverse(ItemToString(ctext)))))));
+static size_t
+opeStrChunks(const Create_field &f, size_t chunk_bytes, size_t max_chunks)
+{
+    const size_t chunks = (f.length + chunk_bytes - 1) / chunk_bytes;
+    return std::max(static_cast<size_t>(1), std::min(chunks, max_chunks));
 }
 
+// > the key of chunk position i is derived from the layer key and i
+static std::vector<std::unique_ptr<const OPE> >
+opeStrChunkOPEs(const std::string &key, size_t chunks, size_t key_bytes,
+                size_t pbits, size_t cbits)
+{
+    std::vector<std::unique_ptr<const OPE> > out;
+    for (size_t i = 0; i < chunks; ++i) {
+        const std::string &chunk_key =
+            hmac<sha256>::mac("OPE_str chunk " + std::to_string(i), key)
+                .substr(0, key_bytes);
+        out.push_back(std::unique_ptr<const OPE>(
+                          new OPE(chunk_key, pbits, cbits)));
+    }
+
+    return out;
+}
 
 OPE_str::OPE_str(const Create_field &f, const std::string &seed_key)
     : key(prng_expand(seed_key, key_bytes)),
-      ope(OPE(key, plain_size * BITS_PER_BYTE, ciph_size * BITS_PER_BYTE))
+      chunks(opeStrChunks(f, chunk_plain_size, max_chunks)),
+      ope(key, legacy_plain_size * BITS_PER_BYTE,
+          legacy_ciph_size * BITS_PER_BYTE),
+      chunk_opes(opeStrChunkOPEs(key, chunks, key_bytes,
+                                 chunk_plain_size * BITS_PER_BYTE,
+                                 chunk_ciph_size * BITS_PER_BYTE))
 {}
 
+// > a legacy layer's serial is just the key
 OPE_str::OPE_str(unsigned int id, const std::string &serial)
-    : EncLayer(id), key(serial),
-    ope(OPE(key, plain_size * BITS_PER_BYTE, ciph_size * BITS_PER_BYTE))
+    : EncLayer(id),
+      key(serial.size() == key_bytes ? serial
+                                     : unserialize_string(serial)[0]),
+      chunks(serial.size() == key_bytes
+             ? 0 : strtoul_(unserialize_string(serial)[1])),
+      ope(key, legacy_plain_size * BITS_PER_BYTE,
+          legacy_ciph_size * BITS_PER_BYTE),
+      chunk_opes(opeStrChunkOPEs(key, chunks, key_bytes,
+                                 chunk_plain_size * BITS_PER_BYTE,
+                                 chunk_ciph_size * BITS_PER_BYTE))
 {}
 
+std::string
+OPE_str::doSerialize() const
+{
+    if (legacy()) {
+        return key;
+    }
+    return serializeStrings({key, std::to_string(chunks)});
+}
+
 Create_field *
 OPE_str::newCreateField(const Create_field &cf,
                         const std::string &anonname) const
 {
-    return arrayCreateFieldHelper(cf, cf.length, MYSQL_TYPE_LONGLONG,
-                                  anonname, &my_charset_bin);
+    if (legacy()) {
+        return arrayCreateFieldHelper(cf, cf.length, MYSQL_TYPE_LONGLONG,
+                                      anonname, &my_charset_bin);
+    }
+    return arrayCreateFieldHelper(cf, chunks * chunk_ciph_size,
+                                  MYSQL_TYPE_VARCHAR, anonname,
+                                  &my_charset_bin);
 }
 
 /*
@@ -1484,139 +1832,767 @@ OPE_str::newCreateField(const Create_field &cf,
  * |         1 |         1 |         1 |         1 |
  * +-----------+-----------+-----------+-----------+
  */
-Item *
-OPE_str::encrypt(const Item &ptext, uint64_t IV) const
+uint32_t
+OPE_str::prefixValue(const Item &ptext)
 {
     std::string ps = toUpperCase(ItemToString(ptext));
-    if (ps.size() < plain_size)
-        ps = ps + std::string(plain_size - ps.size(), 0);
+    if (ps.size() < legacy_plain_size)
+        ps = ps + std::string(legacy_plain_size - ps.size(), 0);
 
     uint32_t pv = 0;
 
-    for (uint i = 0; i < plain_size; i++) {
+    for (uint i = 0; i < legacy_plain_size; i++) {
         pv = pv * 256 + static_cast<int>(ps[i]);
     }
 
-    const ZZ enc = ope.encrypt(to_ZZ(pv));
-
-    return new (current_thd->mem_root)
-               Item_int(static_cast<ulonglong>(uint64FromZZ(enc)));
-}
-
-Item *
-OPE_str::decrypt(const Item &ctext, uint64_t IV) const
-{
-    thrower() << "cannot decrypt string from OPE";
+    return pv;
 }
 
-
-/**************** HOM ***************************/
-
 /*
-class HOM_dec : public HOM {
-public:
-    HOM_dec(Create_field * const cf, const std::string &seed_key);
+ * MySQL ignores trailing spaces when it compares strings, so they are
+ * dropped; the last chunk is padded with zeros.  Strings are ordered by
+ * their first chunks * chunk_plain_size bytes.
+ */
+std::vector<uint64_t>
+OPE_str::chunkValues(const Item &ptext) const
+{
+    std::string ps = toUpperCase(ItemToString(ptext));
+    ps.erase(ps.find_last_not_of(' ') + 1);
+    ps.resize(std::min(ps.size(), chunks * chunk_plain_size));
+
+    std::vector<uint64_t> out;
+    for (size_t i = 0; i < ps.size(); i += chunk_plain_size) {
+        uint64_t v = 0;
+        for (size_t j = i; j < i + chunk_plain_size; j++) {
+            const unsigned char c =
+                j < ps.size() ? static_cast<unsigned char>(ps[j]) : 0;
+            v = (v << 8) | c;
+        }
+        out.push_back(v);
+    }
 
-    //deserialize
-    HOM_dec(unsigned int id, const std::string &serial);
-    ~HOM_dec() {;}
+    return out;
+}
 
-    std::string name() const {return "HOM_dec";}
+Item *
+OPE_str::chunkCiphertext(std::vector<ope_uint128>::const_iterator begin,
+                         std::vector<ope_uint128>::const_iterator end) const
+{
+    std::string enc;
+    for (auto it = begin; it != end; ++it) {
+        enc += leadingZeros(bigEndianString(*it), chunk_ciph_size);
+    }
 
+    return new Item_string(make_thd_string(enc), enc.length(),
+                           &my_charset_bin);
+}
 
-    //TODO needs multi encrypt and decrypt
-    Item *encrypt(const Item &p, uint64_t IV) const;
-    Item * decrypt(Item * const c, uint64_t IV) const;
+Item *
+OPE_str::encrypt(const Item &ptext, uint64_t IV) const
+{
+    if (legacy()) {
+        const ope_uint128 enc = ope.encrypt_native(prefixValue(ptext));
 
-    //expr is the expression (e.g. a field) over which to sum
-    Item *sumUDA(Item *const expr) const;
-    Item *sumUDF(Item *const i1, Item *const i2) const;
+        return new (current_thd->mem_root)
+                   Item_int(static_cast<ulonglong>(enc));
+    }
 
-private:
-    uint const decimals;
-    ZZ const shift;
+    const std::vector<uint64_t> &values = chunkValues(ptext);
+    std::vector<ope_uint128> encs;
+    for (size_t i = 0; i < values.size(); ++i) {
+        encs.push_back(chunk_opes[i]->encrypt_native(values[i]));
+    }
+    return chunkCiphertext(encs.begin(), encs.end());
+}
 
-    std::string doSerialize() const;
-};
-*/
+// > the chunks at each position share one walk of that position's tree
+std::vector<Item *>
+OPE_str::encryptBatch(const std::vector<const Item *> &ptexts,
+                      const std::vector<uint64_t> &IVs) const
+{
+    std::vector<Item *> out;
+    if (legacy()) {
+        std::vector<uint64_t> pvs;
+        for (auto it : ptexts) {
+            pvs.push_back(prefixValue(*it));
+        }
+        for (const auto &it : ope.encrypt_batch_native(pvs)) {
+            out.push_back(new (current_thd->mem_root)
+                              Item_int(static_cast<ulonglong>(it)));
+        }
+        return out;
+    }
 
+    std::vector<std::vector<uint64_t> > values;
+    std::vector<std::vector<uint64_t> > by_position(chunks);
+    for (auto it : ptexts) {
+        values.push_back(chunkValues(*it));
+        for (size_t i = 0; i < values.back().size(); ++i) {
+            by_position[i].push_back(values.back()[i]);
+        }
+    }
 
-std::unique_ptr<EncLayer>
-HOMFactory::create(const Create_field &cf, const std::string &key)
-{
-    if (cf.sql_type == MYSQL_TYPE_DECIMAL
-        || cf.sql_type == MYSQL_TYPE_NEWDECIMAL) {
-        FAIL_TextMessageError("decimal support is broken");
+    std::vector<std::vector<ope_uint128> > encs_by_position;
+    for (size_t i = 0; i < chunks; ++i) {
+        encs_by_position.push_back(
+            chunk_opes[i]->encrypt_batch_native(by_position[i]));
     }
 
-    return std::unique_ptr<EncLayer>(new HOM(cf, key));
+    // > the values took their chunks at each position in order
+    std::vector<size_t> next(chunks, 0);
+    for (const auto &it : values) {
+        std::vector<ope_uint128> encs;
+        for (size_t i = 0; i < it.size(); ++i) {
+            encs.push_back(encs_by_position[i][next[i]++]);
+        }
+        out.push_back(chunkCiphertext(encs.begin(), encs.end()));
+    }
+    return out;
 }
 
-std::unique_ptr<EncLayer>
-HOMFactory::deserialize(unsigned int id, const SerialLayer &serial)
+Item *
+OPE_str::decrypt(const Item &ctext, uint64_t IV) const
 {
-    if (serial.name == "HOM_dec") {
-        FAIL_TextMessageError("decimal support broken");
-    }
-    return std::unique_ptr<EncLayer>(new HOM(id, serial.layer_info));
+    thrower() << "cannot decrypt string from OPE";
 }
 
-static ZZ
-ItemIntToZZ(const Item &ptext)
+bool
+useMutableOPE(const Create_field &cf)
 {
-    const ulonglong val = RiboldMYSQL::val_uint(ptext);
-    return ZZFromUint64(val);
+    const char *const mutable_ope = getenv("CRYPTDB_MUTABLE_OPE");
+    return mutable_ope && equalsIgnoreCase("TRUE", mutable_ope)
+           && isMySQLTypeNumeric(cf)
+           && cf.sql_type != MYSQL_TYPE_DECIMAL
+           && cf.sql_type != MYSQL_TYPE_NEWDECIMAL;
 }
 
-static Item *
-ZZToItemInt(const ZZ &val)
+bool
+usePackedAGG(const Create_field &cf)
 {
-    const ulonglong v = uint64FromZZ(val);
-    return new (current_thd->mem_root) Item_int(v);
+    const char *const packed_agg = getenv("CRYPTDB_PACKED_AGG");
+    if (!packed_agg || !equalsIgnoreCase("TRUE", packed_agg)) {
+        return false;
+    }
+
+    // > every new field is made UNSIGNED, so these hold 32 bits at most
+    switch (cf.sql_type) {
+        case MYSQL_TYPE_TINY:
+        case MYSQL_TYPE_SHORT:
+        case MYSQL_TYPE_INT24:
+        case MYSQL_TYPE_LONG:
+            return true;
+        default:
+            return false;
+    }
 }
 
-static Item *
-ZZToItemStr(const ZZ &val)
-{
-    const std::string &str = StringFromZZ(val);
-    Item * const newit =
-        new (current_thd->mem_root) Item_string(make_thd_string(str),
-                                                str.length(),
-                                                &my_charset_bin);
-    newit->name = NULL; //no alias
+static std::string mutable_ope_dir;
+static std::atomic<bool> mutable_ope_in_use(false);
+// > batches journaled and not applied yet, over every tree
+static std::atomic<unsigned int> mutable_ope_pending(0);
 
-    return newit;
+void
+setMutableOPEJournalDirectory(const std::string &dir)
+{
+    // > it is fine if it already exists
+    mkdir(dir.c_str(), 0700);
+    mutable_ope_dir = dir;
 }
 
-static ZZ
-ItemStrToZZ(const Item &i)
+bool
+mutableOPEJournalsExist()
 {
-    return ZZFromString(ItemToString(i));
+    DIR *const d = opendir(mutable_ope_dir.c_str());
+    if (NULL == d) {
+        return false;
+    }
+
+    bool found = false;
+    for (const struct dirent *e = readdir(d); e && !found; e = readdir(d)) {
+        found = '.' != e->d_name[0];
+    }
+    closedir(d);
+    return found;
 }
 
-/*
-HOM_dec::HOM_dec(Create_field * const cf, const std::string &seed_key)
-    : HOM(cf, seed_key), decimals(cf->decimals),
-      shift(power(to_ZZ(10), decimals))
+bool
+mutableOPEInUse()
 {
-    assert_s(cf->length <= 120, "too large decimal for HOM layer");
+    return mutable_ope_in_use;
 }
 
-std::string
-HOM_dec::doSerialize() const
+bool
+mutableOPERelabelsPending()
 {
-    return std::to_string(decimals) + " " + HOM::doSerialize();
+    return mutable_ope_pending > 0;
 }
 
-HOM_dec::HOM_dec(unsigned int id, const std::string &serial)
-    : HOM(id, underSerial(serial)), decimals(getDecimals(serial)),
-      shift(power(to_ZZ(10), decimals))
-{}
+// > the gate every MutableOPEHold is a claim on
+static pthread_mutex_t hold_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int hold_shared = 0;
+static bool hold_exclusive = false;
+// > the EXCLUSIVE claims that failed and are still wanted
+static unsigned int hold_waiting = 0;
 
-static ZZ
-ItemDecToZZ(const Item &ptext, const ZZ &shift, uint decimals)
+bool
+MutableOPEHold::tryAcquire(Mode m)
 {
-    bool is_null;
+    scoped_lock l(&hold_lock);
+    if (Mode::NONE == m || Mode::EXCLUSIVE == this->mode
+        || (Mode::SHARED == m && Mode::SHARED == this->mode)) {
+        return true;
+    }
+
+    if (Mode::SHARED == m) {
+        // > a waiting EXCLUSIVE would never get in otherwise; our own
+        //   registration does not keep us out
+        if (hold_exclusive
+            || hold_waiting > (this->waiting ? 1u : 0u)) {
+            return false;
+        }
+        // > the query no longer needs the EXCLUSIVE it waited for
+        if (this->waiting) {
+            this->waiting = false;
+            --hold_waiting;
+        }
+        ++hold_shared;
+        this->mode = Mode::SHARED;
+        return true;
+    }
+
+    assert(Mode::EXCLUSIVE == m);
+    const unsigned int others =
+        hold_shared - (Mode::SHARED == this->mode ? 1 : 0);
+    if (hold_exclusive || others > 0) {
+        if (false == this->waiting) {
+            this->waiting = true;
+            ++hold_waiting;
+        }
+        return false;
+    }
+
+    if (Mode::SHARED == this->mode) {
+        --hold_shared;
+    }
+    if (this->waiting) {
+        this->waiting = false;
+        --hold_waiting;
+    }
+    hold_exclusive = true;
+    this->mode = Mode::EXCLUSIVE;
+    return true;
+}
+
+void
+MutableOPEHold::require(Mode m)
+{
+    if (false == this->tryAcquire(m)) {
+        throw MutableOPEBusy(m);
+    }
+}
+
+void
+MutableOPEHold::release()
+{
+    scoped_lock l(&hold_lock);
+    if (Mode::SHARED == this->mode) {
+        --hold_shared;
+    } else if (Mode::EXCLUSIVE == this->mode) {
+        hold_exclusive = false;
+    }
+    this->mode = Mode::NONE;
+}
+
+void
+MutableOPEHold::stopWaiting()
+{
+    scoped_lock l(&hold_lock);
+    if (this->waiting) {
+        this->waiting = false;
+        --hold_waiting;
+    }
+}
+
+static __thread MutableOPEScope *mutable_ope_scope = NULL;
+
+MutableOPEScope::MutableOPEScope(MutableOPEHold *const hold, bool dry_run)
+    : hold(hold), dry_run(dry_run), spoiled(false),
+      outer(mutable_ope_scope)
+{
+    mutable_ope_scope = this;
+}
+
+MutableOPEScope::~MutableOPEScope()
+{
+    assert(this == mutable_ope_scope);
+    mutable_ope_scope = this->outer;
+}
+
+MutableOPEScope *
+MutableOPEScope::current()
+{
+    return mutable_ope_scope;
+}
+
+std::vector<MutableOPERelabels>
+pendingMutableOPERelabels(const EncLayer &el)
+{
+    if ("MOPE_int" != el.name()) {
+        return std::vector<MutableOPERelabels>();
+    }
+    return static_cast<const MOPE_int &>(el).pendingRelabels();
+}
+
+/*
+ * The inserts into a tree are appended to a journal named for the key;
+ * inserting them again in order builds the same tree.  The relabels of a
+ * rebalance follow it's insert as a batch, and the batch is marked once
+ * the columns hold the new ciphertexts, so a restart still knows the
+ * batches that were not applied.  A record is four host order integers,
+ * the kind and then
+ *   INSERT:   the path, it's length and the blowfish ciphertext
+ *   RELABEL:  the batch, the old and the new ciphertext
+ *   END:      the batch
+ *   APPLIED:  the batch
+ */
+class MutableOPETree {
+    MutableOPETree(const MutableOPETree &other) = delete;
+    MutableOPETree &operator=(const MutableOPETree &rhs) = delete;
+
+public:
+    explicit MutableOPETree(const std::string &key);
+    ~MutableOPETree();
+
+    static std::shared_ptr<MutableOPETree> get(const std::string &key);
+    // > every tree built so far
+    static std::vector<std::shared_ptr<MutableOPETree> > all();
+
+    // > the rest take 'lock' first
+
+    // > journals the server's relabels as a new pending batch
+    void journalRelabels();
+    void markApplied(uint64_t seq);
+
+    pthread_mutex_t lock;
+    blowfish bf;
+    ope_server<uint64_t> server;
+    ope_client<uint64_t, blowfish> client;
+    const std::string name;
+    // > batch -> (old, new) ciphertexts
+    std::map<uint64_t, std::vector<std::pair<uint64_t, uint64_t> > >
+        pending;
+
+private:
+    enum Record : uint64_t {INSERT, RELABEL, END, APPLIED};
+
+    void append(Record kind, uint64_t a, uint64_t b, uint64_t c);
+    void flush();
+
+    FILE *journal;
+    uint64_t next_seq;
+
+    static pthread_mutex_t trees_lock;
+    static std::map<std::string, std::shared_ptr<MutableOPETree> > *const
+        trees;
+};
+
+pthread_mutex_t MutableOPETree::trees_lock = PTHREAD_MUTEX_INITIALIZER;
+// > never freed; a layer may be destroyed after static destruction
+std::map<std::string, std::shared_ptr<MutableOPETree> > *const
+    MutableOPETree::trees =
+        new std::map<std::string, std::shared_ptr<MutableOPETree> >();
+
+MutableOPETree::MutableOPETree(const std::string &key)
+    : bf(key), client(&bf, &server), name(toHex(sha1::hash(key))),
+      journal(NULL), next_seq(0)
+{
+    TEST_Text(false == mutable_ope_dir.empty(),
+              "no journal directory for mutable OPE");
+    const std::string path = mutable_ope_dir + "/" + name;
+
+    journal = fopen(path.c_str(), "a+b");
+    TEST_Text(NULL != journal, "can not open mutable OPE journal " + path);
+
+    // > the relabels of a batch cut short by a crash are still in the
+    //   server and are journaled again below
+    std::map<uint64_t, std::vector<std::pair<uint64_t, uint64_t> > >
+        partial;
+    uint64_t record[4];
+    long whole = 0;
+    rewind(journal);
+    while (1 == fread(record, sizeof(record), 1, journal)) {
+        switch (record[0]) {
+        case INSERT:
+            server.insert(record[1], record[2], record[3]);
+            break;
+        case RELABEL:
+            partial[record[1]].push_back(
+                std::make_pair(record[2], record[3]));
+            break;
+        case END:
+            // > the inserts since the last batch made these again
+            server.take_relabels();
+            pending[record[1]] = partial[record[1]];
+            partial.erase(record[1]);
+            break;
+        case APPLIED:
+            pending.erase(record[1]);
+            break;
+        default:
+            FAIL_TextMessageError("corrupt mutable OPE journal " + path);
+        }
+        if (INSERT != record[0]) {
+            next_seq = std::max(next_seq, record[1] + 1);
+        }
+        whole = ftell(journal);
+    }
+    // > a record cut short by a crash was never used; the next one must
+    //   start where it did
+    TEST_Text(0 == ftruncate(fileno(journal), whole),
+              "can not truncate mutable OPE journal " + path);
+
+    journalRelabels();
+    mutable_ope_pending += pending.size();
+
+    server.inserted =
+        [this] (uint64_t v, uint64_t nbits, const uint64_t &encval)
+        {
+            this->append(INSERT, v, nbits, encval);
+            this->flush();
+        };
+
+    pthread_mutex_init(&lock, NULL);
+}
+
+MutableOPETree::~MutableOPETree()
+{
+    fclose(journal);
+    pthread_mutex_destroy(&lock);
+}
+
+std::shared_ptr<MutableOPETree>
+MutableOPETree::get(const std::string &key)
+{
+    scoped_lock l(&trees_lock);
+    auto it = trees->find(key);
+    if (trees->end() == it) {
+        it = trees->insert(std::make_pair(key,
+                std::make_shared<MutableOPETree>(key))).first;
+    }
+    return it->second;
+}
+
+std::vector<std::shared_ptr<MutableOPETree> >
+MutableOPETree::all()
+{
+    scoped_lock l(&trees_lock);
+    std::vector<std::shared_ptr<MutableOPETree> > out;
+    for (const auto &it : *trees) {
+        out.push_back(it.second);
+    }
+    return out;
+}
+
+void
+MutableOPETree::journalRelabels()
+{
+    const std::vector<std::pair<uint64_t, uint64_t> > &relabels =
+        server.take_relabels();
+    if (relabels.empty()) {
+        return;
+    }
+
+    const uint64_t seq = next_seq++;
+    for (const auto &it : relabels) {
+        append(RELABEL, seq, it.first, it.second);
+    }
+    append(END, seq, 0, 0);
+    flush();
+
+    pending[seq] = relabels;
+    ++mutable_ope_pending;
+}
+
+void
+MutableOPETree::markApplied(uint64_t seq)
+{
+    if (0 == pending.erase(seq)) {
+        return;
+    }
+
+    append(APPLIED, seq, 0, 0);
+    flush();
+    --mutable_ope_pending;
+}
+
+void
+MutableOPETree::append(Record kind, uint64_t a, uint64_t b, uint64_t c)
+{
+    const uint64_t record[4] = {kind, a, b, c};
+    fseek(journal, 0, SEEK_END);
+    TEST_Text(1 == fwrite(record, sizeof(record), 1, journal),
+              "failed to write the mutable OPE journal");
+}
+
+void
+MutableOPETree::flush()
+{
+    TEST_Text(0 == fflush(journal),
+              "failed to write the mutable OPE journal");
+}
+
+void
+mutableOPERelabelsApplied(const MutableOPERelabels &batch)
+{
+    scoped_lock l(&batch.tree->lock);
+    batch.tree->markApplied(batch.seq);
+}
+
+void
+dropMutableOPERelabels(const std::vector<MutableOPERelabels> &kept)
+{
+    std::set<const MutableOPETree *> keep;
+    for (const auto &it : kept) {
+        keep.insert(it.tree.get());
+    }
+
+    for (const auto &tree : MutableOPETree::all()) {
+        if (keep.count(tree.get())) {
+            continue;
+        }
+        scoped_lock l(&tree->lock);
+        while (false == tree->pending.empty()) {
+            tree->markApplied(tree->pending.begin()->first);
+        }
+    }
+}
+
+MOPE_int::MOPE_int(const Create_field &cf, const std::string &seed_key)
+    : cinteger(cf, prng_expand(seed_key, key_bytes)),
+      tree(MutableOPETree::get(cinteger.getKey()))
+{
+    mutable_ope_in_use = true;
+}
+
+MOPE_int::MOPE_int(unsigned int id, const std::string &serial)
+    : EncLayer(id), cinteger(CryptedInteger::deserialize(serial)),
+      tree(MutableOPETree::get(cinteger.getKey()))
+{
+    mutable_ope_in_use = true;
+}
+
+Create_field *
+MOPE_int::newCreateField(const Create_field &cf,
+                         const std::string &anonname) const
+{
+    Create_field *const f0 =
+        integerCreateFieldHelper(cf, MYSQL_TYPE_LONGLONG, anonname);
+    f0->flags |= UNSIGNED_FLAG;
+    return f0;
+}
+
+Item *
+MOPE_int::encrypt(const Item &ptext, uint64_t IV) const
+{
+    const uint64_t pval = RiboldMYSQL::val_uint(ptext);
+    cinteger.checkValue(pval);
+
+    LOG(encl) << "MOPE_int encrypt " << pval << " IV " << IV << std::endl;
+
+    MutableOPEScope *const scope = MutableOPEScope::current();
+    // > the value may be a plan's sentinel, and a ciphertext that moves
+    //   can not be part of a plan
+    if (scope && scope->dry_run) {
+        scope->spoiled = true;
+        return new Item_int(static_cast<ulonglong>(0));
+    }
+    MutableOPEHold *const hold = scope ? scope->hold : NULL;
+    if (hold) {
+        hold->require(MutableOPEHold::Mode::SHARED);
+    }
+
+    scoped_lock l(&tree->lock);
+    uint64_t v, nbits;
+    if (hold && false == tree->client.find(pval, &v, &nbits)
+        && tree->server.insert_relabels(nbits)) {
+        hold->require(MutableOPEHold::Mode::EXCLUSIVE);
+    }
+    const uint64_t cval = tree->client.encrypt(pval);
+    if (tree->server.has_relabels()) {
+        tree->journalRelabels();
+        if (hold) {
+            ++hold->rebalances;
+        }
+    }
+    return new Item_int(static_cast<ulonglong>(cval));
+}
+
+Item *
+MOPE_int::decrypt(const Item &ctext, uint64_t IV) const
+{
+    LOG(encl) << "MOPE_int decrypt " << ItemToString(ctext) << " IV " << IV
+              << std::endl;
+
+    const uint64_t cval = RiboldMYSQL::val_uint(ctext);
+    uint64_t pval = 0;
+    {
+        scoped_lock l(&tree->lock);
+        try {
+            pval = tree->client.decrypt(cval);
+        } catch (const ope_lookup_failure &) {
+            FAIL_TextMessageError("unknown mutable OPE ciphertext");
+        }
+    }
+    return new Item_int(static_cast<ulonglong>(pval));
+}
+
+void
+MOPE_int::decryptBatch(std::vector<LayerValue> *const values,
+                       const std::vector<uint64_t> &IVs) const
+{
+    scoped_lock l(&tree->lock);
+    for (auto &it : *values) {
+        try {
+            it = LayerValue::fromUint(tree->client.decrypt(it.uintValue()));
+        } catch (const ope_lookup_failure &) {
+            FAIL_TextMessageError("unknown mutable OPE ciphertext");
+        }
+    }
+}
+
+std::vector<MutableOPERelabels>
+MOPE_int::pendingRelabels() const
+{
+    scoped_lock l(&tree->lock);
+    std::vector<MutableOPERelabels> out;
+    for (const auto &it : tree->pending) {
+        out.push_back({tree, tree->name, it.first, it.second});
+    }
+    return out;
+}
+
+
+/**************** HOM ***************************/
+
+/*
+class HOM_dec : public HOM {
+public:
+    HOM_dec(Create_field * const cf, const std::string &seed_key);
+
+    //deserialize
+    HOM_dec(unsigned int id, const std::string &serial);
+    ~HOM_dec() {;}
+
+    std::string name() const {return "HOM_dec";}
+
+
+    //TODO needs multi encrypt and decrypt
+    Item *encrypt(const Item &p, uint64_t IV) const;
+    Item * decrypt(Item * const c, uint64_t IV) const;
+
+    //expr is the expression (e.g. a field) over which to sum
+    Item *sumUDA(Item *const expr) const;
+    Item *sumUDF(Item *const i1, Item *const i2) const;
+
+private:
+    uint const decimals;
+    ZZ const shift;
+
+    std::string doSerialize() const;
+};
+*/
+
+
+std::unique_ptr<EncLayer>
+HOMFactory::create(const Create_field &cf, const std::string &key,
+                   const AGGSlot *const slot)
+{
+    if (cf.sql_type == MYSQL_TYPE_DECIMAL
+        || cf.sql_type == MYSQL_TYPE_NEWDECIMAL) {
+        FAIL_TextMessageError("decimal support is broken");
+    }
+
+    if (slot) {
+        return std::unique_ptr<EncLayer>(new HOM_pack(cf, key,
+                                                      slot->slot));
+    }
+    return std::unique_ptr<EncLayer>(new HOM(cf, key));
+}
+
+std::unique_ptr<EncLayer>
+HOMFactory::deserialize(unsigned int id, const SerialLayer &serial)
+{
+    if (serial.name == "HOM_dec") {
+        FAIL_TextMessageError("decimal support broken");
+    }
+    if (serial.name == "HOM_pack") {
+        // > the slot, then the key every slot of the column shares
+        const size_t pos = serial.layer_info.find(' ');
+        TEST_Text(std::string::npos != pos, "bad HOM_pack serial");
+        const unsigned int slot =
+            atoi(serial.layer_info.substr(0, pos).c_str());
+        return std::unique_ptr<EncLayer>(
+            new HOM_pack(id, serial.layer_info.substr(pos + 1), slot));
+    }
+    return std::unique_ptr<EncLayer>(new HOM(id, serial.layer_info));
+}
+
+static ZZ
+ItemIntToZZ(const Item &ptext)
+{
+    const ulonglong val = RiboldMYSQL::val_uint(ptext);
+    return ZZFromUint64(val);
+}
+
+static Item *
+ZZToItemInt(const ZZ &val)
+{
+    const ulonglong v = uint64FromZZ(val);
+    return new (current_thd->mem_root) Item_int(v);
+}
+
+static Item *
+ZZToItemStr(const ZZ &val)
+{
+    const std::string &str = StringFromZZ(val);
+    Item * const newit =
+        new (current_thd->mem_root) Item_string(make_thd_string(str),
+                                                str.length(),
+                                                &my_charset_bin);
+    newit->name = NULL; //no alias
+
+    return newit;
+}
+
+static ZZ
+ItemStrToZZ(const Item &i)
+{
+    return ZZFromString(ItemToString(i));
+}
+
+/*
+HOM_dec::HOM_dec(Create_field * const cf, const std::string &seed_key)
+    : HOM(cf, seed_key), decimals(cf->decimals),
+      shift(power(to_ZZ(10), decimals))
+{
+    assert_s(cf->length <= 120, "too large decimal for HOM layer");
+}
+
+std::string
+HOM_dec::doSerialize() const
+{
+    return std::to_string(decimals) + " " + HOM::doSerialize();
+}
+
+HOM_dec::HOM_dec(unsigned int id, const std::string &serial)
+    : HOM(id, underSerial(serial)), decimals(getDecimals(serial)),
+      shift(power(to_ZZ(10), decimals))
+{}
+
+static ZZ
+ItemDecToZZ(const Item &ptext, const ZZ &shift, uint decimals)
+{
+    bool is_null;
     // ss is a number
     // : - xxxx.yyyy
     const std::string &ss(RiboldMYSQL::val_str(ptext, &is_null));
@@ -1676,13 +2652,351 @@ HOM_dec::decrypt(Item * const ctext, uint64_t IV) const
 
 
 
+/*
+ * Precomputed randomness for HOM encryption.  One producer thread keeps
+ * every key's pool topped up, emptiest first, so a burst of INSERTs into
+ * one column is absorbed by its pool and refilled while the proxy waits
+ * on the backend.  An encryption that finds its pool empty computes
+ * the randomness itself.
+ */
+class HOMRandomPool {
+public:
+    explicit HOMRandomPool(const std::shared_ptr<const Paillier_priv> &sk)
+        : sk(sk) {}
+
+    static std::shared_ptr<HOMRandomPool>
+        create(const std::shared_ptr<const Paillier_priv> &sk);
+    // > false if the pool is empty
+    bool pop(ZZ *const rn);
+
+    const std::shared_ptr<const Paillier_priv> sk;
+    // > guarded by 'hom_pool_lock'
+    std::list<ZZ> ready;
+};
+
+static pthread_mutex_t hom_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hom_pool_cond = PTHREAD_COND_INITIALIZER;
+// > never freed; a layer may drop it's pool after static destruction
+static std::list<std::weak_ptr<HOMRandomPool> > *const hom_pools =
+    new std::list<std::weak_ptr<HOMRandomPool> >();
+// > joined at exit so it is not computing while NTL is torn down
+static std::thread *hom_pool_producer = NULL;
+static bool hom_pool_stop = false;
+
+static void stopHOMThreadsAtExit();
+
+static std::atomic<uint64_t> hom_pool_produced(0);
+static std::atomic<uint64_t> hom_pool_produce_usec(0);
+static std::atomic<uint64_t> hom_pool_hits(0);
+static std::atomic<uint64_t> hom_pool_underflows(0);
+
+static size_t
+homPoolDepth()
+{
+    static const size_t depth =
+        getenv("CRYPTDB_HOM_POOL_DEPTH")
+        ? strtoul_(getenv("CRYPTDB_HOM_POOL_DEPTH")) : 128;
+    return depth;
+}
+
+// > the emptiest pool that is not full; NULL if there is none.  Drops
+//   the pools of layers that are gone.
+static std::shared_ptr<HOMRandomPool>
+nextHOMPoolToFill()
+{
+    std::shared_ptr<HOMRandomPool> emptiest;
+    for (auto it = hom_pools->begin(); it != hom_pools->end();) {
+        const std::shared_ptr<HOMRandomPool> pool = it->lock();
+        if (!pool) {
+            it = hom_pools->erase(it);
+            continue;
+        }
+        if (pool->ready.size() < homPoolDepth()
+            && (!emptiest || pool->ready.size() < emptiest->ready.size())) {
+            emptiest = pool;
+        }
+        ++it;
+    }
+
+    return emptiest;
+}
+
+static void
+produceHOMRandomness()
+{
+    scoped_lock l(&hom_pool_lock);
+    while (false == hom_pool_stop) {
+        const std::shared_ptr<HOMRandomPool> pool = nextHOMPoolToFill();
+        if (!pool) {
+            pthread_cond_wait(&hom_pool_cond, &hom_pool_lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&hom_pool_lock);
+        timer t;
+        ZZ rn = pool->sk->rand_rn();
+        hom_pool_produce_usec += t.lap();
+        ++hom_pool_produced;
+        pthread_mutex_lock(&hom_pool_lock);
+
+        pool->ready.push_back(ZZ());
+        swap(pool->ready.back(), rn);
+    }
+}
+
+static void
+stopHOMRandomness()
+{
+    {
+        scoped_lock l(&hom_pool_lock);
+        if (NULL == hom_pool_producer) {
+            return;
+        }
+        hom_pool_stop = true;
+        pthread_cond_signal(&hom_pool_cond);
+    }
+    hom_pool_producer->join();
+}
+
+std::shared_ptr<HOMRandomPool>
+HOMRandomPool::create(const std::shared_ptr<const Paillier_priv> &sk)
+{
+    if (0 == homPoolDepth()) {
+        return std::shared_ptr<HOMRandomPool>();
+    }
+
+    const std::shared_ptr<HOMRandomPool> pool(new HOMRandomPool(sk));
+    scoped_lock l(&hom_pool_lock);
+    hom_pools->push_back(pool);
+    if (NULL == hom_pool_producer) {
+        hom_pool_producer = new std::thread(produceHOMRandomness);
+        stopHOMThreadsAtExit();
+    }
+    pthread_cond_signal(&hom_pool_cond);
+
+    return pool;
+}
+
+bool
+HOMRandomPool::pop(ZZ *const rn)
+{
+    scoped_lock l(&hom_pool_lock);
+    pthread_cond_signal(&hom_pool_cond);
+    if (ready.empty()) {
+        ++hom_pool_underflows;
+        return false;
+    }
+
+    swap(*rn, ready.front());
+    ready.pop_front();
+    ++hom_pool_hits;
+    return true;
+}
+
+HOMPoolStats
+getHOMPoolStats()
+{
+    HOMPoolStats stats;
+    stats.depth = homPoolDepth();
+    stats.keys = 0;
+    stats.ready = 0;
+    {
+        scoped_lock l(&hom_pool_lock);
+        for (const auto &it : *hom_pools) {
+            const std::shared_ptr<HOMRandomPool> pool = it.lock();
+            if (pool) {
+                ++stats.keys;
+                stats.ready += pool->ready.size();
+            }
+        }
+    }
+    stats.produced = hom_pool_produced;
+    stats.produce_usec = hom_pool_produce_usec;
+    stats.hits = hom_pool_hits;
+    stats.underflows = hom_pool_underflows;
+
+    return stats;
+}
+
+/*
+ * Paillier keys are derived from the layer's key alone, so they are
+ * generated once per process and shared by every HOM layer with the
+ * same key, including the ones of a reloaded schema.  Layers queue
+ * their key for background generation when they are built, at startup
+ * and at CREATE TABLE, so that the first query on the column does not
+ * have to generate it.
+ */
+typedef std::shared_future<std::shared_ptr<const Paillier_priv> >
+    HOMKeyFuture;
+
+static pthread_mutex_t hom_keys_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hom_keys_cond = PTHREAD_COND_INITIALIZER;
+// > never freed; the warmers outlive static destruction
+static std::map<std::string, HOMKeyFuture> *const hom_keys =
+    new std::map<std::string, HOMKeyFuture>();
+static std::list<std::pair<std::string, uint> > *const hom_keys_queued =
+    new std::list<std::pair<std::string, uint> >();
+// > joined at exit like the randomness producer; a warmer finishes the
+//   key it is generating first
+static std::vector<std::thread> *const hom_key_warmers =
+    new std::vector<std::thread>();
+static bool hom_keys_stop = false;
+
+static std::atomic<uint64_t> hom_keys_warmed(0);
+static std::atomic<uint64_t> hom_keys_cold(0);
+
+// > 'generated' is set if this call generated the key
+static std::shared_ptr<const Paillier_priv>
+homKey(const std::string &seed_key, uint nbits, bool *const generated)
+{
+    std::promise<std::shared_ptr<const Paillier_priv> > promise;
+    HOMKeyFuture future;
+    *generated = false;
+    {
+        scoped_lock l(&hom_keys_lock);
+        const auto it = hom_keys->find(seed_key);
+        if (hom_keys->end() != it) {
+            future = it->second;
+        } else {
+            future = promise.get_future().share();
+            (*hom_keys)[seed_key] = future;
+            *generated = true;
+        }
+    }
+
+    if (true == *generated) {
+        try {
+            const std::unique_ptr<streamrng<arc4>>
+                prng(new streamrng<arc4>(seed_key));
+            promise.set_value(std::shared_ptr<const Paillier_priv>(
+                new Paillier_priv(Paillier_priv::keygen(prng.get(),
+                                                        nbits))));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            scoped_lock l(&hom_keys_lock);
+            hom_keys->erase(seed_key);
+        }
+    }
+
+    return future.get();
+}
+
+static void
+warmHOMKeys()
+{
+    scoped_lock l(&hom_keys_lock);
+    while (false == hom_keys_stop) {
+        if (hom_keys_queued->empty()) {
+            pthread_cond_wait(&hom_keys_cond, &hom_keys_lock);
+            continue;
+        }
+
+        const std::pair<std::string, uint> next = hom_keys_queued->front();
+        hom_keys_queued->pop_front();
+        if (hom_keys->end() != hom_keys->find(next.first)) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&hom_keys_lock);
+        bool generated;
+        try {
+            homKey(next.first, next.second, &generated);
+        } catch (...) {
+            // > the query that needs the key reports the failure
+            generated = false;
+        }
+        if (true == generated) {
+            ++hom_keys_warmed;
+        }
+        pthread_mutex_lock(&hom_keys_lock);
+    }
+}
+
+static void
+queueHOMKey(const std::string &seed_key, uint nbits)
+{
+    scoped_lock l(&hom_keys_lock);
+    if (hom_keys->end() != hom_keys->find(seed_key)) {
+        return;
+    }
+
+    hom_keys_queued->push_back(std::make_pair(seed_key, nbits));
+    // > a schema load queues every HOM column at once; half the cores
+    //   are left to the queries
+    if (hom_key_warmers->empty()) {
+        const unsigned int warmers = std::max(1u, defaultThreadCount() / 2);
+        for (unsigned int i = 0; i < warmers; ++i) {
+            hom_key_warmers->push_back(std::thread(warmHOMKeys));
+        }
+        stopHOMThreadsAtExit();
+    }
+    pthread_cond_signal(&hom_keys_cond);
+}
+
+static void
+stopHOMKeyWarmers()
+{
+    {
+        scoped_lock l(&hom_keys_lock);
+        hom_keys_stop = true;
+        pthread_cond_broadcast(&hom_keys_cond);
+    }
+    for (auto &it : *hom_key_warmers) {
+        it.join();
+    }
+}
+
+static void
+stopHOMThreads()
+{
+    stopHOMKeyWarmers();
+    stopHOMRandomness();
+}
+
+static pthread_once_t hom_threads_atexit = PTHREAD_ONCE_INIT;
+
+static void
+registerStopHOMThreads()
+{
+    atexit(stopHOMThreads);
+}
+
+// > the HOM background threads are stopped and joined by one atexit
+//   hook, registered by whichever starts first
+static void
+stopHOMThreadsAtExit()
+{
+    pthread_once(&hom_threads_atexit, registerStopHOMThreads);
+}
+
+HOMKeyStats
+getHOMKeyStats()
+{
+    HOMKeyStats stats;
+    {
+        scoped_lock l(&hom_keys_lock);
+        stats.keys = hom_keys->size();
+        stats.queued = hom_keys_queued->size();
+    }
+    stats.warmed = hom_keys_warmed;
+    stats.cold = hom_keys_cold;
+
+    return stats;
+}
+
 HOM::HOM(const Create_field &f, const std::string &seed_key)
-    : seed_key(seed_key), sk(NULL), waiting(true)
-{}
+    : seed_key(seed_key), waiting(true)
+{
+    pthread_mutex_init(&unwait_lock, NULL);
+    queueHOMKey(seed_key, nbits);
+}
 
 HOM::HOM(unsigned int id, const std::string &serial)
-    : EncLayer(id), seed_key(serial), sk(NULL), waiting(true)
-{}
+    : EncLayer(id), seed_key(serial), waiting(true)
+{
+    pthread_mutex_init(&unwait_lock, NULL);
+    queueHOMKey(seed_key, nbits);
+}
 
 Create_field *
 HOM::newCreateField(const Create_field &cf,
@@ -1696,9 +3010,18 @@ HOM::newCreateField(const Create_field &cf,
 void
 HOM::unwait() const
 {
-    const std::unique_ptr<streamrng<arc4>>
-        prng(new streamrng<arc4>(seed_key));
-    sk = new Paillier_priv(Paillier_priv::keygen(prng.get(), nbits));
+    scoped_lock l(&unwait_lock);
+    // another client may have generated the key while we waited
+    if (false == waiting) {
+        return;
+    }
+
+    bool generated;
+    sk = homKey(seed_key, nbits, &generated);
+    if (true == generated) {
+        ++hom_keys_cold;
+    }
+    pool = HOMRandomPool::create(sk);
     waiting = false;
 }
 
@@ -1709,8 +3032,15 @@ HOM::encrypt(const Item &ptext, uint64_t IV) const
         this->unwait();
     }
 
-    const ZZ enc = sk->encrypt(ItemIntToZZ(ptext));
-    return ZZToItemStr(enc);
+    return ZZToItemStr(this->encryptZZ(ItemIntToZZ(ptext)));
+}
+
+ZZ
+HOM::encryptZZ(const ZZ &ptext) const
+{
+    ZZ rn;
+    return pool && pool->pop(&rn) ? sk->encrypt_rn(ptext, rn)
+                                  : sk->encrypt(ptext);
 }
 
 Item *
@@ -1728,6 +3058,22 @@ HOM::decrypt(const Item &ctext, uint64_t IV) const
     return ZZToItemInt(dec);
 }
 
+void
+HOM::decryptBatch(std::vector<LayerValue> *const values,
+                  const std::vector<uint64_t> &IVs) const
+{
+    if (true == waiting) {
+        this->unwait();
+    }
+
+    for (auto &it : *values) {
+        const ZZ dec = sk->decrypt(ZZFromString(it.stringValue()));
+        TEST_Text(NumBytes(dec) <= 8,
+                  "Summation produced an integer larger than 64 bits");
+        it = LayerValue::fromUint(uint64FromZZ(dec));
+    }
+}
+
 static udf_func u_sum_a = {
     LEXSTRING("cryptdb_agg"),
     STRING_RESULT,
@@ -1785,7 +3131,129 @@ HOM::sumUDF(Item *const i1, Item *const i2) const
 }
 
 HOM::~HOM() {
-    delete sk;
+    pthread_mutex_destroy(&unwait_lock);
+}
+
+HOM_pack::HOM_pack(const Create_field &cf, const std::string &seed_key,
+                   unsigned int slot)
+    : HOM(cf, seed_key), slot(slot)
+{
+    assert(slot < slots);
+}
+
+HOM_pack::HOM_pack(unsigned int id, const std::string &seed_key,
+                   unsigned int slot)
+    : HOM(id, seed_key), slot(slot)
+{
+    TEST_Text(slot < slots, "bad HOM_pack slot");
+}
+
+std::string
+HOM_pack::doSerialize() const
+{
+    return std::to_string(slot) + " " + seed_key;
+}
+
+ZZ
+HOM_pack::unpack(const ZZ &dec) const
+{
+    return trunc_ZZ(dec >> (slot * slot_bits), slot_bits);
+}
+
+Item *
+HOM_pack::encrypt(const Item &ptext, uint64_t IV) const
+{
+    if (true == waiting) {
+        this->unwait();
+    }
+
+    const ZZ &ptext_zz = ItemIntToZZ(ptext);
+    TEST_Text(NumBits(ptext_zz) <= 32,
+              "value too large for a packed AGG onion");
+    return ZZToItemStr(this->encryptZZ(ptext_zz << (slot * slot_bits)));
+}
+
+Item *
+HOM_pack::decrypt(const Item &ctext, uint64_t IV) const
+{
+    if (true == waiting) {
+        this->unwait();
+    }
+
+    const ZZ dec = sk->decrypt(ItemStrToZZ(ctext));
+    return ZZToItemInt(this->unpack(dec));
+}
+
+void
+HOM_pack::decryptBatch(std::vector<LayerValue> *const values,
+                       const std::vector<uint64_t> &IVs) const
+{
+    if (true == waiting) {
+        this->unwait();
+    }
+
+    for (auto &it : *values) {
+        const ZZ dec = sk->decrypt(ZZFromString(it.stringValue()));
+        it = LayerValue::fromUint(uint64FromZZ(this->unpack(dec)));
+    }
+}
+
+// > past 2^32 - 1 rows a slot may carry into the next one, so
+//   cryptdb_agg(...) gives NULL instead
+Item *
+HOM_pack::sumUDA(Item *const expr) const
+{
+    if (true == waiting) {
+        this->unwait();
+    }
+
+    List<Item> l;
+    l.push_back(expr);
+    l.push_back(ZZToItemStr(sk->hompubkey()));
+    l.push_back(new (current_thd->mem_root)
+                    Item_int(static_cast<ulonglong>(0xFFFFFFFF)));
+    return new (current_thd->mem_root) Item_func_udf_str(&u_sum_a, l);
+}
+
+// > the column holds the other slots too; an UPDATE goes through
+//   SpecialUpdateExecutor instead
+Item *
+HOM_pack::sumUDF(Item *const i1, Item *const i2) const
+{
+    FAIL_TextMessageError("can not add to a packed AGG onion in place");
+}
+
+Item *
+HOM_pack::combine(const std::vector<const Item *> &ctexts) const
+{
+    if (true == waiting) {
+        this->unwait();
+    }
+
+    // > the encryption of 0 without randomness
+    ZZ product = to_ZZ(1);
+    bool all_null = true;
+    for (auto it : ctexts) {
+        if (Item::Type::NULL_ITEM != it->type()) {
+            product = sk->add(product, ItemStrToZZ(*it));
+            all_null = false;
+        }
+    }
+    if (true == all_null) {
+        return new (current_thd->mem_root) Item_null();
+    }
+    return ZZToItemStr(product);
+}
+
+AGGSlot
+AGGPacker::next()
+{
+    if (HOM_pack::slots == used) {
+        onionname = getpRandomName() + TypeText<onion>::toText(oAGG);
+        used = 0;
+    }
+
+    return AGGSlot{onionname, used++};
 }
 
 /******* SEARCH **************************/
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
+#include <pthread.h>
 
 #include <util/util.hh>
 #include <crypto/prng.hh>
@@ -46,6 +49,34 @@ serial_pack(SECLEVEL l, const std::string &name,
            TypeText<SECLEVEL>::toText(l) + " " + name + " " + layer_info;
 }
 
+/*
+ * A value on it's way through the layers of an onion.  The batch
+ * interface works on these instead of Items because Items can only be
+ * created by a thread that has a THD.
+ */
+class LayerValue {
+public:
+    LayerValue() : is_string(false), is_unsigned(true), integer(0) {}
+
+    static LayerValue fromItem(const Item &i);
+    static LayerValue fromUint(uint64_t value);
+    static LayerValue fromString(const std::string &value);
+    // > the Item the per value decrypt(...) would have produced
+    Item *toItem() const;
+
+    // > what RiboldMYSQL::val_uint(...) and ItemToString(...) would give
+    //   for the same value as an Item
+    uint64_t uintValue() const;
+    std::string stringValue() const;
+
+private:
+    bool is_string;
+    // > integers from the backend are signed
+    bool is_unsigned;
+    uint64_t integer;
+    std::string string;
+};
+
 class EncLayer : public LeafDBMeta {
 public:
     virtual ~EncLayer() {}
@@ -65,6 +96,29 @@ public:
     virtual Item *encrypt(const Item &ptext, uint64_t IV) const = 0;
     virtual Item *decrypt(const Item &ctext, uint64_t IV) const = 0;
 
+    // > encrypts a run of values for one column; the results match
+    //   encrypt(...) value for value
+    virtual std::vector<Item *>
+        encryptBatch(const std::vector<const Item *> &ptexts,
+                     const std::vector<uint64_t> &IVs) const
+    {
+        assert(ptexts.size() == IVs.size());
+        std::vector<Item *> out;
+        for (size_t i = 0; i < ptexts.size(); ++i) {
+            out.push_back(this->encrypt(*ptexts[i], IVs[i]));
+        }
+        return out;
+    }
+
+    // > decrypts a run of values from one column in place; the results
+    //   match decrypt(...) value for value. it does not touch the THD so
+    //   a column can be split across threads
+    virtual void decryptBatch(std::vector<LayerValue> *const values,
+                              const std::vector<uint64_t> &IVs) const
+    {
+        thrower() << "decryptBatch not supported by " << this->name();
+    }
+
     // returns the decryptUDF to remove the onion layer
     virtual Item *decryptUDF(Item * const col, Item * const ivcol = NULL)
         const
@@ -83,6 +137,8 @@ protected:
      friend class EncLayerFactory;
 };
 
+class HOMRandomPool;
+
 class HOM : public EncLayer {
 public:
     HOM(const Create_field &cf, const std::string &seed_key);
@@ -101,22 +157,116 @@ public:
     //TODO needs multi encrypt and decrypt
     Item *encrypt(const Item &p, uint64_t IV) const;
     Item * decrypt(const Item &c, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
 
     //expr is the expression (e.g. a field) over which to sum
-    Item *sumUDA(Item *const expr) const;
-    Item *sumUDF(Item *const i1, Item *const i2) const;
+    virtual Item *sumUDA(Item *const expr) const;
+    virtual Item *sumUDF(Item *const i1, Item *const i2) const;
 
 protected:
     std::string const seed_key;
     static const uint nbits = 1024;
-    mutable Paillier_priv * sk;
+    mutable std::shared_ptr<const Paillier_priv> sk;
 
-private:
     void unwait() const;
+    NTL::ZZ encryptZZ(const NTL::ZZ &ptext) const;
 
-    mutable bool waiting;
+    // > the layer is shared by every client using the SchemaInfo
+    mutable std::atomic<bool> waiting;
+    mutable pthread_mutex_t unwait_lock;
+    // > NULL when the pool is disabled
+    mutable std::shared_ptr<HOMRandomPool> pool;
 };
 
+/*
+ * A slot of a packed AGG onion.  The AGG onions of several narrow
+ * integer columns of a table share one column and one key, each value
+ * in it's own 64 bit slot of the plaintext (the layout of
+ * Paillier::encrypt_pack2 with uint64_t), so a row stores one
+ * ciphertext for all of them.  CRYPTDB_PACKED_AGG turns it on for the
+ * columns of new tables.
+ */
+class HOM_pack : public HOM {
+public:
+    HOM_pack(const Create_field &cf, const std::string &seed_key,
+             unsigned int slot);
+
+    // serialize and deserialize
+    std::string doSerialize() const;
+    HOM_pack(unsigned int id, const std::string &seed_key,
+             unsigned int slot);
+
+    std::string name() const {return "HOM_pack";}
+
+    Item *encrypt(const Item &p, uint64_t IV) const;
+    Item *decrypt(const Item &c, uint64_t IV) const;
+    void decryptBatch(std::vector<LayerValue> *const values,
+                      const std::vector<uint64_t> &IVs) const;
+
+    Item *sumUDA(Item *const expr) const;
+    Item *sumUDF(Item *const i1, Item *const i2) const
+        __attribute__((noreturn));
+
+    // > the ciphertext of one row for the whole column from the
+    //   ciphertexts of it's slots; NULLs count as 0 unless every
+    //   slot is NULL
+    Item *combine(const std::vector<const Item *> &ctexts) const;
+    unsigned int getSlot() const {return slot;}
+
+    // > a value is at most 32 bits, so a slot can not carry into the
+    //   next one before 2^32 rows are summed
+    static const uint slot_bits = 64;
+    static const uint slots = (nbits - 1) / slot_bits;
+
+private:
+    const unsigned int slot;
+
+    NTL::ZZ unpack(const NTL::ZZ &dec) const;
+};
+
+struct AGGSlot {
+    std::string onionname;
+    unsigned int slot;
+};
+
+// > hands out the slots of the packed AGG onions of one new table
+class AGGPacker {
+public:
+    AGGPacker() : used(HOM_pack::slots) {}
+
+    AGGSlot next();
+
+private:
+    std::string onionname;
+    unsigned int used;
+};
+
+// > the randomness pools of the HOM layers; CRYPTDB_HOM_POOL_DEPTH
+//   values are kept ready per key, 0 disables them
+struct HOMPoolStats {
+    size_t depth;               // > per key
+    size_t keys;
+    size_t ready;
+    uint64_t produced;
+    uint64_t produce_usec;
+    uint64_t hits;
+    uint64_t underflows;
+};
+
+HOMPoolStats getHOMPoolStats();
+
+// > HOM keys are generated once per process, in the background when
+//   possible; 'cold' counts the ones a query had to generate itself
+struct HOMKeyStats {
+    size_t keys;
+    size_t queued;
+    uint64_t warmed;
+    uint64_t cold;
+};
+
+HOMKeyStats getHOMKeyStats();
+
 class Search : public EncLayer {
 public:
     Search(const Create_field &cf, const std::string &seed_key);
@@ -149,7 +299,8 @@ class EncLayerFactory {
 public:
     static std::unique_ptr<EncLayer>
         encLayer(onion o, SECLEVEL sl, const Create_field &cf,
-                 const std::string &key);
+                 const std::string &key,
+                 const AGGSlot *const slot = NULL);
 
     // creates EncLayer from its serialization
     static std::unique_ptr<EncLayer>
@@ -158,6 +309,126 @@ public:
     // static std::string serializeLayer(EncLayer * el, DBMeta *parent);
 };
 
+// > packed AGG onion; narrow integers share a ciphertext
+bool usePackedAGG(const Create_field &cf);
+
+// > mutable OPE; the layer's ciphertexts move as it's tree is rebalanced
+bool useMutableOPE(const Create_field &cf);
+// > where the trees are kept across restarts
+void setMutableOPEJournalDirectory(const std::string &dir);
+// > true if some tree has been journaled there
+bool mutableOPEJournalsExist();
+// > true once a mutable OPE layer has been built
+bool mutableOPEInUse();
+
+class MutableOPETree;
+
+// > the (old, new) ciphertexts one rebalance of a tree moved; they are
+//   journaled with the tree until they are applied to it's columns
+struct MutableOPERelabels {
+    std::shared_ptr<MutableOPETree> tree;
+    // > the tree's journal; with 'seq' it names the batch in
+    //   MetaData::Table::mopeRelabelCompletion()
+    std::string tree_name;
+    uint64_t seq;
+    std::vector<std::pair<uint64_t, uint64_t> > relabels;
+};
+
+// > true if some tree has relabels that are not applied yet
+bool mutableOPERelabelsPending();
+// > the batches not applied to the layer's column yet, oldest first;
+//   nothing for other layers
+std::vector<MutableOPERelabels> pendingMutableOPERelabels(const EncLayer &el);
+// > the rows hold the new ciphertexts
+void mutableOPERelabelsApplied(const MutableOPERelabels &batch);
+// > the pending batches of every tree not in 'kept' are dropped; no
+//   column holds those trees' ciphertexts
+void dropMutableOPERelabels(const std::vector<MutableOPERelabels> &kept);
+
+/*
+ * A query's claim on the mutable OPE trees.  The ciphertexts a query
+ * sends or gets back are only good until a tree is rebalanced, so a query
+ * holds the trees SHARED from it's first encryption until it has it's
+ * results.  An insert that rebalances needs them EXCLUSIVE, and the
+ * relabels it makes are applied to the columns before that query runs.
+ * One gate covers every tree, as a query may touch several columns.
+ *
+ * Clients run concurrently on mysql-proxy's event threads, each thread
+ * serving many clients, and the per-client lock is only held for one
+ * call into the proxy.  A hold outlives those calls, as it spans queries
+ * to the server, so the clients it waits for may be served by the very
+ * thread that would block on it.  Nothing here blocks then: a claim that
+ * can not be had throws MutableOPEBusy, and the query has the server
+ * sleep before it asks again.
+ *
+ * EXCLUSIVE claims have priority.  One that fails stays registered until
+ * it is had or the hold is destroyed, and while it is registered no new
+ * SHARED claim is granted, so the SHARED holds drain and the next time
+ * it asks it gets in.
+ */
+class MutableOPEHold {
+    MutableOPEHold(const MutableOPEHold &other) = delete;
+    MutableOPEHold &operator=(const MutableOPEHold &rhs) = delete;
+
+public:
+    enum class Mode {NONE, SHARED, EXCLUSIVE};
+
+    MutableOPEHold() : rebalances(0), mode(Mode::NONE), waiting(false) {}
+    ~MutableOPEHold() {release(); stopWaiting();}
+
+    // > false if other holds are in the way; a failed EXCLUSIVE keeps
+    //   new SHARED holds out until it is had or the hold is destroyed
+    bool tryAcquire(Mode m);
+    // > throws MutableOPEBusy if it can not be had
+    void require(Mode m);
+    // > gives up what the hold has, but not a failed EXCLUSIVE's place
+    //   in line
+    void release();
+    Mode getMode() const {return mode;}
+
+    // > the encryptions under the hold that rebalanced a tree
+    unsigned int rebalances;
+
+private:
+    Mode mode;
+    // > a failed EXCLUSIVE is registered with the gate
+    bool waiting;
+
+    void stopWaiting();
+};
+
+class MutableOPEBusy {
+public:
+    explicit MutableOPEBusy(MutableOPEHold::Mode mode) : mode(mode) {}
+    // > what the query needs
+    const MutableOPEHold::Mode mode;
+};
+
+/*
+ * The hold the mutable OPE encryptions on this thread are made under;
+ * without one the caller keeps other queries off the trees itself.  A dry
+ * run only records a plan, so the encryptions leave the trees alone and
+ * spoil the plan instead.
+ */
+class MutableOPEScope {
+    MutableOPEScope(const MutableOPEScope &other) = delete;
+    MutableOPEScope &operator=(const MutableOPEScope &rhs) = delete;
+
+public:
+    MutableOPEScope(MutableOPEHold *const hold, bool dry_run);
+    ~MutableOPEScope();
+
+    // > NULL outside of any scope
+    static MutableOPEScope *current();
+
+    MutableOPEHold *const hold;
+    const bool dry_run;
+    bool spoiled;
+
+private:
+    MutableOPEScope *const outer;
+};
+
 class PlainText : public EncLayer {
 public:
     PlainText() {}
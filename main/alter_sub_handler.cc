@@ -22,15 +22,22 @@ class AddColumnSubHandler : public AlterSubHandler {
         const auto &key_data = collectKeyData(*lex);
 
         // Create *Meta objects.
+        // > tm belongs to the published snapshot so we count the new
+        //   fields here; the ReplaceDelta of each field advances the
+        //   table's counter past it
+        uint64_t uniq_count = tm.currentCount();
         auto add_it =
             List_iterator<Create_field>(lex->alter_info.create_list);
         lex->alter_info.create_list =
             accumList<Create_field>(add_it,
-                [&a, &tm, &key_data] (List<Create_field> out_list,
-                                      Create_field *cf)
+                [&a, &tm, &key_data, &uniq_count]
+                    (List<Create_field> out_list, Create_field *cf)
             {
-                    return createAndRewriteField(a, cf, &tm, false, key_data,
-                                                 out_list);
+                    // > an added field gets it's own AGG column; the
+                    //   rows in a packed one would not hold it's default
+                    return createAndRewriteField(a, cf, &tm, false,
+                                                 uniq_count++, key_data,
+                                                 out_list, NULL);
             });
 
         return lex;
@@ -62,6 +69,10 @@ class DropColumnSubHandler : public AlterSubHandler {
             TableMeta const &tm =
                 a.getTableMeta(preamble.dbname, preamble.table);
             FieldMeta const &fm = a.getFieldMeta(tm, adrop->name);
+            // > it's AGG column holds the values of other fields
+            TEST_TextMessageError(false == hasPackedAGG(fm),
+                                  "can not drop a field with a packed"
+                                  " AGG onion");
             List<Alter_drop> lst = this->rewrite(fm, adrop);
             out_list.concat(&lst);
             a.deltas.push_back(std::unique_ptr<Delta>(
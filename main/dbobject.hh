@@ -153,6 +153,18 @@ public:
         const = 0;
     virtual AbstractMetaKey const &getKey(const DBMeta &child)
         const = 0;
+    // Build a child from it's serialized form and take ownership of it.
+    virtual DBMeta *deserializeChild(const std::string &key,
+                                     const std::string &serial,
+                                     unsigned int id) = 0;
+
+    // > copy-on-write support for SchemaInfo snapshots; see
+    //   SchemaInfoBuilder
+    // > the copy shares it's children with the original
+    virtual std::unique_ptr<DBMeta> shallowCopy() const = 0;
+    virtual bool replaceChild(const DBMeta &child,
+                              std::unique_ptr<DBMeta> &&replacement) = 0;
+    virtual bool removeChild(const DBMeta &child) = 0;
 
 protected:
     std::vector<DBMeta*>
@@ -185,6 +197,30 @@ public:
         // FIXME:
         assert(false);
     }
+
+    DBMeta *deserializeChild(const std::string &key,
+                             const std::string &serial, unsigned int id)
+    {
+        assert(false);
+    }
+
+    // > leaves are never copied as only the ancestors of a changed
+    //   object are copied
+    std::unique_ptr<DBMeta> shallowCopy() const
+    {
+        assert(false);
+    }
+
+    bool replaceChild(const DBMeta &child,
+                      std::unique_ptr<DBMeta> &&replacement)
+    {
+        return false;
+    }
+
+    bool removeChild(const DBMeta &child)
+    {
+        return false;
+    }
 };
 
 // > TODO: Use static deserialization functions for the derived types so we
@@ -192,6 +228,7 @@ public:
 //   'const' back on the members.
 // > FIXME: The key in children is a pointer so this means our lookup is
 //   slow. Use std::reference_wrapper.
+// > children are shared between SchemaInfo snapshots.
 template <typename ChildType, typename KeyType>
 class MappedDBMeta : public DBMeta {
 public:
@@ -205,13 +242,18 @@ public:
     virtual std::vector<DBMeta *>
         fetchChildren(const std::unique_ptr<Connect> &e_conn);
     bool applyToChildren(std::function<bool(const DBMeta &)> fn) const;
-    const std::map<KeyType, std::unique_ptr<ChildType> > &
+    DBMeta *deserializeChild(const std::string &key,
+                             const std::string &serial, unsigned int id);
+    bool replaceChild(const DBMeta &child,
+                      std::unique_ptr<DBMeta> &&replacement);
+    bool removeChild(const DBMeta &child);
+    const std::map<KeyType, std::shared_ptr<ChildType> > &
         getChildren() const {return children;}
     virtual const ChildType *
         getChildWithGChild(const DBMeta &gchild) const;
 
 private:
-    std::map<KeyType, std::unique_ptr<ChildType> > children;
+    std::map<KeyType, std::shared_ptr<ChildType> > children;
 };
 
 #include <main/dbobject.tt>
@@ -67,14 +67,20 @@ class CreateTableHandler : public DDLHandler {
             // layout we use
             const auto &key_data = collectKeyData(*lex);
 
+            // > the AGG onions of the narrow integer fields share
+            //   ciphertexts when CRYPTDB_PACKED_AGG is set
+            AGGPacker packer;
             auto it =
                 List_iterator<Create_field>(lex->alter_info.create_list);
             new_lex->alter_info.create_list =
                 accumList<Create_field>(it,
-                    [&a, &tm, &key_data] (List<Create_field> out_list,
-                                          Create_field *const cf) {
-                        return createAndRewriteField(a, cf, tm.get(),
-                                                     true, key_data, out_list);
+                    [&a, &tm, &key_data, &packer]
+                        (List<Create_field> out_list,
+                         Create_field *const cf) {
+                        return createAndRewriteField(a, cf, tm.get(), true,
+                                                     tm->leaseCount(),
+                                                     key_data, out_list,
+                                                     &packer);
                 });
 
             // -----------------------------
@@ -241,7 +247,7 @@ class ChangeDBHandler : public DDLHandler {
             const
     {
         assert(a.deltas.size() == 0);
-        return new SimpleExecutor();
+        return new ChangeDBExecutor(lex->select_lex.db);
     }
 };
 
@@ -257,7 +263,8 @@ class DropDBHandler : public DDLHandler {
         a.deltas.push_back(std::unique_ptr<Delta>(
                                     new DeleteDelta(dm, a.getSchema())));
 
-        return new DDLQueryExecutor(*copyWithTHD(lex), std::move(a.deltas));
+        return new DDLQueryExecutor(*copyWithTHD(lex), std::move(a.deltas),
+                                    dbname == a.getDatabaseName());
     }
 };
 
@@ -405,6 +412,10 @@ nextImpl(const ResType &res, const NextParams &nparams)
         TEST_ErrPkt(deltaOutputAfterQuery(nparams.ps.getEConn(), this->deltas,
                                           this->embedded_completion_id.get()),
                    "deltaOuputAfterQuery failed for DDL");
+        nparams.ps.getSchemaCache().applyDeltas(this->deltas);
+        if (true == this->drops_default_db) {
+            nparams.default_db.clear();
+        }
 
         yield return CR_RESULTS(this->ddl_res.get());
     }
@@ -412,3 +423,27 @@ nextImpl(const ResType &res, const NextParams &nparams)
     assert(false);
 }
 
+std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
+ChangeDBExecutor::
+nextImpl(const ResType &res, const NextParams &nparams)
+{
+    reenter(this->corot) {
+        // > we must see the result to know whether the session's
+        //   database actually changed
+        yield return CR_QUERY_AGAIN(nparams.original_query);
+        // > unknown database, access denied and the like are the
+        //   client's to see
+        if (false == res.success()) {
+            if (nparams.backend_error) {
+                throw *nparams.backend_error;
+            }
+            FAIL_GenericPacketException("failed to change database");
+        }
+
+        nparams.default_db = this->dbname;
+        yield return CR_RESULTS(res);
+    }
+
+    assert(false);
+}
+
@@ -11,14 +11,18 @@
 class DDLQueryExecutor : public AbstractQueryExecutor {
     const std::string new_query;
     const std::vector<std::unique_ptr<Delta> > deltas;
+    // > dropping the session's database leaves the session without one
+    const bool drops_default_db;
 
     AssignOnce<ResType> ddl_res;
     AssignOnce<uint64_t> embedded_completion_id;
 
 public:
     DDLQueryExecutor(const LEX &new_lex,
-                     std::vector<std::unique_ptr<Delta> > &&deltas)
-        : new_query(lexToQuery(new_lex)), deltas(std::move(deltas)) {}
+                     std::vector<std::unique_ptr<Delta> > &&deltas,
+                     bool drops_default_db = false)
+        : new_query(lexToQuery(new_lex)), deltas(std::move(deltas)),
+          drops_default_db(drops_default_db) {}
     ~DDLQueryExecutor() {}
     std::pair<ResultType, AbstractAnything *>
         nextImpl(const ResType &res, const NextParams &nparams);
@@ -28,6 +32,16 @@ private:
     bool usesEmbedded() const {return true;}
 };
 
+class ChangeDBExecutor : public AbstractQueryExecutor {
+    const std::string dbname;
+
+public:
+    ChangeDBExecutor(const std::string &dbname) : dbname(dbname) {}
+    ~ChangeDBExecutor() {}
+    std::pair<ResultType, AbstractAnything *>
+        nextImpl(const ResType &res, const NextParams &nparams);
+};
+
 // Abstract base class for command handler.
 class DDLHandler : public SQLHandler {
 public:
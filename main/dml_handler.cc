@@ -1,14 +1,18 @@
 #include <functional>
 
 #include <main/dml_handler.hh>
+#include <main/CryptoHandlers.hh>
 #include <main/rewrite_main.hh>
 #include <main/rewrite_util.hh>
 #include <main/dispatcher.hh>
 #include <main/macro_util.hh>
 #include <main/metadata_tables.hh>
+#include <main/plan_cache.hh>
 #include <parser/lex_util.hh>
 #include <util/onions.hh>
+#include <util/parallel.hh>
 #include <util/yield.hpp>
+#include <util/zz.hh>
 
 extern CItemTypesDir itemTypes;
 
@@ -99,6 +103,7 @@ class InsertHandler : public DMLHandler {
         // > INSERT INTO t () VALUES ();
         // FIXME: Make vector of references.
         std::vector<FieldMeta *> fmVec;
+        std::vector<FieldMeta *> implicit_fmVec;
         std::vector<Item *> implicit_defaults;
         if (lex->field_list.head()) {
             auto it = List_iterator<Item>(lex->field_list);
@@ -139,6 +144,7 @@ class InsertHandler : public DMLHandler {
                 rewriteInsertHelper(*make_item_string(def_value),
                                     *implicit_it, a, &implicit_defaults);
             }
+            implicit_fmVec = field_implicit_defaults;
 
             new_lex->field_list = newList;
         } else {
@@ -192,6 +198,16 @@ class InsertHandler : public DMLHandler {
             new_lex->many_values = newList;
         }
 
+        // -----------------------
+        //   Packed AGG onions
+        // -----------------------
+        {
+            std::vector<FieldMeta *> fields(fmVec);
+            fields.insert(fields.end(), implicit_fmVec.begin(),
+                          implicit_fmVec.end());
+            packAGGColumns(fields, new_lex, a);
+        }
+
         // -----------------------
         // ON DUPLICATE KEY UPDATE
         // -----------------------
@@ -210,6 +226,107 @@ class InsertHandler : public DMLHandler {
 
         return new DMLQueryExecutor(*new_lex, a.rmeta);
     }
+
+    // > each field gave a column for every slot of a packed AGG onion;
+    //   they become the one column of the onion, holding the product of
+    //   their ciphertexts
+    static void packAGGColumns(const std::vector<FieldMeta *> &fields,
+                               LEX *const new_lex, Analysis &a)
+    {
+        // > for each column we emitted, the layer if it is a slot of a
+        //   packed AGG onion and the first column of the same onion
+        std::vector<const HOM_pack *> layers;
+        std::vector<size_t> owners;
+        std::map<std::string, size_t> firsts;
+        for (auto it : fields) {
+            for (auto oit : it->orderedOnionMetas()) {
+                const HOM_pack *const packed =
+                    packedAGGLayer(*oit.second);
+                const size_t column = layers.size();
+                layers.push_back(packed);
+                if (packed) {
+                    const std::string &name =
+                        oit.second->getAnonOnionName();
+                    firsts.insert(std::make_pair(name, column));
+                    owners.push_back(firsts[name]);
+                } else {
+                    owners.push_back(column);
+                }
+            }
+            if (it->getHasSalt()) {
+                owners.push_back(layers.size());
+                layers.push_back(NULL);
+            }
+        }
+        if (firsts.empty()) {
+            return;
+        }
+
+        // > the value of the column is only known once every slot of it
+        //   is encrypted
+        if (a.plan_recorder) {
+            a.plan_recorder->poison("packed AGG onion");
+            return;
+        }
+
+        TEST_TextMessageError(NULL != new_lex->many_values.head(),
+                              "packed AGG onions need INSERT ... VALUES");
+
+        if (new_lex->field_list.head()) {
+            TEST_TextMessageError(
+                new_lex->field_list.elements == layers.size(),
+                "size mismatch between fields and packed AGG onions!");
+            auto it = List_iterator<Item>(new_lex->field_list);
+            List<Item> newList;
+            for (size_t column = 0; column < layers.size(); ++column) {
+                Item *const i = it++;
+                if (owners[column] == column) {
+                    newList.push_back(i);
+                }
+            }
+            new_lex->field_list = newList;
+        }
+
+        auto it = List_iterator<List_item>(new_lex->many_values);
+        List<List_item> newList;
+        for (;;) {
+            List_item *const li = it++;
+            if (!li) {
+                break;
+            }
+            // > INSERT INTO <table> VALUES ();
+            if (0 == li->elements) {
+                newList.push_back(li);
+                continue;
+            }
+            TEST_TextMessageError(li->elements == layers.size(),
+                                  "size mismatch between values and"
+                                  " packed AGG onions!");
+
+            std::vector<Item *> row;
+            std::map<size_t, std::vector<const Item *> > slots;
+            auto it0 = List_iterator<Item>(*li);
+            for (size_t column = 0; column < layers.size(); ++column) {
+                Item *const i = it0++;
+                row.push_back(i);
+                if (layers[column]) {
+                    slots[owners[column]].push_back(i);
+                }
+            }
+
+            List<Item> *const newList0 = new List<Item>();
+            for (size_t column = 0; column < layers.size(); ++column) {
+                if (owners[column] != column) {
+                    continue;
+                }
+                newList0->push_back(layers[column]
+                    ? layers[column]->combine(slots[column])
+                    : row[column]);
+            }
+            newList.push_back(newList0);
+        }
+        new_lex->many_values = newList;
+    }
 };
 
 class UpdateHandler : public DMLHandler {
@@ -415,8 +532,83 @@ class SelectHandler : public DMLHandler {
         set_select_lex(new_lex,
             rewrite_select_lex(new_lex->select_lex, a));
 
+        const std::vector<const Item_func *> sums = homSums(*new_lex);
+        if (aggPartitions() > 1 && sums.size() > 0) {
+            std::vector<NTL::ZZ> moduli;
+            for (const auto &it : sums) {
+                moduli.push_back(ZZFromString(ItemToString(
+                                                *it->arguments()[1])));
+            }
+
+            const TABLE_LIST *const from = lex->select_lex.table_list.first;
+            const std::string &table =
+                quoteText(from->db) + "." +
+                a.translateNonAliasPlainToAnonTableName(from->db,
+                                                        from->table_name);
+            Item *const where = new_lex->select_lex.where;
+            new_lex->select_lex.where = NULL;
+            const std::string &query = lexToQuery(*new_lex);
+            new_lex->select_lex.where = where;
+            return new PartitionedAggExecutor(
+                query, where ? printItemToString(*where) : "", table,
+                moduli, aggPartitions(), a.rmeta);
+        }
+
         return new DMLQueryExecutor(*new_lex, a.rmeta);
     }
+
+    // > CRYPTDB_AGG_PARTITIONS; 1 turns partitioning off
+    static unsigned int aggPartitions()
+    {
+        static const unsigned int partitions =
+            getenv("CRYPTDB_AGG_PARTITIONS")
+            ? strtoul(getenv("CRYPTDB_AGG_PARTITIONS"), NULL, 10) : 1;
+        return partitions;
+    }
+
+    // > the cryptdb_agg(...)s of a select list that has nothing else;
+    //   none if the query has anything else that spans the rows or
+    //   reads other than one table
+    static std::vector<const Item_func *> homSums(const LEX &lex)
+    {
+        const st_select_lex &select_lex = lex.select_lex;
+        if (lex.unit.first_select() != &select_lex
+            || select_lex.next_select()
+            || select_lex.group_list.elements
+            || select_lex.having
+            || select_lex.order_list.elements
+            || select_lex.select_limit
+            || (select_lex.options & SELECT_DISTINCT)
+            || 1 != select_lex.table_list.elements
+            || select_lex.table_list.first->derived) {
+            return std::vector<const Item_func *>();
+        }
+
+        std::vector<const Item_func *> sums;
+        auto item_it =
+            RiboldMYSQL::constList_iterator<Item>(select_lex.item_list);
+        for (;;) {
+            const Item *const item = item_it++;
+            if (!item) {
+                break;
+            }
+            if (Item::FUNC_ITEM != item->type()) {
+                return std::vector<const Item_func *>();
+            }
+            const Item_func *const func =
+                static_cast<const Item_func *>(item);
+            // > a packed one limits the rows of the whole table, which
+            //   the parts do not see
+            if (Item_func::UDF_FUNC != func->functype()
+                || std::string("cryptdb_agg") != func->func_name()
+                || 2 != func->argument_count()) {
+                return std::vector<const Item_func *>();
+            }
+            sums.push_back(func);
+        }
+
+        return sums;
+    }
 };
 
 AbstractQueryExecutor *DMLHandler::
@@ -808,6 +1000,15 @@ determineUpdateType(const Item &value_item, const FieldMeta &fm,
         return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
     }
 
+    // > a new value for one slot of a packed AGG onion would overwrite
+    //   the others; SpecialUpdateExecutor INSERTs the whole row again
+    const bool same_value =
+        value_item.type() == Item::Type::FIELD_ITEM
+        && false == isItem_insert_value(value_item);
+    if (hasPackedAGG(fm) && false == same_value) {
+        return SIMPLE_UPDATE_TYPE::UNSUPPORTED;
+    }
+
     if (value_item.type() == Item::Type::FIELD_ITEM) {
         if (true == isItem_insert_value(value_item)) {
             return SIMPLE_UPDATE_TYPE::ON_DUPLICATE_VALUE;
@@ -884,6 +1085,9 @@ handleUpdateType(SIMPLE_UPDATE_TYPE update_type, const EncSet &es,
                 // have already referenced this @fm.
                 const auto it_salt = a.salts.find(&fm);
                 if ((it_salt == a.salts.end()) && needsSalt(es)) {
+                    if (a.plan_recorder) {
+                        a.plan_recorder->poison("update picks a new salt");
+                    }
                     add_salt = true;
                     const salt_type salt = randomValue();
                     a.salts.insert(std::make_pair(&fm, salt));
@@ -962,7 +1166,8 @@ class SetHandler : public DMLHandler {
              {"sensitive",
               DIRECTIVE_HANDLER(&SetHandler::handleSensitiveDirective)},
              {"killzone",
-              DIRECTIVE_HANDLER(&SetHandler::handleKillZoneDirective)}};
+              DIRECTIVE_HANDLER(&SetHandler::handleKillZoneDirective)},
+             {"stats", DIRECTIVE_HANDLER(&SetHandler::handleStatsDirective)}};
 
         DirectiveHandler dhandler = nullptr;
         std::map<std::string, std::string> var_pairs;
@@ -1079,6 +1284,15 @@ private:
         return new ShowDirectiveExecutor(a.getSchema());
     }
 
+    AbstractQueryExecutor *
+    handleStatsDirective(std::map<std::string, std::string> &var_pairs,
+                         Analysis &a) const
+    {
+        TEST_Text(0 == var_pairs.size(),
+                  "the stats directive takes no parameters");
+        return new StatsDirectiveExecutor();
+    }
+
     AbstractQueryExecutor *
     handleSensitiveDirective(std::map<std::string, std::string> &var_pairs,
                              Analysis &a) const
@@ -1088,16 +1302,22 @@ private:
         const ParameterCollection &params = collectParameters(var_pairs, a);
 
         for (const auto &it : params.onions) {
-            OnionMeta &om = a.getOnionMeta(params.fm, it.first);
+            const OnionMeta &om = a.getOnionMeta(params.fm, it.first);
             const SECLEVEL current_level = a.getOnionLevel(om);
-            if (it.second <= current_level) {
-                om.setMinimumSecLevel(it.second);
-            } else {
+            if (it.second > current_level) {
                 FAIL_TextMessageError("it is not possible to set a minimum level"
                                       " above the current level!");
             }
-            a.deltas.push_back(std::unique_ptr<Delta>(new ReplaceDelta(om,
-                                                                     params.fm)));
+            // > om is shared with other clients; the new level only
+            //   reaches the snapshot published after the directive
+            const SECLEVEL minimum_level = it.second;
+            a.deltas.push_back(std::unique_ptr<Delta>(
+                new ReplaceDelta(om, params.fm,
+                    [minimum_level] (DBMeta *const copy)
+                    {
+                        static_cast<OnionMeta *>(copy)
+                            ->setMinimumSecLevel(minimum_level);
+                    })));
         }
 
         return new SensitiveDirectiveExecutor(std::move(a.deltas));
@@ -1277,6 +1497,190 @@ nextImpl(const ResType &res, const NextParams &nparams)
     assert(false);
 }
 
+namespace {
+// > the single row of one part's sums
+struct PartialSums {
+    std::vector<std::string> names;
+    std::vector<enum_field_types> types;
+    std::vector<std::string> values;
+    std::vector<bool> nulls;
+};
+}
+
+// > runs on a thread without a THD, so the row is read as strings
+//   rather than unpacked into Items
+static PartialSums
+runPartialSums(ConnectPool *const pool, const std::string &query)
+{
+    const ConnectPool::Lease conn(pool);
+    std::unique_ptr<DBResult> dbres;
+    TEST_ErrPkt(conn->execute(query, &dbres),
+                "partial aggregate failed against remote database");
+
+    MYSQL_RES *const native = dbres->n;
+    TEST_ErrPkt(native && 1 == mysql_num_rows(native),
+                "partial aggregate did not return one row");
+    const unsigned int count = mysql_num_fields(native);
+    const MYSQL_FIELD *const fields = mysql_fetch_fields(native);
+    const MYSQL_ROW row = mysql_fetch_row(native);
+    const unsigned long *const lengths = mysql_fetch_lengths(native);
+
+    PartialSums out;
+    for (unsigned int j = 0; j < count; ++j) {
+        out.names.push_back(fields[j].name);
+        out.types.push_back(fields[j].type);
+        out.values.push_back(row[j] ? std::string(row[j], lengths[j])
+                                    : std::string());
+        out.nulls.push_back(NULL == row[j]);
+    }
+
+    return out;
+}
+
+// > the ends of the table's integer key; false if it has none or no
+//   rows.  _rowid names a one column integer PRIMARY (or UNIQUE NOT
+//   NULL) key, and MIN and MAX of it read the ends of it's index
+static bool
+keyBounds(ConnectPool *const pool, const std::string &table,
+          NTL::ZZ *const low, NTL::ZZ *const high)
+{
+    const ConnectPool::Lease conn(pool);
+    std::unique_ptr<DBResult> dbres;
+    bool found = false;
+    if (conn->execute(" SELECT MIN(_rowid), MAX(_rowid) FROM " + table +
+                      ";", &dbres)) {
+        MYSQL_RES *const native = dbres->n;
+        if (native && 1 == mysql_num_rows(native)) {
+            const MYSQL_ROW row = mysql_fetch_row(native);
+            if (row[0] && row[1]) {
+                *low = ZZFromDecString(row[0]);
+                *high = ZZFromDecString(row[1]);
+                found = true;
+            }
+        }
+    }
+
+    return found;
+}
+
+std::string
+PartitionedAggExecutor::wholeQuery() const
+{
+    return this->where.empty() ? this->query
+                               : this->query + " WHERE " + this->where;
+}
+
+// > one query for each range of the key; the whole query if there is
+//   no key to split
+std::vector<std::string>
+PartitionedAggExecutor::partQueries(ConnectPool *const pool) const
+{
+    NTL::ZZ low, high;
+    if (false == keyBounds(pool, this->table, &low, &high)) {
+        return std::vector<std::string>({this->wholeQuery()});
+    }
+
+    const NTL::ZZ span = high - low + 1;
+    std::vector<std::string> queries;
+    for (unsigned int i = 0; i < this->partitions; ++i) {
+        const NTL::ZZ first =
+            low + span * static_cast<long>(i) /
+                  static_cast<long>(this->partitions);
+        const NTL::ZZ last =
+            low + span * static_cast<long>(i + 1) /
+                  static_cast<long>(this->partitions) - 1;
+        // > fewer keys than parts
+        if (first > last) {
+            continue;
+        }
+
+        const std::string &range =
+            "_rowid BETWEEN " + DecStringFromZZ(first) +
+            " AND " + DecStringFromZZ(last);
+        queries.push_back(this->query + " WHERE " +
+                          (this->where.empty()
+                              ? range
+                              : "(" + this->where + ") AND " + range));
+    }
+
+    return queries;
+}
+
+std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
+PartitionedAggExecutor::
+nextImpl(const ResType &res, const NextParams &nparams)
+{
+    reenter(this->corot) {
+        // > the parts run on their own connections and would miss the
+        //   client's uncommitted writes
+        yield return CR_QUERY_AGAIN(
+            "CALL " + MetaData::Proc::activeTransactionP());
+        TEST_ErrPkt(res.success(),
+                    "failed to determine if there is an active transaction");
+        this->in_trx = handleActiveTransactionPResults(res);
+
+        if (true == this->in_trx.get()) {
+            yield return CR_QUERY_AGAIN(this->wholeQuery());
+            TEST_ErrPkt(res.success(),
+                        "DML query failed against remote database");
+
+            yield {
+                try {
+                    return CR_RESULTS(Rewriter::decryptResults(res,
+                                                               this->rmeta));
+                } catch (...) {
+                    FAIL_GenericPacketException(
+                        "error decrypting dml results");
+                }
+            }
+        }
+
+        yield {
+            ConnectPool *const pool = &nparams.ps.getAggConnPool();
+            const std::vector<std::string> &queries =
+                this->partQueries(pool);
+            std::vector<PartialSums> parts(queries.size());
+            parallelFor(queries.size(),
+                        [pool, &queries, &parts] (size_t i)
+                        {
+                            parts[i] = runPartialSums(pool, queries[i]);
+                        },
+                        queries.size());
+
+            // > a missing product is the encryption of 0 without
+            //   randomness
+            std::vector<Item *> row;
+            for (size_t j = 0; j < this->moduli.size(); ++j) {
+                NTL::ZZ product = NTL::to_ZZ(1);
+                for (const auto &it : parts) {
+                    TEST_ErrPkt(it.values.size() == this->moduli.size(),
+                                "partial aggregate has the wrong columns");
+                    if (false == it.nulls[j]) {
+                        NTL::MulMod(product, product,
+                                    ZZFromString(it.values[j]),
+                                    this->moduli[j]);
+                    }
+                }
+                row.push_back(make_item_string(StringFromZZ(product)));
+            }
+
+            const ResType combined(true, 0, 0,
+                                   std::vector<std::string>(parts[0].names),
+                                   std::vector<enum_field_types>(
+                                       parts[0].types),
+                                   {row});
+            try {
+                return CR_RESULTS(Rewriter::decryptResults(combined,
+                                                           this->rmeta));
+            } catch (...) {
+                FAIL_GenericPacketException("error decrypting dml results");
+            }
+        }
+    }
+
+    assert(false);
+}
+
 // currently only supports queries that return QUERY_COME_AGAIN
 // > this is an attempt to keep this function simple
 static std::pair<std::string, ReturnMeta>
@@ -1299,6 +1703,8 @@ rewriteAndGetFirstQuery(const std::string &query, NextParams nparams)
                               delete_rewrite.rmeta);
     } catch (const SchemaFailure &e) {
         FAIL_GenericPacketException("failed to get schema info");
+    } catch (const ErrorPacketException &e) {
+        throw;
     } catch (...) {
         FAIL_GenericPacketException("error rewriting a single query");
     }
@@ -1419,15 +1825,24 @@ nextImpl(const ResType &res, const NextParams &nparams)
             // > This code relies on single threaded access to the database
             //   and on the fact that the database is cleaned up after
             //   every such operation.
+            // > The rows are unpacked a batch at a time so only one batch
+            //   of them is ever held as Items.
             std::unique_ptr<DBResult> dbres;
             const std::string &select_results_q =
                 " SELECT * FROM " + this->plain_table + ";";
-            SPECIALIZED_SYNC(nparams.ps.getEConn()->execute(select_results_q,
-                                                            &dbres));
-            const ResType interim_res = ResType(dbres->unpack());
-            assert(interim_res.success());
-            this->escaped_output_values =
-                pItemVectorToNiceValueList(interim_res.rows);
+            SPECIALIZED_SYNC(nparams.ps.getEConn()->execute(
+                                select_results_q, &dbres));
+            assert(dbres->getSuccess());
+            std::vector<std::string> value_lists;
+            while (true) {
+                const ScopedMemRoot batch_root;
+                const ResType batch = dbres->unpack(RESULT_BATCH_ROWS);
+                if (0 == batch.rows.size()) {
+                    break;
+                }
+                value_lists.push_back(pItemVectorToNiceValueList(batch.rows));
+            }
+            this->escaped_output_values = vector_join(value_lists, ",");
 
             // Cleanup the embedded database.
             const std::string &cleanup_q =
@@ -1554,6 +1969,65 @@ nextImpl(const ResType &res, const NextParams &nparams)
     assert(false);
 }
 
+std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
+StatsDirectiveExecutor::
+nextImpl(const ResType &res, const NextParams &nparams)
+{
+    reenter(this->corot) {
+        yield {
+            const PlanCache::Stats &stats =
+                Rewriter::getPlanCache().getStats();
+            const HOMPoolStats &hom = getHOMPoolStats();
+            const HOMKeyStats &hom_keys = getHOMKeyStats();
+            const uint64_t total =
+                stats.hits + stats.misses + stats.bypasses;
+            const auto average =
+                [] (uint64_t usec, uint64_t count)
+                {
+                    return 0 == count ? 0 : usec / count;
+                };
+            const std::vector<std::pair<std::string, uint64_t> > values{
+                {"plan_cache_entries", stats.entries},
+                {"plan_cache_hits", stats.hits},
+                {"plan_cache_misses", stats.misses},
+                {"plan_cache_bypasses", stats.bypasses},
+                {"plan_cache_hit_rate_percent",
+                 0 == total ? 0 : stats.hits * 100 / total},
+                {"plan_cache_hit_avg_usec",
+                 average(stats.hit_usec, stats.hits)},
+                {"plan_cache_miss_avg_usec",
+                 average(stats.miss_usec, stats.misses)},
+                {"plan_cache_bypass_avg_usec",
+                 average(stats.bypass_usec, stats.bypasses)},
+                {"hom_pool_depth", hom.depth},
+                {"hom_pool_keys", hom.keys},
+                {"hom_pool_ready", hom.ready},
+                {"hom_pool_produced", hom.produced},
+                {"hom_pool_refill_per_sec",
+                 0 == hom.produce_usec
+                    ? 0 : hom.produced * 1000000 / hom.produce_usec},
+                {"hom_pool_hits", hom.hits},
+                {"hom_pool_underflows", hom.underflows},
+                {"hom_keys", hom_keys.keys},
+                {"hom_keys_queued", hom_keys.queued},
+                {"hom_keys_warmed", hom_keys.warmed},
+                {"hom_keys_cold", hom_keys.cold}};
+
+            std::vector<std::vector<Item *> > rows;
+            for (const auto &it : values) {
+                rows.push_back({make_item_string(it.first),
+                                make_item_string(std::to_string(it.second))});
+            }
+            return CR_RESULTS(ResType(true, 0, 0, {"stat", "value"},
+                                      {MYSQL_TYPE_VAR_STRING,
+                                       MYSQL_TYPE_VAR_STRING},
+                                      std::move(rows)));
+        }
+    }
+
+    assert(false);
+}
+
 bool ShowDirectiveExecutor::
 deleteAllShowDirectiveEntries(const std::unique_ptr<Connect> &e_conn)
 {
@@ -1604,6 +2078,7 @@ nextImpl(const ResType &res, const NextParams &nparams)
                                          Delta::REGULAR_TABLE));
 
             SPECIALIZED_SYNC(nparams.ps.getEConn()->execute("COMMIT"));
+            nparams.ps.getSchemaCache().applyDeltas(this->deltas);
 
             return CR_QUERY_RESULTS("DO 0;");
         }
@@ -12,15 +12,56 @@ class DMLQueryExecutor : public AbstractQueryExecutor {
 public:
     DMLQueryExecutor(const LEX &lex, const ReturnMeta &rmeta)
         : query(lexToQuery(lex)), rmeta(rmeta) {}
+    DMLQueryExecutor(const std::string &query, const ReturnMeta &rmeta)
+        : query(query), rmeta(rmeta) {}
     ~DMLQueryExecutor() {}
     std::pair<ResultType, AbstractAnything *>
         nextImpl(const ResType &res, const NextParams &nparams);
+    bool cacheable() const {return true;}
+    const ReturnMeta *batchedResults() const {return &rmeta;}
+    const std::string &getQuery() const {return query;}
 
 private:
     const std::string query;
     const ReturnMeta rmeta;
 };
 
+// > a SELECT of HOM sums alone over one table, split into queries over
+//   disjoint ranges of the table's integer key that run at once on their
+//   own connections; their ciphertexts are multiplied together and
+//   decrypted once.  The parts can not see uncommitted writes, so a
+//   client with an open transaction runs the query whole.
+class PartitionedAggExecutor : public AbstractQueryExecutor {
+public:
+    PartitionedAggExecutor(const std::string &query,
+                           const std::string &where,
+                           const std::string &table,
+                           const std::vector<NTL::ZZ> &moduli,
+                           unsigned int partitions,
+                           const ReturnMeta &rmeta)
+        : query(query), where(where), table(table), moduli(moduli),
+          partitions(partitions), rmeta(rmeta) {}
+    ~PartitionedAggExecutor() {}
+    std::pair<ResultType, AbstractAnything *>
+        nextImpl(const ResType &res, const NextParams &nparams);
+
+private:
+    std::string wholeQuery() const;
+    std::vector<std::string> partQueries(ConnectPool *const pool) const;
+
+    // > the query without it's WHERE clause, which is kept apart so each
+    //   part can add it's key range
+    const std::string query;
+    const std::string where;
+    const std::string table;
+    // > n^2 for each column
+    const std::vector<NTL::ZZ> moduli;
+    const unsigned int partitions;
+    const ReturnMeta rmeta;
+
+    AssignOnce<bool> in_trx;
+};
+
 class SpecialUpdateExecutor : public AbstractQueryExecutor {
     const std::string original_query;
     const std::string plain_table;
@@ -94,6 +135,17 @@ private:
     bool usesEmbedded() const {return true;}
 };
 
+// > reports the plan cache and HOM key and randomness pool counters;
+//   SET @cryptdb='stats'
+class StatsDirectiveExecutor : public AbstractQueryExecutor {
+public:
+    StatsDirectiveExecutor() {}
+    ~StatsDirectiveExecutor() {}
+
+    std::pair<ResultType, AbstractAnything *>
+        nextImpl(const ResType &res, const NextParams &nparams);
+};
+
 class ShowTablesExecutor : public AbstractQueryExecutor {
     const std::vector<std::unique_ptr<Delta> > deltas;
 
@@ -25,13 +25,6 @@ MetaData::Table::embeddedQueryCompletion()
            "embeddedQueryCompletion";
 }
 
-std::string
-MetaData::Table::staleness()
-{
-    return DB::embeddedDB() + "." + Internal::getPrefix() +
-           "staleness";
-}
-
 std::string
 MetaData::Table::showDirective()
 {
@@ -46,6 +39,19 @@ MetaData::Table::remoteQueryCompletion()
            "remoteQueryCompletion";
 }
 
+std::string
+MetaData::Table::mopeRelabelCompletion()
+{
+    return DB::remoteDB() + "." + Internal::getPrefix() +
+           "mopeRelabelCompletion";
+}
+
+std::string
+MetaData::Table::mopeRelabelMap()
+{
+    return DB::remoteDB() + "." + Internal::getPrefix() + "mopeRelabelMap";
+}
+
 std::string
 MetaData::Proc::activeTransactionP()
 {
@@ -133,14 +139,6 @@ MetaData::initialize(const std::unique_ptr<Connect> &conn,
         RETURN_FALSE_IF_FALSE(e_conn->execute(create_embedded_completion));
     }
 
-    const std::string create_staleness =
-        " CREATE TABLE IF NOT EXISTS " + Table::staleness() +
-        "   (cache_id BIGINT UNIQUE NOT NULL,"
-        "    stale BOOLEAN NOT NULL,"
-        "    id SERIAL PRIMARY KEY)"
-        " ENGINE=InnoDB;";
-    RETURN_FALSE_IF_FALSE(e_conn->execute(create_staleness));
-
     const std::string create_show_directive =
         " CREATE TABLE IF NOT EXISTS " + Table::showDirective() +
         "   (_database VARCHAR(500) NOT NULL,"
@@ -165,6 +163,16 @@ MetaData::initialize(const std::unique_ptr<Connect> &conn,
         " ENGINE=InnoDB;";
     RETURN_FALSE_IF_FALSE(conn->execute(create_remote_completion));
 
+    // > the mutable OPE relabel batches that have been applied to the
+    //   columns; 'tree' names the journal
+    const std::string create_mope_completion =
+        " CREATE TABLE IF NOT EXISTS " + Table::mopeRelabelCompletion() +
+        "   (tree VARCHAR(64) NOT NULL,"
+        "    seq BIGINT UNSIGNED NOT NULL,"
+        "    PRIMARY KEY (tree, seq))"
+        " ENGINE=InnoDB;";
+    RETURN_FALSE_IF_FALSE(conn->execute(create_mope_completion));
+
     initialized = true;
     return true;
 }
@@ -16,9 +16,11 @@ namespace MetaData {
         std::string metaObject();
         std::string bleedingMetaObject();
         std::string embeddedQueryCompletion();
-        std::string staleness();
         std::string showDirective();
         std::string remoteQueryCompletion();
+        std::string mopeRelabelCompletion();
+        // > a temporary table; one per connection
+        std::string mopeRelabelMap();
     };
 
     namespace Proc {
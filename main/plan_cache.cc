@@ -0,0 +1,709 @@
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+#include <ctype.h>
+#include <string.h>
+
+#include <main/plan_cache.hh>
+#include <main/rewrite_util.hh>
+#include <main/dml_handler.hh>
+#include <main/macro_util.hh>
+#include <parser/embedmysql.hh>
+#include <parser/lex_util.hh>
+#include <util/scoped_lock.hh>
+#include <util/util.hh>
+
+// > the largest number of literals we template in one query
+static const size_t MAX_LITERALS = 1 << 16;
+
+// > keeps sentinels from colliding with constants the rewrite makes up
+static uint64_t
+sentinelNonce()
+{
+    static const uint64_t nonce = randomValue();
+    return nonce;
+}
+
+static const std::string &
+nonceText()
+{
+    static const std::string text =
+        [] ()
+        {
+            std::ostringstream s;
+            s << std::hex << std::setw(16) << std::setfill('0')
+              << sentinelNonce();
+            return s.str();
+        }();
+    return text;
+}
+
+std::string
+QueryShape::intSentinel(size_t index)
+{
+    // > stays below 2^63 so the parser gives us an Item_int
+    const uint64_t base =
+        (1ULL << 62) + ((sentinelNonce() & 0xFFFFFFFF) << 20);
+    return std::to_string(base + index);
+}
+
+std::string
+QueryShape::stringSentinel(size_t index)
+{
+    return "cdblit" + nonceText() + "_" + std::to_string(index) + "_";
+}
+
+static std::string
+slotMarker(size_t index)
+{
+    return "cdbslot" + nonceText() + "_" + std::to_string(index) + "_";
+}
+
+std::string
+QueryShape::sentinelQuery() const
+{
+    std::string out;
+    size_t position = 0;
+    for (size_t i = 0; i < literals.size(); ++i) {
+        const Literal &literal = literals[i];
+        out += query.substr(position, literal.offset - position);
+        if (LiteralType::INT == literal.type) {
+            out += intSentinel(i);
+        } else {
+            out += "'" + stringSentinel(i) + "'";
+        }
+        position = literal.offset + literal.text.length();
+    }
+    out += query.substr(position);
+
+    return out;
+}
+
+static bool
+isIdentChar(char c)
+{
+    return isalnum(static_cast<unsigned char>(c)) || '_' == c || '$' == c;
+}
+
+// > the previous non whitespace character
+static char
+previousChar(const std::string &query, size_t i)
+{
+    while (i > 0) {
+        const char c = query[--i];
+        if (!isspace(static_cast<unsigned char>(c))) {
+            return c;
+        }
+    }
+
+    return '\0';
+}
+
+bool
+normalizeQuery(const std::string &query, QueryShape *const shape)
+{
+    shape->query = query;
+    shape->text.clear();
+    shape->literals.clear();
+
+    // > only DML is templated
+    const size_t start = query.find_first_not_of(" \t\r\n");
+    if (std::string::npos == start) {
+        return false;
+    }
+    size_t verb_end = start;
+    while (verb_end < query.size()
+           && isalpha(static_cast<unsigned char>(query[verb_end]))) {
+        ++verb_end;
+    }
+    const std::string &verb =
+        toLowerCase(query.substr(start, verb_end - start));
+    if ("select" != verb && "insert" != verb && "update" != verb
+        && "delete" != verb) {
+        return false;
+    }
+
+    bool after_string = false;
+    const size_t n = query.size();
+    for (size_t i = start; i < n;) {
+        const char c = query[i];
+        if (isspace(static_cast<unsigned char>(c))) {
+            if (!shape->text.empty() && ' ' != shape->text.back()) {
+                shape->text += ' ';
+            }
+            ++i;
+            continue;
+        }
+
+        // > comments can carry version specific sql; placeholders are
+        //   not valid in a client query
+        if ('#' == c || '?' == c
+            || ('-' == c && i + 1 < n && '-' == query[i + 1])
+            || ('/' == c && i + 1 < n && '*' == query[i + 1])) {
+            return false;
+        }
+
+        if ('`' == c) {
+            size_t j = i + 1;
+            for (;; ++j) {
+                if (j >= n) {
+                    return false;
+                }
+                if ('`' == query[j]) {
+                    if (j + 1 < n && '`' == query[j + 1]) {
+                        ++j;
+                        continue;
+                    }
+                    break;
+                }
+            }
+            shape->text += query.substr(i, j + 1 - i);
+            after_string = false;
+            i = j + 1;
+            continue;
+        }
+
+        if ('\'' == c || '"' == c) {
+            // > adjacent strings are concatenated by the parser
+            if (true == after_string) {
+                return false;
+            }
+            // > hex and bit strings, X'...' and B'...'
+            if (i > 0 && strchr("xXbB", query[i - 1])
+                && (i < 2 || !isIdentChar(query[i - 2]))) {
+                return false;
+            }
+
+            size_t j = i + 1;
+            for (;; ++j) {
+                if (j >= n) {
+                    return false;
+                }
+                if ('\\' == query[j]) {
+                    ++j;
+                    continue;
+                }
+                if (c == query[j]) {
+                    if (j + 1 < n && c == query[j + 1]) {
+                        ++j;
+                        continue;
+                    }
+                    break;
+                }
+            }
+            shape->literals.push_back(
+                {QueryShape::LiteralType::STRING,
+                 query.substr(i, j + 1 - i), i});
+            shape->text += '?';
+            after_string = true;
+            i = j + 1;
+            continue;
+        }
+
+        if (isdigit(static_cast<unsigned char>(c))
+            && (i == 0 || (!isIdentChar(query[i - 1])
+                           && '.' != query[i - 1]))) {
+            size_t j = i;
+            while (j < n && isdigit(static_cast<unsigned char>(query[j]))) {
+                ++j;
+            }
+            // > decimals, floats, hex numbers and identifiers that begin
+            //   with digits; negative numbers are folded by the parser
+            if ((j < n && (isIdentChar(query[j]) || '.' == query[j]))
+                || j - i > 18
+                || '-' == previousChar(query, i)
+                || '+' == previousChar(query, i)) {
+                return false;
+            }
+            shape->literals.push_back(
+                {QueryShape::LiteralType::INT, query.substr(i, j - i), i});
+            shape->text += '?';
+            after_string = false;
+            i = j;
+            continue;
+        }
+
+        shape->text += c;
+        after_string = false;
+        ++i;
+    }
+
+    return shape->literals.size() <= MAX_LITERALS;
+}
+
+// > the value of a string literal as the parser would see it
+static std::string
+unescapeLiteral(const std::string &text)
+{
+    assert(text.size() >= 2);
+    const char quote = text[0];
+    std::string out;
+    for (size_t i = 1; i < text.size() - 1; ++i) {
+        const char c = text[i];
+        if ('\\' == c) {
+            const char e = text[++i];
+            switch (e) {
+                case '0': out += '\0'; break;
+                case 'b': out += '\b'; break;
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'Z': out += '\032'; break;
+                // > kept for LIKE patterns
+                case '%': case '_': out += '\\'; out += e; break;
+                default: out += e; break;
+            }
+        } else if (quote == c) {
+            // > doubled quote
+            out += c;
+            ++i;
+        } else {
+            out += c;
+        }
+    }
+
+    return out;
+}
+
+static std::string
+renderItem(const Item &i)
+{
+    std::ostringstream s;
+    s << i;
+    return s.str();
+}
+
+static std::string
+renderText(const PlanText &text, const std::vector<std::string> &slots)
+{
+    assert(text.pieces.size() == text.slots.size() + 1);
+
+    std::string out = text.pieces[0];
+    for (size_t i = 0; i < text.slots.size(); ++i) {
+        out += slots.at(text.slots[i]);
+        out += text.pieces[i + 1];
+    }
+
+    return out;
+}
+
+QueryRewrite
+QueryPlan::instantiate(const QueryShape &shape, const Analysis &a) const
+{
+    assert(this->builtFor(a.getSchema()));
+
+    // > the Items we encrypt need a THD to be allocated against
+    embedded_thd thd;
+
+    const std::vector<QueryShape::Literal> &literals = shape.getLiterals();
+    std::vector<Item *> items;
+    for (const auto &it : literals) {
+        if (QueryShape::LiteralType::INT == it.type) {
+            items.push_back(new (current_thd->mem_root)
+                                Item_int(static_cast<longlong>(
+                                    strtoll(it.text.c_str(), NULL, 10))));
+        } else {
+            items.push_back(make_item_string(unescapeLiteral(it.text)));
+        }
+    }
+
+    std::vector<uint64_t> salts;
+    for (unsigned int i = 0; i < this->salt_groups; ++i) {
+        salts.push_back(randomValue());
+    }
+
+    // > the values a multi-row INSERT puts in one column are encrypted
+    //   together; OPE shares its tree walk between them
+    std::map<std::pair<const OnionMeta *, onion>, std::vector<size_t> >
+        batches;
+    for (size_t i = 0; i < this->slots.size(); ++i) {
+        const PlanSlot &slot = this->slots[i];
+        if (PlanSlot::Kind::ENCRYPTED == slot.kind) {
+            batches[std::make_pair(slot.om, slot.o)].push_back(i);
+        }
+    }
+
+    std::vector<const Item *> encrypted(this->slots.size(), NULL);
+    for (const auto &it : batches) {
+        const std::vector<size_t> &indexes = it.second;
+        std::vector<const Item *> ptexts;
+        std::vector<uint64_t> IVs;
+        for (auto i : indexes) {
+            const PlanSlot &slot = this->slots[i];
+            ptexts.push_back(items.at(slot.literal));
+            IVs.push_back(slot.salt_group < 0 ? slot.IV
+                                              : salts.at(slot.salt_group));
+        }
+
+        if (1 == indexes.size()) {
+            encrypted[indexes[0]] =
+                encrypt_item_layers(*ptexts[0], it.first.second,
+                                    *it.first.first, a, IVs[0]);
+            continue;
+        }
+
+        const std::vector<Item *> &encs =
+            encrypt_items_layers(ptexts, it.first.second, *it.first.first,
+                                 a, IVs);
+        for (size_t j = 0; j < indexes.size(); ++j) {
+            encrypted[indexes[j]] = encs[j];
+        }
+    }
+
+    std::vector<std::string> rendered;
+    for (size_t i = 0; i < this->slots.size(); ++i) {
+        const PlanSlot &it = this->slots[i];
+        switch (it.kind) {
+            case PlanSlot::Kind::ENCRYPTED: {
+                assert(encrypted[i]);
+                rendered.push_back(renderItem(*encrypted[i]));
+                break;
+            }
+            case PlanSlot::Kind::SALT: {
+                const Item *const salt =
+                    new (current_thd->mem_root)
+                        Item_int(static_cast<ulonglong>(
+                                    salts.at(it.salt_group)));
+                rendered.push_back(renderItem(*salt));
+                break;
+            }
+            case PlanSlot::Kind::LITERAL: {
+                rendered.push_back(literals.at(it.literal).text);
+                break;
+            }
+            default:
+                assert(false);
+        }
+    }
+
+    ReturnMeta rmeta;
+    for (const auto &it : this->rmeta.rfmeta) {
+        const auto &name = this->names.find(it.first);
+        if (this->names.end() == name) {
+            rmeta.rfmeta.insert(it);
+            continue;
+        }
+
+        const ReturnField &rf = it.second;
+        rmeta.rfmeta.insert(
+            std::make_pair(it.first,
+                           ReturnField(rf.getIsSalt(),
+                                       renderText(name->second, rendered),
+                                       rf.getOLK(),
+                                       rf.getSaltPosition())));
+    }
+
+    const std::string &query = renderText(this->query, rendered);
+    return QueryRewrite(true, rmeta, this->kill_zone,
+                        new DMLQueryExecutor(query, rmeta));
+}
+
+PlanRecorder::PlanRecorder(const QueryShape &shape)
+    : shape(shape), salt_groups(0), poisoned(false)
+{
+    const std::vector<QueryShape::Literal> &literals = shape.getLiterals();
+    for (size_t i = 0; i < literals.size(); ++i) {
+        if (QueryShape::LiteralType::INT == literals[i].type) {
+            sentinels[QueryShape::intSentinel(i)] = i;
+        } else {
+            sentinels[QueryShape::stringSentinel(i)] = i;
+        }
+    }
+}
+
+const QueryShape::Literal *
+PlanRecorder::findLiteral(const Item &i, size_t *const index)
+{
+    if (Item::Type::INT_ITEM != i.type()
+        && Item::Type::STRING_ITEM != i.type()) {
+        return NULL;
+    }
+
+    const std::string &value = ItemToString(i);
+    const auto &it = this->sentinels.find(value);
+    if (this->sentinels.end() == it) {
+        if (std::string::npos != value.find(nonceText())) {
+            this->poison("constant derived from a literal");
+        }
+        return NULL;
+    }
+
+    const QueryShape::Literal &literal =
+        this->shape.getLiterals().at(it->second);
+    const Item::Type expected =
+        QueryShape::LiteralType::INT == literal.type ? Item::Type::INT_ITEM
+                                                     : Item::Type::STRING_ITEM;
+    if (expected != i.type()) {
+        this->poison("literal changed type");
+        return NULL;
+    }
+
+    *index = it->second;
+    return &literal;
+}
+
+Item *
+PlanRecorder::addSlot(const PlanSlot &slot)
+{
+    this->slots.push_back(slot);
+    return make_item_string(slotMarker(this->slots.size() - 1));
+}
+
+Item *
+PlanRecorder::encrypt(const Item &i, onion o, const OnionMeta &om,
+                      uint64_t IV)
+{
+    size_t index;
+    if (NULL == this->findLiteral(i, &index)) {
+        return NULL;
+    }
+
+    return this->addSlot({PlanSlot::Kind::ENCRYPTED, index, o, &om, IV, -1});
+}
+
+bool
+PlanRecorder::encryptAllOnions(const Item &i, const FieldMeta &fm,
+                               std::vector<Item *> *const l)
+{
+    size_t index;
+    if (NULL == this->findLiteral(i, &index)) {
+        // > the value would be baked into the plan with it's salt
+        if (fm.getHasSalt()) {
+            this->poison("salted constant that is not a literal");
+        }
+        return false;
+    }
+
+    const int group = fm.getHasSalt() ? this->salt_groups++ : -1;
+    for (const auto &it : fm.orderedOnionMetas()) {
+        const onion o = it.first->getValue();
+        l->push_back(this->addSlot({PlanSlot::Kind::ENCRYPTED, index, o,
+                                    it.second, 0, group}));
+    }
+    if (fm.getHasSalt()) {
+        l->push_back(this->addSlot({PlanSlot::Kind::SALT, 0, oINVALID,
+                                    NULL, 0, group}));
+    }
+
+    return true;
+}
+
+Item *
+PlanRecorder::salt()
+{
+    return this->addSlot({PlanSlot::Kind::SALT, 0, oINVALID, NULL, 0,
+                          static_cast<int>(this->salt_groups++)});
+}
+
+void
+PlanRecorder::poison(const std::string &why)
+{
+    LOG(cdb_v) << "query plan can not be cached: " << why;
+    this->poisoned = true;
+}
+
+struct Needle {
+    std::string text;
+    size_t slot;
+    // > must not be a part of a longer token
+    bool whole_token;
+};
+
+// > split 'text' at every needle; false if anything that looks like one
+//   of our sentinels or markers is left over
+static bool
+splitText(const std::string &text, const std::vector<Needle> &needles,
+          PlanText *const out, std::vector<unsigned int> *const counts)
+{
+    std::vector<std::pair<size_t, const Needle *> > found;
+    for (const auto &it : needles) {
+        for (size_t pos = text.find(it.text); std::string::npos != pos;
+             pos = text.find(it.text, pos + 1)) {
+            const size_t end = pos + it.text.length();
+            if (it.whole_token
+                && ((pos > 0 && (isIdentChar(text[pos - 1])
+                                 || '.' == text[pos - 1]))
+                    || (end < text.size() && (isIdentChar(text[end])
+                                              || '.' == text[end])))) {
+                continue;
+            }
+            found.push_back(std::make_pair(pos, &it));
+            ++counts->at(it.slot);
+        }
+    }
+    std::sort(found.begin(), found.end(),
+              [] (const std::pair<size_t, const Needle *> &a,
+                  const std::pair<size_t, const Needle *> &b)
+              {
+                  return a.first < b.first;
+              });
+
+    size_t position = 0;
+    for (const auto &it : found) {
+        if (it.first < position) {
+            return false;
+        }
+        out->pieces.push_back(text.substr(position, it.first - position));
+        out->slots.push_back(it.second->slot);
+        position = it.first + it.second->text.length();
+    }
+    out->pieces.push_back(text.substr(position));
+
+    for (const auto &it : out->pieces) {
+        if (std::string::npos != it.find(nonceText())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::shared_ptr<const QueryPlan>
+PlanRecorder::finish(const std::string &rewritten, const ReturnMeta &rmeta,
+                     const KillZone &kill_zone, const SchemaInfo &schema)
+    const
+{
+    if (true == this->poisoned) {
+        return std::shared_ptr<const QueryPlan>();
+    }
+
+    // > literals that pass through unencrypted get a slot of their own
+    std::vector<PlanSlot> slots = this->slots;
+    std::vector<Needle> literal_needles;
+    const std::vector<QueryShape::Literal> &literals =
+        this->shape.getLiterals();
+    for (size_t i = 0; i < literals.size(); ++i) {
+        const size_t slot = slots.size();
+        slots.push_back({PlanSlot::Kind::LITERAL, i, oINVALID, NULL, 0, -1});
+        if (QueryShape::LiteralType::INT == literals[i].type) {
+            literal_needles.push_back({QueryShape::intSentinel(i), slot,
+                                       true});
+        } else {
+            literal_needles.push_back(
+                {"'" + QueryShape::stringSentinel(i) + "'", slot, false});
+        }
+    }
+
+    std::vector<Needle> query_needles = literal_needles;
+    for (size_t i = 0; i < this->slots.size(); ++i) {
+        query_needles.push_back({"'" + slotMarker(i) + "'", i, false});
+    }
+
+    std::vector<unsigned int> counts(slots.size(), 0);
+    PlanText query;
+    if (false == splitText(rewritten, query_needles, &query, &counts)) {
+        LOG(cdb_v) << "query plan can not be cached: unrecognized slots";
+        return std::shared_ptr<const QueryPlan>();
+    }
+
+    // > every encryption must land in the query exactly once and every
+    //   literal must be used; else the rewrite did something with the
+    //   literal we can not repeat
+    std::vector<bool> used(literals.size(), false);
+    for (size_t i = 0; i < slots.size(); ++i) {
+        if (PlanSlot::Kind::LITERAL == slots[i].kind) {
+            if (counts[i] > 0) {
+                used[slots[i].literal] = true;
+            }
+            continue;
+        }
+        if (1 != counts[i]) {
+            LOG(cdb_v) << "query plan can not be cached: slot " << i
+                       << " used " << counts[i] << " times";
+            return std::shared_ptr<const QueryPlan>();
+        }
+        if (PlanSlot::Kind::ENCRYPTED == slots[i].kind) {
+            used[slots[i].literal] = true;
+        }
+    }
+    if (used.end() != std::find(used.begin(), used.end(), false)) {
+        LOG(cdb_v) << "query plan can not be cached: unused literal";
+        return std::shared_ptr<const QueryPlan>();
+    }
+
+    // > result names are taken from the text of the query
+    std::map<int, PlanText> names;
+    for (const auto &it : rmeta.rfmeta) {
+        const std::string &name = it.second.fieldCalled();
+        PlanText name_text;
+        if (false == splitText(name, literal_needles, &name_text, &counts)) {
+            LOG(cdb_v) << "query plan can not be cached: result name";
+            return std::shared_ptr<const QueryPlan>();
+        }
+        if (name_text.slots.size() > 0) {
+            names[it.first] = name_text;
+        }
+    }
+
+    return std::shared_ptr<const QueryPlan>(
+        new QueryPlan(&schema, std::move(slots), this->salt_groups,
+                      std::move(query), rmeta, std::move(names),
+                      kill_zone));
+}
+
+PlanCache::PlanCache(size_t capacity)
+    : capacity(capacity), hits(0), misses(0), bypasses(0), hit_usec(0),
+      miss_usec(0), bypass_usec(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+std::string
+PlanCache::key(const std::string &default_db, const SchemaInfo &schema,
+               const QueryShape &shape)
+{
+    return default_db + '\0' + std::to_string(schema.getVersion()) + '\0'
+           + shape.getText();
+}
+
+std::shared_ptr<const QueryPlan>
+PlanCache::lookup(const std::string &key, bool *const known)
+{
+    scoped_lock l(&this->lock);
+    const auto &it = this->entries.find(key);
+    if (this->entries.end() == it) {
+        *known = false;
+        return std::shared_ptr<const QueryPlan>();
+    }
+
+    this->lru.splice(this->lru.begin(), this->lru, it->second.second);
+    *known = true;
+    return it->second.first;
+}
+
+void
+PlanCache::insert(const std::string &key,
+                  const std::shared_ptr<const QueryPlan> &plan)
+{
+    scoped_lock l(&this->lock);
+    // > another client may have built the same plan
+    const auto &it = this->entries.find(key);
+    if (this->entries.end() != it) {
+        it->second.first = plan;
+        this->lru.splice(this->lru.begin(), this->lru, it->second.second);
+        return;
+    }
+
+    // > plans for old schema versions are never hit again and age out
+    while (this->entries.size() >= this->capacity) {
+        this->entries.erase(this->lru.back());
+        this->lru.pop_back();
+    }
+
+    this->lru.push_front(key);
+    this->entries[key] = std::make_pair(plan, this->lru.begin());
+}
+
+PlanCache::Stats
+PlanCache::getStats() const
+{
+    size_t entries;
+    {
+        scoped_lock l(&this->lock);
+        entries = this->entries.size();
+    }
+
+    return Stats{hits.load(), misses.load(), bypasses.load(),
+                 hit_usec.load(), miss_usec.load(), bypass_usec.load(),
+                 entries};
+}
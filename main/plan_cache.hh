@@ -0,0 +1,200 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <unordered_map>
+
+#include <pthread.h>
+
+#include <main/Analysis.hh>
+#include <main/rewrite_main.hh>
+
+/*
+ * Plan caching for DML.
+ *
+ * Applications issue the same statements over and over with different
+ * constants.  We take the integer and string literals out of a query to
+ * get it's shape; the first time we see a shape we rewrite it with
+ * sentinels in place of the literals and keep the rewritten text with a
+ * slot wherever a literal ends up.  Later queries with the same shape,
+ * default database and schema version only encrypt their literals into
+ * the slots; they are not parsed and they are not analyzed.
+ */
+
+class QueryShape {
+public:
+    enum class LiteralType {INT, STRING};
+    struct Literal {
+        LiteralType type;
+        // > as the client wrote it, quotes included
+        std::string text;
+        size_t offset;
+    };
+
+    QueryShape() {}
+
+    const std::string &getQuery() const {return query;}
+    const std::string &getText() const {return text;}
+    const std::vector<Literal> &getLiterals() const {return literals;}
+    // > the client query with every literal replaced by it's sentinel
+    std::string sentinelQuery() const;
+
+    static std::string intSentinel(size_t index);
+    static std::string stringSentinel(size_t index);
+
+    friend bool normalizeQuery(const std::string &query,
+                               QueryShape *const shape);
+
+private:
+    std::string query;
+    // > the query with it's literals replaced by '?' and whitespace
+    //   collapsed
+    std::string text;
+    std::vector<Literal> literals;
+};
+
+// > false if the query is not DML or has constructs we do not template;
+//   the query is then rewritten as usual
+bool
+normalizeQuery(const std::string &query, QueryShape *const shape);
+
+struct PlanSlot {
+    enum class Kind {ENCRYPTED, SALT, LITERAL};
+
+    Kind kind;
+    size_t literal;
+    onion o;
+    const OnionMeta *om;
+    uint64_t IV;
+    // > the encryptions of one inserted value share a fresh salt
+    int salt_group;
+};
+
+// > text with a slot between each pair of pieces
+struct PlanText {
+    std::vector<std::string> pieces;
+    std::vector<size_t> slots;
+};
+
+class QueryPlan {
+public:
+    QueryPlan(const SchemaInfo *schema, std::vector<PlanSlot> &&slots,
+              unsigned int salt_groups, PlanText &&query,
+              const ReturnMeta &rmeta, std::map<int, PlanText> &&names,
+              const KillZone &kill_zone)
+        : schema(schema), slots(std::move(slots)),
+          salt_groups(salt_groups), query(std::move(query)),
+          rmeta(rmeta), names(std::move(names)), kill_zone(kill_zone) {}
+
+    // > the slots point into the snapshot the plan was built against; a
+    //   client using that snapshot keeps them alive
+    bool builtFor(const SchemaInfo &schema) const
+        {return this->schema == &schema;}
+    QueryRewrite instantiate(const QueryShape &shape,
+                             const Analysis &a) const;
+
+private:
+    const SchemaInfo *const schema;
+    const std::vector<PlanSlot> slots;
+    const unsigned int salt_groups;
+    const PlanText query;
+    const ReturnMeta rmeta;
+    // > result names that contain one of our literals
+    const std::map<int, PlanText> names;
+    const KillZone kill_zone;
+};
+
+// > handed to the Analysis while a plan is built; the rewrite handlers
+//   ask it to stand in for the encryption of the client's literals
+class PlanRecorder {
+    PlanRecorder(const PlanRecorder &other) = delete;
+    PlanRecorder &operator=(const PlanRecorder &rhs) = delete;
+
+public:
+    PlanRecorder(const QueryShape &shape);
+    ~PlanRecorder() {}
+
+    // > NULL if 'i' is not one of the client's literals
+    Item *encrypt(const Item &i, onion o, const OnionMeta &om,
+                  uint64_t IV);
+    // > false if 'i' is not one of the client's literals
+    bool encryptAllOnions(const Item &i, const FieldMeta &fm,
+                          std::vector<Item *> *const l);
+    // > a fresh salt for a value that is not one of the literals
+    Item *salt();
+    // > the rewrite depends on something we can not put in a slot
+    void poison(const std::string &why);
+
+    std::shared_ptr<const QueryPlan>
+        finish(const std::string &rewritten, const ReturnMeta &rmeta,
+               const KillZone &kill_zone, const SchemaInfo &schema) const;
+
+private:
+    const QueryShape &shape;
+    std::map<std::string, size_t> sentinels;
+    std::vector<PlanSlot> slots;
+    unsigned int salt_groups;
+    bool poisoned;
+
+    // > NULL if 'i' is not a literal; poisons if it is derived from one
+    const QueryShape::Literal *findLiteral(const Item &i, size_t *const index);
+    Item *addSlot(const PlanSlot &slot);
+};
+
+// > shared by all clients
+class PlanCache {
+    PlanCache(const PlanCache &other) = delete;
+    PlanCache &operator=(const PlanCache &rhs) = delete;
+
+public:
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t bypasses;
+        uint64_t hit_usec;
+        uint64_t miss_usec;
+        uint64_t bypass_usec;
+        size_t entries;
+    };
+
+    explicit PlanCache(size_t capacity);
+    ~PlanCache() {pthread_mutex_destroy(&lock);}
+
+    static std::string key(const std::string &default_db,
+                           const SchemaInfo &schema,
+                           const QueryShape &shape);
+    // > 'known' is false for a shape we have not seen; a known shape
+    //   without a plan can not be cached
+    std::shared_ptr<const QueryPlan>
+        lookup(const std::string &key, bool *const known);
+    void insert(const std::string &key,
+                const std::shared_ptr<const QueryPlan> &plan);
+
+    // > hits are served from a plan; misses build one; bypasses are
+    //   rewritten as usual
+    void recordHit(uint64_t usec) {++hits; hit_usec += usec;}
+    void recordMiss(uint64_t usec) {++misses; miss_usec += usec;}
+    void recordBypass(uint64_t usec) {++bypasses; bypass_usec += usec;}
+    Stats getStats() const;
+
+private:
+    typedef std::pair<std::shared_ptr<const QueryPlan>,
+                      std::list<std::string>::iterator> Entry;
+
+    const size_t capacity;
+    mutable pthread_mutex_t lock;
+    // > most recently used first
+    std::list<std::string> lru;
+    std::unordered_map<std::string, Entry> entries;
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> bypasses;
+    std::atomic<uint64_t> hit_usec;
+    std::atomic<uint64_t> miss_usec;
+    std::atomic<uint64_t> bypass_usec;
+};
@@ -17,6 +17,7 @@
 #include <main/rewrite_main.hh>
 #include <main/rewrite_util.hh>
 #include <main/CryptoHandlers.hh>
+#include <main/plan_cache.hh>
 #include <util/cryptdb_log.hh>
 #include <util/enum_text.hh>
 #include <parser/lex_util.hh>
@@ -43,6 +44,12 @@ encrypt_item(const Item &i, const OLK &olk, Analysis &a)
     const auto it = a.salts.find(fm);
     const salt_type IV = (it == a.salts.end()) ? 0 : it->second;
     OnionMeta * const om = fm->getOnionMeta(o);
+    if (a.plan_recorder) {
+        Item *const slot = a.plan_recorder->encrypt(i, o, *om, IV);
+        if (slot) {
+            return slot;
+        }
+    }
     Item * const ret_i = encrypt_item_layers(i, o, *om, a, IV);
 
     return ret_i;
@@ -8,6 +8,8 @@
 #include <vector>
 #include <set>
 #include <list>
+#include <unordered_map>
+#include <atomic>
 #include <algorithm>
 #include <stdio.h>
 #include <typeinfo>
@@ -17,11 +19,14 @@
 #include <util/cryptdb_log.hh>
 #include <util/enum_text.hh>
 #include <util/yield.hpp>
+#include <util/parallel.hh>
+#include <util/scoped_lock.hh>
 #include <main/CryptoHandlers.hh>
 #include <parser/lex_util.hh>
 #include <main/sql_handler.hh>
 #include <main/dml_handler.hh>
 #include <main/ddl_handler.hh>
+#include <main/plan_cache.hh>
 #include <main/metadata_tables.hh>
 #include <main/macro_util.hh>
 
@@ -585,12 +590,89 @@ metaSanityCheck(const std::unique_ptr<Connect> &e_conn)
     return true;
 }
 
+struct MetaObjectRow {
+    MetaObjectRow(const std::string &serial_object,
+                  const std::string &serial_key, unsigned int id)
+        : serial_object(serial_object), serial_key(serial_key), id(id) {}
+
+    const std::string serial_object;
+    const std::string serial_key;
+    const unsigned int id;
+};
+
+typedef std::unordered_map<unsigned int, std::vector<MetaObjectRow> >
+    MetaObjectIndex;
+
+// > the whole metaObject table in one scan, indexed by parent_id
+static MetaObjectIndex
+fetchMetaObjects(const std::unique_ptr<Connect> &e_conn,
+                 uint64_t *const count)
+{
+    const std::string table_name = MetaData::Table::metaObject();
+    const std::string serials_query =
+        " SELECT " + table_name + ".serial_object,"
+        "        " + table_name + ".serial_key,"
+        "        " + table_name + ".id,"
+        "        " + table_name + ".parent_id"
+        " FROM " + table_name + ";";
+    std::unique_ptr<DBResult> db_res;
+    TEST_TextMessageError(e_conn->execute(serials_query, &db_res),
+                          "failed to fetch metadata objects");
+
+    MetaObjectIndex index;
+    *count = 0;
+    MYSQL_ROW row;
+    while ((row = mysql_fetch_row(db_res->n))) {
+        unsigned long * const l = mysql_fetch_lengths(db_res->n);
+        assert(l != NULL);
+
+        const unsigned int id = atoi(std::string(row[2], l[2]).c_str());
+        const unsigned int parent_id =
+            atoi(std::string(row[3], l[3]).c_str());
+        index[parent_id].push_back(
+            MetaObjectRow(std::string(row[0], l[0]),
+                          std::string(row[1], l[1]), id));
+        ++*count;
+    }
+
+    return index;
+}
+
+static std::vector<DBMeta *>
+loadChildren(DBMeta *const parent, const MetaObjectIndex &index)
+{
+    std::vector<DBMeta *> out_vec;
+    const auto &it = index.find(parent->getDatabaseID());
+    if (index.end() == it) {
+        return out_vec;
+    }
+
+    for (const auto &row : it->second) {
+        out_vec.push_back(
+            parent->deserializeChild(row.serial_key, row.serial_object,
+                                     row.id));
+    }
+
+    return out_vec;
+}
+
+static void
+loadDescendants(DBMeta *const parent, const MetaObjectIndex &index)
+{
+    for (auto it : loadChildren(parent, index)) {
+        loadDescendants(it, index);
+    }
+}
+
 // This function will not build all of our tables when it is run
 // on an empty database.  If you don't have a parent, your table won't be
 // built.  We probably want to seperate our database logic into 3 parts.
 //  1> Schema buildling (CREATE TABLE IF NOT EXISTS...)
 //  2> INSERTing
 //  3> SELECTing
+// > the metadata is read with one query and the tree is built from
+//   memory; each table's fields, onions and EncLayers are independent
+//   of the other tables so they are deserialized in parallel
 std::unique_ptr<SchemaInfo>
 loadSchemaInfo(const std::unique_ptr<Connect> &conn,
                const std::unique_ptr<Connect> &e_conn)
@@ -598,23 +680,42 @@ loadSchemaInfo(const std::unique_ptr<Connect> &conn,
     // Must be done before loading the children.
     assert(deltaSanityCheck(conn, e_conn));
 
-    std::unique_ptr<SchemaInfo>schema(new SchemaInfo());
-    // Recursively rebuild the AbstractMeta<Whatever> and it's children.
-    std::function<DBMeta *(DBMeta *const)> loadChildren =
-        [&loadChildren, &e_conn](DBMeta *const parent) {
-            auto kids = parent->fetchChildren(e_conn);
-            for (auto it : kids) {
-                loadChildren(it);
-            }
+    Timer t;
+    uint64_t count;
+    const MetaObjectIndex &index = fetchMetaObjects(e_conn, &count);
+    const double fetch_ms = t.lap_ms();
 
-            return parent;  /* lambda */
-        };
-
-    loadChildren(schema.get());
+    std::unique_ptr<SchemaInfo>schema(new SchemaInfo());
+    std::vector<DBMeta *> tables;
+    for (auto it : loadChildren(schema.get(), index)) {
+        const std::vector<DBMeta *> &kids = loadChildren(it, index);
+        tables.insert(tables.end(), kids.begin(), kids.end());
+    }
+    parallelFor(tables.size(),
+                [&tables, &index] (size_t i)
+                {
+                    loadDescendants(tables[i], index);
+                });
+    const double build_ms = t.lap_ms();
 
     assert(sanityCheck(*schema.get()));
     assert(metaSanityCheck(e_conn));
     assert(tablesSanityCheck(*schema.get(), e_conn, conn));
+    const double check_ms = t.lap_ms();
+
+    // > the first load happens when the proxy starts
+    static std::atomic<bool> first_load(true);
+    const std::string &report =
+        "loaded schema: " + std::to_string(count) + " objects, " +
+        std::to_string(tables.size()) + " tables; " +
+        "fetch " + std::to_string(fetch_ms) + " ms, " +
+        "build " + std::to_string(build_ms) + " ms, " +
+        "sanity checks " + std::to_string(check_ms) + " ms";
+    if (first_load.exchange(false)) {
+        std::cerr << report << std::endl;
+    } else {
+        LOG(cdb_v) << report;
+    }
 
     return std::move(schema);
 }
@@ -743,14 +844,16 @@ buildTypeTextTranslator()
     {
         "PLAIN_ONION_LAYOUT", "NUM_ONION_LAYOUT",
         "BEST_EFFORT_NUM_ONION_LAYOUT", "STR_ONION_LAYOUT",
-        "BEST_EFFORT_STR_ONION_LAYOUT"
-        
+        "BEST_EFFORT_STR_ONION_LAYOUT", "MOPE_NUM_ONION_LAYOUT",
+        "BEST_EFFORT_MOPE_NUM_ONION_LAYOUT"
+
     };
     const std::vector<onionlayout> onion_layouts
     {
         PLAIN_ONION_LAYOUT, NUM_ONION_LAYOUT,
         BEST_EFFORT_NUM_ONION_LAYOUT, STR_ONION_LAYOUT,
-        BEST_EFFORT_STR_ONION_LAYOUT
+        BEST_EFFORT_STR_ONION_LAYOUT, MOPE_NUM_ONION_LAYOUT,
+        BEST_EFFORT_MOPE_NUM_ONION_LAYOUT
     };
     RETURN_FALSE_IF_FALSE(onion_layout_strings.size() ==
                             onion_layouts.size());
@@ -999,7 +1102,7 @@ do_optimize_const_item(T *i, Analysis &a) {
     */
 }
 
-static Item *
+Item *
 decrypt_item_layers(const Item &i, const FieldMeta *const fm, onion o,
                     uint64_t IV)
 {
@@ -1366,6 +1469,8 @@ const std::unique_ptr<SQLDispatcher> Rewriter::dml_dispatcher =
     std::unique_ptr<SQLDispatcher>(buildDMLDispatcher());
 const std::unique_ptr<SQLDispatcher> Rewriter::ddl_dispatcher =
     std::unique_ptr<SQLDispatcher>(buildDDLDispatcher());
+// > plans for old schema versions stay until they age out
+PlanCache Rewriter::plan_cache(4096);
 
 // NOTE : This will probably choke on multidatabase queries.
 AbstractQueryExecutor *
@@ -1433,6 +1538,151 @@ Rewriter::dispatchOnLex(Analysis &a, const std::string &query)
     return NULL;
 }
 
+// > rows per INSERT into the relabel map
+static const size_t RELABEL_MAP_ROWS = 1000;
+
+// > one UPDATE joined to a map of the batch's (old, new) pairs, so no row
+//   moves twice; it does nothing once the batch is in the completion
+//   table
+static void
+relabelColumnQueries(const std::string &db, const std::string &table,
+                     const std::string &column,
+                     const MutableOPERelabels &batch,
+                     std::vector<std::string> *const queries)
+{
+    const std::string &relabel_map = MetaData::Table::mopeRelabelMap();
+    queries->push_back(" DELETE FROM " + relabel_map + ";");
+
+    const auto &relabels = batch.relabels;
+    for (size_t i = 0; i < relabels.size(); i += RELABEL_MAP_ROWS) {
+        const size_t end = std::min(relabels.size(), i + RELABEL_MAP_ROWS);
+        std::stringstream values;
+        for (size_t j = i; j < end; ++j) {
+            values << (j == i ? "" : ", ") << "(" << relabels[j].first
+                   << ", " << relabels[j].second << ")";
+        }
+        queries->push_back(" INSERT INTO " + relabel_map +
+                           "   (old_code, new_code) VALUES " + values.str() +
+                           ";");
+    }
+
+    queries->push_back(
+        " UPDATE " + quoteText(db) + "." + table + " AS t"
+        "   JOIN " + relabel_map + " AS m"
+        "     ON t." + column + " = m.old_code"
+        "    SET t." + column + " = m.new_code"
+        "  WHERE NOT EXISTS"
+        "   (SELECT 1 FROM " + MetaData::Table::mopeRelabelCompletion() +
+        "     WHERE tree = '" + batch.tree_name + "'"
+        "       AND seq = " + std::to_string(batch.seq) + ");");
+}
+
+// > the statements that move the rows of the columns in 'schema' to the
+//   new ciphertexts of the pending mutable OPE relabels, and the batches
+//   they apply; they are run in one transaction
+static std::vector<std::string>
+mutableOPERelabelQueries(const SchemaInfo &schema,
+                         std::vector<MutableOPERelabels> *const batches)
+{
+    std::vector<std::string> queries;
+    std::set<std::pair<std::string, uint64_t> > applied;
+    for (const auto &dit : schema.getChildren()) {
+        const std::string &db = dit.first.getValue();
+        for (const auto &tit : dit.second->getChildren()) {
+            const TableMeta &tm = *tit.second.get();
+            for (const auto &fit : tm.getChildren()) {
+                for (const auto &oit : fit.second->getChildren()) {
+                    const OnionMeta &om = *oit.second.get();
+                    for (const auto &layer : om.getLayers()) {
+                        for (const auto &batch :
+                                pendingMutableOPERelabels(*layer.get())) {
+                            relabelColumnQueries(db, tm.getAnonTableName(),
+                                                 om.getAnonOnionName(),
+                                                 batch, &queries);
+                            applied.insert(std::make_pair(batch.tree_name,
+                                                          batch.seq));
+                            batches->push_back(batch);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    dropMutableOPERelabels(*batches);
+    if (batches->empty()) {
+        return std::vector<std::string>();
+    }
+
+    // > after every UPDATE; a tree may be shared by several columns
+    std::stringstream values;
+    for (const auto &it : applied) {
+        values << (it == *applied.begin() ? "" : ", ")
+               << "('" << it.first << "', " << it.second << ")";
+    }
+    queries.push_back(" INSERT IGNORE INTO "
+                      + MetaData::Table::mopeRelabelCompletion()
+                      + "   (tree, seq) VALUES " + values.str() + ";");
+
+    const std::string &relabel_map = MetaData::Table::mopeRelabelMap();
+    queries.insert(queries.begin(),
+        " CREATE TEMPORARY TABLE IF NOT EXISTS " + relabel_map +
+        "   (old_code BIGINT UNSIGNED NOT NULL PRIMARY KEY,"
+        "    new_code BIGINT UNSIGNED NOT NULL)"
+        " ENGINE=MEMORY;");
+    queries.push_back(" DROP TEMPORARY TABLE IF EXISTS " + relabel_map + ";");
+
+    return queries;
+}
+
+bool
+applyMutableOPERelabels(const std::unique_ptr<Connect> &conn,
+                        const SchemaInfo &schema)
+{
+    std::vector<MutableOPERelabels> batches;
+    const std::vector<std::string> &queries =
+        mutableOPERelabelQueries(schema, &batches);
+    if (queries.empty()) {
+        return true;
+    }
+
+    RETURN_FALSE_IF_FALSE(conn->execute("START TRANSACTION;"));
+    for (const auto &it : queries) {
+        if (false == conn->execute(it)) {
+            conn->execute("ROLLBACK;");
+            return false;
+        }
+    }
+    RETURN_FALSE_IF_FALSE(conn->execute("COMMIT;"));
+
+    for (const auto &it : batches) {
+        mutableOPERelabelsApplied(it);
+    }
+    return true;
+}
+
+// > the results hold mutable OPE ciphertexts
+static bool
+returnsMutableOPE(const ReturnMeta &rmeta)
+{
+    for (const auto &it : rmeta.rfmeta) {
+        const OLK &olk = it.second.getOLK();
+        if (it.second.getIsSalt() || NULL == olk.key) {
+            continue;
+        }
+        const OnionMeta *const om = olk.key->getOnionMeta(olk.o);
+        if (NULL == om) {
+            continue;
+        }
+        for (const auto &layer : om->getLayers()) {
+            if ("MOPE_int" == layer->name()) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
 QueryRewrite
 Rewriter::rewrite(const std::string &q, const SchemaInfo &schema,
                   const std::string &default_db, const ProxyState &ps)
@@ -1440,6 +1690,208 @@ Rewriter::rewrite(const std::string &q, const SchemaInfo &schema,
     LOG(cdb_v) << "q " << q;
     assert(0 == mysql_thread_init());
 
+    if (false == mutableOPEInUse()) {
+        return Rewriter::rewriteCached(q, schema, default_db, ps);
+    }
+
+    // > a step of a query that is already running; it has the hold the
+    //   rest of the query is made under and can not wait for more
+    const MutableOPEScope *const outer = MutableOPEScope::current();
+    if (outer && outer->hold) {
+        MutableOPEHold *const hold = outer->hold;
+        const unsigned int rebalances = hold->rebalances;
+        try {
+            QueryRewrite qr =
+                Rewriter::rewriteScoped(q, schema, default_db, ps, hold);
+            // > the relabels must reach the columns before the query
+            //   goes on; the next query applies them
+            if (rebalances != hold->rebalances) {
+                ROLLBACK_ERROR_PACKET
+            }
+            return qr;
+        } catch (const MutableOPEBusy &) {
+            ROLLBACK_ERROR_PACKET
+        }
+    }
+
+    const std::shared_ptr<MutableOPEHold> hold(new MutableOPEHold());
+    // > relabels left by a query that did not finish, or by a restart,
+    //   are applied before anything else reads the columns
+    MutableOPEHold::Mode mode =
+        mutableOPERelabelsPending() ? MutableOPEHold::Mode::EXCLUSIVE
+                                    : MutableOPEHold::Mode::NONE;
+    if (hold->tryAcquire(mode)) {
+        try {
+            return Rewriter::rewriteHeld(q, schema, default_db, ps, hold);
+        } catch (const MutableOPEBusy &e) {
+            mode = e.mode;
+            hold->release();
+        }
+    }
+
+    return QueryRewrite(true, ReturnMeta(), KillZone(),
+                        new MutableOPEWaitExecutor(hold, mode));
+}
+
+QueryRewrite
+Rewriter::rewriteHeld(const std::string &q, const SchemaInfo &schema,
+                      const std::string &default_db, const ProxyState &ps,
+                      const std::shared_ptr<MutableOPEHold> &hold)
+{
+    QueryRewrite qr =
+        Rewriter::rewriteScoped(q, schema, default_db, ps, hold.get());
+
+    std::vector<MutableOPERelabels> batches;
+    std::vector<std::string> relabel_queries;
+    if (MutableOPEHold::Mode::EXCLUSIVE == hold->getMode()) {
+        relabel_queries = mutableOPERelabelQueries(schema, &batches);
+    }
+
+    return QueryRewrite(true, qr.rmeta, qr.kill_zone,
+                        new MutableOPEExecutor(hold, relabel_queries,
+                                               batches,
+                                               std::move(qr.executor)));
+}
+
+QueryRewrite
+Rewriter::rewriteScoped(const std::string &q, const SchemaInfo &schema,
+                        const std::string &default_db, const ProxyState &ps,
+                        MutableOPEHold *const hold)
+{
+    const MutableOPEScope scope(hold, false);
+    QueryRewrite qr = Rewriter::rewriteCached(q, schema, default_db, ps);
+    // > the ciphertexts in the results must not move before they are
+    //   decrypted
+    if (returnsMutableOPE(qr.rmeta)) {
+        hold->require(MutableOPEHold::Mode::SHARED);
+    }
+
+    return qr;
+}
+
+QueryRewrite
+Rewriter::rewriteCached(const std::string &q, const SchemaInfo &schema,
+                        const std::string &default_db, const ProxyState &ps)
+{
+    Timer t;
+    QueryShape shape;
+    if (normalizeQuery(q, &shape)) {
+        const std::string &key = PlanCache::key(default_db, schema, shape);
+        bool known;
+        std::shared_ptr<const QueryPlan> plan =
+            plan_cache.lookup(key, &known);
+        // > a client still on an older snapshot can't use a newer plan
+        if (plan && !plan->builtFor(schema)) {
+            plan.reset();
+        }
+        if (false == known) {
+            plan = Rewriter::buildPlan(shape, schema, default_db, ps);
+            plan_cache.insert(key, plan);
+        }
+
+        if (plan) {
+            const Analysis analysis(default_db, schema, ps.getMasterKey(),
+                                    ps.defaultSecurityRating());
+            QueryRewrite qr = plan->instantiate(shape, analysis);
+            if (known) {
+                plan_cache.recordHit(t.lap());
+            } else {
+                plan_cache.recordMiss(t.lap());
+            }
+            return qr;
+        }
+
+        if (false == known) {
+            QueryRewrite qr =
+                Rewriter::rewriteUncached(q, schema, default_db, ps);
+            plan_cache.recordMiss(t.lap());
+            return qr;
+        }
+    }
+
+    QueryRewrite qr = Rewriter::rewriteUncached(q, schema, default_db, ps);
+    plan_cache.recordBypass(t.lap());
+    return qr;
+}
+
+const PlanCache &
+Rewriter::getPlanCache()
+{
+    return plan_cache;
+}
+
+// > rewrite the query with sentinels for it's literals and remember where
+//   they end up; NULL if the rewrite can not be repeated this way
+std::shared_ptr<const QueryPlan>
+Rewriter::buildPlan(const QueryShape &shape, const SchemaInfo &schema,
+                    const std::string &default_db, const ProxyState &ps)
+{
+    Analysis analysis(default_db, schema, ps.getMasterKey(),
+                      ps.defaultSecurityRating());
+    PlanRecorder recorder(shape);
+    analysis.plan_recorder = &recorder;
+    const MutableOPEScope dry_run(NULL, true);
+
+    std::unique_ptr<AbstractQueryExecutor> executor;
+    try {
+        executor = std::unique_ptr<AbstractQueryExecutor>(
+            Rewriter::dispatchOnLex(analysis, shape.sentinelQuery()));
+    } catch (...) {
+        // > the real query will produce the error
+        return std::shared_ptr<const QueryPlan>();
+    }
+    if (!executor || false == executor->cacheable()) {
+        return std::shared_ptr<const QueryPlan>();
+    }
+    // > a plan must not change the metadata
+    if (analysis.deltas.size() > 0 || dry_run.spoiled) {
+        return std::shared_ptr<const QueryPlan>();
+    }
+
+    const std::string &rewritten =
+        static_cast<DMLQueryExecutor *>(executor.get())->getQuery();
+    return recorder.finish(rewritten, analysis.rmeta, analysis.kill_zone,
+                           schema);
+}
+
+std::vector<std::string>
+Rewriter::resultColumns(const std::string &q, const SchemaInfo &schema,
+                        const std::string &default_db, const ProxyState &ps)
+{
+    Analysis analysis(default_db, schema, ps.getMasterKey(),
+                      ps.defaultSecurityRating());
+    // > nothing is run, so no value belongs in a tree
+    const MutableOPEScope dry_run(NULL, true);
+
+    std::unique_ptr<AbstractQueryExecutor> executor;
+    try {
+        executor = std::unique_ptr<AbstractQueryExecutor>(
+            Rewriter::dispatchOnLex(analysis, q));
+    } catch (...) {
+        return std::vector<std::string>();
+    }
+    // > only a plain rewrite has the final ReturnMeta; an onion
+    //   adjustment is not run from here
+    if (!executor || false == executor->cacheable()
+        || analysis.deltas.size() > 0) {
+        return std::vector<std::string>();
+    }
+
+    std::vector<std::string> names;
+    for (const auto &it : analysis.rmeta.rfmeta) {
+        if (false == it.second.getIsSalt()) {
+            names.push_back(it.second.fieldCalled());
+        }
+    }
+
+    return names;
+}
+
+QueryRewrite
+Rewriter::rewriteUncached(const std::string &q, const SchemaInfo &schema,
+                          const std::string &default_db,
+                          const ProxyState &ps)
+{
     Analysis analysis(default_db, schema, ps.getMasterKey(),
                       ps.defaultSecurityRating());
 
@@ -1474,8 +1926,49 @@ std::string ReturnMeta::stringify() {
     return res.str();
 }
 
+// > cells decrypted by one task
+static const size_t DECRYPT_CHUNK_ROWS = 512;
+// > results with fewer cells to decrypt stay on the calling thread; the
+//   pool's wakeups cost more than they save
+static const size_t DECRYPT_PARALLEL_ROWS = 4 * DECRYPT_CHUNK_ROWS;
+
+// > the values of one column that go through decryptBatch(...)
+struct BatchColumn {
+    unsigned int column;
+    const OnionMeta *om;
+    std::vector<unsigned int> rows;
+    std::vector<LayerValue> values;
+    std::vector<uint64_t> IVs;
+};
+
+// > PlainText hands back a copy of the Item, whatever it's type
+static bool
+batchDecryptable(const OnionMeta &om)
+{
+    for (const auto &it : om.getLayers()) {
+        if (SECLEVEL::PLAINVAL == it->level()) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static uint64_t
+saltValue(const std::vector<Item *> &row, int salt_pos)
+{
+    if (salt_pos < 0) {
+        return 0;
+    }
+
+    Item_int *const salt_item = static_cast<Item_int *>(row[salt_pos]);
+    assert_s(!salt_item->null_value, "salt item is null");
+    return salt_item->value;
+}
+
 ResType
-Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
+Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta,
+                         unsigned int threads)
 {
     assert(dbres.success());
 
@@ -1484,7 +1977,11 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
     const unsigned int cols = dbres.names.size();
 
     // un-anonymize the names
+    // > the backend only knows the type of the ciphertext, so encrypted
+    //   columns are reported as strings; plaintext columns keep the
+    //   type the backend gave them
     std::vector<std::string> dec_names;
+    std::vector<enum_field_types> dec_types;
     for (auto it = dbres.names.begin();
         it != dbres.names.end(); it++) {
         const unsigned int index = it - dbres.names.begin();
@@ -1492,6 +1989,14 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
         if (!rf.getIsSalt()) {
             //need to return this field
             dec_names.push_back(rf.fieldCalled());
+
+            FieldMeta *const fm = rf.getOLK().key;
+            const OnionMeta *const om =
+                fm ? fm->getOnionMeta(rf.getOLK().o) : NULL;
+            const bool encrypted = om && batchDecryptable(*om);
+            dec_types.push_back(encrypted || index >= dbres.types.size()
+                                    ? MYSQL_TYPE_VAR_STRING
+                                    : dbres.types[index]);
         }
     }
 
@@ -1503,7 +2008,9 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
         dec_rows[i] = std::vector<Item *>(real_cols);
     }
 
-    // decrypt rows
+    // > Items are read and created here; only the decryption itself
+    //   runs on other threads
+    std::vector<BatchColumn> batches;
     unsigned int col_index = 0;
     for (unsigned int c = 0; c < cols; c++) {
         const ReturnField &rf = rmeta.rfmeta.at(c);
@@ -1512,20 +2019,31 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
         }
 
         FieldMeta *const fm = rf.getOLK().key;
+        const OnionMeta *const om =
+            fm ? fm->getOnionMeta(rf.getOLK().o) : NULL;
+        const bool batch = om && batchDecryptable(*om);
+        if (batch) {
+            BatchColumn column;
+            column.column = col_index;
+            column.om = om;
+            batches.push_back(std::move(column));
+        }
         for (unsigned int r = 0; r < rows; r++) {
             if (!fm || dbres.rows[r][c]->is_null()) {
                 dec_rows[r][col_index] = dbres.rows[r][c];
-            } else {
-                uint64_t salt = 0;
-                const int salt_pos = rf.getSaltPosition();
-                if (salt_pos >= 0) {
-                    Item_int *const salt_item =
-                        static_cast<Item_int *>(dbres.rows[r][salt_pos]);
-                    assert_s(!salt_item->null_value, "salt item is null");
-                    salt = salt_item->value;
-                }
+                continue;
+            }
 
-                dec_rows[r][col_index] = 
+            const uint64_t salt =
+                saltValue(dbres.rows[r], rf.getSaltPosition());
+            if (batch) {
+                BatchColumn &column = batches.back();
+                column.rows.push_back(r);
+                column.values.push_back(
+                    LayerValue::fromItem(*dbres.rows[r][c]));
+                column.IVs.push_back(salt);
+            } else {
+                dec_rows[r][col_index] =
                     decrypt_item_layers(*dbres.rows[r][c],
                                         fm, rf.getOLK().o, salt);
             }
@@ -1533,9 +2051,47 @@ Rewriter::decryptResults(const ResType &dbres, const ReturnMeta &rmeta)
         col_index++;
     }
 
+    // > each task takes a run of rows from one column through every
+    //   layer of it's onion, outermost first
+    std::vector<std::pair<BatchColumn *, size_t> > tasks;
+    size_t cells = 0;
+    for (auto &it : batches) {
+        for (size_t start = 0; start < it.values.size();
+             start += DECRYPT_CHUNK_ROWS) {
+            tasks.push_back(std::make_pair(&it, start));
+        }
+        cells += it.values.size();
+    }
+    parallelFor(tasks.size(),
+        [&tasks] (size_t i)
+        {
+            BatchColumn &column = *tasks[i].first;
+            const size_t start = tasks[i].second;
+            const size_t end =
+                std::min(start + DECRYPT_CHUNK_ROWS, column.values.size());
+            std::vector<LayerValue> values(column.values.begin() + start,
+                                           column.values.begin() + end);
+            const std::vector<uint64_t> IVs(column.IVs.begin() + start,
+                                            column.IVs.begin() + end);
+
+            const auto &layers = column.om->getLayers();
+            for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+                (*it)->decryptBatch(&values, IVs);
+            }
+            std::move(values.begin(), values.end(),
+                      column.values.begin() + start);
+        },
+        cells >= DECRYPT_PARALLEL_ROWS ? threads : 1);
+
+    for (const auto &column : batches) {
+        for (size_t i = 0; i < column.rows.size(); ++i) {
+            dec_rows[column.rows[i]][column.column] =
+                column.values[i].toItem();
+        }
+    }
+
     return ResType(dbres.ok, dbres.affected_rows, dbres.insert_id,
-                   std::move(dec_names),
-                   std::vector<enum_field_types>(dbres.types),
+                   std::move(dec_names), std::move(dec_types),
                    std::move(dec_rows));
 }
 
@@ -1675,6 +2231,7 @@ nextImpl(const ResType &res, const NextParams &nparams)
         TEST_ErrPkt(deltaOutputAfterQuery(nparams.ps.getEConn(), this->deltas,
                                           this->embedded_completion_id.get()),
                     "deltaOutputAfterQuery failed for onion adjustment");
+        nparams.ps.getSchemaCache().applyDeltas(this->deltas);
 
         // if the client was in the middle of a transaction we must alert
         // him that we had to rollback his queries
@@ -1689,6 +2246,8 @@ nextImpl(const ResType &res, const NextParams &nparams)
                     nparams.default_db, nparams.ps));
         } catch (const AbstractException &e) {
             FAIL_GenericPacketException(e.to_string());
+        } catch (const ErrorPacketException &e) {
+            throw;
         } catch (...) {
             FAIL_GenericPacketException(
                 "unknown error occured while rewriting onion adjusment query");
@@ -1712,3 +2271,160 @@ nextImpl(const ResType &res, const NextParams &nparams)
     assert(false);
 }
 
+std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
+MutableOPEExecutor::
+nextImpl(const ResType &res, const NextParams &nparams)
+{
+    try {
+        const auto &result = this->step(res, nparams);
+        if (ResultType::RESULTS == result.first) {
+            this->hold->release();
+        }
+        return result;
+    } catch (...) {
+        // > the client may not send another query for a while
+        this->hold->release();
+        throw;
+    }
+}
+
+std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
+MutableOPEExecutor::
+step(const ResType &res, const NextParams &nparams)
+{
+    reenter(this->corot) {
+        if (false == this->relabel_queries.empty()) {
+            yield return CR_QUERY_AGAIN(
+                "CALL " + MetaData::Proc::activeTransactionP());
+            TEST_ErrPkt(res.success(),
+                   "failed to determine if there is an active transasction");
+            this->in_trx = handleActiveTransactionPResults(res);
+
+            if (true == this->in_trx.get()) {
+                yield return CR_QUERY_AGAIN("ROLLBACK");
+                TEST_ErrPkt(res.success(), "failed to rollback");
+            }
+
+            yield return CR_QUERY_AGAIN("START TRANSACTION");
+            TEST_ErrPkt(res.success(), "failed to start transaction");
+
+            for (this->relabel_index = 0;
+                 this->relabel_index < this->relabel_queries.size();
+                 ++this->relabel_index) {
+                yield return CR_QUERY_AGAIN(
+                    this->relabel_queries[this->relabel_index]);
+                CR_ROLLBACK_AND_FAIL(res,
+                            "failed to relabel mutable OPE column!");
+            }
+
+            yield return CR_QUERY_AGAIN("COMMIT");
+            TEST_ErrPkt(res.success(), "failed to commit mutable OPE relabels");
+
+            for (const auto &it : this->batches) {
+                mutableOPERelabelsApplied(it);
+            }
+
+            if (true == this->in_trx.get()) {
+                ROLLBACK_ERROR_PACKET
+            }
+        }
+
+        while (true) {
+            yield {
+                if (true == this->passthrough) {
+                    if (false == res.success() && nparams.backend_error) {
+                        throw *nparams.backend_error;
+                    }
+                    TEST_ErrPkt(res.success(),
+                                "query failed against remote database");
+                    return CR_RESULTS(res);
+                }
+
+                try {
+                    const MutableOPEScope scope(this->hold.get(), false);
+                    const auto result =
+                        this->executor->next(this->first ? ResType(true, 0, 0)
+                                                         : res,
+                                             nparams);
+                    this->first = false;
+                    // > the hold must last until the server is done with
+                    //   the query, so the results come back to us
+                    if (ResultType::QUERY_USE_RESULTS == result.first
+                        && MutableOPEHold::Mode::NONE
+                           != this->hold->getMode()) {
+                        const std::unique_ptr<AbstractAnything>
+                            query(result.second);
+                        this->passthrough = true;
+                        return CR_QUERY_AGAIN(query->extract<std::string>());
+                    }
+                    return result;
+                } catch (const ErrorPacketException &e) {
+                    // > a step that could not be rewritten under the
+                    //   hold; the client's transaction is rolled back
+                    if (1213 != e.getErrorCode()) {
+                        throw;
+                    }
+                    this->rollback_error.reset(new ErrorPacketException(e));
+                }
+                return CR_QUERY_AGAIN("ROLLBACK");
+            }
+            assert(this->rollback_error);
+            throw *this->rollback_error;
+        }
+    }
+
+    assert(false);
+}
+
+bool
+MutableOPEWaitExecutor::reissue(const NextParams &nparams)
+{
+    if (false == this->hold->tryAcquire(this->mode)) {
+        return false;
+    }
+
+    try {
+        this->reissue_query_rewrite.reset(new QueryRewrite(
+            Rewriter::rewriteHeld(
+                nparams.original_query, *nparams.ps.getSchemaInfo().get(),
+                nparams.default_db, nparams.ps, this->hold)));
+    } catch (const MutableOPEBusy &e) {
+        // > it needs more than it waited for
+        this->mode = e.mode;
+        this->hold->release();
+        return false;
+    } catch (const AbstractException &e) {
+        FAIL_GenericPacketException(e.to_string());
+    }
+
+    return true;
+}
+
+std::pair<AbstractQueryExecutor::ResultType, AbstractAnything *>
+MutableOPEWaitExecutor::
+nextImpl(const ResType &res, const NextParams &nparams)
+{
+    reenter(this->corot) {
+        while (false == this->reissue(nparams)) {
+            // > the other queries are between their own queries to the
+            //   server; a short wait lets them finish
+            yield return CR_QUERY_AGAIN("DO SLEEP(0.005);");
+            TEST_ErrPkt(res.success(), "failed to wait for mutable OPE");
+        }
+
+        while (true) {
+            yield {
+                auto result =
+                    this->reissue_query_rewrite->executor->next(
+                        first_reissue ? ResType(true, 0, 0)
+                                      : res,
+                        nparams);
+                this->first_reissue = false;
+                return result;
+            }
+        }
+    }
+
+    assert(false);
+}
+
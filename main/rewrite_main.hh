@@ -22,6 +22,7 @@
 #include "field.h"
 
 #include <main/Analysis.hh>
+#include <util/parallel.hh>
 #include <main/dml_handler.hh>
 #include <main/ddl_handler.hh>
 #include <parser/Annotation.hh>
@@ -51,6 +52,17 @@ public:
 void
 printRes(const ResType & r);
 
+// > one value through every layer of it's onion, without batching
+Item *
+decrypt_item_layers(const Item &i, const FieldMeta *const fm, onion o,
+                    uint64_t IV);
+
+// > applies the pending mutable OPE relabels to the columns in 'schema'
+//   in a transaction of it's own
+bool
+applyMutableOPERelabels(const std::unique_ptr<Connect> &conn,
+                        const SchemaInfo &schema);
+
 //contains the results of a query rewrite:
 // - rewritten queries
 // - data structure needed to decrypt results
@@ -61,12 +73,17 @@ public:
         : rmeta(rmeta), kill_zone(kill_zone),
           executor(std::unique_ptr<AbstractQueryExecutor>(executor)) {}
     QueryRewrite(QueryRewrite &&other_qr) : rmeta(other_qr.rmeta),
+        kill_zone(other_qr.kill_zone),
         executor(std::move(other_qr.executor)) {}
     const ReturnMeta rmeta;
     const KillZone kill_zone;
     std::unique_ptr<AbstractQueryExecutor> executor;
 };
 
+class PlanCache;
+class QueryPlan;
+class QueryShape;
+
 // Main class processing rewriting
 class Rewriter {
     Rewriter();
@@ -78,16 +95,50 @@ public:
                 const std::string &default_db,
                 const ProxyState &ps);
 
+    // > large results are decrypted on up to 'threads' threads
     static ResType
-        decryptResults(const ResType &dbres, const ReturnMeta &rm);
+        decryptResults(const ResType &dbres, const ReturnMeta &rm,
+                       unsigned int threads = defaultThreadCount());
+
+    static const PlanCache &getPlanCache();
+
+    // > the names of the columns 'q' returns, found by rewriting it
+    //   without running anything; empty if it returns none or if they
+    //   can not be known ahead of time
+    static std::vector<std::string>
+        resultColumns(const std::string &q, const SchemaInfo &schema,
+                      const std::string &default_db,
+                      const ProxyState &ps);
 
 private:
+    friend class MutableOPEWaitExecutor;
+
+    // > a query that is not a step of another, under it's own hold
+    static QueryRewrite
+        rewriteHeld(const std::string &q, const SchemaInfo &schema,
+                    const std::string &default_db, const ProxyState &ps,
+                    const std::shared_ptr<MutableOPEHold> &hold);
+    static QueryRewrite
+        rewriteScoped(const std::string &q, const SchemaInfo &schema,
+                      const std::string &default_db, const ProxyState &ps,
+                      MutableOPEHold *const hold);
+    static QueryRewrite
+        rewriteCached(const std::string &q, const SchemaInfo &schema,
+                      const std::string &default_db, const ProxyState &ps);
+    static QueryRewrite
+        rewriteUncached(const std::string &q, const SchemaInfo &schema,
+                        const std::string &default_db,
+                        const ProxyState &ps);
+    static std::shared_ptr<const QueryPlan>
+        buildPlan(const QueryShape &shape, const SchemaInfo &schema,
+                  const std::string &default_db, const ProxyState &ps);
     static AbstractQueryExecutor *
         dispatchOnLex(Analysis &a, const std::string &query);
 
     static const bool translator_dummy;
     static const std::unique_ptr<SQLDispatcher> dml_dispatcher;
     static const std::unique_ptr<SQLDispatcher> ddl_dispatcher;
+    static PlanCache plan_cache;
 };
 
 #define UNIMPLEMENTED                                               \
@@ -355,3 +406,71 @@ private:
     bool stales() const {return true;}
     bool usesEmbedded() const {return true;}
 };
+
+/*
+ * Runs a query under it's MutableOPEHold and lets the hold go once the
+ * query has it's results.  The relabels of a rebalance the rewrite made
+ * are applied first, in a transaction of their own on the client's
+ * connection; the tree has moved whatever the client does, so like an
+ * onion adjustment an open transaction is rolled back.
+ */
+class MutableOPEExecutor : public AbstractQueryExecutor {
+    const std::shared_ptr<MutableOPEHold> hold;
+    const std::vector<std::string> relabel_queries;
+    const std::vector<MutableOPERelabels> batches;
+    const std::unique_ptr<AbstractQueryExecutor> executor;
+
+    // coroutine state
+    bool first;
+    // > the results we asked for in place of the executor's
+    //   QUERY_USE_RESULTS
+    bool passthrough;
+    size_t relabel_index;
+    AssignOnce<bool> in_trx;
+    std::unique_ptr<ErrorPacketException> rollback_error;
+
+public:
+    MutableOPEExecutor(const std::shared_ptr<MutableOPEHold> &hold,
+                       const std::vector<std::string> &relabel_queries,
+                       const std::vector<MutableOPERelabels> &batches,
+                       std::unique_ptr<AbstractQueryExecutor> &&executor)
+        : hold(hold), relabel_queries(relabel_queries), batches(batches),
+          executor(std::move(executor)), first(true), passthrough(false),
+          relabel_index(0) {}
+
+    std::pair<ResultType, AbstractAnything *>
+        nextImpl(const ResType &res, const NextParams &nparams);
+    // > results decrypted a batch at a time never come back through
+    //   next(...), so only a query holding nothing can have them
+    const ReturnMeta *batchedResults() const {
+        return MutableOPEHold::Mode::NONE == hold->getMode()
+               ? executor->batchedResults() : NULL;
+    }
+
+private:
+    std::pair<ResultType, AbstractAnything *>
+        step(const ResType &res, const NextParams &nparams);
+};
+
+// > a query that can not have it's MutableOPEHold yet has the server
+//   sleep until it can, and is then rewritten again
+class MutableOPEWaitExecutor : public AbstractQueryExecutor {
+    const std::shared_ptr<MutableOPEHold> hold;
+    MutableOPEHold::Mode mode;
+
+    // coroutine state
+    bool first_reissue;
+    std::unique_ptr<QueryRewrite> reissue_query_rewrite;
+
+public:
+    MutableOPEWaitExecutor(const std::shared_ptr<MutableOPEHold> &hold,
+                           MutableOPEHold::Mode mode)
+        : hold(hold), mode(mode), first_reissue(true) {}
+
+    std::pair<ResultType, AbstractAnything *>
+        nextImpl(const ResType &res, const NextParams &nparams);
+
+private:
+    // > false until the query is rewritten under the hold
+    bool reissue(const NextParams &nparams);
+};
@@ -19,6 +19,7 @@
 #include <main/rewrite_util.hh>
 #include <main/CryptoHandlers.hh>
 #include <main/macro_util.hh>
+#include <main/plan_cache.hh>
 #include <util/cryptdb_log.hh>
 #include <util/enum_text.hh>
 #include <parser/lex_util.hh>
@@ -314,6 +315,10 @@ static class ANON : public CItemSubtypeIT<Item_null, Item::Type::NULL_ITEM> {
             l->push_back(RiboldMYSQL::clone_item(i));
         }
         if (fm.getHasSalt()) {
+            if (a.plan_recorder) {
+                l->push_back(a.plan_recorder->salt());
+                return;
+            }
             const ulonglong salt = randomValue();
             l->push_back(new Item_int(static_cast<ulonglong>(salt)));
         }
@@ -5,6 +5,7 @@
 #include <main/macro_util.hh>
 #include <main/metadata_tables.hh>
 #include <main/schema.hh>
+#include <main/plan_cache.hh>
 #include <parser/lex_util.hh>
 #include <parser/stringify.hh>
 #include <util/enum_text.hh>
@@ -245,6 +246,11 @@ rewrite_create_field(const FieldMeta * const fm,
     // create each onion column
     for (auto oit : fm->orderedOnionMetas()) {
         OnionMeta * const om = oit.second;
+        // > the first slot of a packed AGG onion creates it's column
+        const HOM_pack *const packed = packedAGGLayer(*om);
+        if (packed && 0 != packed->getSlot()) {
+            continue;
+        }
         Create_field * const new_cf = get_create_field(a, f, *om);
 
         output_cfields.push_back(new_cf);
@@ -413,10 +419,12 @@ isUnique(const std::string &name,
 List<Create_field>
 createAndRewriteField(Analysis &a, Create_field * const cf,
                       TableMeta *const tm, bool new_table,
+                      uint64_t uniq_count,
                       const std::vector<std::tuple<std::vector<std::string>,
                                         Key::Keytype> >
                           &key_data,
-                      List<Create_field> &rewritten_cfield_list)
+                      List<Create_field> &rewritten_cfield_list,
+                      AGGPacker *const packer)
 {
     // we only support the creation of UNSIGNED fields
     cf->flags = cf->flags | UNSIGNED_FLAG;
@@ -424,8 +432,8 @@ createAndRewriteField(Analysis &a, Create_field * const cf,
     const std::string &name = std::string(cf->field_name);
     std::unique_ptr<FieldMeta>
         fm(new FieldMeta(*cf, a.getMasterKey().get(),
-                         a.getDefaultSecurityRating(), tm->leaseCount(),
-                         isUnique(name, key_data)));
+                         a.getDefaultSecurityRating(), uniq_count,
+                         isUnique(name, key_data), packer));
 
     // -----------------------------
     //         Rewrite FIELD
@@ -445,9 +453,15 @@ createAndRewriteField(Analysis &a, Create_field * const cf,
         a.deltas.push_back(std::unique_ptr<Delta>(
                                 new CreateDelta(std::move(fm), *tm,
                                                 IdentityMetaKey(name))));
+        const uint64_t next_count = uniq_count + 1;
         a.deltas.push_back(std::unique_ptr<Delta>(
                new ReplaceDelta(*tm,
-                                a.getDatabaseMeta(a.getDatabaseName()))));
+                                a.getDatabaseMeta(a.getDatabaseName()),
+                                [next_count] (DBMeta *const copy)
+                                {
+                                    static_cast<TableMeta *>(copy)
+                                        ->setCount(next_count);
+                                })));
     }
 
     return rewritten_cfield_list;
@@ -477,6 +491,33 @@ encrypt_item_layers(const Item &i, onion o, const OnionMeta &om,
     return new_enc;
 }
 
+std::vector<Item *>
+encrypt_items_layers(const std::vector<const Item *> &items, onion o,
+                     const OnionMeta &om, const Analysis &a,
+                     const std::vector<uint64_t> &IVs)
+{
+    assert(items.size() == IVs.size());
+    for (auto it : items) {
+        assert(!RiboldMYSQL::is_null(*it));
+    }
+
+    const auto &enc_layers = a.getEncLayers(om);
+    assert_s(enc_layers.size() > 0, "onion must have at least one layer");
+    std::vector<const Item *> enc(items);
+    std::vector<Item *> new_enc;
+
+    for (const auto &it : enc_layers) {
+        LOG(encl) << "encrypt layer "
+                  << TypeText<SECLEVEL>::toText(it->level())
+                  << " for " << items.size() << " values\n";
+        new_enc = it->encryptBatch(enc, IVs);
+        assert(new_enc.size() == items.size());
+        enc.assign(new_enc.begin(), new_enc.end());
+    }
+
+    return new_enc;
+}
+
 std::string
 escapeString(const std::unique_ptr<Connect> &c,
              const std::string &escape_me)
@@ -490,6 +531,24 @@ escapeString(const std::unique_ptr<Connect> &c,
     return std::string(escaped.get());
 }
 
+const HOM_pack *
+packedAGGLayer(const OnionMeta &om)
+{
+    const EncLayer *const el = om.getLayerBack();
+    if (SECLEVEL::HOM != el->level() || "HOM_pack" != el->name()) {
+        return NULL;
+    }
+
+    return static_cast<const HOM_pack *>(el);
+}
+
+bool
+hasPackedAGG(const FieldMeta &fm)
+{
+    const OnionMeta *const om = fm.getOnionMeta(oAGG);
+    return om && packedAGGLayer(*om);
+}
+
 void
 encrypt_item_all_onions(const Item &i, const FieldMeta &fm,
                         uint64_t IV, Analysis &a, std::vector<Item*> *l)
@@ -505,6 +564,10 @@ void
 typical_rewrite_insert_type(const Item &i, const FieldMeta &fm,
                             Analysis &a, std::vector<Item *> *l)
 {
+    if (a.plan_recorder && a.plan_recorder->encryptAllOnions(i, fm, l)) {
+        return;
+    }
+
     const uint64_t salt = fm.getHasSalt() ? randomValue() : 0;
 
     encrypt_item_all_onions(i, fm, salt, a, l);
@@ -61,15 +61,24 @@ bool string_to_bool(const std::string &s);
 List<Create_field>
 createAndRewriteField(Analysis &a, Create_field * const cf,
                       TableMeta *const tm, bool new_table,
+                      uint64_t uniq_count,
                       const std::vector<std::tuple<std::vector<std::string>,
                                         Key::Keytype> >
                           &key_data,
-                      List<Create_field> &rewritten_cfield_list);
+                      List<Create_field> &rewritten_cfield_list,
+                      AGGPacker *const packer);
 
 Item *
 encrypt_item_layers(const Item &i, onion o, const OnionMeta &om,
                     const Analysis &a, uint64_t IV = 0);
 
+// > encrypts many values of one onion a layer at a time, so layers that
+//   can share work between values (OPE) see them together
+std::vector<Item *>
+encrypt_items_layers(const std::vector<const Item *> &items, onion o,
+                     const OnionMeta &om, const Analysis &a,
+                     const std::vector<uint64_t> &IVs);
+
 // FIXME(burrows): Generalize to support any container with next AND end
 // semantics.
 template <typename T>
@@ -116,6 +125,13 @@ void
 typical_rewrite_insert_type(const Item &i, const FieldMeta &fm,
                             Analysis &a, std::vector<Item *> *l);
 
+// > the layer of a packed AGG onion; NULL if 'om' is not one
+const HOM_pack *
+packedAGGLayer(const OnionMeta &om);
+
+bool
+hasPackedAGG(const FieldMeta &fm);
+
 void
 process_select_lex(const st_select_lex &select_lex, Analysis &a);
 
@@ -11,6 +11,7 @@
 #include <main/dbobject.hh>
 #include <main/metadata_tables.hh>
 #include <main/macro_util.hh>
+#include <util/scoped_lock.hh>
 
 std::vector<DBMeta *>
 DBMeta::doFetchChildren(const std::unique_ptr<Connect> &e_conn,
@@ -54,8 +55,10 @@ DBMeta::doFetchChildren(const std::unique_ptr<Connect> &e_conn,
 OnionMeta::OnionMeta(onion o, std::vector<SECLEVEL> levels,
                      const AES_KEY * const m_key,
                      const Create_field &cf, unsigned long uniq_count,
-                     SECLEVEL minimum_seclevel)
-    : onionname(getpRandomName() + TypeText<onion>::toText(o)),
+                     SECLEVEL minimum_seclevel,
+                     const AGGSlot *const slot)
+    : onionname(slot ? slot->onionname
+                     : getpRandomName() + TypeText<onion>::toText(o)),
       uniq_count(uniq_count), minimum_seclevel(minimum_seclevel)
 {
     assert(levels.size() >= 1);
@@ -68,7 +71,7 @@ OnionMeta::OnionMeta(onion o, std::vector<SECLEVEL> levels,
             m_key ? getLayerKey(m_key, uniqueFieldName, l)
                   : "plainkey";
         std::unique_ptr<EncLayer>
-            el(EncLayerFactory::encLayer(o, l, *newcf, key));
+            el(EncLayerFactory::encLayer(o, l, *newcf, key, slot));
 
         const Create_field &oldcf = *newcf;
         newcf = el->newCreateField(oldcf);
@@ -117,27 +120,63 @@ OnionMeta::fetchChildren(const std::unique_ptr<Connect> &e_conn)
                            const std::string &)>
         deserialHelper =
     [this] (const std::string &key, const std::string &serial,
-            const std::string &id) -> EncLayer *
+            const std::string &id) -> DBMeta *
     {
-        // > Probably going to want to use indexes in AbstractMetaKey
-        // for now, otherwise you will need to abstract and rederive
-        // a keyed and nonkeyed version of Delta.
-        const std::unique_ptr<UIntMetaKey>
-            meta_key(AbstractMetaKey::factory<UIntMetaKey>(key));
-        const unsigned int index = meta_key->getValue();
-        if (index >= this->layers.size()) {
-            this->layers.resize(index + 1);
-        }
-        std::unique_ptr<EncLayer>
-            layer(EncLayerFactory::deserializeLayer(atoi(id.c_str()),
-                                                    serial));
-        this->layers[index] = std::move(layer);
-        return this->layers[index].get();
+        return this->deserializeChild(key, serial, atoi(id.c_str()));
     };
 
     return DBMeta::doFetchChildren(e_conn, deserialHelper);
 }
 
+DBMeta *
+OnionMeta::deserializeChild(const std::string &key,
+                            const std::string &serial, unsigned int id)
+{
+    // > Probably going to want to use indexes in AbstractMetaKey
+    // for now, otherwise you will need to abstract and rederive
+    // a keyed and nonkeyed version of Delta.
+    const std::unique_ptr<UIntMetaKey>
+        meta_key(AbstractMetaKey::factory<UIntMetaKey>(key));
+    const unsigned int index = meta_key->getValue();
+    if (index >= this->layers.size()) {
+        this->layers.resize(index + 1);
+    }
+    std::unique_ptr<EncLayer>
+        layer(EncLayerFactory::deserializeLayer(id, serial));
+    this->layers[index] = std::move(layer);
+    return this->layers[index].get();
+}
+
+bool
+OnionMeta::replaceChild(const DBMeta &child,
+                        std::unique_ptr<DBMeta> &&replacement)
+{
+    for (auto &it : layers) {
+        if (it.get() == &child) {
+            it = std::shared_ptr<EncLayer>(
+                static_cast<EncLayer *>(replacement.release()));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// > the key of a layer is it's index so we only expect to lose the
+//   top layer
+bool
+OnionMeta::removeChild(const DBMeta &child)
+{
+    for (auto it = layers.begin(); it != layers.end(); ++it) {
+        if (it->get() == &child) {
+            layers.erase(it);
+            return true;
+        }
+    }
+
+    return false;
+}
+
 bool
 OnionMeta::applyToChildren(std::function<bool(const DBMeta &)>
     fn) const
@@ -253,7 +292,9 @@ determineSecLevelData(onion o, std::vector<SECLEVEL> levels, bool unique)
         assert(SECLEVEL::PLAINVAL == levels.back()
                || SECLEVEL::RND == levels.back());
     } else if (oOPE == o) {
-        assert(SECLEVEL::RND == levels.back());
+        // mutable OPE has no RND
+        assert(SECLEVEL::RND == levels.back()
+               || SECLEVEL::OPE == levels.back());
     } else if (oAGG == o) {
         assert(SECLEVEL::HOM == levels.back());
     } else {
@@ -266,7 +307,8 @@ determineSecLevelData(onion o, std::vector<SECLEVEL> levels, bool unique)
 // If mkey == NULL, the field is not encrypted
 static bool
 init_onions_layout(const AES_KEY *const m_key, FieldMeta *const fm,
-                   const Create_field &cf, bool unique)
+                   const Create_field &cf, bool unique,
+                   AGGPacker *const packer)
 {
     const onionlayout onion_layout = fm->getOnionLayout();
     if (fm->getHasSalt() != (static_cast<bool>(m_key)
@@ -287,11 +329,19 @@ init_onions_layout(const AES_KEY *const m_key, FieldMeta *const fm,
             determineSecLevelData(o, levels, unique);
         assert(level_data.first.size() >= 1);
 
+        AGGSlot slot;
+        const bool packed =
+            oAGG == o && m_key && packer && usePackedAGG(cf);
+        if (packed) {
+            slot = packer->next();
+        }
+
         // A new OnionMeta will only occur with a new FieldMeta so
         // we never have to build Deltaz for our OnionMetaz.
         std::unique_ptr<OnionMeta>
             om(new OnionMeta(o, std::get<0>(level_data), m_key, cf,
-                             fm->leaseCount(), std::get<1>(level_data)));
+                             fm->leaseCount(), std::get<1>(level_data),
+                             packed ? &slot : NULL));
         const std::string &onion_name = om->getAnonOnionName();
         fm->addChild(OnionMetaKey(o), std::move(om));
 
@@ -306,7 +356,8 @@ FieldMeta::FieldMeta(const Create_field &field,
                      const AES_KEY * const m_key,
                      SECURITY_RATING sec_rating,
                      unsigned long uniq_count,
-                     bool unique)
+                     bool unique,
+                     AGGPacker *const packer)
     : fname(std::string(field.field_name)),
       salt_name(BASE_SALT_NAME + getpRandomName()),
       onion_layout(determineOnionLayout(m_key, field, sec_rating)),
@@ -316,7 +367,8 @@ FieldMeta::FieldMeta(const Create_field &field,
       has_default(determineHasDefault(field)),
       default_value(determineDefaultValue(has_default, field))
 {
-    TEST_TextMessageError(init_onions_layout(m_key, this, field, unique),
+    TEST_TextMessageError(init_onions_layout(m_key, this, field, unique,
+                                             packer),
                           "Failed to build onions for new FieldMeta!");
 }
 
@@ -409,13 +461,17 @@ onionlayout FieldMeta::determineOnionLayout(const AES_KEY *const m_key,
     }
 
     if (SECURITY_RATING::SENSITIVE == sec_rating) {
-        if (true == isMySQLTypeNumeric(f)) {
+        if (true == useMutableOPE(f)) {
+            return MOPE_NUM_ONION_LAYOUT;
+        } else if (true == isMySQLTypeNumeric(f)) {
             return NUM_ONION_LAYOUT;
         } else {
             return STR_ONION_LAYOUT;
         }
     } else if (SECURITY_RATING::BEST_EFFORT == sec_rating) {
-        if (true == isMySQLTypeNumeric(f)) {
+        if (true == useMutableOPE(f)) {
+            return BEST_EFFORT_MOPE_NUM_ONION_LAYOUT;
+        } else if (true == isMySQLTypeNumeric(f)) {
             return BEST_EFFORT_NUM_ONION_LAYOUT;
         } else {
             return BEST_EFFORT_STR_ONION_LAYOUT;
@@ -559,116 +615,170 @@ DatabaseMeta::serialize(const DBObject &parent) const
     return serial;
 }
 
-static bool
-lowLevelGetCurrentStaleness(const std::unique_ptr<Connect> &e_conn,
-                            unsigned int cache_id)
-{
-    const std::string &query =
-        " SELECT stale FROM " + MetaData::Table::staleness() +
-        "  WHERE cache_id = " + std::to_string(cache_id) + ";";
-    std::unique_ptr<DBResult> db_res;
-    RFIF(e_conn->execute(query, &db_res));
-    assert(1 == mysql_num_rows(db_res->n));
-
-    const MYSQL_ROW row = mysql_fetch_row(db_res->n);
-    const unsigned long *const l = mysql_fetch_lengths(db_res->n);
-    assert(l != NULL);
-
-    return string_to_bool(std::string(row[0], l[0]));
-}
+// > starts above the loaded_epoch of a fresh SchemaCache
+std::atomic<uint64_t> SchemaCache::epoch(1);
 
 std::shared_ptr<const SchemaInfo>
 SchemaCache::getSchema(const std::unique_ptr<Connect> &conn,
                        const std::unique_ptr<Connect> &e_conn) const
 {
-    if (true == this->no_loads) {
-        // Use this cleanup if we can't maintain consistent states.
-        /*
-        TEST_TextMessageError(cleanupStaleness(e_conn),
-                              "Failed to cleanup staleness for first"
-                              " usage!");
-        */
-        TEST_SchemaFailure(initialStaleness(e_conn));
-        this->no_loads = false;
+    // > the snapshot is published before loaded_epoch, so if the epochs
+    //   match the snapshot is at least that current
+    if (SchemaCache::epoch.load() == this->loaded_epoch.load()) {
+        const std::shared_ptr<const SchemaInfo> &snapshot =
+            std::atomic_load(&this->schema);
+        assert(snapshot);
+        return snapshot;
     }
 
-    if (true == lowLevelGetCurrentStaleness(e_conn, this->id)) {
-        this->schema =
-            std::shared_ptr<SchemaInfo>(loadSchemaInfo(conn, e_conn));
+    scoped_lock l(&this->lock);
+    // > read the epoch before loading; if the metadata changes while we
+    //   load we will load again on the next call
+    const uint64_t current = SchemaCache::epoch.load();
+    // another client may have done the load while we waited
+    if (current != this->loaded_epoch.load()) {
+        std::unique_ptr<SchemaInfo> loaded(loadSchemaInfo(conn, e_conn));
+        loaded->setVersion(current);
+        const std::shared_ptr<const SchemaInfo> snapshot(loaded.release());
+        std::atomic_store(&this->schema, snapshot);
+        this->loaded_epoch.store(current);
     }
 
-    assert(this->schema);
-    return this->schema;
+    const std::shared_ptr<const SchemaInfo> &snapshot =
+        std::atomic_load(&this->schema);
+    assert(snapshot);
+    return snapshot;
 }
 
-static void
-lowLevelAllStale(const std::unique_ptr<Connect> &e_conn)
+void
+SchemaCache::stale() const
 {
-    const std::string &query =
-        " UPDATE " + MetaData::Table::staleness() +
-        "    SET stale = TRUE;";
-    TEST_SchemaFailure(e_conn->execute(query));
+    ++SchemaCache::epoch;
 }
 
 void
-SchemaCache::updateStaleness(const std::unique_ptr<Connect> &e_conn,
-                             bool staleness) const
+SchemaCache::applyDeltas(const std::vector<std::unique_ptr<Delta> > &deltas)
+    const
 {
-    if (true == staleness) {
-        // Make everyone stale.
-        return lowLevelAllStale(e_conn);
+    scoped_lock l(&this->lock);
+    uint64_t current = SchemaCache::epoch.load();
+    const std::shared_ptr<const SchemaInfo> &base =
+        std::atomic_load(&this->schema);
+    // > somebody else staled us; the next getSchema(...) will load
+    //   our changes from the embedded database
+    if (!base || current != this->loaded_epoch.load()) {
+        this->stale();
+        return;
     }
 
-    // We are no longer stale.
-    return this->lowLevelCurrentUnstale(e_conn);
+    SchemaInfoBuilder builder(*base.get());
+    for (const auto &it : deltas) {
+        if (false == it->applyToSnapshot(&builder)) {
+            LOG(warn) << "failed to apply delta to schema snapshot;"
+                      << " reloading";
+            this->stale();
+            return;
+        }
+    }
+
+    // > other caches must still load our changes; if the epoch moved
+    //   while we were building, we are stale and the new snapshot is
+    //   discarded
+    if (false == SchemaCache::epoch.compare_exchange_strong(current,
+                                                            current + 1)) {
+        return;
+    }
+
+    std::atomic_store(&this->schema, builder.build(current + 1));
+    this->loaded_epoch.store(current + 1);
 }
 
-bool
-SchemaCache::initialStaleness(const std::unique_ptr<Connect> &e_conn) const
+// > the object and all of it's ancestors in 'path', root first
+static bool
+findPath(const DBMeta &current, const DBMeta &target,
+         std::vector<const DBMeta *> *const path)
 {
-    const std::string seed_staleness =
-        " INSERT INTO " + MetaData::Table::staleness() +
-        "   (cache_id, stale) VALUES " +
-        "   (" + std::to_string(this->id) + ", TRUE);";
-    RFIF(e_conn->execute(seed_staleness));
+    path->push_back(&current);
+    if (&current == &target) {
+        return true;
+    }
 
-    return true;
+    bool found = false;
+    current.applyToChildren(
+        [&target, path, &found] (const DBMeta &child)
+        {
+            found = findPath(child, target, path);
+            return false == found;      // shortcircuit
+        });
+    if (false == found) {
+        path->pop_back();
+    }
+
+    return found;
 }
 
-bool
-SchemaCache::cleanupStaleness(const std::unique_ptr<Connect> &e_conn) const
+SchemaInfoBuilder::SchemaInfoBuilder(const SchemaInfo &base)
+    : base(base),
+      root(static_cast<SchemaInfo *>(base.shallowCopy().release()))
 {
-    const std::string remove_staleness =
-        " DELETE FROM " + MetaData::Table::staleness() +
-        "       WHERE cache_id = " + std::to_string(this->id) + ";";
-    RFIF(e_conn->execute(remove_staleness));
-
-    return true;
+    copies[&base] = root.get();
 }
-static bool
-lowLevelToggleCurrentStaleness(const std::unique_ptr<Connect> &e_conn,
-                               unsigned int cache_id, bool staleness)
+
+DBMeta *
+SchemaInfoBuilder::getMutable(const DBMeta &meta)
 {
-    const std::string &query =
-        " UPDATE " + MetaData::Table::staleness() +
-        "    SET stale = " + bool_to_string(staleness) +
-        "  WHERE cache_id = " + std::to_string(cache_id) + ";";
-    RFIF(e_conn->execute(query));
+    const auto &cached = copies.find(&meta);
+    if (copies.end() != cached) {
+        return cached->second;
+    }
 
-    return true;
+    std::vector<const DBMeta *> path;
+    if (false == findPath(base, meta, &path)) {
+        return NULL;
+    }
+
+    // > copy every ancestor we haven't copied yet and have it's copied
+    //   parent point at the copy
+    assert(path.front() == &base);
+    DBMeta *parent_copy = root.get();
+    for (auto it = path.begin() + 1; it != path.end(); ++it) {
+        const DBMeta &old = **it;
+        const auto &copy_it = copies.find(&old);
+        if (copies.end() != copy_it) {
+            parent_copy = copy_it->second;
+            continue;
+        }
+
+        std::unique_ptr<DBMeta> copy = old.shallowCopy();
+        DBMeta *const raw_copy = copy.get();
+        if (false == parent_copy->replaceChild(old, std::move(copy))) {
+            // > the parent lost this child to an earlier delta
+            return NULL;
+        }
+        copies[&old] = raw_copy;
+        parent_copy = raw_copy;
+    }
+
+    return parent_copy;
 }
 
-void
-SchemaCache::lowLevelCurrentStale(const std::unique_ptr<Connect> &e_conn)
-    const
+const DBMeta &
+SchemaInfoBuilder::getCurrent(const DBMeta &meta) const
 {
-    TEST_SchemaFailure(lowLevelToggleCurrentStaleness(e_conn, this->id, true));
+    const auto &cached = copies.find(&meta);
+    if (copies.end() != cached) {
+        return *cached->second;
+    }
+
+    return meta;
 }
 
-void
-SchemaCache::lowLevelCurrentUnstale(const std::unique_ptr<Connect> &e_conn)
-    const
+std::shared_ptr<const SchemaInfo>
+SchemaInfoBuilder::build(uint64_t version)
 {
-    TEST_SchemaFailure(lowLevelToggleCurrentStaleness(e_conn, this->id, false));
+    assert(root);
+    copies.clear();
+    root->setVersion(version);
+    return std::shared_ptr<const SchemaInfo>(root.release());
 }
 
@@ -14,6 +14,8 @@
 #include <iostream>
 #include <sstream>
 #include <functional>
+#include <atomic>
+#include <pthread.h>
 
 /*
  * The name must be unique as it is used as a unique identifier when
@@ -31,9 +33,12 @@
 class OnionMeta : public DBMeta {
 public:
     // New.
+    // > with a slot the onion shares the column (and key) of the other
+    //   slots of it's packed AGG onion
     OnionMeta(onion o, std::vector<SECLEVEL> levels,
               const AES_KEY * const m_key, const Create_field &cf,
-              unsigned long uniq_count, SECLEVEL minimum_seclevel);
+              unsigned long uniq_count, SECLEVEL minimum_seclevel,
+              const AGGSlot *const slot = NULL);
 
     // Restore.
     static std::unique_ptr<OnionMeta>
@@ -42,6 +47,11 @@ public:
               unsigned long uniq_count, SECLEVEL minimum_seclevel)
         : DBMeta(id), onionname(onionname), uniq_count(uniq_count),
           minimum_seclevel(minimum_seclevel) {}
+    // Copy-on-write; shares the EncLayers.
+    OnionMeta(const OnionMeta &om)
+        : DBMeta(om), layers(om.layers), onionname(om.onionname),
+          uniq_count(om.uniq_count), minimum_seclevel(om.minimum_seclevel)
+        {}
 
     std::string serialize(const DBObject &parent) const;
     std::string getAnonOnionName() const;
@@ -50,19 +60,26 @@ public:
         fetchChildren(const std::unique_ptr<Connect> &e_conn);
     bool applyToChildren(std::function<bool(const DBMeta &)>) const;
     UIntMetaKey const &getKey(const DBMeta &child) const;
+    DBMeta *deserializeChild(const std::string &key,
+                             const std::string &serial, unsigned int id);
+    std::unique_ptr<DBMeta> shallowCopy() const
+        {return std::unique_ptr<DBMeta>(new OnionMeta(*this));}
+    bool replaceChild(const DBMeta &child,
+                      std::unique_ptr<DBMeta> &&replacement);
+    bool removeChild(const DBMeta &child);
     EncLayer *getLayerBack() const;
     EncLayer *getLayer(const SECLEVEL &sl) const;
     bool hasEncLayer(const SECLEVEL &sl) const;
     SECLEVEL getSecLevel() const;
     unsigned long getUniq() const {return uniq_count;}
-    const std::vector<std::unique_ptr<EncLayer> > &getLayers() const
+    const std::vector<std::shared_ptr<EncLayer> > &getLayers() const
         {return layers;}
     SECLEVEL getMinimumSecLevel() const {return minimum_seclevel;}
     void setMinimumSecLevel(SECLEVEL seclevel) {this->minimum_seclevel = seclevel;}
 
 private:
     // first in list is lowest layer
-    std::vector<std::unique_ptr<EncLayer> > layers;
+    std::vector<std::shared_ptr<EncLayer> > layers;
     const std::string onionname;
     const unsigned long uniq_count;
     SECLEVEL minimum_seclevel;
@@ -73,6 +90,7 @@ class UniqueCounter {
 public:
     uint64_t leaseCount() {return getCounter_()++;}
     uint64_t currentCount() {return getCounter_();}
+    void setCount(uint64_t count) {getCounter_() = count;}
 
 private:
     virtual uint64_t &getCounter_() = 0;
@@ -82,9 +100,10 @@ class FieldMeta : public MappedDBMeta<OnionMeta, OnionMetaKey>,
                   public UniqueCounter {
 public:
     // New.
+    // > 'packer' places the AGG onion in a packed one if it may be
     FieldMeta(const Create_field &field, const AES_KEY * const mKey,
               SECURITY_RATING sec_rating, unsigned long uniq_count,
-              bool unique);
+              bool unique, AGGPacker *const packer = NULL);
     // Restore (WARN: Creates an incomplete type as it will not have it's
     // OnionMetas until they are added by the caller).
     static std::unique_ptr<FieldMeta>
@@ -110,6 +129,8 @@ public:
 
     OnionMeta *getOnionMeta(onion o) const;
     TYPENAME("fieldMeta");
+    std::unique_ptr<DBMeta> shallowCopy() const
+        {return std::unique_ptr<DBMeta>(new FieldMeta(*this));}
 
     SECURITY_RATING getSecurityRating() const {return sec_rating;}
     bool hasOnion(onion o) const;
@@ -165,6 +186,8 @@ public:
     std::vector<FieldMeta *> orderedFieldMetas() const;
     std::vector<FieldMeta *> defaultedFieldMetas() const;
     TYPENAME("tableMeta")
+    std::unique_ptr<DBMeta> shallowCopy() const
+        {return std::unique_ptr<DBMeta>(new TableMeta(*this));}
     std::string getAnonIndexName(const std::string &index_name,
                                  onion o) const;
 
@@ -191,49 +214,99 @@ public:
 
     std::string serialize(const DBObject &parent) const;
     TYPENAME("databaseMeta")
+    std::unique_ptr<DBMeta> shallowCopy() const
+        {return std::unique_ptr<DBMeta>(new DatabaseMeta(*this));}
 };
 
 // AWARE: Table/Field aliases __WILL NOT__ be looked up when calling from
 // this level or below. Use Analysis::* if you need aliasing.
 class SchemaInfo : public MappedDBMeta<DatabaseMeta, IdentityMetaKey> {
 public:
-    SchemaInfo() : MappedDBMeta(0) {}
+    SchemaInfo() : MappedDBMeta(0), version(0) {}
     ~SchemaInfo() {}
 
     TYPENAME("schemaInfo")
+    std::unique_ptr<DBMeta> shallowCopy() const
+        {return std::unique_ptr<DBMeta>(new SchemaInfo(*this));}
+    // > the SchemaCache epoch this snapshot was published at; it does
+    //   not change once the snapshot is handed out
+    uint64_t getVersion() const {return version;}
+    void setVersion(uint64_t v) {version = v;}
 
 private:
+    uint64_t version;
+
     std::string serialize(const DBObject &parent) const
     {
         FAIL_TextMessageError("SchemaInfo can not be serialized!");
     }
 };
 
+// > builds a new SchemaInfo snapshot from an old one; objects are copied
+//   only along the paths to the objects that change, everything else is
+//   shared with the old snapshot
+class SchemaInfoBuilder {
+    SchemaInfoBuilder(const SchemaInfoBuilder &other) = delete;
+    SchemaInfoBuilder &operator=(const SchemaInfoBuilder &rhs) = delete;
+
+public:
+    SchemaInfoBuilder(const SchemaInfo &base);
+
+    // > returns the copy of 'meta' in the new snapshot; NULL if 'meta'
+    //   is not a part of the old snapshot
+    DBMeta *getMutable(const DBMeta &meta);
+    // > the object 'meta' is known as in the new snapshot
+    const DBMeta &getCurrent(const DBMeta &meta) const;
+    std::shared_ptr<const SchemaInfo> build(uint64_t version);
+
+private:
+    const SchemaInfo &base;
+    std::unique_ptr<SchemaInfo> root;
+    std::map<const DBMeta *, DBMeta *> copies;
+};
+
+class Delta;
+
+// > getSchema(...) hands out immutable SchemaInfo snapshots; a client
+//   holds on to its snapshot for the duration of a query
+// > the metadata version is kept in memory; executors that modify the
+//   metadata hand their deltas to applyDeltas(...), or call stale() and
+//   the next getSchema(...) loads a new snapshot; otherwise no query is
+//   issued against the embedded database
 class SchemaCache {
     SchemaCache(const SchemaCache &cache) = delete;
     SchemaCache &operator=(const SchemaCache &cache) = delete;
     SchemaCache &operator=(SchemaCache &&cache) = delete;
 
 public:
-    SchemaCache() : no_loads(true), id(randomValue() % UINT_MAX) {}
+    SchemaCache() : loaded_epoch(0) {pthread_mutex_init(&lock, NULL);}
     SchemaCache(SchemaCache &&cache)
-        : schema(std::move(cache.schema)), no_loads(cache.no_loads),
-          id(cache.id) {}
+        : schema(std::atomic_load(&cache.schema)),
+          loaded_epoch(cache.loaded_epoch.load())
+        {pthread_mutex_init(&lock, NULL);}
+    ~SchemaCache() {pthread_mutex_destroy(&lock);}
 
     std::shared_ptr<const SchemaInfo>
         getSchema(const std::unique_ptr<Connect> &conn,
                   const std::unique_ptr<Connect> &e_conn) const;
-    void updateStaleness(const std::unique_ptr<Connect> &e_conn,
-                         bool staleness) const;
-    bool initialStaleness(const std::unique_ptr<Connect> &e_conn) const;
-    bool cleanupStaleness(const std::unique_ptr<Connect> &e_conn) const;
-    void lowLevelCurrentStale(const std::unique_ptr<Connect> &e_conn) const;
-    void lowLevelCurrentUnstale(const std::unique_ptr<Connect> &e_conn) const;
+    // Make everyone stale.
+    void stale() const;
+    // > the deltas have been written to the regular metadata table;
+    //   update our snapshot without reloading it
+    void applyDeltas(const std::vector<std::unique_ptr<Delta> > &deltas)
+        const;
+    uint64_t getEpoch() const {return SchemaCache::epoch.load();}
 
 private:
     mutable std::shared_ptr<const SchemaInfo> schema;
-    mutable bool no_loads;
-    const unsigned int id;
+    // > the epoch the current snapshot was loaded at
+    mutable std::atomic<uint64_t> loaded_epoch;
+    // > serializes loads; readers of a warm cache never take it
+    mutable pthread_mutex_t lock;
+
+    // > shared by every SchemaCache in the process as they are all
+    //   backed by the same embedded database
+    static std::atomic<uint64_t> epoch;
 };
 
 typedef std::shared_ptr<const SchemaInfo> SchemaInfoRef;
@@ -11,22 +11,27 @@ next(const ResType &res, const NextParams &nparams)
 {
     genericPreamble(nparams);
 
-    return this->nextImpl(res, nparams);
+    // > the epoch is not bumped before a step that stales; it's deltas
+    //   reach the regular metadata table in one transaction and a load
+    //   reads that table with one SELECT, so a load sees none or all of
+    //   them. applyDeltas(...) runs after the COMMIT under the lock
+    //   loads take, and stales us itself if it can not build on the
+    //   snapshot it finds
+    try {
+        return this->nextImpl(res, nparams);
+    } catch (...) {
+        // > we may have failed between writing deltas to the regular
+        //   metadata table and applying them to our snapshot
+        if (this->stales()) {
+            nparams.ps.getSchemaCache().stale();
+        }
+        throw;
+    }
 }
 
 void AbstractQueryExecutor::
 genericPreamble(const NextParams &nparams)
 {
-    // We handle before any queries because a failed query
-    // may stale the database during recovery and then
-    // we'd have to handle there as well.
-    try {
-        nparams.ps.getSchemaCache().updateStaleness(
-            nparams.ps.getEConn(), this->stales());
-    } catch (const SchemaFailure &e) {
-        FAIL_GenericPacketException("failed updating staleness");
-    }
-
     if (this->usesEmbedded()) {
         TEST_ErrPkt(
             lowLevelSetCurrentDatabase(nparams.ps.getEConn(), nparams.default_db),
@@ -50,14 +50,29 @@ newAnything(const Type &t)
     return new Anything<Type>(t);
 }
 
+// > the error packet the backend answered a query with; executors whose
+//   errors are the backend's own throw it to send it to the client as is
+struct BackendError {
+    std::string message;
+    unsigned int code;
+    std::string sqlstate;
+};
+
 struct NextParams {
     const ProxyState &ps;
-    const std::string &default_db;
+    // > the proxy tracks the session's database itself; executors for
+    //   queries that change it (USE, DROP DATABASE) update it once the
+    //   server has accepted the change
+    std::string &default_db;
     const std::string original_query;
-
-    NextParams(const ProxyState &ps, const std::string &default_db,
-               const std::string &original_query)
-        : ps(ps), default_db(default_db), original_query(original_query) {}
+    // > NULL unless the last query failed on the backend
+    const BackendError *backend_error;
+
+    NextParams(const ProxyState &ps, std::string &default_db,
+               const std::string &original_query,
+               const BackendError *backend_error = NULL)
+        : ps(ps), default_db(default_db), original_query(original_query),
+          backend_error(backend_error) {}
 };
 
 class AbstractQueryExecutor {
@@ -76,6 +91,13 @@ public:
         nextImpl(const ResType &res, const NextParams &nparams) = 0;
     virtual bool stales() const {return false;}
     virtual bool usesEmbedded() const {return false;}
+    // > the executor issues one rewritten query and decrypts it's
+    //   results; such rewrites can be kept in the PlanCache
+    virtual bool cacheable() const {return false;}
+    // > the results of the query the executor asks for next are only
+    //   decrypted and handed to the client, so the proxy may decrypt them
+    //   a batch at a time instead of calling next(...) with all of them
+    virtual const ReturnMeta *batchedResults() const {return NULL;}
 
 private:
     void genericPreamble(const NextParams &nparams);
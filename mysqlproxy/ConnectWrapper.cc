@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <lua5.1/lua.hpp>
 
+#include <crypto/ope.hh>
+
 #include <util/ctr.hh>
 #include <util/cryptdb_log.hh>
 #include <util/scoped_lock.hh>
@@ -16,6 +18,9 @@
 #include <parser/sql_utils.hh>
 #include <parser/mysql_type_metadata.hh>
 
+#include <mysqlproxy/prepared_stmt.hh>
+#include <mysqlproxy/result_packets.hh>
+
 __thread ProxyState *thread_ps = NULL;
 
 class WrapperState {
@@ -26,11 +31,36 @@ class WrapperState {
 
 public:
     std::string last_query;
+    // > the session's database as tracked from the handshake, USE and
+    //   COM_INIT_DB; we only ask the server for it when we can no longer
+    //   trust our copy
     std::string default_db;
+    bool default_db_synced;
+    unsigned long long backend_thread_id;
     std::ofstream * PLAIN_LOG;
-
-    WrapperState() {}
-    ~WrapperState() {}
+    // > the client's prepared statements; they never reach the backend
+    std::map<unsigned int, std::unique_ptr<PreparedStatement> > statements;
+    unsigned int next_statement_id;
+    // > the current query is a COM_STMT_EXECUTE and wants binary rows
+    bool binary_results;
+    bool binary_passthrough;
+    // > the longest value in each column of the result being decrypted
+    //   a batch at a time
+    std::vector<unsigned int> batch_lengths;
+    // > the server status of the backend's last result; the result sets
+    //   we build report it
+    unsigned short server_status;
+
+    WrapperState() : default_db_synced(false), backend_thread_id(0),
+                     next_statement_id(1), binary_results(false),
+                     binary_passthrough(false),
+                     server_status(SERVER_STATUS_AUTOCOMMIT)
+        {pthread_mutex_init(&lock, NULL);}
+    ~WrapperState() {pthread_mutex_destroy(&lock);}
+
+    // > serializes the lua entry points of a single client; distinct
+    //   clients proceed concurrently
+    pthread_mutex_t *getLock() {return &lock;}
 
     const std::unique_ptr<QueryRewrite> &getQueryRewrite() const {
         assert(this->qr);
@@ -47,9 +77,10 @@ public:
     }
 
     std::unique_ptr<ProxyState> ps;
-    // we are running cryptdb in a threaded environment without proper
-    // locking; this leads to crashes during onion adjustment unless we
-    // take some minimal precautions
+    Timer t;
+    // clients run concurrently and share the SchemaInfo handed out by
+    // the SchemaCache; this leads to crashes during onion adjustment
+    // unless we take some minimal precautions
     // > everytime we process a query we take a reference to the SchemaInfo
     //   so that we know the same SchemaInfo (and it's children) will be
     //   available on the backend for Deltaz; this handles the following
@@ -65,8 +96,8 @@ public:
     //        reference doesn't protect it. now when thread B gets his
     //        SchemaInfo the cache is still stale so he deletes the only
     //        reference to the SchemaInfo thread A is using
-    //      + this case only applies if we aren't using the lock on each
-    //        function (connect, disonnect, rewrite, envoi); thread A
+    //      + this case applies because clients don't share a lock
+    //        (connect, disonnect, rewrite, next); thread A
     //        takes a reference to SchemaInfo then before he can ``get''
     //        the SchemaInfo thread B stales the cache. now thread A
     //        gets the SchemaInfo and his reference doesn't protect it.
@@ -77,13 +108,14 @@ public:
 
 private:
     std::unique_ptr<QueryRewrite> qr;
+    pthread_mutex_t lock;
 };
 
-static Timer t;
-
 //static EDBProxy * cl = NULL;
 static SharedProxyState * shared_ps = NULL;
-static pthread_mutex_t big_lock;
+// > guards clients, shared_ps and the plain query logging globals;
+//   only held long enough to find or register a client
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static bool EXECUTE_QUERIES = true;
 
@@ -92,10 +124,27 @@ static std::string TRAIN_QUERY ="";
 static bool LOG_PLAIN_QUERIES = false;
 static std::string PLAIN_BASELOG = "";
 
+// > where the OPE node cache is kept between runs of the proxy
+static std::string OPE_CACHE_PATH = "";
+
 
 static int counter = 0;
 
-static std::map<std::string, WrapperState*> clients;
+static std::map<std::string, std::shared_ptr<WrapperState> > clients;
+
+// > the shared_ptr keeps the WrapperState alive if the client is
+//   disconnected while we are still working on its behalf
+static std::shared_ptr<WrapperState>
+getClient(const std::string &client)
+{
+    scoped_lock l(&clients_lock);
+    const auto &it = clients.find(client);
+    if (clients.end() == it) {
+        return std::shared_ptr<WrapperState>();
+    }
+
+    return it->second;
+}
 
 static void
 returnResultSet(lua_State *L, const ResType &res);
@@ -127,7 +176,6 @@ connect(lua_State *const L)
     assert(test64bitZZConversions());
 
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
@@ -136,88 +184,119 @@ connect(lua_State *const L)
     const std::string user = xlua_tolstring(L, 4);
     const std::string psswd = xlua_tolstring(L, 5);
     const std::string embed_dir = xlua_tolstring(L, 6);
+    // > the database the client gave in the handshake, if any
+    const bool handshake_db = !lua_isnil(L, 7);
 
     ConnectionInfo const ci = ConnectionInfo(server, user, psswd, port);
 
-    assert(clients.end() == clients.find(client));
-    clients[client] = new WrapperState();
-
-    // Is it the first connection?
-    if (!shared_ps) {
-        std::cerr << "starting proxy\n";
-        //cryptdb_logger::setConf(string(getenv("CRYPTDB_LOG")?:""));
-
-        LOG(wrapper) << "connect " << client << "; "
-                     << "server = " << server << ":" << port << "; "
-                     << "user = " << user << "; "
-                     << "password = " << psswd;
-
-        const std::string &false_str = "FALSE";
-        const std::string &mkey      = "113341234";  // XXX do not change as
-                                                     // it's used for tpcc exps
-        shared_ps =
-            new SharedProxyState(ci, embed_dir, mkey,
-                                 determineSecurityRating());
-
-        //may need to do training
-        const char *ev = getenv("TRAIN_QUERY");
-        if (ev) {
-            std::cerr << "Deprecated query training!" << std::endl;
-        }
+    const std::shared_ptr<WrapperState> ws(new WrapperState());
+    // > nobody else can see the new client until it is registered, but
+    //   take its lock before we do so that rewrite(...) and next(...)
+    //   wait for the ProxyState
+    scoped_lock ws_l(ws->getLock());
+    if (handshake_db) {
+        ws->default_db = xlua_tolstring(L, 7);
+        ws->default_db_synced = true;
+    }
 
-        ev = getenv("EXECUTE_QUERIES");
-        if (ev && equalsIgnoreCase(false_str, ev)) {
-            LOG(wrapper) << "do not execute queries";
-            EXECUTE_QUERIES = false;
-        } else {
-            LOG(wrapper) << "execute queries";
-            EXECUTE_QUERIES = true;
-        }
+    {
+        scoped_lock l(&clients_lock);
+        assert(clients.end() == clients.find(client));
+        clients[client] = ws;
+
+        // Is it the first connection?
+        if (!shared_ps) {
+            std::cerr << "starting proxy\n";
+            //cryptdb_logger::setConf(string(getenv("CRYPTDB_LOG")?:""));
+
+            LOG(wrapper) << "connect " << client << "; "
+                         << "server = " << server << ":" << port << "; "
+                         << "user = " << user << "; "
+                         << "password = " << psswd;
+
+            const std::string &false_str = "FALSE";
+            const std::string &mkey      = "113341234";  // XXX do not change as
+                                                         // it's used for tpcc exps
+            shared_ps =
+                new SharedProxyState(ci, embed_dir, mkey,
+                                     determineSecurityRating());
+
+            //may need to do training
+            const char *ev = getenv("TRAIN_QUERY");
+            if (ev) {
+                std::cerr << "Deprecated query training!" << std::endl;
+            }
 
-        ev = getenv("LOAD_ENC_TABLES");
-        if (ev) {
-            std::cerr << "No current functionality for loading tables\n";
-            //cerr << "loading enc tables\n";
-            //cl->loadEncTables(string(ev));
-        }
+            ev = getenv("EXECUTE_QUERIES");
+            if (ev && equalsIgnoreCase(false_str, ev)) {
+                LOG(wrapper) << "do not execute queries";
+                EXECUTE_QUERIES = false;
+            } else {
+                LOG(wrapper) << "execute queries";
+                EXECUTE_QUERIES = true;
+            }
 
-        ev = getenv("LOG_PLAIN_QUERIES");
-        if (ev) {
-            std::string logPlainQueries = std::string(ev);
-            if (logPlainQueries != "") {
-                LOG_PLAIN_QUERIES = true;
-                PLAIN_BASELOG = logPlainQueries;
-                logPlainQueries += StringFromVal(++counter);
+            ev = getenv("CRYPTDB_OPE_CACHE_MB");
+            if (ev) {
+                OPECache::shared().setBudget(
+                    static_cast<size_t>(atoi(ev)) << 20);
+            }
 
-                assert_s(system(("rm -f" + logPlainQueries + "; touch " + logPlainQueries).c_str()) >= 0, "failed to rm -f and touch " + logPlainQueries);
+            ev = getenv("CRYPTDB_OPE_CACHE");
+            if (ev) {
+                OPE_CACHE_PATH = ev;
+                if (OPECache::shared().load(OPE_CACHE_PATH)) {
+                    LOG(wrapper) << "loaded "
+                                 << OPECache::shared().entries()
+                                 << " OPE nodes from " << OPE_CACHE_PATH;
+                }
+            }
+
+            ev = getenv("LOAD_ENC_TABLES");
+            if (ev) {
+                std::cerr << "No current functionality for loading tables\n";
+                //cerr << "loading enc tables\n";
+                //cl->loadEncTables(string(ev));
+            }
+
+            ev = getenv("LOG_PLAIN_QUERIES");
+            if (ev) {
+                std::string logPlainQueries = std::string(ev);
+                if (logPlainQueries != "") {
+                    LOG_PLAIN_QUERIES = true;
+                    PLAIN_BASELOG = logPlainQueries;
+                    logPlainQueries += StringFromVal(++counter);
+
+                    assert_s(system(("rm -f" + logPlainQueries + "; touch " + logPlainQueries).c_str()) >= 0, "failed to rm -f and touch " + logPlainQueries);
+
+                    std::ofstream * const PLAIN_LOG =
+                        new std::ofstream(logPlainQueries, std::ios_base::app);
+                    LOG(wrapper) << "proxy logs plain queries at " << logPlainQueries;
+                    assert_s(PLAIN_LOG != NULL, "could not create file " + logPlainQueries);
+                    ws->PLAIN_LOG = PLAIN_LOG;
+                } else {
+                    LOG_PLAIN_QUERIES = false;
+                }
+            }
+        } else {
+            if (LOG_PLAIN_QUERIES) {
+                std::string logPlainQueries =
+                    PLAIN_BASELOG+StringFromVal(++counter);
+                assert_s(system((" touch " + logPlainQueries).c_str()) >= 0, "failed to remove or touch plain log");
+                LOG(wrapper) << "proxy logs plain queries at " << logPlainQueries;
 
                 std::ofstream * const PLAIN_LOG =
                     new std::ofstream(logPlainQueries, std::ios_base::app);
-                LOG(wrapper) << "proxy logs plain queries at " << logPlainQueries;
                 assert_s(PLAIN_LOG != NULL, "could not create file " + logPlainQueries);
-                clients[client]->PLAIN_LOG = PLAIN_LOG;
-            } else {
-                LOG_PLAIN_QUERIES = false;
+                ws->PLAIN_LOG = PLAIN_LOG;
             }
         }
-    } else {
-        if (LOG_PLAIN_QUERIES) {
-            std::string logPlainQueries =
-                PLAIN_BASELOG+StringFromVal(++counter);
-            assert_s(system((" touch " + logPlainQueries).c_str()) >= 0, "failed to remove or touch plain log");
-            LOG(wrapper) << "proxy logs plain queries at " << logPlainQueries;
-
-            std::ofstream * const PLAIN_LOG =
-                new std::ofstream(logPlainQueries, std::ios_base::app);
-            assert_s(PLAIN_LOG != NULL, "could not create file " + logPlainQueries);
-            clients[client]->PLAIN_LOG = PLAIN_LOG;
-        }
     }
-    clients[client]->ps =
-        std::unique_ptr<ProxyState>(new ProxyState(*shared_ps));
+
+    ws->ps = std::unique_ptr<ProxyState>(new ProxyState(*shared_ps));
     // We don't want to use the THD from the previous connection
     // if such is even possible...
-    clients[client]->ps->safeCreateEmbeddedTHD();
+    ws->ps->safeCreateEmbeddedTHD();
 
     return 0;
 }
@@ -226,57 +305,70 @@ static int
 disconnect(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
-    if (clients.find(client) == clients.end()) {
-        return 0;
+    std::shared_ptr<WrapperState> ws;
+    bool last_client;
+    {
+        scoped_lock l(&clients_lock);
+        const auto &it = clients.find(client);
+        if (clients.end() == it) {
+            return 0;
+        }
+        ws = it->second;
+        clients.erase(it);
+        last_client = clients.empty();
     }
 
     LOG(wrapper) << "disconnect " << client;
 
-    auto ws = clients[client];
-    clients[client] = NULL;
+    {
+        // wait for any work still in flight for this client
+        scoped_lock ws_l(ws->getLock());
+        thread_ps = NULL;
+        ws->ps.reset();
+    }
 
-    thread_ps = NULL;
-    delete ws;
-    clients.erase(client);
+    // > the proxy may be stopped any time nobody is connected
+    if (last_client && false == OPE_CACHE_PATH.empty()) {
+        if (false == OPECache::shared().save(OPE_CACHE_PATH)) {
+            LOG(warn) << "could not save the OPE cache to "
+                      << OPE_CACHE_PATH;
+        }
+    }
 
     mysql_thread_end();
     return 0;
 }
 
+// > pushes the status and error message for lua
 static int
-rewrite(lua_State *const L)
+rewriteQuery(lua_State *const L, WrapperState *const c_wrapper,
+             ProxyState *const ps, const std::string &query,
+             unsigned long long _thread_id)
 {
-    ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
-    assert(0 == mysql_thread_init());
-
-    const std::string client = xlua_tolstring(L, 1);
-    if (clients.find(client) == clients.end()) {
-        lua_pushnil(L);
-        xlua_pushlstring(L, "failed to recognize client");     
-        return 2;
-    }
-    WrapperState *const c_wrapper = clients[client];
-    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
-    assert(ps);
-
-    const std::string &query = xlua_tolstring(L, 2);
-    const unsigned long long _thread_id =
-        strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
-
     std::list<std::string> new_queries;
 
+    c_wrapper->binary_passthrough = false;
     c_wrapper->last_query = query;
-    t.lap_ms();
+    c_wrapper->t.lap_ms();
     if (EXECUTE_QUERIES) {
         try {
-            TEST_Text(retrieveDefaultDatabase(_thread_id, ps->getConn(),
-                                              &c_wrapper->default_db),
-                      "proxy failed to retrieve default database!");
+            // > a new backend thread means mysql-proxy reconnected us
+            //   and the server session starts over
+            if (c_wrapper->backend_thread_id != _thread_id) {
+                if (0 != c_wrapper->backend_thread_id) {
+                    c_wrapper->default_db_synced = false;
+                }
+                c_wrapper->backend_thread_id = _thread_id;
+            }
+            if (false == c_wrapper->default_db_synced) {
+                TEST_Text(retrieveDefaultDatabase(_thread_id, ps->getConn(),
+                                                  &c_wrapper->default_db),
+                          "proxy failed to retrieve default database!");
+                c_wrapper->default_db_synced = true;
+            }
             // save a reference so a second thread won't eat objects
             // that DeltaOuput wants later
             const std::shared_ptr<const SchemaInfo> &schema =
@@ -311,6 +403,216 @@ rewrite(lua_State *const L)
     return 2;
 }
 
+static int
+rewrite(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        lua_pushnil(L);
+        xlua_pushlstring(L, "failed to recognize client");     
+        return 2;
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+
+    const std::string &query = xlua_tolstring(L, 2);
+    const unsigned long long _thread_id =
+        strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
+
+    c_wrapper->binary_results = false;
+    return rewriteQuery(L, c_wrapper.get(), ps, query, _thread_id);
+}
+
+static void
+xlua_pushpackets(lua_State *const L, const std::vector<std::string> &packets)
+{
+    lua_createtable(L, static_cast<int>(packets.size()), 0);
+    int const t_packets = lua_gettop(L);
+    for (uint i = 0; i < packets.size(); ++i) {
+        xlua_pushlstring(L, packets[i]);
+        lua_rawseti(L, t_packets, i+1);
+    }
+}
+
+// > COM_STMT_PREPARE; the statement is kept by the proxy and the
+//   response packets are handed back to lua
+static int
+stmt_prepare(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "failed to recognize client");
+        return 2;
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+
+    const std::string &query = xlua_tolstring(L, 2);
+    try {
+        std::unique_ptr<PreparedStatement>
+            stmt(new PreparedStatement(query));
+
+        // > clients that bind their result buffers from the prepare
+        //   response need the columns now
+        std::vector<std::string> columns;
+        if (EXECUTE_QUERIES) {
+            const std::shared_ptr<const SchemaInfo> &schema =
+                ps->getSchemaInfo();
+            columns = Rewriter::resultColumns(stmt->withNullParameters(),
+                                              *schema.get(),
+                                              c_wrapper->default_db, *ps);
+        }
+
+        const unsigned int id = c_wrapper->next_statement_id++;
+        const std::vector<std::string> &packets =
+            prepareOkPackets(id, *stmt.get(), columns,
+                             c_wrapper->server_status);
+        c_wrapper->statements[id] = std::move(stmt);
+
+        lua_pushboolean(L, true);                   // status
+        xlua_pushpackets(L, packets);               // response
+        return 2;
+    } catch (const AbstractException &e) {
+        lua_pushboolean(L, false);                  // status
+        xlua_pushlstring(L, e.to_string());         // error message
+        return 2;
+    } catch (const CryptDBError &e) {
+        lua_pushboolean(L, false);                  // status
+        xlua_pushlstring(L, e.msg);                 // error message
+        return 2;
+    }
+}
+
+// > COM_STMT_EXECUTE; binds the parameters and rewrites the statement
+//   like any other query
+static int
+stmt_execute(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        lua_pushboolean(L, false);
+        xlua_pushlstring(L, "failed to recognize client");
+        return 2;
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+
+    const std::string &packet = xlua_tolstring(L, 2);
+    const unsigned long long _thread_id =
+        strtoull(xlua_tolstring(L, 3).c_str(), NULL, 10);
+
+    std::string query;
+    try {
+        const auto &it = c_wrapper->statements.find(statementId(packet));
+        TEST_Text(c_wrapper->statements.end() != it,
+                  "unknown prepared statement");
+        query = it->second->bind(packet);
+    } catch (const AbstractException &e) {
+        lua_pushboolean(L, false);                  // status
+        xlua_pushlstring(L, e.to_string());         // error message
+        return 2;
+    }
+
+    c_wrapper->binary_results = true;
+    return rewriteQuery(L, c_wrapper.get(), ps, query, _thread_id);
+}
+
+// > COM_STMT_SEND_LONG_DATA; the server never answers it so neither do
+//   we, a bad packet is ignored like the server would
+static int
+stmt_send_long_data(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        return 0;
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+
+    const std::string &packet = xlua_tolstring(L, 2);
+    try {
+        const auto &it = c_wrapper->statements.find(statementId(packet));
+        if (c_wrapper->statements.end() != it) {
+            it->second->appendLongData(packet);
+        }
+    } catch (const AbstractException &e) {
+        LOG(warn) << "bad long data packet: " << e.to_string();
+    }
+
+    return 0;
+}
+
+// > COM_STMT_RESET; false if the statement is unknown
+static int
+stmt_reset(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+
+    try {
+        const auto &it =
+            c_wrapper->statements.find(statementId(xlua_tolstring(L, 2)));
+        if (c_wrapper->statements.end() == it) {
+            lua_pushboolean(L, false);
+            return 1;
+        }
+        it->second->reset();
+    } catch (const AbstractException &) {
+        lua_pushboolean(L, false);
+        return 1;
+    }
+
+    lua_pushboolean(L, true);
+    return 1;
+}
+
+// > COM_STMT_CLOSE
+static int
+stmt_close(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        return 0;
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+
+    try {
+        c_wrapper->statements.erase(statementId(xlua_tolstring(L, 2)));
+    } catch (const AbstractException &e) {
+        LOG(warn) << "bad close statement packet: " << e.to_string();
+    }
+
+    return 0;
+}
+
 inline std::vector<Item *>
 itemNullVector(unsigned int count)
 {
@@ -322,18 +624,11 @@ itemNullVector(unsigned int count)
     return out;
 }
 
-static ResType
-getResTypeFromLuaTable(lua_State *const L, int fields_index,
-                       int rows_index, int affected_rows_index,
-                       int insert_id_index, int status_index)
+static void
+getFieldsFromLuaTable(lua_State *const L, int fields_index,
+                      std::vector<std::string> *const names,
+                      std::vector<enum_field_types> *const types)
 {
-    const bool status = lua_toboolean(L, status_index);
-    if (false == status) {
-        return ResType(false, 0, 0);
-    }
-
-    std::vector<std::string> names;
-    std::vector<enum_field_types> types;
     /* iterate over the fields argument */
     lua_pushnil(L);
     while (lua_next(L, fields_index)) {
@@ -344,9 +639,9 @@ getResTypeFromLuaTable(lua_State *const L, int fields_index,
         while (lua_next(L, -2)) {
             const std::string k = xlua_tolstring(L, -2);
             if ("name" == k) {
-                names.push_back(xlua_tolstring(L, -1));
+                names->push_back(xlua_tolstring(L, -1));
             } else if ("type" == k) {
-                types.push_back(static_cast<enum_field_types>(luaL_checkint(L, -1)));
+                types->push_back(static_cast<enum_field_types>(luaL_checkint(L, -1)));
             } else {
                 LOG(warn) << "unknown key " << k;
             }
@@ -356,8 +651,13 @@ getResTypeFromLuaTable(lua_State *const L, int fields_index,
         lua_pop(L, 1);
     }
 
-    assert(names.size() == types.size());
+    assert(names->size() == types->size());
+}
 
+static std::vector<std::vector<Item *> >
+getRowsFromLuaTable(lua_State *const L, int rows_index,
+                    const std::vector<enum_field_types> &types)
+{
     /* iterate over the rows argument */
     std::vector<std::vector<Item *> > rows;
     lua_pushnil(L);
@@ -389,6 +689,26 @@ getResTypeFromLuaTable(lua_State *const L, int fields_index,
         lua_pop(L, 1);
     }
 
+    return rows;
+}
+
+static ResType
+getResTypeFromLuaTable(lua_State *const L, int fields_index,
+                       int rows_index, int affected_rows_index,
+                       int insert_id_index, int status_index)
+{
+    const bool status = lua_toboolean(L, status_index);
+    if (false == status) {
+        return ResType(false, 0, 0);
+    }
+
+    std::vector<std::string> names;
+    std::vector<enum_field_types> types;
+    getFieldsFromLuaTable(L, fields_index, &names, &types);
+
+    std::vector<std::vector<Item *> > rows =
+        getRowsFromLuaTable(L, rows_index, types);
+
     return ResType(status, lua_tointeger(L, affected_rows_index),
                    lua_tointeger(L, insert_id_index), std::move(names),
                    std::move(types), std::move(rows));
@@ -404,24 +724,51 @@ nilBuffer(lua_State *const L, size_t count)
     return;
 }
 
+static int
+returnError(lua_State *const L, const std::string &message,
+            unsigned int code, const std::string &sqlstate)
+{
+    xlua_pushlstring(L, "error");
+    xlua_pushlstring(L, message);
+     lua_pushinteger(L, code);
+    xlua_pushlstring(L, sqlstate);
+
+    nilBuffer(L, 1);
+    return 5;
+}
+
+static int
+returnResults(lua_State *const L, const ResType &res, bool binary,
+              unsigned short status)
+{
+    // > result set packets are built here and lua sends them as is
+    if (res.names.size() > 0) {
+        TEST_GenericPacketException(true == res.ok, "something bad happened");
+        xlua_pushlstring(L, "raw-results");
+        xlua_pushpackets(L, true == binary
+                                ? binaryResultSetPackets(res, status)
+                                : textResultSetPackets(res, status));
+        nilBuffer(L, 3);
+        return 5;
+    }
+
+    xlua_pushlstring(L, "results");
+    returnResultSet(L, res);        // pushes 4 items on stack
+    return 5;
+}
+
 static int
 next(lua_State *const L)
 {
     ANON_REGION(__func__, &perf_cg);
-    scoped_lock l(&big_lock);
     assert(0 == mysql_thread_init());
 
     const std::string client = xlua_tolstring(L, 1);
-    if (clients.find(client) == clients.end()) {
-        xlua_pushlstring(L, "error");
-        xlua_pushlstring(L, "unknown client");
-         lua_pushinteger(L,  100);
-        xlua_pushlstring(L, "12345");
-
-        nilBuffer(L, 1);
-        return 5;
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        return returnError(L, "unknown client", 100, "12345");
     }
-    WrapperState *const c_wrapper = clients[client];
+    scoped_lock ws_l(c_wrapper->getLock());
 
     assert(EXECUTE_QUERIES);
 
@@ -430,9 +777,29 @@ next(lua_State *const L)
     ps->safeCreateEmbeddedTHD();
 
     const ResType &res = getResTypeFromLuaTable(L, 2, 3, 4, 5, 6);
+    // > lua passes the backend's error packet along with a failed result
+    std::unique_ptr<BackendError> backend_error;
+    if (!lua_isnil(L, 7)) {
+        backend_error.reset(new BackendError());
+        backend_error->message = xlua_tolstring(L, 7);
+        backend_error->code = lua_tointeger(L, 8);
+        backend_error->sqlstate = xlua_tolstring(L, 9);
+    }
+    if (!lua_isnoneornil(L, 10)) {
+        c_wrapper->server_status = lua_tointeger(L, 10);
+    }
     const std::unique_ptr<QueryRewrite> &qr = c_wrapper->getQueryRewrite();
     try {
-        NextParams nparams(*ps, c_wrapper->default_db, c_wrapper->last_query);
+        NextParams nparams(*ps, c_wrapper->default_db, c_wrapper->last_query,
+                           backend_error.get());
+
+        // > the plaintext results of a query we passed through for a
+        //   binary protocol client
+        if (true == c_wrapper->binary_passthrough) {
+            c_wrapper->binary_passthrough = false;
+            TEST_ErrPkt(res.success(), "prepared statement failed");
+            return returnResults(L, res, true, c_wrapper->server_status);
+        }
 
         c_wrapper->selfKill(KillZone::Where::Before);
         const auto &new_results = qr->executor->next(res, nparams);
@@ -447,15 +814,25 @@ next(lua_State *const L)
         switch (result_type) {
         case AbstractQueryExecutor::ResultType::QUERY_COME_AGAIN: {
             // more to do before we have the client's results
-            xlua_pushlstring(L, "again");
-
             const auto &output =
                 std::get<1>(new_results)->extract<std::pair<bool, std::string> >();
 
             const auto &want_interim = output.first;
-            lua_pushboolean(L, want_interim);
-
             const auto &next_query = output.second;
+            // > lua hands us the rows a batch at a time with
+            //   decrypt_rows(...) and finishes with decrypt_end(...)
+            if (true == want_interim
+                && false == c_wrapper->binary_results
+                && qr->executor->batchedResults()) {
+                c_wrapper->batch_lengths.clear();
+                xlua_pushlstring(L, "batches");
+                xlua_pushlstring(L, next_query);
+                nilBuffer(L, 3);
+                return 5;
+            }
+
+            xlua_pushlstring(L, "again");
+            lua_pushboolean(L, want_interim);
             xlua_pushlstring(L, next_query);
 
             nilBuffer(L, 2);
@@ -464,34 +841,177 @@ next(lua_State *const L)
         case AbstractQueryExecutor::ResultType::QUERY_USE_RESULTS: {
             // the results of executing this query should be send directly
             // back to the client
-            xlua_pushlstring(L, "query-results");
             const auto &new_query =
                 std::get<1>(new_results)->extract<std::string>();
+            // > the backend would answer with text rows; have the
+            //   results come back to us instead
+            if (true == c_wrapper->binary_results) {
+                c_wrapper->binary_passthrough = true;
+                xlua_pushlstring(L, "again");
+                lua_pushboolean(L, true);
+                xlua_pushlstring(L, new_query);
+                nilBuffer(L, 2);
+                return 5;
+            }
 
+            xlua_pushlstring(L, "query-results");
             xlua_pushlstring(L, new_query);
             nilBuffer(L, 3);
             return 5;
         }
         case AbstractQueryExecutor::ResultType::RESULTS: {
             // ready to return results to the client
-            xlua_pushlstring(L, "results");
-
             const auto &res = new_results.second->extract<ResType>();
-            returnResultSet(L, res);        // pushes 4 items on stack
-            return 5;
+            return returnResults(L, res, c_wrapper->binary_results,
+                                 c_wrapper->server_status);
         }
         default:
             assert(false);
         }
     } catch (const ErrorPacketException &e) {
+        // > we can't tell how far the server got with the query so
+        //   don't trust our copy of the session's database
+        c_wrapper->default_db_synced = false;
+
         // lua_pop(L, lua_gettop(L));
-        xlua_pushlstring(L, "error");
-        xlua_pushlstring(L, e.getMessage());
-         lua_pushinteger(L, e.getErrorCode());
-        xlua_pushlstring(L, e.getSQLState());
+        return returnError(L, e.getMessage(), e.getErrorCode(),
+                           e.getSQLState());
+    } catch (const BackendError &e) {
+        return returnError(L, e.message, e.code, e.sqlstate);
+    }
+}
 
-        nilBuffer(L, 1);
+static ResType
+decryptResultBatch(const ResType &res, const ReturnMeta &rmeta)
+{
+    try {
+        return Rewriter::decryptResults(res, rmeta);
+    } catch (...) {
+        FAIL_GenericPacketException("error decrypting dml results");
+    }
+
+    assert(false);
+}
+
+// > the rows of a result that next(...) asked lua to hand over in
+//   batches; decrypts one batch of them and appends their row packets to
+//   the table at index 4; returns nothing unless there is an error
+static int
+decrypt_rows(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        return returnError(L, "unknown client", 100, "12345");
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+    ps->ensureEmbeddedTHD();
+
+    const ReturnMeta *const rmeta =
+        c_wrapper->getQueryRewrite()->executor->batchedResults();
+    assert(rmeta);
+    try {
+        // > the Items of the batch go away with it so the memory we use
+        //   follows the batch size and not the size of the result
+        const ScopedMemRoot batch_root;
+
+        std::vector<std::string> names;
+        std::vector<enum_field_types> types;
+        getFieldsFromLuaTable(L, 2, &names, &types);
+        std::vector<std::vector<Item *> > rows =
+            getRowsFromLuaTable(L, 3, types);
+        const ResType batch(true, 0, 0, std::move(names), std::move(types),
+                            std::move(rows));
+
+        const ResType &dec_batch = decryptResultBatch(batch, *rmeta);
+        size_t index = lua_objlen(L, 4);
+        for (const auto &it : dec_batch.rows) {
+            xlua_pushlstring(L,
+                             textRowPacket(it, &c_wrapper->batch_lengths));
+            lua_rawseti(L, 4, ++index);
+        }
+    } catch (const ErrorPacketException &e) {
+        return returnError(L, e.getMessage(), e.getErrorCode(),
+                           e.getSQLState());
+    }
+
+    return 0;
+}
+
+// > returns the same values as next(...); the result set is sent with
+//   the row packets decrypt_rows(...) collected
+static int
+decrypt_end(lua_State *const L)
+{
+    ANON_REGION(__func__, &perf_cg);
+    assert(0 == mysql_thread_init());
+
+    const std::string client = xlua_tolstring(L, 1);
+    const std::shared_ptr<WrapperState> &c_wrapper = getClient(client);
+    if (!c_wrapper) {
+        return returnError(L, "unknown client", 100, "12345");
+    }
+    scoped_lock ws_l(c_wrapper->getLock());
+
+    ProxyState *const ps = thread_ps = c_wrapper->ps.get();
+    assert(ps);
+    ps->ensureEmbeddedTHD();
+
+    const std::unique_ptr<QueryRewrite> &qr = c_wrapper->getQueryRewrite();
+    const ReturnMeta *const rmeta = qr->executor->batchedResults();
+    assert(rmeta);
+    c_wrapper->setKillZone(qr->kill_zone);
+    if (!lua_isnoneornil(L, 6)) {
+        c_wrapper->server_status = lua_tointeger(L, 6);
+    }
+    try {
+        std::vector<std::string> names;
+        std::vector<enum_field_types> types;
+        getFieldsFromLuaTable(L, 2, &names, &types);
+        const ResType res(true, lua_tointeger(L, 4), lua_tointeger(L, 5),
+                          std::move(names), std::move(types));
+        const ResType &dec_res = decryptResultBatch(res, *rmeta);
+        if (0 == dec_res.names.size()) {
+            xlua_pushlstring(L, "results");
+            returnResultSet(L, dec_res);
+            return 5;
+        }
+
+        // > the header goes in front of the rows; the row packets are
+        //   only referenced, not copied
+        std::vector<unsigned int> &lengths = c_wrapper->batch_lengths;
+        lengths.resize(dec_res.names.size(), 0);
+        const std::vector<std::string> &header =
+            resultSetHeader(dec_res.names, dec_res.types, lengths,
+                            c_wrapper->server_status);
+        const size_t rows = lua_objlen(L, 3);
+
+        xlua_pushlstring(L, "raw-results");
+        lua_createtable(L, static_cast<int>(header.size() + rows + 1), 0);
+        const int t_packets = lua_gettop(L);
+        size_t index = 0;
+        for (const auto &it : header) {
+            xlua_pushlstring(L, it);
+            lua_rawseti(L, t_packets, ++index);
+        }
+        for (size_t i = 1; i <= rows; ++i) {
+            lua_rawgeti(L, 3, i);
+            lua_rawseti(L, t_packets, ++index);
+        }
+        xlua_pushlstring(L, eofPacket(c_wrapper->server_status));
+        lua_rawseti(L, t_packets, ++index);
+
+        nilBuffer(L, 3);
         return 5;
+    } catch (const ErrorPacketException &e) {
+        return returnError(L, e.getMessage(), e.getErrorCode(),
+                           e.getSQLState());
     }
 }
 
@@ -554,6 +1074,13 @@ cryptdb_lib[] = {
     F(disconnect),
     F(rewrite),
     F(next),
+    F(decrypt_rows),
+    F(decrypt_end),
+    F(stmt_prepare),
+    F(stmt_execute),
+    F(stmt_send_long_data),
+    F(stmt_reset),
+    F(stmt_close),
     { 0, 0 },
 };
 
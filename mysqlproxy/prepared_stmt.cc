@@ -0,0 +1,483 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <ctype.h>
+#include <stdio.h>
+
+#include <mysqlproxy/prepared_stmt.hh>
+#include <mysqlproxy/result_packets.hh>
+#include <main/error.hh>
+#include <main/macro_util.hh>
+#include <parser/lex_util.hh>
+#include <util/util.hh>
+
+static const unsigned char UNSIGNED_PARAMETER = 0x80;
+
+// > reads a packet; throws if we run off the end of it
+class PacketReader {
+public:
+    PacketReader(const std::string &packet, size_t position)
+        : packet(packet), position(position) {}
+
+    uint64_t
+    integer(size_t bytes)
+    {
+        need(bytes);
+        uint64_t out = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            out |= static_cast<uint64_t>(
+                       static_cast<unsigned char>(packet[position + i]))
+                   << (8 * i);
+        }
+        position += bytes;
+
+        return out;
+    }
+
+    std::string
+    bytes(size_t count)
+    {
+        need(count);
+        const std::string out = packet.substr(position, count);
+        position += count;
+
+        return out;
+    }
+
+    std::string
+    rest()
+    {
+        return bytes(packet.size() - position);
+    }
+
+    uint64_t
+    lengthEncoded()
+    {
+        const unsigned char first = integer(1);
+        switch (first) {
+        case 0xFC: return integer(2);
+        case 0xFD: return integer(3);
+        case 0xFE: return integer(8);
+        default:
+            TEST_Text(first < 0xFB, "malformed length in packet");
+            return first;
+        }
+    }
+
+private:
+    const std::string &packet;
+    size_t position;
+
+    void
+    need(size_t count) const
+    {
+        TEST_Text(position <= packet.size()
+                  && count <= packet.size() - position,
+                  "truncated prepared statement packet");
+    }
+};
+
+// > skips quoted strings, quoted identifiers and comments; returns the
+//   position after them or 'i' if there is nothing to skip
+static size_t
+skipNonCode(const std::string &query, size_t i)
+{
+    const size_t n = query.size();
+    const char c = query[i];
+    if ('\'' == c || '"' == c || '`' == c) {
+        for (size_t j = i + 1; j < n; ++j) {
+            if ('\\' == query[j] && '`' != c) {
+                ++j;
+                continue;
+            }
+            if (c == query[j]) {
+                if (j + 1 < n && c == query[j + 1]) {
+                    ++j;
+                    continue;
+                }
+                return j + 1;
+            }
+        }
+        FAIL_TextMessageError("unterminated quote in prepared statement");
+    }
+
+    if ('#' == c || ('-' == c && i + 2 < n && '-' == query[i + 1]
+                     && isspace(static_cast<unsigned char>(query[i + 2])))) {
+        const size_t end = query.find('\n', i);
+        return std::string::npos == end ? n : end + 1;
+    }
+
+    if ('/' == c && i + 1 < n && '*' == query[i + 1]) {
+        const size_t end = query.find("*/", i + 2);
+        TEST_Text(std::string::npos != end,
+                  "unterminated comment in prepared statement");
+        return end + 2;
+    }
+
+    return i;
+}
+
+PreparedStatement::PreparedStatement(const std::string &query)
+    : query(query)
+{
+    // > the results of anything else can not be sent in binary form
+    const size_t start = query.find_first_not_of(" \t\r\n(");
+    TEST_Text(std::string::npos != start, "empty prepared statement");
+    size_t verb_end = start;
+    while (verb_end < query.size()
+           && isalpha(static_cast<unsigned char>(query[verb_end]))) {
+        ++verb_end;
+    }
+    const std::string &verb =
+        toLowerCase(query.substr(start, verb_end - start));
+    TEST_Text("select" == verb || "insert" == verb || "update" == verb
+              || "delete" == verb || "replace" == verb,
+              "only SELECT, INSERT, UPDATE, DELETE and REPLACE can be"
+              " prepared");
+
+    for (size_t i = 0; i < query.size();) {
+        const size_t next = skipNonCode(query, i);
+        if (next != i) {
+            i = next;
+            continue;
+        }
+        if ('?' == query[i]) {
+            this->placeholders.push_back(i);
+        }
+        ++i;
+    }
+    TEST_Text(this->placeholders.size() <= 0xFFFF,
+              "too many parameters in prepared statement");
+}
+
+static std::string
+quoteLiteral(const std::string &value)
+{
+    std::string out = "'";
+    for (const char c : value) {
+        switch (c) {
+        case '\0': out += "\\0"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\032': out += "\\Z"; break;
+        case '\'': out += "\\'"; break;
+        case '\\': out += "\\\\"; break;
+        default: out += c; break;
+        }
+    }
+    out += "'";
+
+    return out;
+}
+
+static std::string
+integerLiteral(uint64_t value, size_t bytes, bool is_unsigned)
+{
+    if (true == is_unsigned) {
+        return std::to_string(value);
+    }
+
+    switch (bytes) {
+    case 1: return std::to_string(static_cast<int8_t>(value));
+    case 2: return std::to_string(static_cast<int16_t>(value));
+    case 4: return std::to_string(static_cast<int32_t>(value));
+    default:
+        assert(8 == bytes);
+        return std::to_string(static_cast<int64_t>(value));
+    }
+}
+
+static std::string
+floatLiteral(double value, int precision)
+{
+    TEST_Text(std::isfinite(value),
+              "infinite and NaN parameters are not supported");
+    std::ostringstream s;
+    s << std::setprecision(precision) << value;
+    return s.str();
+}
+
+static std::string
+temporalLiteral(PacketReader *const r, bool date_only)
+{
+    const unsigned int length = r->integer(1);
+    TEST_Text(0 == length || 4 == length || 7 == length || 11 == length,
+              "malformed date parameter");
+    unsigned int year = 0, month = 0, day = 0, hour = 0, minute = 0,
+                 second = 0, usec = 0;
+    if (length >= 4) {
+        year = r->integer(2);
+        month = r->integer(1);
+        day = r->integer(1);
+    }
+    if (length >= 7) {
+        hour = r->integer(1);
+        minute = r->integer(1);
+        second = r->integer(1);
+    }
+    if (length >= 11) {
+        usec = r->integer(4);
+    }
+
+    char buf[64];
+    if (true == date_only) {
+        snprintf(buf, sizeof(buf), "%04u-%02u-%02u", year, month, day);
+    } else if (0 != usec) {
+        snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u.%06u",
+                 year, month, day, hour, minute, second, usec);
+    } else {
+        snprintf(buf, sizeof(buf), "%04u-%02u-%02u %02u:%02u:%02u",
+                 year, month, day, hour, minute, second);
+    }
+
+    return quoteLiteral(buf);
+}
+
+static std::string
+timeLiteral(PacketReader *const r)
+{
+    const unsigned int length = r->integer(1);
+    TEST_Text(0 == length || 8 == length || 12 == length,
+              "malformed time parameter");
+    bool negative = false;
+    unsigned long hours = 0;
+    unsigned int minute = 0, second = 0, usec = 0;
+    if (length >= 8) {
+        negative = 0 != r->integer(1);
+        hours = r->integer(4) * 24;
+        hours += r->integer(1);
+        minute = r->integer(1);
+        second = r->integer(1);
+    }
+    if (length >= 12) {
+        usec = r->integer(4);
+    }
+
+    char buf[64];
+    if (0 != usec) {
+        snprintf(buf, sizeof(buf), "%s%02lu:%02u:%02u.%06u",
+                 negative ? "-" : "", hours, minute, second, usec);
+    } else {
+        snprintf(buf, sizeof(buf), "%s%02lu:%02u:%02u",
+                 negative ? "-" : "", hours, minute, second);
+    }
+
+    return quoteLiteral(buf);
+}
+
+// > DECIMAL parameters arrive as text; keep them numeric only if they
+//   are a plain number, [+-]digits[.digits][e[+-]digits]
+static bool
+isDecimalText(const std::string &value)
+{
+    size_t i = 0;
+    const size_t n = value.size();
+    auto digits = [&value, &i, n] ()
+    {
+        const size_t start = i;
+        while (i < n && isdigit(static_cast<unsigned char>(value[i]))) {
+            ++i;
+        }
+        return i - start;
+    };
+
+    if (i < n && ('-' == value[i] || '+' == value[i])) {
+        ++i;
+    }
+    size_t mantissa = digits();
+    if (i < n && '.' == value[i]) {
+        ++i;
+        mantissa += digits();
+    }
+    if (0 == mantissa) {
+        return false;
+    }
+    if (i < n && ('e' == value[i] || 'E' == value[i])) {
+        ++i;
+        if (i < n && ('-' == value[i] || '+' == value[i])) {
+            ++i;
+        }
+        if (0 == digits()) {
+            return false;
+        }
+    }
+
+    return i == n;
+}
+
+static std::string
+readParameter(PacketReader *const r, unsigned char type, bool is_unsigned)
+{
+    switch (type) {
+    case MYSQL_TYPE_NULL:
+        return "NULL";
+    case MYSQL_TYPE_TINY:
+        return integerLiteral(r->integer(1), 1, is_unsigned);
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_YEAR:
+        return integerLiteral(r->integer(2), 2, is_unsigned);
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_INT24:
+        return integerLiteral(r->integer(4), 4, is_unsigned);
+    case MYSQL_TYPE_LONGLONG:
+        return integerLiteral(r->integer(8), 8, is_unsigned);
+    case MYSQL_TYPE_FLOAT: {
+        const uint32_t bits = r->integer(4);
+        float f;
+        memcpy(&f, &bits, sizeof(f));
+        return floatLiteral(f, 9);
+    }
+    case MYSQL_TYPE_DOUBLE: {
+        const uint64_t bits = r->integer(8);
+        double d;
+        memcpy(&d, &bits, sizeof(d));
+        return floatLiteral(d, 17);
+    }
+    case MYSQL_TYPE_DATE:
+        return temporalLiteral(r, true);
+    case MYSQL_TYPE_DATETIME:
+    case MYSQL_TYPE_TIMESTAMP:
+        return temporalLiteral(r, false);
+    case MYSQL_TYPE_TIME:
+        return timeLiteral(r);
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL: {
+        const std::string &value = r->bytes(r->lengthEncoded());
+        return isDecimalText(value) ? value : quoteLiteral(value);
+    }
+    default:
+        // > strings, blobs, enums, sets, bits and geometry
+        return quoteLiteral(r->bytes(r->lengthEncoded()));
+    }
+}
+
+std::string
+PreparedStatement::bind(const std::string &packet)
+{
+    PacketReader r(packet, 1);
+    r.integer(4);                               // statement id
+    const unsigned char flags = r.integer(1);
+    TEST_Text(0 == flags, "prepared statement cursors are not supported");
+    r.integer(4);                               // iteration count
+
+    const size_t count = this->paramCount();
+    std::vector<std::string> values;
+    if (count > 0) {
+        const std::string &nulls = r.bytes((count + 7) / 8);
+        if (0 != r.integer(1)) {
+            this->types.clear();
+            this->unsigned_types.clear();
+            for (size_t i = 0; i < count; ++i) {
+                this->types.push_back(r.integer(1));
+                this->unsigned_types.push_back(
+                    0 != (r.integer(1) & UNSIGNED_PARAMETER));
+            }
+        }
+        TEST_Text(this->types.size() == count,
+                  "prepared statement parameters were never bound");
+
+        for (size_t i = 0; i < count; ++i) {
+            if (nulls[i / 8] & (1 << (i % 8))) {
+                values.push_back("NULL");
+                continue;
+            }
+            // > parameters sent as long data have no value in the packet
+            const auto &it = this->long_data.find(i);
+            if (this->long_data.end() != it) {
+                values.push_back(quoteLiteral(it->second));
+                continue;
+            }
+            values.push_back(readParameter(&r, this->types[i],
+                                           this->unsigned_types[i]));
+        }
+    }
+    // > the server forgets long data after each execution
+    this->long_data.clear();
+
+    std::string out;
+    size_t position = 0;
+    for (size_t i = 0; i < count; ++i) {
+        out += this->query.substr(position,
+                                  this->placeholders[i] - position);
+        // > keep '-1' from becoming '--1' after a minus
+        if (!values[i].empty() && '-' == values[i][0]) {
+            out += " " + values[i];
+        } else {
+            out += values[i];
+        }
+        position = this->placeholders[i] + 1;
+    }
+    out += this->query.substr(position);
+
+    return out;
+}
+
+std::string
+PreparedStatement::withNullParameters() const
+{
+    std::string out;
+    size_t position = 0;
+    for (const size_t placeholder : this->placeholders) {
+        out += this->query.substr(position, placeholder - position);
+        out += "NULL";
+        position = placeholder + 1;
+    }
+    out += this->query.substr(position);
+
+    return out;
+}
+
+void
+PreparedStatement::appendLongData(const std::string &packet)
+{
+    PacketReader r(packet, 1);
+    r.integer(4);                               // statement id
+    const unsigned int param = r.integer(2);
+    TEST_Text(param < this->paramCount(),
+              "long data for an unknown parameter");
+    this->long_data[param] += r.rest();
+}
+
+unsigned int
+statementId(const std::string &packet)
+{
+    PacketReader r(packet, 1);
+    return r.integer(4);
+}
+
+std::vector<std::string>
+prepareOkPackets(unsigned int stmt_id, const PreparedStatement &stmt,
+                 const std::vector<std::string> &columns,
+                 unsigned short status)
+{
+    std::vector<std::string> out;
+
+    std::string ok;
+    putInteger(&ok, 0x00, 1);
+    putInteger(&ok, stmt_id, 4);
+    putInteger(&ok, columns.size(), 2);
+    putInteger(&ok, stmt.paramCount(), 2);
+    putInteger(&ok, 0, 1);                      // filler
+    putInteger(&ok, 0, 2);                      // warnings
+    out.push_back(ok);
+
+    if (stmt.paramCount() > 0) {
+        for (size_t i = 0; i < stmt.paramCount(); ++i) {
+            out.push_back(columnDefinition("?", MYSQL_TYPE_VAR_STRING, 0));
+        }
+        out.push_back(eofPacket(status));
+    }
+
+    // > described the way the result sets will be; every value is sent
+    //   as a string
+    if (columns.size() > 0) {
+        for (const auto &it : columns) {
+            out.push_back(columnDefinition(it, MYSQL_TYPE_VAR_STRING, 0));
+        }
+        out.push_back(eofPacket(status));
+    }
+
+    return out;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <parser/sql_utils.hh>
+
+/*
+ * Server side prepared statements for binary protocol clients.
+ *
+ * The backend never sees the client's statement; a prepared statement
+ * only lives in the proxy.  Each COM_STMT_EXECUTE binds the parameters
+ * into the statement as literals and the resulting text query goes
+ * through the normal rewrite, so the plan cache serves every execution
+ * after the first with the same parameter types.  The results are
+ * returned to the client in the binary row format.
+ */
+
+class PreparedStatement {
+    PreparedStatement(const PreparedStatement &other) = delete;
+    PreparedStatement &operator=(const PreparedStatement &rhs) = delete;
+
+public:
+    // > throws if the statement can not be prepared
+    explicit PreparedStatement(const std::string &query);
+    ~PreparedStatement() {}
+
+    const std::string &getQuery() const {return query;}
+    size_t paramCount() const {return placeholders.size();}
+
+    // > the text query for one COM_STMT_EXECUTE packet; throws if the
+    //   packet is malformed
+    std::string bind(const std::string &packet);
+    // > the query with NULL for every parameter, to learn the shape of
+    //   it's results from
+    std::string withNullParameters() const;
+    // > COM_STMT_SEND_LONG_DATA
+    void appendLongData(const std::string &packet);
+    // > COM_STMT_RESET
+    void reset() {long_data.clear();}
+
+private:
+    const std::string query;
+    // > offsets of the '?'s in the query
+    std::vector<size_t> placeholders;
+    // > the client only sends the parameter types when they change
+    std::vector<unsigned char> types;
+    std::vector<bool> unsigned_types;
+    std::map<unsigned int, std::string> long_data;
+};
+
+// > the statement id of a COM_STMT_* packet
+unsigned int
+statementId(const std::string &packet);
+
+// > COM_STMT_PREPARE response; packets without their headers.  'status'
+//   is the last server status the backend reported
+std::vector<std::string>
+prepareOkPackets(unsigned int stmt_id, const PreparedStatement &stmt,
+                 const std::vector<std::string> &columns,
+                 unsigned short status);
@@ -0,0 +1,200 @@
+#include <algorithm>
+
+#include <mysqlproxy/result_packets.hh>
+#include <main/error.hh>
+#include <main/macro_util.hh>
+#include <parser/lex_util.hh>
+
+// > the packets we build are sent whole
+static const size_t MAX_PACKET_LENGTH = 0xFFFFFF - 1;
+
+static const unsigned short UTF8_GENERAL_CI = 33;
+// > a NULL column of a text protocol row
+static const unsigned char TEXT_NULL = 0xFB;
+
+void
+putInteger(std::string *const out, uint64_t value, size_t bytes)
+{
+    for (size_t i = 0; i < bytes; ++i) {
+        out->push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    }
+}
+
+void
+putLengthEncoded(std::string *const out, uint64_t value)
+{
+    if (value < 0xFB) {
+        putInteger(out, value, 1);
+    } else if (value <= 0xFFFF) {
+        out->push_back(static_cast<char>(0xFC));
+        putInteger(out, value, 2);
+    } else if (value <= 0xFFFFFF) {
+        out->push_back(static_cast<char>(0xFD));
+        putInteger(out, value, 3);
+    } else {
+        out->push_back(static_cast<char>(0xFE));
+        putInteger(out, value, 8);
+    }
+}
+
+void
+putLengthEncoded(std::string *const out, const std::string &value)
+{
+    putLengthEncoded(out, value.size());
+    out->append(value);
+}
+
+std::string
+columnDefinition(const std::string &name, unsigned char type,
+                 unsigned int length)
+{
+    std::string out;
+    putLengthEncoded(&out, "def");              // catalog
+    putLengthEncoded(&out, "");                 // schema
+    putLengthEncoded(&out, "");                 // table
+    putLengthEncoded(&out, "");                 // org_table
+    putLengthEncoded(&out, name);
+    putLengthEncoded(&out, name);               // org_name
+    putLengthEncoded(&out, 0x0C);               // length of the rest
+    putInteger(&out, UTF8_GENERAL_CI, 2);
+    putInteger(&out, length, 4);
+    putInteger(&out, type, 1);
+    putInteger(&out, 0, 2);                     // flags
+    putInteger(&out, 0, 1);                     // decimals
+    putInteger(&out, 0, 2);                     // filler
+
+    return out;
+}
+
+std::string
+eofPacket(unsigned short status)
+{
+    std::string out;
+    putInteger(&out, 0xFE, 1);
+    putInteger(&out, 0, 2);                     // warnings
+    putInteger(&out, status, 2);
+
+    return out;
+}
+
+static bool
+isNullValue(const Item *const item)
+{
+    return NULL == item || RiboldMYSQL::is_null(*item);
+}
+
+std::vector<std::string>
+resultSetHeader(const std::vector<std::string> &names,
+                const std::vector<enum_field_types> &types,
+                const std::vector<unsigned int> &lengths,
+                unsigned short status)
+{
+    assert(names.size() == types.size());
+    assert(names.size() == lengths.size());
+
+    std::vector<std::string> out;
+    std::string count;
+    putLengthEncoded(&count, names.size());
+    out.push_back(count);
+    for (size_t j = 0; j < names.size(); ++j) {
+        out.push_back(columnDefinition(names[j], types[j], lengths[j]));
+    }
+    out.push_back(eofPacket(status));
+
+    return out;
+}
+
+std::vector<std::string>
+binaryResultSetPackets(const ResType &res, unsigned short status)
+{
+    const size_t columns = res.names.size();
+    assert(columns > 0);
+
+    std::vector<std::vector<std::string> > values(res.rows.size());
+    std::vector<unsigned int> lengths(columns, 0);
+    for (size_t i = 0; i < res.rows.size(); ++i) {
+        assert(res.rows[i].size() == columns);
+        for (size_t j = 0; j < columns; ++j) {
+            const Item *const item = res.rows[i][j];
+            values[i].push_back(isNullValue(item) ? ""
+                                                  : ItemToString(*item));
+            lengths[j] = std::max(lengths[j],
+                                  static_cast<unsigned int>(
+                                      values[i][j].size()));
+        }
+    }
+
+    // > every value is sent as a string, as the prepare response said
+    std::vector<std::string> out =
+        resultSetHeader(res.names,
+                        std::vector<enum_field_types>(
+                            columns, MYSQL_TYPE_VAR_STRING),
+                        lengths, status);
+    for (size_t i = 0; i < res.rows.size(); ++i) {
+        std::string row;
+        putInteger(&row, 0x00, 1);
+        // > the null bitmap of a binary row is offset by two bits
+        std::string nulls((columns + 7 + 2) / 8, '\0');
+        std::string data;
+        for (size_t j = 0; j < columns; ++j) {
+            if (isNullValue(res.rows[i][j])) {
+                nulls[(j + 2) / 8] |= static_cast<char>(1 << ((j + 2) % 8));
+                continue;
+            }
+            putLengthEncoded(&data, values[i][j]);
+        }
+        row += nulls + data;
+        TEST_ErrPkt(row.size() <= MAX_PACKET_LENGTH,
+                    "result row is too large for a prepared statement");
+        out.push_back(row);
+    }
+    out.push_back(eofPacket(status));
+
+    return out;
+}
+
+std::string
+textRowPacket(const std::vector<Item *> &row,
+              std::vector<unsigned int> *const lengths)
+{
+    if (lengths->size() < row.size()) {
+        lengths->resize(row.size(), 0);
+    }
+
+    std::string out;
+    for (size_t j = 0; j < row.size(); ++j) {
+        if (isNullValue(row[j])) {
+            putInteger(&out, TEXT_NULL, 1);
+            continue;
+        }
+
+        const std::string &value = ItemToString(*row[j]);
+        putLengthEncoded(&out, value);
+        (*lengths)[j] = std::max((*lengths)[j],
+                                 static_cast<unsigned int>(value.size()));
+    }
+    TEST_ErrPkt(out.size() <= MAX_PACKET_LENGTH,
+                "result row is too large to send");
+
+    return out;
+}
+
+std::vector<std::string>
+textResultSetPackets(const ResType &res, unsigned short status)
+{
+    assert(res.names.size() > 0);
+
+    std::vector<unsigned int> lengths(res.names.size(), 0);
+    std::vector<std::string> rows;
+    for (const auto &it : res.rows) {
+        assert(it.size() == res.names.size());
+        rows.push_back(textRowPacket(it, &lengths));
+    }
+
+    std::vector<std::string> out =
+        resultSetHeader(res.names, res.types, lengths, status);
+    out.insert(out.end(), rows.begin(), rows.end());
+    out.push_back(eofPacket(status));
+
+    return out;
+}
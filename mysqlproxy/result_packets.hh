@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <parser/sql_utils.hh>
+
+/*
+ * Result sets encoded as MySQL protocol packets.
+ *
+ * Lua sends the packets to the client as they are, so a row costs one
+ * Lua string instead of a table with a string for every cell.  Packets
+ * are returned without their headers; the proxy adds those.
+ */
+
+void
+putInteger(std::string *const out, uint64_t value, size_t bytes);
+void
+putLengthEncoded(std::string *const out, uint64_t value);
+void
+putLengthEncoded(std::string *const out, const std::string &value);
+
+std::string
+columnDefinition(const std::string &name, unsigned char type,
+                 unsigned int length);
+// > 'status' is the backend's server status, so the client sees the
+//   transaction state the server reported
+std::string
+eofPacket(unsigned short status);
+
+// > a result set in the binary protocol; every value is a string
+std::vector<std::string>
+binaryResultSetPackets(const ResType &res, unsigned short status);
+
+// > a result set in the text protocol; columns keep the types in 'res'
+std::vector<std::string>
+textResultSetPackets(const ResType &res, unsigned short status);
+
+// > the column count and the column definitions of a result set; the
+//   rows follow and an eofPacket() ends it
+std::vector<std::string>
+resultSetHeader(const std::vector<std::string> &names,
+                const std::vector<enum_field_types> &types,
+                const std::vector<unsigned int> &lengths,
+                unsigned short status);
+
+// > grows 'lengths' to the longest value seen in each column
+std::string
+textRowPacket(const std::vector<Item *> &row,
+              std::vector<unsigned int> *const lengths);
@@ -3,8 +3,11 @@ assert(package.loadlib(os.getenv("EDBDIR").."/obj/libexecute.so",
 local proto = assert(require("mysql.proto"))
 
 local g_want_interim    = nil
+local g_batches         = false
 local skip              = false
 local client            = nil
+-- rows handed to CryptDB.decrypt_rows at a time
+local DECRYPT_BATCH_ROWS = 1024
 --
 -- Interception points provided by mysqlproxy
 --
@@ -20,7 +23,8 @@ function read_auth()
                     proxy.connection.server.dst.port,
                     os.getenv("CRYPTDB_USER") or "root",
                     os.getenv("CRYPTDB_PASS") or "letmein",
-            os.getenv("CRYPTDB_SHADOW") or os.getenv("EDBDIR").."/shadow")
+            os.getenv("CRYPTDB_SHADOW") or os.getenv("EDBDIR").."/shadow",
+                    proxy.connection.client.default_db)
     -- EDBClient uses its own connection to the SQL server to set up UDFs
     -- and to manipulate multi-principal state.  (And, in the future, to
     -- store its schema state for single- and multi-principal operation.)
@@ -149,6 +153,51 @@ function read_query_real(packet)
         end
 
         return next_handler("query", true, client, {}, {}, nil, nil)
+    elseif string.byte(packet) == proxy.COM_STMT_PREPARE then
+        -- the statement stays in the proxy; the backend only ever sees
+        -- the rewritten text queries
+        local status, response = CryptDB.stmt_prepare(client, query)
+        if false == status then
+            proxy.response.type = proxy.MYSQLD_PACKET_ERR
+            proxy.response.errmsg = response
+            return proxy.PROXY_SEND_RESULT
+        end
+
+        proxy.response.type = proxy.MYSQLD_PACKET_RAW
+        proxy.response.packets = response
+        return proxy.PROXY_SEND_RESULT
+    elseif string.byte(packet) == proxy.COM_STMT_EXECUTE then
+        status, error_msg =
+            CryptDB.stmt_execute(client, packet,
+                                 proxy.connection.server.thread_id)
+
+        if false == status then
+            proxy.response.type = proxy.MYSQLD_PACKET_ERR
+            proxy.response.errmsg = error_msg
+            return proxy.PROXY_SEND_RESULT
+        end
+
+        return next_handler("query", true, client, {}, {}, nil, nil)
+    elseif string.byte(packet) == proxy.COM_STMT_SEND_LONG_DATA then
+        -- the client expects no answer to long data or closes; both
+        -- stay in the proxy, the server only ever sees text queries
+        CryptDB.stmt_send_long_data(client, packet)
+        return proxy.PROXY_IGNORE_RESULT
+    elseif string.byte(packet) == proxy.COM_STMT_CLOSE then
+        CryptDB.stmt_close(client, packet)
+        return proxy.PROXY_IGNORE_RESULT
+    elseif string.byte(packet) == proxy.COM_STMT_RESET then
+        if CryptDB.stmt_reset(client, packet) then
+            proxy.response.type = proxy.MYSQLD_PACKET_OK
+        else
+            proxy.response.type = proxy.MYSQLD_PACKET_ERR
+            proxy.response.errmsg = "unknown prepared statement"
+        end
+        return proxy.PROXY_SEND_RESULT
+    elseif string.byte(packet) == proxy.COM_STMT_FETCH then
+        proxy.response.type = proxy.MYSQLD_PACKET_ERR
+        proxy.response.errmsg = "prepared statement cursors are not supported"
+        return proxy.PROXY_SEND_RESULT
     elseif string.byte(packet) == proxy.COM_QUIT then
         -- do nothing
     else
@@ -167,12 +216,20 @@ function read_query_result_real(inj)
     skip = false
 
     local resultset = inj.resultset
+    local batches = g_batches
+    g_batches = false
 
     if resultset.query_status == proxy.MYSQLD_PACKET_ERR then
-        return next_handler("results", false, client, {}, {}, 0, 0)
+        local errmsg, errcode, sqlstate = parse_err_packet(resultset.raw)
+        return next_handler("results", false, client, {}, {}, 0, 0,
+                            errmsg, errcode, sqlstate)
     end
 
     local client = proxy.connection.client.src.name
+    if true == batches then
+        return decrypt_batches(client, resultset)
+    end
+
     local interim_fields = {}
     local interim_rows = {}
 
@@ -214,7 +271,54 @@ function read_query_result_real(inj)
     end
 
     return next_handler("results", true, client, interim_fields, interim_rows,
-                        resultset.affected_rows, resultset.insert_id)
+                        resultset.affected_rows, resultset.insert_id,
+                        nil, nil, nil, server_status(resultset))
+end
+
+-- decrypt the rows a batch at a time instead of handing all of them
+-- to CryptDB.next at once; CryptDB hands back one packet per row.
+-- mysql-proxy has already read the whole result from the server; this
+-- only keeps the decrypted copies of it small
+function decrypt_batches(client, resultset)
+    local fields = {}
+    local resfields = resultset.fields
+    for i = 1, #resfields do
+        fields[i] = { type = resfields[i].type,
+                      name = resfields[i].name }
+    end
+
+    local packets = {}
+    local batch   = {}
+    local resrows = resultset.rows
+    if resrows then
+        for row in resrows do
+            table.insert(batch, row)
+            if #batch == DECRYPT_BATCH_ROWS then
+                local control, param0, param1, param2, param3 =
+                    CryptDB.decrypt_rows(client, fields, batch, packets)
+                if control then
+                    return handle_control("results", control, param0,
+                                          param1, param2, param3)
+                end
+                batch = {}
+            end
+        end
+    end
+
+    if #batch > 0 then
+        local control, param0, param1, param2, param3 =
+            CryptDB.decrypt_rows(client, fields, batch, packets)
+        if control then
+            return handle_control("results", control, param0, param1,
+                                  param2, param3)
+        end
+    end
+
+    return handle_control("results",
+                          CryptDB.decrypt_end(client, fields, packets,
+                                             resultset.affected_rows,
+                                             resultset.insert_id,
+                                             server_status(resultset)))
 end
 
 local q_index = 0
@@ -234,14 +338,55 @@ function handle_from(from)
     assert(nil)
 end
 
+-- the message, code and sqlstate of an ERR packet; nil if there is none
+function parse_err_packet(raw)
+    if nil == raw or string.byte(raw) ~= 0xff or #raw < 3 then
+        return nil
+    end
+
+    local errcode = string.byte(raw, 2) + 256 * string.byte(raw, 3)
+    if "#" == string.sub(raw, 4, 4) then
+        return string.sub(raw, 10), errcode, string.sub(raw, 5, 9)
+    end
+    return string.sub(raw, 4), errcode, "HY000"
+end
+
+-- the server status the backend sent with it's result, rebuilt from the
+-- flags mysql-proxy parsed out of it; nil if there are none
+function server_status(resultset)
+    local flags = resultset.flags
+    if nil == flags then
+        return nil
+    end
+
+    local status = 0
+    if flags.in_trans then status = status + 0x0001 end
+    if flags.auto_commit then status = status + 0x0002 end
+    if flags.no_good_index_used then status = status + 0x0010 end
+    if flags.no_index_used then status = status + 0x0020 end
+    return status
+end
+
 function next_handler(from, status, client, fields, rows, affected_rows,
-                      insert_id)
-    local control, param0, param1, param2, param3 =
-        CryptDB.next(client, fields, rows, affected_rows, insert_id, status)
+                      insert_id, errmsg, errcode, sqlstate, backend_status)
+    return handle_control(from,
+                          CryptDB.next(client, fields, rows, affected_rows,
+                                       insert_id, status, errmsg, errcode,
+                                       sqlstate, backend_status))
+end
+
+function handle_control(from, control, param0, param1, param2, param3)
     if "again" == control then
         g_want_interim      = param0
         local query         = param1
 
+        proxy.queries:append(get_index(), string.char(proxy.COM_QUERY) .. query,
+                             { resultset_is_needed = true } )
+        return handle_from(from)
+    elseif "batches" == control then
+        local query = param0
+
+        g_batches = true
         proxy.queries:append(get_index(), string.char(proxy.COM_QUERY) .. query,
                              { resultset_is_needed = true } )
         return handle_from(from)
@@ -266,6 +411,12 @@ function next_handler(from, status, client, fields, rows, affected_rows,
         proxy.response.affected_rows    = raffected_rows
         proxy.response.insert_id        = rinsert_id
 
+        return proxy.PROXY_SEND_RESULT
+    elseif "raw-results" == control then
+        -- result set packets built by CryptDB
+        proxy.response.type     = proxy.MYSQLD_PACKET_RAW
+        proxy.response.packets  = param0
+
         return proxy.PROXY_SEND_RESULT
     elseif "error" == control then
         proxy.response.type     = proxy.MYSQLD_PACKET_ERR
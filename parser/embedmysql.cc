@@ -44,6 +44,22 @@ query_parse::~query_parse()
     cleanup();
 }
 
+embedded_thd::embedded_thd()
+{
+    assert(create_embedded_thd(0));
+    t = current_thd;
+    assert(t != NULL);
+}
+
+embedded_thd::~embedded_thd()
+{
+    t->end_statement();
+    t->cleanup_after_query();
+    close_thread_tables(t);
+    --thread_count;
+    delete t;
+}
+
 LEX *
 query_parse::lex()
 {
@@ -22,3 +22,13 @@ class query_parse {
     THD *t;
     Parser_state ps;
 };
+
+// > a THD for work that creates Items without parsing a query
+class embedded_thd {
+ public:
+    embedded_thd();
+    ~embedded_thd();
+
+ private:
+    THD *t;
+};
@@ -50,6 +50,25 @@ make_thd_string(const string &s, size_t *lenp)
     return thd->strmake(s.data(), s.size());
 }
 
+ScopedMemRoot::ScopedMemRoot()
+    : thd(current_thd), saved_mem_root(thd->mem_root),
+      saved_free_list(thd->free_list)
+{
+    init_sql_alloc(&mem_root, thd->variables.query_alloc_block_size, 0);
+    thd->mem_root = &mem_root;
+    thd->free_list = NULL;
+}
+
+ScopedMemRoot::~ScopedMemRoot()
+{
+    // > the Items made in scope are linked into the THD's free list and
+    //   must be cleaned up before their memory goes away
+    thd->free_items();
+    thd->free_list = saved_free_list;
+    thd->mem_root = saved_mem_root;
+    free_root(&mem_root, MYF(0));
+}
+
 string
 ItemToString(const Item &i) {
     if (RiboldMYSQL::is_null(i)) {
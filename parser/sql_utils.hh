@@ -43,6 +43,24 @@ public:
 
 char * make_thd_string(const std::string &s, size_t *lenp = 0);
 
+// > Items and strings made on the current THD while this is in scope are
+//   freed with it; results handled a batch at a time use one per batch
+//   so that memory follows the batch and not the whole result
+class ScopedMemRoot {
+    ScopedMemRoot(const ScopedMemRoot &other) = delete;
+    ScopedMemRoot &operator=(const ScopedMemRoot &rhs) = delete;
+
+public:
+    ScopedMemRoot();
+    ~ScopedMemRoot();
+
+private:
+    THD *const thd;
+    MEM_ROOT *const saved_mem_root;
+    Item *const saved_free_list;
+    MEM_ROOT mem_root;
+};
+
 std::string ItemToString(const Item &i);
 std::string printItemToString(const Item &i);
 
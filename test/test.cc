@@ -1,4 +1,5 @@
 #include <algorithm>
+#include <functional>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
@@ -15,6 +16,11 @@
 #include <sys/wait.h>
 
 #include <main/Connect.hh>
+#include <main/rewrite_main.hh>
+#include <main/rewrite_util.hh>
+#include <main/CryptoHandlers.hh>
+#include <parser/embedmysql.hh>
+#include <crypto/BasicCrypto.hh>
 
 #include <util/util.hh>
 #include <util/params.hh>
@@ -3023,6 +3029,168 @@ test_PKCS(const TestConfig &tc, int ac, char **av)
     std::cerr << "msg" << dec << "\n";
 }
 
+/*
+ * Decrypts a result set with a column for each onion of an integer field
+ * at 1 to N threads and checks that every run gives the plaintexts back.
+ *
+ *   decrypt [rows] [max threads]
+ */
+static void
+benchDecryptResults(const TestConfig &tc, int ac, char **av)
+{
+    const unsigned int rows = ac > 1 ? atoi(av[1]) : 4000;
+    const unsigned int max_threads =
+        ac > 2 ? atoi(av[2]) : defaultThreadCount();
+
+    init_mysql(tc.shadowdb_dir);
+    const embedded_thd thd;
+
+    Create_field cf;
+    cf.field_name = const_cast<char *>("bench");
+    cf.sql_type = MYSQL_TYPE_LONGLONG;
+    cf.length = 20;
+    cf.decimals = 0;
+    cf.flags = UNSIGNED_FLAG | NOT_NULL_FLAG;
+    cf.def = NULL;
+    cf.charset = &my_charset_bin;
+    cf.interval = NULL;
+    cf.unireg_check = Field::NONE;
+
+    const std::unique_ptr<AES_KEY> m_key(getKey("decrypt benchmark key"));
+    FieldMeta fm(cf, m_key.get(), SECURITY_RATING::SENSITIVE, 1, false);
+
+    std::vector<onion> onions;
+    for (const onion o : {oDET, oOPE, oAGG}) {
+        if (fm.hasOnion(o)) {
+            onions.push_back(o);
+        }
+    }
+    const int salt_pos = onions.size();
+
+    ReturnMeta rmeta;
+    std::vector<std::string> names;
+    std::vector<enum_field_types> types;
+    for (unsigned int i = 0; i < onions.size(); ++i) {
+        const OnionMeta *const om = fm.getOnionMeta(onions[i]);
+        const std::string &name = TypeText<onion>::toText(onions[i]);
+        rmeta.rfmeta.insert(std::make_pair(i,
+            ReturnField(false, name,
+                        OLK(onions[i], om->getSecLevel(), &fm),
+                        salt_pos)));
+        names.push_back(name);
+        types.push_back(MYSQL_TYPE_VARCHAR);
+    }
+    rmeta.rfmeta.insert(std::make_pair(salt_pos,
+        ReturnField(true, "salt", OLK(oINVALID, SECLEVEL::INVALID, NULL),
+                    -1)));
+    names.push_back("salt");
+    types.push_back(MYSQL_TYPE_LONGLONG);
+
+    std::vector<uint64_t> plaintexts;
+    std::vector<std::vector<Item *> > enc_rows;
+    for (unsigned int r = 0; r < rows; ++r) {
+        const uint64_t plain = randomValue() % 1000000000;
+        const uint64_t salt = randomValue();
+        plaintexts.push_back(plain);
+
+        std::vector<Item *> row;
+        for (const onion o : onions) {
+            Item *i = new Item_int(static_cast<ulonglong>(plain));
+            for (const auto &it : fm.getOnionMeta(o)->getLayers()) {
+                i = it->encrypt(*i, salt);
+            }
+            row.push_back(i);
+        }
+        row.push_back(new Item_int(static_cast<ulonglong>(salt)));
+        enc_rows.push_back(row);
+    }
+    const ResType res(true, 0, 0, std::move(names), std::move(types),
+                      std::move(enc_rows));
+
+    std::cerr << rows << " rows, " << onions.size() << " encrypted columns"
+              << std::endl;
+
+    // > the one value at a time path the batches replace
+    std::vector<std::vector<std::string> > serial(rows);
+    {
+        Timer t;
+        for (unsigned int r = 0; r < rows; ++r) {
+            const uint64_t salt =
+                static_cast<Item_int *>(res.rows[r][salt_pos])->value;
+            for (unsigned int c = 0; c < onions.size(); ++c) {
+                const Item *const dec =
+                    decrypt_item_layers(*res.rows[r][c], &fm, onions[c],
+                                        salt);
+                serial[r].push_back(ItemToString(*dec));
+            }
+        }
+        const uint64_t usec = t.lap();
+        std::cerr << "serial: "
+                  << rows * 1000000.0 / std::max(usec, (uint64_t)1)
+                  << " rows/sec" << std::endl;
+    }
+
+    for (unsigned int threads = 1; threads <= max_threads; ++threads) {
+        Timer t;
+        const ResType &dec = Rewriter::decryptResults(res, rmeta, threads);
+        const uint64_t usec = t.lap();
+
+        for (unsigned int r = 0; r < rows; ++r) {
+            for (unsigned int c = 0; c < onions.size(); ++c) {
+                const std::string &s = ItemToString(*dec.rows[r][c]);
+                assert_s(s == serial[r][c],
+                         "batched decryption does not match the serial "
+                         "path");
+                assert_s(s == std::to_string(plaintexts[r]),
+                         "decryption does not match the plaintext");
+            }
+        }
+        std::cerr << "threads " << threads << ": "
+                  << rows * 1000000.0 / std::max(usec, (uint64_t)1)
+                  << " rows/sec" << std::endl;
+    }
+}
+
+/*
+ * Loads the proxy's schema from the embedded database with the old
+ * walk, one query for each object, and with loadSchemaInfo(...).
+ *
+ *   schemaload [repeats]
+ */
+static void
+benchSchemaLoad(const TestConfig &tc, int ac, char **av)
+{
+    const unsigned int repeats = ac > 1 ? atoi(av[1]) : 3;
+
+    const ConnectionInfo ci(tc.host, tc.user, tc.pass, tc.port);
+    SharedProxyState shared(ci, tc.shadowdb_dir, "2392834",
+                            determineSecurityRating());
+    ProxyState ps(shared);
+
+    std::function<void(DBMeta *const)> perObject =
+        [&perObject, &ps] (DBMeta *const parent)
+        {
+            for (auto it : parent->fetchChildren(ps.getEConn())) {
+                perObject(it);
+            }
+        };
+
+    for (unsigned int i = 0; i < repeats; ++i) {
+        Timer t;
+        const std::unique_ptr<SchemaInfo> walked(new SchemaInfo());
+        perObject(walked.get());
+        const double walk_ms = t.lap_ms();
+
+        loadSchemaInfo(ps.getConn(), ps.getEConn());
+        const double load_ms = t.lap_ms();
+
+        std::cerr << "per object queries " << walk_ms << " ms, "
+                  << "loadSchemaInfo " << load_ms << " ms ("
+                  << WorkerPool::instance().size() + 1 << " threads)"
+                  << std::endl;
+    }
+}
+
 static void help(const TestConfig &tc, int ac, char **av);
 
 static struct {
@@ -3044,6 +3212,8 @@ static struct {
     { "test_enc_tables","",                             &testEncTables },
     { "trace",          "trace eval",                   &testTrace },
     { "bench",          "TPC-C benchmark eval",         &testBench },
+    { "decrypt",        "result decryption benchmark",  &benchDecryptResults },
+    { "schemaload",     "schema load benchmark",        &benchSchemaLoad },
     //{ "utils",          "",                             &testUtils },
         { "train",          "",                             &testTrain },
     
@@ -7,12 +7,16 @@
 
 #define DEBUG 1
 
+#include <algorithm>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include <crypto/BasicCrypto.hh>
 #include <crypto/blowfish.hh>
 #include <crypto/SWPSearch.hh>
 #include <crypto/paillier.hh>
+#include <crypto/mont.hh>
 #include <util/params.hh>
 #include <util/util.hh>
 #include <util/version.hh>
@@ -30,6 +34,7 @@ typedef long long longlong;
 my_bool   cryptdb_decrypt_int_sem_init(UDF_INIT *const initid,
                                        UDF_ARGS *const args,
                                        char *const message);
+void      cryptdb_decrypt_int_sem_deinit(UDF_INIT *const initid);
 ulonglong cryptdb_decrypt_int_sem(UDF_INIT *const initid,
                                   UDF_ARGS *const args,
                                   char *const is_null, char *const error);
@@ -37,6 +42,7 @@ ulonglong cryptdb_decrypt_int_sem(UDF_INIT *const initid,
 my_bool   cryptdb_decrypt_int_det_init(UDF_INIT *const initid,
                                        UDF_ARGS *const args,
                                        char *const message);
+void      cryptdb_decrypt_int_det_deinit(UDF_INIT *const initid);
 ulonglong cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
                                   char *const is_null, char *const error);
 
@@ -98,7 +104,7 @@ log(const std::string &s)
 
 static std::string
 decrypt_SEM(const unsigned char *const eValueBytes, uint64_t eValueLen,
-            AES_KEY *const aesKey, uint64_t salt)
+            const AES_KEY *const aesKey, uint64_t salt)
 {
     std::string c(reinterpret_cast<const char *>(eValueBytes),
                   static_cast<unsigned int>(eValueLen));
@@ -107,53 +113,99 @@ decrypt_SEM(const unsigned char *const eValueBytes, uint64_t eValueLen,
 }
 
 
-static std::unique_ptr<std::list<std::string>>
-split(const std::string &s, unsigned int plen)
+static uint64_t
+getui(UDF_ARGS *const args, int i)
 {
-    const unsigned int len = s.length();
-    if (len % plen != 0) {
-        thrower() << "split receives invalid input";
-    }
+    return static_cast<uint64_t>(*reinterpret_cast<ulonglong *>(args->args[i]));
+}
 
-    const unsigned int num = len / plen;
-    std::unique_ptr<std::list<std::string>>
-        res(new std::list<std::string>());
+static char *
+getba(UDF_ARGS *const args, int i, uint64_t &len)
+{
+    len = args->lengths[i];
+    return args->args[i];
+}
 
-    for (unsigned int i = 0; i < num; i++) {
-        res.get()->push_back(s.substr(i*plen, plen));
+/*
+ * Onion adjustment calls the decryption UDFs with the same literal key
+ * for every row, so the _init functions expand a constant key once and
+ * keep the schedule in initid->ptr.  A key that is not constant is
+ * still expanded row by row.
+ */
+static blowfish *
+constant_bf_key(UDF_ARGS *const args, int i)
+{
+    if (NULL == args->args[i]) {
+        return NULL;
     }
-
-    return res;
+    return new blowfish(std::string(args->args[i], args->lengths[i]));
 }
 
-
-static bool
-searchExists(const Token &token, const std::string &overall_ciph)
+static uint64_t
+bf_decrypt(const blowfish *const bf, UDF_ARGS *const args, int i,
+           uint64_t ct)
 {
-    const std::unique_ptr<std::list<std::string>>
-        l(split(overall_ciph, SWPCiphSize));
-    return SWP::searchExists(token, *l.get());
+    if (bf) {
+        return bf->decrypt(ct);
+    }
+
+    uint64_t keyLen;
+    char *const keyBytes = getba(args, i, keyLen);
+    return blowfish(std::string(keyBytes, keyLen)).decrypt(ct);
 }
 
+struct text_state {
+    // > NULL unless the key is constant
+    std::unique_ptr<AES_KEY> aesKey;
+    // > the last row's result; returned to the server in place
+    std::string value;
+};
 
-static bool
-search(const Token &token, const std::string &overall_ciph)
+// > a bad constant key is left to fail on each row, as it did before
+static void
+text_state_init(UDF_INIT *const initid, UDF_ARGS *const args)
 {
-   return searchExists(token, overall_ciph);
-}
+    text_state *const ts = new text_state();
+    if (args->args[1]) {
+        try {
+            ts->aesKey.reset(get_AES_dec_key(
+                std::string(args->args[1], args->lengths[1])));
+        } catch (const CryptoError &) {
+        }
+    }
 
+    initid->ptr = reinterpret_cast<char *>(ts);
+}
 
-static uint64_t
-getui(UDF_ARGS *const args, int i)
+static void
+text_state_deinit(UDF_INIT *const initid)
 {
-    return static_cast<uint64_t>(*reinterpret_cast<ulonglong *>(args->args[i]));
+    delete reinterpret_cast<text_state *>(initid->ptr);
 }
 
 static char *
-getba(UDF_ARGS *const args, int i, uint64_t &len)
+text_state_result(UDF_INIT *const initid, const std::string &value,
+                  unsigned long *const length)
 {
-    len = args->lengths[i];
-    return args->args[i];
+    text_state *const ts = reinterpret_cast<text_state *>(initid->ptr);
+    ts->value = value;
+    *length = ts->value.size();
+    return &ts->value[0];
+}
+
+// > the key schedule for this row; 'scratch' holds it if it is not cached
+static const AES_KEY *
+text_key(const text_state *const ts, UDF_ARGS *const args,
+         std::unique_ptr<AES_KEY> *const scratch)
+{
+    if (ts->aesKey) {
+        return ts->aesKey.get();
+    }
+
+    uint64_t keyLen;
+    char *const keyBytes = getba(args, 1, keyLen);
+    scratch->reset(get_AES_dec_key(std::string(keyBytes, keyLen)));
+    return scratch->get();
 }
 
 my_bool
@@ -170,9 +222,16 @@ cryptdb_decrypt_int_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
     }
 
     initid->maybe_null = 1;
+    initid->ptr = reinterpret_cast<char *>(constant_bf_key(args, 1));
     return 0;
 }
 
+void
+cryptdb_decrypt_int_sem_deinit(UDF_INIT *const initid)
+{
+    delete reinterpret_cast<blowfish *>(initid->ptr);
+}
+
 ulonglong
 cryptdb_decrypt_int_sem(UDF_INIT *const initid, UDF_ARGS *const args,
                         char *const is_null, char *const error)
@@ -184,15 +243,10 @@ cryptdb_decrypt_int_sem(UDF_INIT *const initid, UDF_ARGS *const args,
     } else {
         try {
             const uint64_t eValue = getui(args, 0);
-
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
             const uint64_t salt = getui(args, 2);
 
-            blowfish bf(key);
-            value = bf.decrypt(eValue) ^ salt;
+            value = bf_decrypt(reinterpret_cast<blowfish *>(initid->ptr),
+                               args, 1, eValue) ^ salt;
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = 0;
@@ -220,9 +274,16 @@ cryptdb_decrypt_int_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
     }
 
     initid->maybe_null = 1;
+    initid->ptr = reinterpret_cast<char *>(constant_bf_key(args, 1));
     return 0;
 }
 
+void
+cryptdb_decrypt_int_det_deinit(UDF_INIT *const initid)
+{
+    delete reinterpret_cast<blowfish *>(initid->ptr);
+}
+
 ulonglong
 cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
                         char *const is_null, char *const error)
@@ -235,12 +296,8 @@ cryptdb_decrypt_int_det(UDF_INIT *const initid, UDF_ARGS *const args,
         try {
             const uint64_t eValue = getui(args, 0);
 
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
-            blowfish bf(key);
-            value = bf.decrypt(eValue);
+            value = bf_decrypt(reinterpret_cast<blowfish *>(initid->ptr),
+                               args, 1, eValue);
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = 0;
@@ -266,18 +323,14 @@ cryptdb_decrypt_text_sem_init(UDF_INIT *const initid, UDF_ARGS *const args,
     }
 
     initid->maybe_null = 1;
+    text_state_init(initid, args);
     return 0;
 }
 
 void
 cryptdb_decrypt_text_sem_deinit(UDF_INIT *const initid)
 {
-    /*
-     * in mysql-server/sql/item_func.cc, udf_handler::fix_fields
-     * initializes initid.ptr=0 for us.
-     */
-    if (initid->ptr)
-        delete[] initid->ptr;
+    text_state_deinit(initid);
 }
 
 char *
@@ -294,16 +347,15 @@ cryptdb_decrypt_text_sem(UDF_INIT *const initid, UDF_ARGS *const args,
             uint64_t eValueLen;
             char *const eValueBytes = getba(args, 0, eValueLen);
 
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string &key = std::string(keyBytes, keyLen);
-
             const uint64_t salt = getui(args, 2);
 
-            const std::unique_ptr<AES_KEY> aesKey(get_AES_dec_key(key));
+            std::unique_ptr<AES_KEY> scratch;
+            const AES_KEY *const aesKey =
+                text_key(reinterpret_cast<text_state *>(initid->ptr), args,
+                         &scratch);
             value =
                 decrypt_SEM(reinterpret_cast<unsigned char *>(eValueBytes),
-                            eValueLen, aesKey.get(), salt);
+                            eValueLen, aesKey, salt);
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = "";
@@ -312,12 +364,7 @@ cryptdb_decrypt_text_sem(UDF_INIT *const initid, UDF_ARGS *const args,
 
     // NOTE: This is not creating a proper C string, no guarentee of NUL
     // termination.
-    char *const res = new char[value.get().length()];
-    initid->ptr = res;
-    memcpy(res, value.get().data(), value.get().length());
-    *length = value.get().length();
-
-    return static_cast<char*>(initid->ptr);
+    return text_state_result(initid, value.get(), length);
 }
 
 
@@ -334,18 +381,14 @@ cryptdb_decrypt_text_det_init(UDF_INIT *const initid, UDF_ARGS *const args,
     }
 
     initid->maybe_null = 1;
+    text_state_init(initid, args);
     return 0;
 }
 
 void
 cryptdb_decrypt_text_det_deinit(UDF_INIT *const initid)
 {
-    /*
-     * in mysql-server/sql/item_func.cc, udf_handler::fix_fields
-     * initializes initid.ptr=0 for us.
-     */
-    if (initid->ptr)
-        delete[] initid->ptr;
+    text_state_deinit(initid);
 }
 
 char *
@@ -362,26 +405,21 @@ cryptdb_decrypt_text_det(UDF_INIT *const initid, UDF_ARGS *const args,
             uint64_t eValueLen;
             char *const eValueBytes = getba(args, 0, eValueLen);
 
-            uint64_t keyLen;
-            char *const keyBytes = getba(args, 1, keyLen);
-            const std::string key = std::string(keyBytes, keyLen);
-
-            const std::unique_ptr<AES_KEY> aesKey(get_AES_dec_key(key));
+            std::unique_ptr<AES_KEY> scratch;
+            const AES_KEY *const aesKey =
+                text_key(reinterpret_cast<text_state *>(initid->ptr), args,
+                         &scratch);
             value =
                 decrypt_AES_CMC(std::string(eValueBytes,
                                     static_cast<unsigned int>(eValueLen)),
-                                aesKey.get(), true);
+                                aesKey, true);
         } catch (const CryptoError &e) {
             std::cerr << e.msg << std::endl;
             value = "";
         }
     }
 
-    char *const res = new char[value.get().length()];
-    initid->ptr = res;
-    memcpy(res, value.get().data(), value.get().length());
-    *length = value.get().length();
-    return initid->ptr;
+    return text_state_result(initid, value.get(), length);
 }
 
 /*
@@ -405,18 +443,19 @@ cryptdb_searchSWP_init(UDF_INIT *const initid, UDF_ARGS *const args,
         return 1;
     }
 
-    Token *const t = new Token();
-
-    uint64_t ciphLen;
-    char *const ciph = getba(args, 1, ciphLen);
-
-    uint64_t wordKeyLen;
-    char *const wordKey = getba(args, 2, wordKeyLen);
-
-    t->ciph = std::string(ciph, ciphLen);
-    t->wordKey = std::string(wordKey, wordKeyLen);
-
-    initid->ptr = reinterpret_cast<char *>(t);
+    // > the token is the same for every row of a query unless it is
+    //   not constant, in which case each row builds its own
+    if (args->args[1] && args->args[2]) {
+        Token t;
+        t.ciph = std::string(args->args[1], args->lengths[1]);
+        t.wordKey = std::string(args->args[2], args->lengths[2]);
+        try {
+            initid->ptr = reinterpret_cast<char *>(new SWPSearcher(t));
+        } catch (const CryptoError &e) {
+            snprintf(message, MYSQL_ERRMSG_SIZE, "%s", e.msg.c_str());
+            return 1;
+        }
+    }
 
     return 0;
 }
@@ -424,8 +463,7 @@ cryptdb_searchSWP_init(UDF_INIT *const initid, UDF_ARGS *const args,
 void
 cryptdb_searchSWP_deinit(UDF_INIT *const initid)
 {
-    Token *const t = reinterpret_cast<Token *>(initid->ptr);
-    delete t;
+    delete reinterpret_cast<SWPSearcher *>(initid->ptr);
 }
 
 ulonglong
@@ -433,36 +471,66 @@ cryptdb_searchSWP(UDF_INIT *const initid, UDF_ARGS *const args,
                   char *const is_null, char *const error)
 {
     uint64_t allciphLen;
-    char *const allciph = getba(args, 0, allciphLen);
-    const std::string overallciph = std::string(allciph, allciphLen);
-
-    Token *const t = reinterpret_cast<Token *>(initid->ptr);
+    const unsigned char *const allciph =
+        reinterpret_cast<unsigned char *>(getba(args, 0, allciphLen));
+
+    try {
+        SWPSearcher *const searcher =
+            reinterpret_cast<SWPSearcher *>(initid->ptr);
+        if (searcher) {
+            return searcher->searchExists(allciph, allciphLen);
+        }
 
-    return search(*t, overallciph);
+        Token t;
+        t.ciph = std::string(args->args[1], args->lengths[1]);
+        t.wordKey = std::string(args->args[2], args->lengths[2]);
+        return SWPSearcher(t).searchExists(allciph, allciphLen);
+    } catch (const CryptoError &e) {
+        std::cerr << e.msg << std::endl;
+        *error = 1;
+        return 0;
+    }
 }
 
 
+// > the running product is kept as limbs and is off by R^-count until
+//   cryptdb_agg(...) fixes it, so a row costs one Montgomery multiply
+//   and no allocation
 struct agg_state {
-    ZZ sum;
-    ZZ n2;
-    bool n2_set;
+    std::unique_ptr<mpn_montgomery> mont;
+    std::string n2;                         // > what 'mont' was built for
+    std::vector<mp_limb_t> sum;
+    std::vector<mp_limb_t> row;
+    uint64_t count;
     void *rbuf;
 };
 
+static void
+agg_reset(agg_state *const as)
+{
+    std::fill(as->sum.begin(), as->sum.end(), 0);
+    if (as->sum.size() > 0) {
+        as->sum[0] = 1;
+    }
+    as->count = 0;
+}
+
 my_bool
 cryptdb_agg_init(UDF_INIT *const initid, UDF_ARGS *const args,
                  char *const message)
 {
-    if (args->arg_count != 2 ||
+    if ((args->arg_count != 2 && args->arg_count != 3) ||
         args->arg_type[0] != STRING_RESULT ||
-        args->arg_type[1] != STRING_RESULT)
+        args->arg_type[1] != STRING_RESULT ||
+        (args->arg_count == 3 && args->arg_type[2] != INT_RESULT))
     {
-        strcpy(message, "Usage: cryptdb_agg(string ciphertext, string pubkey)");
+        strcpy(message, "Usage: cryptdb_agg(string ciphertext, string pubkey[, int max_rows])");
         return 1;
     }
 
     agg_state *const as = new agg_state();
     as->rbuf = malloc(Paillier_len_bytes);
+    as->count = 0;
     initid->ptr = reinterpret_cast<char *>(as);
     initid->maybe_null = 1;
     return 0;
@@ -482,38 +550,49 @@ void
 cryptdb_agg_clear(UDF_INIT *const initid, char *const is_null, char *const error)
 {
     agg_state *const as = reinterpret_cast<agg_state *>(initid->ptr);
-    as->sum = to_ZZ(1);
-    as->n2_set = 0;
+    agg_reset(as);
 }
 
 //args will be element to add, constant N2
+// > and for a packed AGG onion the most rows it's slots can hold the
+//   sum of; past it the result is NULL
 my_bool
 cryptdb_agg_add(UDF_INIT *const initid, UDF_ARGS *const args,
                 char *const is_null, char *const error)
 {
-    //cerr << "in agg_add \n";
     agg_state *const as = reinterpret_cast<agg_state *>(initid->ptr);
-    if (!as->n2_set) {
-        //cerr << "n2 length is " << args->lengths[1] << "\n";
-        //cerr << "n2 first byte is " << (int)args->args[1][0] << "\n";
-        ZZFromBytes(as->n2,
-                    reinterpret_cast<const uint8_t *>(args->args[1]),
+    if (!as->mont || as->n2.size() != args->lengths[1]
+        || memcmp(as->n2.data(), args->args[1], args->lengths[1])) {
+        as->n2.assign(args->args[1], args->lengths[1]);
+        ZZ n2;
+        ZZFromBytes(n2, reinterpret_cast<const uint8_t *>(args->args[1]),
                     args->lengths[1]);
-        //cerr << "n2 is " << as->n2 << "\n";
-        as->n2_set = 1;
+        as->mont.reset(new mpn_montgomery(n2));
+        as->sum.resize(as->mont->limbs());
+        as->row.resize(as->mont->limbs());
+        agg_reset(as);
     }
 
-    ZZ e;
+    // > adding by zero
     if (NULL == args->args[0]) {
-        e = to_ZZ(1);
-    } else {
-        ZZFromBytes(e, reinterpret_cast<const uint8_t *>(args->args[0]),
-                    args->lengths[0]);
+        return true;
     }
 
-    //cerr << "element to add " << e << "\n";
-    MulMod(as->sum, as->sum, e, as->n2);
-    //cerr << "sum so far " << as->sum << "\n";
+    if (3 == args->arg_count && NULL != args->args[2]
+        && as->count >= static_cast<uint64_t>(
+                            *reinterpret_cast<long long *>(args->args[2]))) {
+        *error = 1;
+        return true;
+    }
+
+    if (!as->mont->from_bytes(&as->row[0],
+                              reinterpret_cast<const uint8_t *>(args->args[0]),
+                              args->lengths[0])) {
+        *error = 1;
+        return true;
+    }
+    as->mont->mul(&as->sum[0], &as->sum[0], &as->row[0]);
+    ++as->count;
     return true;
 }
 
@@ -522,8 +601,11 @@ cryptdb_agg(UDF_INIT *const initid, UDF_ARGS *const args, char *const result,
             unsigned long *const length, char *const is_null, char *const error)
 {
     agg_state *const as = reinterpret_cast<agg_state *>(initid->ptr);
-    BytesFromZZ(static_cast<uint8_t *>(as->rbuf), as->sum,
-                Paillier_len_bytes);
+    const ZZ &sum =
+        as->mont ? MulMod(as->mont->to_zz(&as->sum[0]),
+                          as->mont->rpow(as->count), as->mont->modulus())
+                 : to_ZZ(1);
+    BytesFromZZ(static_cast<uint8_t *>(as->rbuf), sum, Paillier_len_bytes);
     *length = Paillier_len_bytes;
     return static_cast<char *>(as->rbuf);
 }
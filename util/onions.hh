@@ -58,6 +58,24 @@ static onionlayout BEST_EFFORT_NUM_ONION_LAYOUT = {
                                     SECLEVEL::RND})}
 };
 
+// Mutable OPE ciphertexts change when the proxy rebalances it's tree, so
+// they can not sit under RND.
+static onionlayout MOPE_NUM_ONION_LAYOUT = {
+    {oDET, std::vector<SECLEVEL>({SECLEVEL::DETJOIN, SECLEVEL::DET,
+                                  SECLEVEL::RND})},
+    {oOPE, std::vector<SECLEVEL>({SECLEVEL::OPE})},
+    {oAGG, std::vector<SECLEVEL>({SECLEVEL::HOM})}
+};
+
+static onionlayout BEST_EFFORT_MOPE_NUM_ONION_LAYOUT = {
+    {oDET, std::vector<SECLEVEL>({SECLEVEL::DETJOIN, SECLEVEL::DET,
+                                  SECLEVEL::RND})},
+    {oOPE, std::vector<SECLEVEL>({SECLEVEL::OPE})},
+    {oAGG, std::vector<SECLEVEL>({SECLEVEL::HOM})},
+    {oPLAIN, std::vector<SECLEVEL>({SECLEVEL::PLAINVAL, SECLEVEL::DET,
+                                    SECLEVEL::RND})}
+};
+
 static onionlayout STR_ONION_LAYOUT = {
     {oDET, std::vector<SECLEVEL>({SECLEVEL::DETJOIN, SECLEVEL::DET,
                                   SECLEVEL::RND})},
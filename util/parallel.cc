@@ -0,0 +1,71 @@
+#include <util/parallel.hh>
+
+WorkerPool &
+WorkerPool::instance()
+{
+    static WorkerPool *const pool = new WorkerPool();
+    return *pool;
+}
+
+WorkerPool::WorkerPool() : threads(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&queued, NULL);
+    pthread_cond_init(&finished, NULL);
+}
+
+void
+WorkerPool::post(Job *const job, unsigned int helpers)
+{
+    scoped_lock l(&lock);
+    for (unsigned int i = 0; i < helpers; ++i) {
+        queue.push_back(job);
+    }
+    // > a thread for every helper of the largest call so far; calls at
+    //   the same time share them
+    while (threads < helpers) {
+        std::thread(&WorkerPool::work, this).detach();
+        ++threads;
+    }
+    pthread_cond_broadcast(&queued);
+}
+
+void
+WorkerPool::finish(Job *const job)
+{
+    scoped_lock l(&lock);
+    queue.erase(std::remove(queue.begin(), queue.end(), job), queue.end());
+    while (job->running > 0) {
+        pthread_cond_wait(&finished, &lock);
+    }
+}
+
+unsigned int
+WorkerPool::size()
+{
+    scoped_lock l(&lock);
+    return threads;
+}
+
+void
+WorkerPool::work()
+{
+    scoped_lock l(&lock);
+    for (;;) {
+        while (queue.empty()) {
+            pthread_cond_wait(&queued, &lock);
+        }
+
+        Job *const job = queue.back();
+        queue.pop_back();
+        ++job->running;
+
+        pthread_mutex_unlock(&lock);
+        job->work();
+        pthread_mutex_lock(&lock);
+
+        if (0 == --job->running) {
+            pthread_cond_broadcast(&finished);
+        }
+    }
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <util/scoped_lock.hh>
+
+inline unsigned int
+defaultThreadCount()
+{
+    const unsigned int n = std::thread::hardware_concurrency();
+    return 0 == n ? 1 : n;
+}
+
+/*
+ * The threads parallelFor(...) borrows.  They are started the first time
+ * a call needs them and then wait for work for the life of the process,
+ * so a call costs a queue push and a wakeup rather than a thread create
+ * and join for every helper.
+ *
+ * A caller never waits for a helper that has not started on its job; it
+ * takes those back off the queue.  Calls from inside a job, or from more
+ * clients than there are threads, can not deadlock; they only get less
+ * help.
+ */
+class WorkerPool {
+    WorkerPool(const WorkerPool &other) = delete;
+    WorkerPool &operator=(const WorkerPool &rhs) = delete;
+
+public:
+    // > one parallelFor call; each helper runs 'work' once
+    class Job {
+        Job(const Job &other) = delete;
+        Job &operator=(const Job &rhs) = delete;
+
+    public:
+        explicit Job(const std::function<void()> &work)
+            : work(work), running(0) {}
+
+    private:
+        friend class WorkerPool;
+        const std::function<void()> work;
+        // > helpers inside work()
+        unsigned int running;
+    };
+
+    static WorkerPool &instance();
+
+    // > queues 'helpers' runs of the job, starting threads as needed
+    void post(Job *const job, unsigned int helpers);
+    // > drops the job's runs that have not started and waits for the
+    //   others to return
+    void finish(Job *const job);
+
+    // > threads started so far
+    unsigned int size();
+
+private:
+    WorkerPool();
+    // > the threads outlive static destruction, so the pool is never
+    //   freed
+    ~WorkerPool() = delete;
+
+    void work();
+
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t finished;
+    std::vector<Job *> queue;
+    unsigned int threads;
+};
+
+/*
+ * Calls fn(i) for every i in [0, count) on at most 'threads' threads,
+ * the calling thread included; the others come from WorkerPool.
+ * Indexes are handed out one at a time so uneven amounts of work
+ * balance out.
+ *
+ * The first exception thrown by fn stops the remaining work and is
+ * rethrown in the calling thread once all threads have finished.
+ */
+template <typename Fn>
+void
+parallelFor(size_t count, Fn fn, unsigned int threads = defaultThreadCount())
+{
+    std::atomic<size_t> next(0);
+    std::exception_ptr error;
+    pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+    auto worker = [count, &fn, &next, &error, &error_lock] ()
+    {
+        for (size_t i = next++; i < count; i = next++) {
+            try {
+                fn(i);
+            } catch (...) {
+                scoped_lock l(&error_lock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                next = count;
+            }
+        }
+    };
+
+    const size_t n = std::min(static_cast<size_t>(threads), count);
+    if (n > 1) {
+        WorkerPool &pool = WorkerPool::instance();
+        WorkerPool::Job job(worker);
+        pool.post(&job, n - 1);
+        worker();
+        pool.finish(&job);
+    } else {
+        worker();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}